@@ -0,0 +1,220 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Tiny LD_PRELOAD shim that counts heap allocations made by the process
+ * that it is loaded into. The count is kept in a file that is mmap'd
+ * by both this shim and the benchmark driver, so the driver can sample
+ * it at any point while the collector is running.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void *(*real_malloc)(size_t) = NULL;
+static void *(*real_calloc)(size_t, size_t) = NULL;
+static void *(*real_realloc)(void *, size_t) = NULL;
+static void (*real_free)(void *) = NULL;
+static int (*real_posix_memalign)(void **, size_t, size_t) = NULL;
+static void *(*real_aligned_alloc)(size_t, size_t) = NULL;
+static void *(*real_memalign)(size_t, size_t) = NULL;
+
+static uint64_t localcount = 0;
+static uint64_t *alloccount = &localcount;
+
+/* dlsym() may allocate memory before we have found the real allocators,
+ * so serve any such requests out of a small static buffer */
+static char bootstrap[8192] __attribute__((aligned(16)));
+static size_t bootused = 0;
+static int resolving = 0;
+
+#define IS_BOOTSTRAP(ptr) (((char *)(ptr)) >= bootstrap && \
+        ((char *)(ptr)) < bootstrap + sizeof(bootstrap))
+
+static void *bootstrap_alloc(size_t size, size_t alignment) {
+    uintptr_t base = (uintptr_t)bootstrap;
+    size_t start, want;
+
+    if (alignment < 16) {
+        alignment = 16;
+    }
+    start = (((base + bootused) + alignment - 1) & ~(alignment - 1)) - base;
+    want = (size + 15) & ~((size_t)15);
+
+    if (start + want > sizeof(bootstrap)) {
+        return NULL;
+    }
+    bootused = start + want;
+    return bootstrap + start;
+}
+
+static void resolve_real_allocators(void) {
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = 0;
+}
+
+__attribute__((constructor))
+static void init_bench_alloc(void) {
+    char *fname;
+    int fd;
+    void *map;
+
+    if (real_malloc == NULL) {
+        resolve_real_allocators();
+    }
+
+    fname = getenv("OPENLI_BENCH_ALLOCFILE");
+    if (fname == NULL) {
+        return;
+    }
+
+    fd = open(fname, O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+
+    map = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (map != MAP_FAILED) {
+        alloccount = (uint64_t *)map;
+    }
+}
+
+void *malloc(size_t size) {
+    if (real_malloc == NULL) {
+        if (resolving) {
+            return bootstrap_alloc(size, 16);
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+    return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (real_calloc == NULL) {
+        if (resolving) {
+            /* The bootstrap buffer is never reused, so is already zeroed */
+            return bootstrap_alloc(nmemb * size, 16);
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+    return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *newptr;
+
+    if (real_realloc == NULL || real_malloc == NULL) {
+        if (resolving) {
+            newptr = bootstrap_alloc(size, 16);
+            if (newptr && ptr) {
+                size_t avail = (bootstrap + sizeof(bootstrap)) - (char *)ptr;
+                memmove(newptr, ptr, size < avail ? size : avail);
+            }
+            return newptr;
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+
+    if (ptr && IS_BOOTSTRAP(ptr)) {
+        newptr = real_malloc(size);
+        if (newptr) {
+            size_t avail = (bootstrap + sizeof(bootstrap)) - (char *)ptr;
+            memcpy(newptr, ptr, size < avail ? size : avail);
+        }
+        return newptr;
+    }
+    return real_realloc(ptr, size);
+}
+
+/* Aligned allocations do not go through malloc(), so they have to be
+ * counted separately */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (real_posix_memalign == NULL) {
+        if (resolving) {
+            *memptr = bootstrap_alloc(size, alignment);
+            return (*memptr == NULL) ? ENOMEM : 0;
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+    return real_posix_memalign(memptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (real_aligned_alloc == NULL) {
+        if (resolving) {
+            return bootstrap_alloc(size, alignment);
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+    return real_aligned_alloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (real_memalign == NULL) {
+        if (resolving) {
+            return bootstrap_alloc(size, alignment);
+        }
+        resolve_real_allocators();
+    }
+    __atomic_add_fetch(alloccount, 1, __ATOMIC_RELAXED);
+    return real_memalign(alignment, size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || IS_BOOTSTRAP(ptr)) {
+        return;
+    }
+    if (real_free == NULL) {
+        if (resolving) {
+            /* We cannot hand this back until we have found free() */
+            return;
+        }
+        resolve_real_allocators();
+    }
+    real_free(ptr);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,1303 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Benchmark driver for the OpenLI collector.
+ *
+ * The driver plays the part of both the provisioner and the mediator: it
+ * hands a synthetic set of intercepts to a real collector process, replays
+ * a pcap file into the collector via a FIFO and counts the ETSI records
+ * that come out the other end.
+ *
+ * The timestamp of each replayed packet is rewritten to the time at which
+ * it was handed to the collector, so the timestamp in the resulting ETSI
+ * record header can be used to measure end-to-end latency. The per-stage
+ * breakdown of that latency is scraped from the collector's own pipeline
+ * statistics listener once the replay has finished.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <libtrace.h>
+#include <libtrace/linked_list.h>
+#include <libwandder_etsili.h>
+#include <uthash.h>
+
+#include "logger.h"
+#include "util.h"
+#include "netcomms.h"
+#include "intercept.h"
+#include "coreserver.h"
+
+#define BENCH_MEDIATOR_ID 1
+#define BENCH_AGENCY "benchlea"
+#define BENCH_LATENCY_BUCKETS 32
+#define BENCH_MAX_SINKS 64
+#define BENCH_STATS_TIMEOUT 5000
+
+typedef struct bench_addr {
+    uint32_t addr;
+    UT_hash_handle hh;
+} bench_addr_t;
+
+typedef struct bench_opts {
+    char *pcapfile;
+    char *collector;
+    char *allocshim;
+    char *sipfile;
+    char *extraconf;
+    char *provport;
+    char *medport;
+    char *statsport;
+
+    int iptargets;
+    int voiptargets;
+    int staticranges;
+    int loops;
+
+    int threads;
+    int seqtrackers;
+    int encoders;
+    int forwarders;
+
+    int settlesecs;
+    int idlesecs;
+    int timeout;
+    uint8_t keepdir;
+
+    coreserver_t *servers;
+} bench_opts_t;
+
+typedef struct bench_replay {
+    char *pcapfile;
+    char *fifoname;
+    int loops;
+
+    uint64_t packets;
+    struct timeval start;
+    struct timeval end;
+    int error;
+    volatile int started;
+    volatile int done;
+} bench_replay_t;
+
+typedef struct bench_sink {
+    int fd;
+    net_buffer_t *nb;
+} bench_sink_t;
+
+typedef struct bench_results {
+    uint64_t scanpackets;
+    uint64_t ccs;
+    uint64_t iris;
+    uint64_t recordbytes;
+    uint64_t latsamples;
+    uint64_t maxlatency;
+    uint64_t latency[BENCH_LATENCY_BUCKETS];
+    struct timeval lastrecord;
+
+    uint64_t allocstart;
+    uint64_t allocend;
+
+    /* Report from the collector's pipeline statistics listener */
+    char *stagereport;
+} bench_results_t;
+
+static ipintercept_t *benchipints = NULL;
+static voipintercept_t *benchvoipints = NULL;
+static volatile int bench_halt = 0;
+
+static void halt_signal(int signal) {
+    (void)signal;
+    bench_halt = 1;
+}
+
+static void usage(char *prog) {
+
+    fprintf(stderr, "Usage: %s -r <pcap file> [options]\n\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -c <path>       collector binary (default: ./openlicollector)\n");
+    fprintf(stderr, "  -a <path>       allocation counting shim (default: ./.libs/libopenlibenchalloc.so)\n");
+    fprintf(stderr, "  -i <num>        number of IP targets (default: 10)\n");
+    fprintf(stderr, "  -v <num>        number of VoIP targets (default: 0)\n");
+    fprintf(stderr, "  -s <num>        number of static IP ranges (default: 0)\n");
+    fprintf(stderr, "  -u <file>       SIP identities (user@realm) for the VoIP targets\n");
+    fprintf(stderr, "  -R <ip:port>    RADIUS server (can be repeated)\n");
+    fprintf(stderr, "  -G <ip:port>    GTP server (can be repeated)\n");
+    fprintf(stderr, "  -S <ip:port>    SIP server (can be repeated)\n");
+    fprintf(stderr, "  -l <num>        replay the pcap file this many times (default: 1)\n");
+    fprintf(stderr, "  -t <num>        collector processing threads (default: 1)\n");
+    fprintf(stderr, "  -q <num>        collector sequence tracker threads (default: 1)\n");
+    fprintf(stderr, "  -e <num>        collector encoder threads (default: 2)\n");
+    fprintf(stderr, "  -f <num>        collector forwarding threads (default: 1)\n");
+    fprintf(stderr, "  -x <file>       extra YAML to append to the collector config\n");
+    fprintf(stderr, "  -P <port>       port to use for the fake provisioner (default: 19001)\n");
+    fprintf(stderr, "  -M <port>       port to use for the fake mediator (default: 19002)\n");
+    fprintf(stderr, "  -p <port>       port for the collector pipeline statistics (default: 19003)\n");
+    fprintf(stderr, "  -w <secs>       time to let intercepts settle before replaying (default: 2)\n");
+    fprintf(stderr, "  -d <secs>       stop once no records have arrived for this long (default: 2)\n");
+    fprintf(stderr, "  -T <secs>       give up after this long (default: 600)\n");
+    fprintf(stderr, "  -k              keep the working directory (config, collector log)\n");
+}
+
+static int add_bench_coreserver(bench_opts_t *opts, char *arg,
+        uint8_t cstype) {
+
+    coreserver_t *cs;
+    char *sep = strrchr(arg, ':');
+
+    if (sep == NULL || sep == arg || *(sep + 1) == '\0') {
+        fprintf(stderr, "Invalid server '%s', expected ip:port\n", arg);
+        return -1;
+    }
+
+    cs = (coreserver_t *)calloc(1, sizeof(coreserver_t));
+    cs->servertype = cstype;
+    cs->ipstr = strndup(arg, sep - arg);
+    cs->portstr = strdup(sep + 1);
+    cs->serverkey = construct_coreserver_key(cs);
+
+    HASH_ADD_KEYPTR(hh, opts->servers, cs->serverkey, strlen(cs->serverkey),
+            cs);
+    return 0;
+}
+
+/* Reads through the pcap file once to count the packets in it and to
+ * find some IPv4 addresses that we can target with our intercepts.
+ */
+static int scan_pcap(bench_opts_t *opts, bench_addr_t **addrs, int wanted,
+        uint64_t *pktcount) {
+
+    libtrace_t *trace;
+    libtrace_packet_t *packet;
+    char uri[4096];
+    bench_addr_t *found;
+    int count = 0;
+
+    snprintf(uri, sizeof(uri), "pcapfile:%s", opts->pcapfile);
+    trace = trace_create(uri);
+    if (trace_is_err(trace)) {
+        libtrace_err_t err = trace_get_err(trace);
+        fprintf(stderr, "Unable to open %s: %s\n", opts->pcapfile,
+                err.problem);
+        trace_destroy(trace);
+        return -1;
+    }
+
+    if (trace_start(trace) == -1) {
+        libtrace_err_t err = trace_get_err(trace);
+        fprintf(stderr, "Unable to start %s: %s\n", opts->pcapfile,
+                err.problem);
+        trace_destroy(trace);
+        return -1;
+    }
+
+    packet = trace_create_packet();
+    *pktcount = 0;
+    while (trace_read_packet(trace, packet) > 0) {
+        libtrace_ip_t *ip;
+        uint32_t cand[2];
+        int i;
+
+        (*pktcount) ++;
+        if (count >= wanted) {
+            continue;
+        }
+
+        ip = trace_get_ip(packet);
+        if (ip == NULL) {
+            continue;
+        }
+
+        cand[0] = ip->ip_src.s_addr;
+        cand[1] = ip->ip_dst.s_addr;
+        for (i = 0; i < 2 && count < wanted; i++) {
+            HASH_FIND(hh, *addrs, &(cand[i]), sizeof(uint32_t), found);
+            if (found) {
+                continue;
+            }
+            found = (bench_addr_t *)calloc(1, sizeof(bench_addr_t));
+            found->addr = cand[i];
+            HASH_ADD(hh, *addrs, addr, sizeof(uint32_t), found);
+            count ++;
+        }
+    }
+
+    trace_destroy_packet(packet);
+    trace_destroy(trace);
+    return count;
+}
+
+static void populate_common(intercept_common_t *common, char *liid) {
+    common->liid = strdup(liid);
+    common->liid_len = strlen(liid);
+    common->authcc = strdup("NZ");
+    common->authcc_len = strlen(common->authcc);
+    common->delivcc = strdup("NZ");
+    common->delivcc_len = strlen(common->delivcc);
+    common->destid = BENCH_MEDIATOR_ID;
+    common->targetagency = strdup(BENCH_AGENCY);
+}
+
+static ipintercept_t *create_bench_ipintercept(char *liid) {
+    ipintercept_t *ipint;
+    char user[128];
+
+    ipint = (ipintercept_t *)calloc(1, sizeof(ipintercept_t));
+    populate_common(&(ipint->common), liid);
+
+    snprintf(user, sizeof(user), "%s-user", liid);
+    ipint->username = strdup(user);
+    ipint->username_len = strlen(user);
+    ipint->accesstype = INTERNET_ACCESS_TYPE_LAN;
+    ipint->vendmirrorid = OPENLI_VENDOR_MIRROR_NONE;
+    ipint->statics = NULL;
+    ipint->options = 0;
+
+    HASH_ADD_KEYPTR(hh_liid, benchipints, ipint->common.liid,
+            ipint->common.liid_len, ipint);
+    return ipint;
+}
+
+static void add_bench_iprange(ipintercept_t *ipint, char *rangestr) {
+    static_ipranges_t *ipr;
+
+    HASH_FIND(hh, ipint->statics, rangestr, strlen(rangestr), ipr);
+    if (ipr) {
+        return;
+    }
+
+    ipr = (static_ipranges_t *)calloc(1, sizeof(static_ipranges_t));
+    ipr->rangestr = strdup(rangestr);
+    ipr->liid = strdup(ipint->common.liid);
+    ipr->cin = HASH_CNT(hh, ipint->statics) + 1;
+    HASH_ADD_KEYPTR(hh, ipint->statics, ipr->rangestr, strlen(ipr->rangestr),
+            ipr);
+}
+
+static void create_bench_voipintercept(char *liid, char *identity) {
+    voipintercept_t *vint;
+    openli_sip_identity_t *sipid;
+    char *at;
+
+    vint = (voipintercept_t *)calloc(1, sizeof(voipintercept_t));
+    populate_common(&(vint->common), liid);
+    vint->targets = libtrace_list_init(sizeof(openli_sip_identity_t *));
+    vint->active = 1;
+
+    sipid = (openli_sip_identity_t *)calloc(1, sizeof(openli_sip_identity_t));
+    at = strchr(identity, '@');
+    if (at) {
+        sipid->username = strndup(identity, at - identity);
+        sipid->realm = strdup(at + 1);
+        sipid->realm_len = strlen(sipid->realm);
+    } else {
+        sipid->username = strdup(identity);
+    }
+    sipid->username_len = strlen(sipid->username);
+    sipid->active = 1;
+    libtrace_list_push_back(vint->targets, &sipid);
+
+    HASH_ADD_KEYPTR(hh_liid, benchvoipints, vint->common.liid,
+            vint->common.liid_len, vint);
+}
+
+static int create_bench_intercepts(bench_opts_t *opts, bench_addr_t *addrs) {
+
+    bench_addr_t *a, *tmp;
+    ipintercept_t *ipint, *rangeint = NULL;
+    char liid[64];
+    char rangestr[64];
+    char addrstr[INET_ADDRSTRLEN];
+    int i = 0, ranges = 0;
+
+    /* Each IP target gets its own intercept, matching one address seen
+     * in the pcap. Static ranges are all attached to a single intercept,
+     * covering the /24 around the remaining addresses we found. */
+    HASH_ITER(hh, addrs, a, tmp) {
+        inet_ntop(AF_INET, &(a->addr), addrstr, sizeof(addrstr));
+        if (i < opts->iptargets) {
+            snprintf(liid, sizeof(liid), "BENCHIP%d", i);
+            ipint = create_bench_ipintercept(liid);
+            snprintf(rangestr, sizeof(rangestr), "%s/32", addrstr);
+            add_bench_iprange(ipint, rangestr);
+            i ++;
+            continue;
+        }
+
+        if (ranges >= opts->staticranges) {
+            break;
+        }
+        if (rangeint == NULL) {
+            rangeint = create_bench_ipintercept("BENCHRANGES");
+        }
+        snprintf(rangestr, sizeof(rangestr), "%u.%u.%u.0/24",
+                ((uint8_t *)&(a->addr))[0], ((uint8_t *)&(a->addr))[1],
+                ((uint8_t *)&(a->addr))[2]);
+        add_bench_iprange(rangeint, rangestr);
+        ranges = HASH_CNT(hh, rangeint->statics);
+    }
+
+    if (i < opts->iptargets) {
+        fprintf(stderr,
+                "Warning: only found %d IPv4 addresses for %d IP targets\n",
+                i, opts->iptargets);
+    }
+
+    /* Pad out the static ranges with ones that shouldn't match anything,
+     * so that the lookup structures are still the size that was asked for */
+    while (ranges < opts->staticranges) {
+        if (rangeint == NULL) {
+            rangeint = create_bench_ipintercept("BENCHRANGES");
+        }
+        snprintf(rangestr, sizeof(rangestr), "100.%u.%u.0/24",
+                64 + ((ranges >> 8) & 0x3f), ranges & 0xff);
+        add_bench_iprange(rangeint, rangestr);
+        ranges = HASH_CNT(hh, rangeint->statics);
+    }
+
+    if (opts->voiptargets > 0) {
+        FILE *f = NULL;
+        char line[1024];
+        char ident[1024];
+
+        if (opts->sipfile) {
+            f = fopen(opts->sipfile, "r");
+            if (f == NULL) {
+                fprintf(stderr, "Unable to open %s: %s\n", opts->sipfile,
+                        strerror(errno));
+                return -1;
+            }
+        }
+
+        for (i = 0; i < opts->voiptargets; i++) {
+            snprintf(ident, sizeof(ident), "benchuser%d", i);
+            while (f && fgets(line, sizeof(line), f)) {
+                line[strcspn(line, "\r\n \t")] = '\0';
+                if (line[0] != '\0' && line[0] != '#') {
+                    snprintf(ident, sizeof(ident), "%s", line);
+                    break;
+                }
+            }
+            snprintf(liid, sizeof(liid), "BENCHVOIP%d", i);
+            create_bench_voipintercept(liid, ident);
+        }
+
+        if (f) {
+            fclose(f);
+        }
+    }
+    return 0;
+}
+
+static int push_bench_config(bench_opts_t *opts, net_buffer_t *nb) {
+
+    openli_mediator_t med;
+    coreserver_t *cs, *cstmp;
+    ipintercept_t *ipint, *iptmp;
+    voipintercept_t *vint, *vtmp;
+    libtrace_list_node_t *n;
+
+    med.mediatorid = BENCH_MEDIATOR_ID;
+    med.ipstr = "127.0.0.1";
+    med.portstr = opts->medport;
+    if (push_mediator_onto_net_buffer(nb, &med) < 0) {
+        return -1;
+    }
+
+    HASH_ITER(hh, opts->servers, cs, cstmp) {
+        if (push_coreserver_onto_net_buffer(nb, cs, cs->servertype) < 0) {
+            return -1;
+        }
+    }
+
+    HASH_ITER(hh_liid, benchipints, ipint, iptmp) {
+        if (push_ipintercept_onto_net_buffer(nb, ipint) < 0) {
+            return -1;
+        }
+    }
+
+    HASH_ITER(hh_liid, benchvoipints, vint, vtmp) {
+        if (push_voipintercept_onto_net_buffer(nb, vint) < 0) {
+            return -1;
+        }
+        for (n = vint->targets->head; n != NULL; n = n->next) {
+            if (push_sip_target_onto_net_buffer(nb,
+                    *((openli_sip_identity_t **)(n->data)), vint) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return push_nomore_intercepts(nb);
+}
+
+static int write_collector_config(bench_opts_t *opts, char *fname,
+        char *fifoname) {
+
+    FILE *f;
+
+    f = fopen(fname, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "provisioneraddr: 127.0.0.1\n");
+    fprintf(f, "provisionerport: %s\n", opts->provport);
+    fprintf(f, "operatorid: OpenLIbench\n");
+    fprintf(f, "networkelementid: bench\n");
+    fprintf(f, "interceptpointid: bench01\n");
+    fprintf(f, "seqtrackerthreads: %d\n", opts->seqtrackers);
+    fprintf(f, "encoderthreads: %d\n", opts->encoders);
+    fprintf(f, "forwardingthreads: %d\n", opts->forwarders);
+    fprintf(f, "logstatfrequency: 0\n");
+    fprintf(f, "statsport: %s\n", opts->statsport);
+
+    if (opts->extraconf) {
+        FILE *extra = fopen(opts->extraconf, "r");
+        char line[4096];
+
+        if (extra == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", opts->extraconf,
+                    strerror(errno));
+            fclose(f);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), extra)) {
+            fputs(line, f);
+        }
+        fclose(extra);
+    }
+
+    fprintf(f, "inputs:\n");
+    fprintf(f, " - uri: pcapfile:%s\n", fifoname);
+    fprintf(f, "   threads: %d\n", opts->threads);
+    fclose(f);
+    return 0;
+}
+
+static int write_fully(int fd, uint8_t *buf, size_t len) {
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+/* Streams the pcap file into the FIFO that the collector is reading from,
+ * stamping each packet with the current time as it goes.
+ */
+static void *replay_pcap(void *arg) {
+
+    bench_replay_t *rep = (bench_replay_t *)arg;
+    uint8_t filehdr[24];
+    uint32_t rechdr[4];
+    uint32_t magic, caplen;
+    uint8_t *pktbuf = NULL;
+    uint32_t pktalloc = 0;
+    int swapped = 0, nsec = 0, fd, i;
+    struct timeval now;
+    FILE *f;
+
+    f = fopen(rep->pcapfile, "r");
+    if (f == NULL || fread(filehdr, sizeof(filehdr), 1, f) != 1) {
+        fprintf(stderr, "Unable to read pcap header from %s\n",
+                rep->pcapfile);
+        goto replayfail;
+    }
+
+    memcpy(&magic, filehdr, sizeof(magic));
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        nsec = (magic == PCAP_MAGIC_NSEC);
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC ||
+            __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        swapped = 1;
+        nsec = (__builtin_bswap32(magic) == PCAP_MAGIC_NSEC);
+    } else {
+        fprintf(stderr, "%s is not a pcap file (compressed and pcapng files "
+                "are not supported for replay)\n", rep->pcapfile);
+        goto replayfail;
+    }
+
+    /* This will block until the collector opens the other end */
+    fd = open(rep->fifoname, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open replay FIFO: %s\n", strerror(errno));
+        goto replayfail;
+    }
+
+    if (write_fully(fd, filehdr, sizeof(filehdr)) < 0) {
+        close(fd);
+        goto replayfail;
+    }
+
+    gettimeofday(&(rep->start), NULL);
+    rep->started = 1;
+
+    for (i = 0; i < rep->loops && !bench_halt; i++) {
+        fseek(f, sizeof(filehdr), SEEK_SET);
+        while (!bench_halt && fread(rechdr, sizeof(rechdr), 1, f) == 1) {
+            caplen = swapped ? __builtin_bswap32(rechdr[2]) : rechdr[2];
+            if (caplen > 262144) {
+                fprintf(stderr, "Corrupt pcap record in %s\n",
+                        rep->pcapfile);
+                i = rep->loops;
+                break;
+            }
+            if (caplen > pktalloc) {
+                pktbuf = realloc(pktbuf, caplen);
+                pktalloc = caplen;
+            }
+            if (caplen > 0 && fread(pktbuf, caplen, 1, f) != 1) {
+                break;
+            }
+
+            gettimeofday(&now, NULL);
+            rechdr[0] = (uint32_t)now.tv_sec;
+            rechdr[1] = nsec ? (uint32_t)now.tv_usec * 1000 :
+                    (uint32_t)now.tv_usec;
+            if (swapped) {
+                rechdr[0] = __builtin_bswap32(rechdr[0]);
+                rechdr[1] = __builtin_bswap32(rechdr[1]);
+            }
+
+            if (write_fully(fd, (uint8_t *)rechdr, sizeof(rechdr)) < 0 ||
+                    write_fully(fd, pktbuf, caplen) < 0) {
+                fprintf(stderr, "Error writing to replay FIFO: %s\n",
+                        strerror(errno));
+                i = rep->loops;
+                break;
+            }
+            rep->packets ++;
+        }
+    }
+
+    close(fd);
+    fclose(f);
+    free(pktbuf);
+    gettimeofday(&(rep->end), NULL);
+    rep->done = 1;
+    pthread_exit(NULL);
+
+replayfail:
+    if (f) {
+        fclose(f);
+    }
+    rep->error = 1;
+    rep->done = 1;
+    pthread_exit(NULL);
+}
+
+static inline double tv_diff(struct timeval *a, struct timeval *b) {
+    return (double)(b->tv_sec - a->tv_sec) +
+            ((double)(b->tv_usec - a->tv_usec) / 1000000.0);
+}
+
+static void record_latency(bench_results_t *res, struct timeval *stamp,
+        struct timeval *now) {
+
+    int64_t usecs;
+    int bucket = 0;
+
+    usecs = ((int64_t)now->tv_sec - stamp->tv_sec) * 1000000 +
+            ((int64_t)now->tv_usec - stamp->tv_usec);
+    if (usecs < 0) {
+        usecs = 0;
+    }
+
+    while (bucket < BENCH_LATENCY_BUCKETS - 1 && (1LL << bucket) <= usecs) {
+        bucket ++;
+    }
+    res->latency[bucket] ++;
+    res->latsamples ++;
+    if ((uint64_t)usecs > res->maxlatency) {
+        res->maxlatency = usecs;
+    }
+}
+
+static void handle_record(bench_results_t *res, wandder_etsispec_t *dec,
+        uint8_t *body, uint16_t bodylen, struct timeval *now) {
+
+    uint16_t liidlen;
+    struct timeval stamp;
+
+    res->recordbytes += bodylen;
+    res->lastrecord = *now;
+
+    /* Records from the collector are prefixed with the LIID */
+    if (bodylen < sizeof(uint16_t)) {
+        return;
+    }
+    memcpy(&liidlen, body, sizeof(uint16_t));
+    liidlen = ntohs(liidlen);
+    if (bodylen <= liidlen + sizeof(uint16_t)) {
+        return;
+    }
+
+    wandder_attach_etsili_buffer(dec, body + liidlen + sizeof(uint16_t),
+            bodylen - liidlen - sizeof(uint16_t), false);
+    stamp = wandder_etsili_get_header_timestamp(dec);
+    if (stamp.tv_sec != 0) {
+        record_latency(res, &stamp, now);
+    }
+}
+
+static int drain_sink(bench_sink_t *sink, bench_results_t *res,
+        wandder_etsispec_t *dec) {
+
+    openli_proto_msgtype_t msgtype;
+    uint8_t *body;
+    uint16_t bodylen;
+    uint64_t intid;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    do {
+        msgtype = receive_net_buffer(sink->nb, &body, &bodylen, &intid);
+        switch(msgtype) {
+            case OPENLI_PROTO_ETSI_CC:
+                res->ccs ++;
+                handle_record(res, dec, body, bodylen, &now);
+                break;
+            case OPENLI_PROTO_ETSI_IRI:
+                res->iris ++;
+                handle_record(res, dec, body, bodylen, &now);
+                break;
+            case OPENLI_PROTO_NO_MESSAGE:
+                break;
+            case OPENLI_PROTO_PEER_DISCONNECTED:
+            case OPENLI_PROTO_RECV_ERROR:
+            case OPENLI_PROTO_INVALID_MESSAGE:
+            case OPENLI_PROTO_BUFFER_TOO_FULL:
+                return -1;
+            default:
+                /* heartbeats etc. */
+                break;
+        }
+    } while (msgtype != OPENLI_PROTO_NO_MESSAGE);
+    return 0;
+}
+
+static void close_sink(bench_sink_t *sink) {
+    destroy_net_buffer(sink->nb);
+    close(sink->fd);
+    sink->fd = -1;
+    sink->nb = NULL;
+}
+
+/* Fetches the per-stage latencies, queue depths and mediator backlogs
+ * from the collector's pipeline statistics listener. The report covers
+ * everything since the collector started, but hardly any records are
+ * produced before the replay begins.
+ */
+static void fetch_stage_stats(bench_opts_t *opts, bench_results_t *res) {
+
+    struct pollfd pfd;
+    char *report = NULL;
+    size_t reportlen = 0, reportalloc = 0;
+    ssize_t ret;
+    int fd;
+
+    fd = connect_socket("127.0.0.1", opts->statsport, 0, 0);
+    if (fd <= 0) {
+        fprintf(stderr, "Unable to connect to collector statistics port %s\n",
+                opts->statsport);
+        return;
+    }
+
+    while (1) {
+        if (reportalloc - reportlen < 1024) {
+            char *tmp = realloc(report, reportalloc + 4096);
+            if (tmp == NULL) {
+                break;
+            }
+            report = tmp;
+            reportalloc += 4096;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, BENCH_STATS_TIMEOUT);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "Timed out waiting for collector statistics\n");
+            break;
+        }
+
+        ret = read(fd, report + reportlen, reportalloc - reportlen - 1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        reportlen += ret;
+    }
+    close(fd);
+
+    if (report == NULL || reportlen == 0) {
+        free(report);
+        return;
+    }
+    report[reportlen] = '\0';
+    res->stagereport = report;
+}
+
+static void print_stage_stats(bench_results_t *res) {
+
+    char *line, *saveptr = NULL;
+
+    if (res->stagereport == NULL) {
+        return;
+    }
+
+    printf("  pipeline statistics (from the collector, latencies in us):\n");
+    for (line = strtok_r(res->stagereport, "\n", &saveptr); line != NULL;
+            line = strtok_r(NULL, "\n", &saveptr)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        printf("    %s\n", line);
+    }
+}
+
+static void print_results(bench_opts_t *opts, bench_replay_t *rep,
+        bench_results_t *res) {
+
+    struct timeval *end;
+    double elapsed;
+    uint64_t records = res->ccs + res->iris;
+    uint64_t seen = 0;
+    int i;
+
+    end = &(rep->end);
+    if (timercmp(&(res->lastrecord), end, >)) {
+        end = &(res->lastrecord);
+    }
+    elapsed = tv_diff(&(rep->start), end);
+    if (elapsed <= 0) {
+        elapsed = 0.000001;
+    }
+
+    printf("OpenLI collector benchmark\n");
+    printf("  input:            %s (%" PRIu64 " packets x %d)\n",
+            opts->pcapfile, res->scanpackets, opts->loops);
+    printf("  intercepts:       %d IP, %d VoIP, %d static ranges\n",
+            opts->iptargets, opts->voiptargets, opts->staticranges);
+    printf("  threads:          %d processing, %d seqtracker, %d encoder, "
+            "%d forwarder\n", opts->threads, opts->seqtrackers,
+            opts->encoders, opts->forwarders);
+    printf("  elapsed:          %.3f s\n", elapsed);
+    printf("  packets replayed: %" PRIu64 " (%.0f packets/s)\n",
+            rep->packets, rep->packets / elapsed);
+    printf("  records:          %" PRIu64 " CC, %" PRIu64 " IRI, "
+            "%" PRIu64 " bytes (%.0f records/s)\n", res->ccs, res->iris,
+            res->recordbytes, records / elapsed);
+
+    if (opts->allocshim) {
+        uint64_t allocs = res->allocend - res->allocstart;
+        printf("  allocations:      %" PRIu64 " (%.2f per record, "
+                "%.2f per packet)\n", allocs,
+                records ? (double)allocs / records : 0.0,
+                rep->packets ? (double)allocs / rep->packets : 0.0);
+    }
+
+    print_stage_stats(res);
+
+    if (res->latsamples == 0) {
+        return;
+    }
+
+    printf("  end-to-end latency (packet replayed -> record received):\n");
+    for (i = 0; i < BENCH_LATENCY_BUCKETS; i++) {
+        if (res->latency[i] == 0) {
+            continue;
+        }
+        seen += res->latency[i];
+        printf("    < %10llu us: %12" PRIu64 "  (%6.2f%%)\n",
+                (1ULL << i), res->latency[i],
+                (100.0 * seen) / res->latsamples);
+    }
+    printf("    max: %" PRIu64 " us\n", res->maxlatency);
+}
+
+int main(int argc, char *argv[]) {
+
+    bench_opts_t opts;
+    bench_replay_t rep;
+    bench_results_t res;
+    bench_sink_t sinks[BENCH_MAX_SINKS];
+    bench_addr_t *addrs = NULL, *a, *atmp;
+    coreserver_t *cs, *cstmp;
+    ipintercept_t *ipint, *iptmp;
+    voipintercept_t *vint, *vtmp;
+    wandder_etsispec_t *dec = NULL;
+    net_buffer_t *provin = NULL, *provout = NULL;
+    pthread_t replaytid;
+    struct sigaction sigact;
+    struct timeval started, pushed, now;
+    char workdir[] = "/tmp/openlibench.XXXXXX";
+    char configname[4096], fifoname[4096], logname[4096], allocname[4096];
+    volatile uint64_t *alloccount = NULL;
+    int provlisten = -1, medlisten = -1, provfd = -1;
+    int i, ret, status, exitcode = 1;
+    int nsinks = 0, havepushed = 0, replaying = 0, collectordone = 0;
+    int haveworkdir = 0;
+    pid_t pid = -1;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&rep, 0, sizeof(rep));
+    memset(&res, 0, sizeof(res));
+
+    opts.collector = "./openlicollector";
+    opts.allocshim = "./.libs/libopenlibenchalloc.so";
+    opts.provport = "19001";
+    opts.medport = "19002";
+    opts.statsport = "19003";
+    opts.iptargets = 10;
+    opts.loops = 1;
+    opts.threads = 1;
+    opts.seqtrackers = 1;
+    opts.encoders = 2;
+    opts.forwarders = 1;
+    opts.settlesecs = 2;
+    opts.idlesecs = 2;
+    opts.timeout = 600;
+
+    while (1) {
+        int c = getopt(argc, argv, "r:c:a:i:v:s:u:R:G:S:l:t:q:e:f:x:P:M:p:w:d:T:kh");
+        if (c == -1) {
+            break;
+        }
+
+        switch(c) {
+            case 'r': opts.pcapfile = optarg; break;
+            case 'c': opts.collector = optarg; break;
+            case 'a': opts.allocshim = optarg; break;
+            case 'i': opts.iptargets = atoi(optarg); break;
+            case 'v': opts.voiptargets = atoi(optarg); break;
+            case 's': opts.staticranges = atoi(optarg); break;
+            case 'u': opts.sipfile = optarg; break;
+            case 'l': opts.loops = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'q': opts.seqtrackers = atoi(optarg); break;
+            case 'e': opts.encoders = atoi(optarg); break;
+            case 'f': opts.forwarders = atoi(optarg); break;
+            case 'x': opts.extraconf = optarg; break;
+            case 'P': opts.provport = optarg; break;
+            case 'M': opts.medport = optarg; break;
+            case 'p': opts.statsport = optarg; break;
+            case 'w': opts.settlesecs = atoi(optarg); break;
+            case 'd': opts.idlesecs = atoi(optarg); break;
+            case 'T': opts.timeout = atoi(optarg); break;
+            case 'k': opts.keepdir = 1; break;
+            case 'R':
+                if (add_bench_coreserver(&opts, optarg,
+                        OPENLI_CORE_SERVER_RADIUS) < 0) {
+                    return 1;
+                }
+                break;
+            case 'G':
+                if (add_bench_coreserver(&opts, optarg,
+                        OPENLI_CORE_SERVER_GTP) < 0) {
+                    return 1;
+                }
+                break;
+            case 'S':
+                if (add_bench_coreserver(&opts, optarg,
+                        OPENLI_CORE_SERVER_SIP) < 0) {
+                    return 1;
+                }
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.pcapfile == NULL || opts.loops < 1 || opts.threads < 1 ||
+            opts.iptargets < 0 || opts.voiptargets < 0 ||
+            opts.staticranges < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.allocshim && access(opts.allocshim, R_OK) != 0) {
+        fprintf(stderr, "Allocation shim %s not found, not counting "
+                "allocations\n", opts.allocshim);
+        opts.allocshim = NULL;
+    }
+
+    sigact.sa_handler = halt_signal;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (scan_pcap(&opts, &addrs, opts.iptargets + opts.staticranges,
+            &(res.scanpackets)) < 0) {
+        return 1;
+    }
+    if (create_bench_intercepts(&opts, addrs) < 0) {
+        goto benchdone;
+    }
+
+    if (mkdtemp(workdir) == NULL) {
+        fprintf(stderr, "Unable to create working directory: %s\n",
+                strerror(errno));
+        goto benchdone;
+    }
+    haveworkdir = 1;
+    snprintf(configname, sizeof(configname), "%s/collector.yaml", workdir);
+    snprintf(fifoname, sizeof(fifoname), "%s/replay.pcap", workdir);
+    snprintf(logname, sizeof(logname), "%s/collector.log", workdir);
+    snprintf(allocname, sizeof(allocname), "%s/allocs", workdir);
+
+    if (mkfifo(fifoname, 0600) < 0) {
+        fprintf(stderr, "Unable to create replay FIFO: %s\n",
+                strerror(errno));
+        goto benchdone;
+    }
+
+    if (write_collector_config(&opts, configname, fifoname) < 0) {
+        goto benchdone;
+    }
+
+    if (opts.allocshim) {
+        int fd = open(allocname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        void *map = MAP_FAILED;
+
+        if (fd >= 0 && ftruncate(fd, sizeof(uint64_t)) == 0) {
+            map = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Unable to set up allocation counter\n");
+            opts.allocshim = NULL;
+        } else {
+            alloccount = (volatile uint64_t *)map;
+        }
+    }
+
+    provlisten = create_listener("127.0.0.1", opts.provport,
+            "bench provisioner");
+    medlisten = create_listener("127.0.0.1", opts.medport, "bench mediator");
+    if (provlisten < 0 || medlisten < 0) {
+        goto benchdone;
+    }
+    fd_set_nonblock(provlisten);
+    fd_set_nonblock(medlisten);
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        goto benchdone;
+    }
+
+    if (pid == 0) {
+        int logfd = open(logname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (logfd >= 0) {
+            dup2(logfd, STDOUT_FILENO);
+            dup2(logfd, STDERR_FILENO);
+            close(logfd);
+        }
+        if (opts.allocshim) {
+            setenv("LD_PRELOAD", opts.allocshim, 1);
+            setenv("OPENLI_BENCH_ALLOCFILE", allocname, 1);
+        }
+        execl(opts.collector, opts.collector, "-c", configname,
+                (char *)NULL);
+        fprintf(stderr, "Unable to run %s: %s\n", opts.collector,
+                strerror(errno));
+        _exit(127);
+    }
+
+    dec = wandder_create_etsili_decoder();
+    for (i = 0; i < BENCH_MAX_SINKS; i++) {
+        sinks[i].fd = -1;
+        sinks[i].nb = NULL;
+    }
+
+    gettimeofday(&started, NULL);
+    rep.pcapfile = opts.pcapfile;
+    rep.fifoname = fifoname;
+    rep.loops = opts.loops;
+
+    while (!bench_halt) {
+        struct pollfd pfds[BENCH_MAX_SINKS + 3];
+        int npfds = 0;
+        openli_proto_msgtype_t err;
+
+        pfds[npfds].fd = provlisten;
+        pfds[npfds++].events = POLLIN;
+        pfds[npfds].fd = medlisten;
+        pfds[npfds++].events = POLLIN;
+        if (provfd >= 0) {
+            pfds[npfds].fd = provfd;
+            pfds[npfds++].events = POLLIN;
+        }
+        for (i = 0; i < nsinks; i++) {
+            if (sinks[i].fd >= 0) {
+                pfds[npfds].fd = sinks[i].fd;
+                pfds[npfds++].events = POLLIN;
+            }
+        }
+
+        ret = poll(pfds, npfds, 100);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "Collector exited unexpectedly, see %s\n",
+                    logname);
+            opts.keepdir = 1;
+            collectordone = 1;
+            break;
+        }
+
+        if (provfd < 0) {
+            provfd = accept(provlisten, NULL, NULL);
+            if (provfd >= 0) {
+                fd_set_nonblock(provfd);
+                provin = create_net_buffer(NETBUF_RECV, provfd, NULL);
+                provout = create_net_buffer(NETBUF_SEND, provfd, NULL);
+            }
+        }
+
+        if (provfd >= 0) {
+            openli_proto_msgtype_t msgtype;
+            uint8_t *body;
+            uint16_t bodylen;
+            uint64_t intid;
+
+            do {
+                msgtype = receive_net_buffer(provin, &body, &bodylen,
+                        &intid);
+                if (msgtype == OPENLI_PROTO_COLLECTOR_AUTH && !havepushed) {
+                    if (push_bench_config(&opts, provout) < 0) {
+                        fprintf(stderr,
+                                "Unable to queue intercepts for collector\n");
+                        bench_halt = 1;
+                    }
+                    havepushed = 1;
+                    gettimeofday(&pushed, NULL);
+                }
+            } while (msgtype > OPENLI_PROTO_NO_MESSAGE);
+
+            if (msgtype < 0 || transmit_net_buffer(provout, &err) < 0) {
+                fprintf(stderr, "Lost provisioner connection to collector\n");
+                break;
+            }
+        }
+
+        while (nsinks < BENCH_MAX_SINKS) {
+            int fd = accept(medlisten, NULL, NULL);
+            if (fd < 0) {
+                break;
+            }
+            fd_set_nonblock(fd);
+            sinks[nsinks].fd = fd;
+            sinks[nsinks].nb = create_net_buffer(NETBUF_RECV, fd, NULL);
+            nsinks ++;
+        }
+
+        for (i = 0; i < nsinks; i++) {
+            if (sinks[i].fd >= 0 && drain_sink(&(sinks[i]), &res, dec) < 0) {
+                close_sink(&(sinks[i]));
+            }
+        }
+
+        gettimeofday(&now, NULL);
+        if (havepushed && !replaying &&
+                tv_diff(&pushed, &now) >= opts.settlesecs) {
+            if (alloccount) {
+                res.allocstart = *alloccount;
+            }
+            if (pthread_create(&replaytid, NULL, replay_pcap, &rep) != 0) {
+                fprintf(stderr, "Unable to start replay thread\n");
+                break;
+            }
+            replaying = 1;
+        }
+
+        if (replaying && rep.done) {
+            struct timeval *last = &(rep.end);
+
+            if (rep.error) {
+                break;
+            }
+            if (timercmp(&(res.lastrecord), last, >)) {
+                last = &(res.lastrecord);
+            }
+            if (tv_diff(last, &now) >= opts.idlesecs) {
+                exitcode = 0;
+                break;
+            }
+        }
+
+        if (tv_diff(&started, &now) >= opts.timeout) {
+            fprintf(stderr, "Benchmark timed out after %d seconds\n",
+                    opts.timeout);
+            break;
+        }
+    }
+
+    if (alloccount) {
+        res.allocend = *alloccount;
+    }
+
+    if (!collectordone && replaying) {
+        fetch_stage_stats(&opts, &res);
+    }
+
+    if (!collectordone) {
+        kill(pid, SIGTERM);
+        for (i = 0; i < 100; i++) {
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                collectordone = 1;
+                break;
+            }
+            usleep(100000);
+        }
+        if (!collectordone) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+        }
+    }
+
+    if (replaying) {
+        /* Unblock the replay thread if the collector never opened the
+         * FIFO */
+        bench_halt = 1;
+        if (!rep.started) {
+            int fd = open(fifoname, O_RDONLY | O_NONBLOCK);
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        pthread_join(replaytid, NULL);
+        if (rep.started) {
+            print_results(&opts, &rep, &res);
+        }
+    }
+
+benchdone:
+    for (i = 0; i < nsinks; i++) {
+        if (sinks[i].fd >= 0) {
+            close_sink(&(sinks[i]));
+        }
+    }
+    if (provfd >= 0) {
+        destroy_net_buffer(provin);
+        destroy_net_buffer(provout);
+        close(provfd);
+    }
+    if (provlisten >= 0) {
+        close(provlisten);
+    }
+    if (medlisten >= 0) {
+        close(medlisten);
+    }
+    if (dec) {
+        wandder_free_etsili_decoder(dec);
+    }
+    if (res.stagereport) {
+        free(res.stagereport);
+    }
+    if (alloccount) {
+        munmap((void *)alloccount, sizeof(uint64_t));
+    }
+
+    if (haveworkdir) {
+        if (opts.keepdir) {
+            fprintf(stderr, "Collector config and log kept in %s\n", workdir);
+        } else {
+            unlink(configname);
+            unlink(fifoname);
+            unlink(logname);
+            unlink(allocname);
+            rmdir(workdir);
+        }
+    }
+
+    HASH_ITER(hh, addrs, a, atmp) {
+        HASH_DELETE(hh, addrs, a);
+        free(a);
+    }
+    HASH_ITER(hh_liid, benchipints, ipint, iptmp) {
+        HASH_DELETE(hh_liid, benchipints, ipint);
+        free_single_ipintercept(ipint);
+    }
+    HASH_ITER(hh_liid, benchvoipints, vint, vtmp) {
+        HASH_DELETE(hh_liid, benchvoipints, vint);
+        free_single_voipintercept(vint);
+    }
+    HASH_ITER(hh, opts.servers, cs, cstmp) {
+        HASH_DELETE(hh, opts.servers, cs);
+        free_single_coreserver(cs);
+    }
+    return exitcode;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
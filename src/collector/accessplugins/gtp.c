@@ -111,6 +111,7 @@ struct gtp_infelem {
     uint16_t ielength;
     uint8_t ieflags;
     void *iecontent;
+    uint16_t iealloced;
     gtp_infoelem_t *next;
 };
 
@@ -169,6 +170,11 @@ struct gtp_saved_packet {
     uint16_t iplen;
     gtp_infoelem_t *ies;
     gtp_session_t *matched_session;
+
+    /* Links saved packets in the order they were saved, so that old ones
+     * can be expired without scanning the whole saved_packets array */
+    gtp_saved_pkt_t *prev;
+    gtp_saved_pkt_t *next;
 };
 
 typedef struct gtp_parsed {
@@ -204,10 +210,13 @@ typedef struct gtp_global {
     gtp_parsed_t *parsedpkt;
 
     Pvoid_t saved_packets;
+    gtp_saved_pkt_t *saved_oldest;
+    gtp_saved_pkt_t *saved_newest;
+
     Pvoid_t session_map;
     Pvoid_t alt_session_map;
 
-    double lastrefresh;
+    gtp_infoelem_t *freeies;
 } gtp_global_t;
 
 
@@ -301,6 +310,70 @@ static inline void gtp_free_ie_list(gtp_infoelem_t *ies) {
     }
 }
 
+static inline void gtp_release_ie_list(gtp_global_t *glob,
+        gtp_infoelem_t *ies) {
+
+    gtp_infoelem_t *ie, *tmp;
+
+    ie = ies;
+
+    /* Keep the content buffers, they can be reused for the next IE */
+    while (ie) {
+        tmp = ie;
+        ie = ie->next;
+        tmp->next = glob->freeies;
+        glob->freeies = tmp;
+    }
+}
+
+static inline void release_saved_packet(gtp_global_t *glob,
+        gtp_saved_pkt_t *pkt) {
+
+    if (pkt->ipcontent) {
+        free(pkt->ipcontent);
+    }
+    gtp_release_ie_list(glob, pkt->ies);
+    free(pkt);
+}
+
+static inline void add_saved_packet(gtp_global_t *glob, gtp_saved_pkt_t *pkt) {
+
+    PWord_t pval;
+
+    JLI(pval, glob->saved_packets, pkt->reqid);
+    *pval = (Word_t)pkt;
+
+    pkt->next = NULL;
+    pkt->prev = glob->saved_newest;
+    if (glob->saved_newest) {
+        glob->saved_newest->next = pkt;
+    } else {
+        glob->saved_oldest = pkt;
+    }
+    glob->saved_newest = pkt;
+}
+
+static inline void remove_saved_packet(gtp_global_t *glob,
+        gtp_saved_pkt_t *pkt) {
+
+    Word_t rc;
+
+    JLD(rc, glob->saved_packets, pkt->reqid);
+
+    if (pkt->prev) {
+        pkt->prev->next = pkt->next;
+    } else {
+        glob->saved_oldest = pkt->next;
+    }
+    if (pkt->next) {
+        pkt->next->prev = pkt->prev;
+    } else {
+        glob->saved_newest = pkt->prev;
+    }
+    pkt->prev = NULL;
+    pkt->next = NULL;
+}
+
 static void gtp_destroy_plugin_data(access_plugin_t *p) {
     gtp_global_t *glob;
     unsigned char index[64];
@@ -336,6 +409,8 @@ static void gtp_destroy_plugin_data(access_plugin_t *p) {
     }
     JLFA(res, glob->saved_packets);
 
+    gtp_free_ie_list(glob->freeies);
+
     if (glob->parsedpkt) {
         free(glob->parsedpkt);
     }
@@ -348,28 +423,21 @@ static void gtp_uncouple_parsed_data(access_plugin_t *p) {
 
 static void gtp_destroy_parsed_data(access_plugin_t *p, void *parsed) {
 
+    gtp_global_t *glob = (gtp_global_t *)(p->plugindata);
     gtp_parsed_t *gparsed = (gtp_parsed_t *)parsed;
 
     if (!gparsed) {
         return;
     }
 
-    gtp_free_ie_list(gparsed->ies);
+    gtp_release_ie_list(glob, gparsed->ies);
 
     if (gparsed->request) {
-        if (gparsed->request->ipcontent) {
-            free(gparsed->request->ipcontent);
-        }
-        gtp_free_ie_list(gparsed->request->ies);
-        free(gparsed->request);
+        release_saved_packet(glob, gparsed->request);
     }
 
     if (gparsed->response) {
-        if (gparsed->response->ipcontent) {
-            free(gparsed->response->ipcontent);
-        }
-        gtp_free_ie_list(gparsed->response->ies);
-        free(gparsed->response);
+        release_saved_packet(glob, gparsed->response);
     }
 
     if (gparsed->attached) {
@@ -410,35 +478,51 @@ static inline bool interesting_info_element(uint8_t gtpv, uint8_t ietype) {
     return false;
 }
 
-static inline gtp_infoelem_t *create_new_gtpv2_infoel(uint8_t ietype,
-        uint16_t ielen, uint8_t *ieptr) {
+static inline gtp_infoelem_t *get_free_infoel(gtp_global_t *glob,
+        uint16_t ielen) {
+
+    gtp_infoelem_t *el;
+
+    if (glob->freeies) {
+        el = glob->freeies;
+        glob->freeies = el->next;
+    } else {
+        el = (gtp_infoelem_t *)calloc(1, sizeof(gtp_infoelem_t));
+    }
+
+    if (el->iecontent == NULL || el->iealloced < ielen) {
+        el->iecontent = realloc(el->iecontent, ielen);
+        el->iealloced = ielen;
+    }
+    el->next = NULL;
+    return el;
+}
+
+static inline gtp_infoelem_t *create_new_gtpv2_infoel(gtp_global_t *glob,
+        uint8_t ietype, uint16_t ielen, uint8_t *ieptr) {
 
     gtp_infoelem_t *el;
 
-    el = (gtp_infoelem_t *)calloc(1, sizeof(gtp_infoelem_t));
+    el = get_free_infoel(glob, ielen);
 
     el->ietype = ietype;
     el->ielength = ielen;
     el->ieflags = *(ieptr + 3);
-    el->iecontent = malloc(ielen);
-    el->next = NULL;
 
     memcpy(el->iecontent, ieptr + 4, ielen);
     return el;
 }
 
-static inline gtp_infoelem_t *create_new_gtpv1_infoel(uint8_t ietype,
-        uint16_t ielen, uint8_t *ieptr) {
+static inline gtp_infoelem_t *create_new_gtpv1_infoel(gtp_global_t *glob,
+        uint8_t ietype, uint16_t ielen, uint8_t *ieptr) {
 
     gtp_infoelem_t *el;
 
-    el = (gtp_infoelem_t *)calloc(1, sizeof(gtp_infoelem_t));
+    el = get_free_infoel(glob, ielen);
 
     el->ietype = ietype;
     el->ielength = ielen;
     el->ieflags = 0;
-    el->iecontent = malloc(ielen);
-    el->next = NULL;
 
     if (ietype & 0x80) {
         memcpy(el->iecontent, ieptr + 3, ielen);
@@ -535,8 +619,8 @@ static inline uint16_t gtpv1_lookup_ielen(uint8_t ietype) {
     return 0;
 }
 
-static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
-        uint16_t gtplen) {
+static int walk_gtpv1_ies(gtp_global_t *glob, gtp_parsed_t *parsedpkt,
+        uint8_t *ptr, uint32_t rem, uint16_t gtplen) {
 
     uint16_t used = 0;
 
@@ -566,7 +650,7 @@ static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
         }
 
         if (interesting_info_element(parsedpkt->version, ietype)) {
-            gtpel = create_new_gtpv1_infoel(ietype, ielen, ptr);
+            gtpel = create_new_gtpv1_infoel(glob, ietype, ielen, ptr);
             gtpel->next = parsedpkt->ies;
             parsedpkt->ies = gtpel;
         }
@@ -606,8 +690,8 @@ static int walk_gtpv1_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
     return 0;
 }
 
-static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
-        uint16_t gtplen) {
+static void walk_gtpv2_ies(gtp_global_t *glob, gtp_parsed_t *parsedpkt,
+        uint8_t *ptr, uint32_t rem, uint16_t gtplen) {
 
     uint16_t used = 0;
 
@@ -620,7 +704,7 @@ static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
         ielen = ntohs(*((uint16_t *)(ptr + 1)));
 
         if (interesting_info_element(parsedpkt->version, ietype)) {
-            gtpel = create_new_gtpv2_infoel(ietype, ielen, ptr);
+            gtpel = create_new_gtpv2_infoel(glob, ietype, ielen, ptr);
             gtpel->next = parsedpkt->ies;
             parsedpkt->ies = gtpel;
 
@@ -654,26 +738,16 @@ static void walk_gtpv2_ies(gtp_parsed_t *parsedpkt, uint8_t *ptr, uint32_t rem,
 
 static void flush_old_gtp_packets(gtp_global_t *glob, double ts) {
 
-    Word_t index, rc;
-    PWord_t pval;
-    int purged = 0;
-
-    index = 0;
-    JLF(pval, glob->saved_packets, index);
-
-    while (pval) {
-        gtp_saved_pkt_t *pkt = (gtp_saved_pkt_t *)(*pval);
+    gtp_saved_pkt_t *pkt;
 
-        if (ts > pkt->tvsec + GTP_FLUSH_OLD_PKT_FREQ) {
-            gtp_free_ie_list(pkt->ies);
-            if (pkt->ipcontent) {
-                free(pkt->ipcontent);
-            }
-            JLD(rc, glob->saved_packets, pkt->reqid);
-            free(pkt);
-            purged ++;
+    /* Saved packets are kept in the order they arrived, so we can stop
+     * as soon as we find one that is still young enough */
+    while ((pkt = glob->saved_oldest) != NULL) {
+        if (ts <= pkt->tvsec + GTP_FLUSH_OLD_PKT_FREQ) {
+            break;
         }
-        JLN(pval, glob->saved_packets, index);
+        remove_saved_packet(glob, pkt);
+        release_saved_packet(glob, pkt);
     }
 }
 
@@ -711,7 +785,7 @@ static int gtp_parse_v2_teid(gtp_global_t *glob, libtrace_packet_t *pkt,
     rem -= sizeof(gtpv2_header_teid_t);
     len -= (sizeof(gtpv2_header_teid_t) - 4);
 
-    walk_gtpv2_ies(glob->parsedpkt, ptr, rem, len);
+    walk_gtpv2_ies(glob, glob->parsedpkt, ptr, rem, len);
 
     return 0;
 }
@@ -750,7 +824,7 @@ static int gtp_parse_v1_teid(gtp_global_t *glob, libtrace_packet_t *pkt,
     rem -= sizeof(gtpv1_header_t);
     len -= (sizeof(gtpv1_header_t) - 8);
 
-    if (walk_gtpv1_ies(glob->parsedpkt, ptr, rem, len) < 0) {
+    if (walk_gtpv1_ies(glob, glob->parsedpkt, ptr, rem, len) < 0) {
         return -1;
     }
 
@@ -854,15 +928,7 @@ static void *gtp_parse_packet(access_plugin_t *p, libtrace_packet_t *pkt) {
     }
 
     glob->parsedpkt->tvsec = trace_get_seconds(pkt);
-
-    if (glob->lastrefresh == 0) {
-        glob->lastrefresh = (uint32_t)glob->parsedpkt->tvsec;
-    }
-
-    if (glob->parsedpkt->tvsec - glob->lastrefresh > GTP_FLUSH_OLD_PKT_FREQ) {
-        flush_old_gtp_packets(glob, glob->parsedpkt->tvsec);
-        glob->lastrefresh = (uint32_t)glob->parsedpkt->tvsec;
-    }
+    flush_old_gtp_packets(glob, glob->parsedpkt->tvsec);
 
     if (glob->parsedpkt->serveripfamily == 0) {
         return glob->parsedpkt;
@@ -987,8 +1053,7 @@ static user_identity_t *gtp_get_userid(access_plugin_t *p, void *parsed,
 
         JLG(pval, glob->saved_packets, saved->reqid);
         if (pval == NULL) {
-            JLI(pval, glob->saved_packets, saved->reqid);
-            *pval = (Word_t)saved;
+            add_saved_packet(glob, saved);
         } else {
             gparsed->ies = saved->ies;
             if (saved->ipcontent) {
@@ -1321,7 +1386,6 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
     gtp_saved_pkt_t *saved, *check;
     gtp_parsed_t *gparsed = (gtp_parsed_t *)parsed;
     PWord_t pval;
-    Word_t rcint;
 
     saved = calloc(1, sizeof(gtp_saved_pkt_t));
 
@@ -1343,8 +1407,7 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
 
     JLG(pval, glob->saved_packets, saved->reqid);
     if (pval == NULL) {
-        JLI(pval, glob->saved_packets, saved->reqid);
-        *pval = (Word_t)saved;
+        add_saved_packet(glob, saved);
 
         if (gparsed->msgtype == GTPV2_CREATE_SESSION_REQUEST ||
                 gparsed->msgtype == GTPV2_DELETE_SESSION_REQUEST ||
@@ -1365,7 +1428,7 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
     } else {
         check = (gtp_saved_pkt_t *)*pval;
 
-        JLD(rcint, glob->saved_packets, check->reqid);
+        remove_saved_packet(glob, check);
 
         if (saved->type == GTPV2_CREATE_SESSION_REQUEST &&
                 check->type == GTPV2_CREATE_SESSION_RESPONSE) {
@@ -1413,14 +1476,8 @@ static access_session_t *gtp_update_session_state(access_plugin_t *p,
             gparsed->response = saved;
         } else if (saved->type == check->type) {
             /* probably a re-transmit */
-            JLI(pval, glob->saved_packets, saved->reqid);
-            *pval = (Word_t)saved;
-
-            if (check->ipcontent) {
-                free(check->ipcontent);
-            }
-            gtp_free_ie_list(check->ies);
-            free(check);
+            add_saved_packet(glob, saved);
+            release_saved_packet(glob, check);
             return NULL;
         } else {
             logger(LOG_INFO, "OpenLI: unexpected GTP packet pair (saved=%u, check=%u) for reqid %lu", saved->type, check->type, saved->reqid);
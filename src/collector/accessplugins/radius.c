@@ -35,7 +35,14 @@
 #include "internetaccess.h"
 #include "util.h"
 
-#define ORPHAN_EXPIRY (1.0)
+/* Both expiry times are in seconds */
+#define ORPHAN_EXPIRY (1)
+#define REQUEST_EXPIRY (30)
+
+/* Number of one second buckets in each NAS's expiry wheels -- must be
+ * larger than both of the expiry times above */
+#define RADIUS_WHEEL_SLOTS (64)
+#define RADIUS_WHEEL_SLOT(tvsec) (((uint64_t)(tvsec)) % RADIUS_WHEEL_SLOTS)
 
 #define DERIVE_REQUEST_ID(rad, reqtype) \
     ((((uint32_t)rad->msgident) << 16) + (((uint32_t)rad->sourceport)) + \
@@ -137,7 +144,9 @@ struct radius_saved_request {
     int targetuser_count;
     int active_targets;
 
+    /* next is also used to link requests in the free list */
     radius_saved_req_t *next;
+    radius_saved_req_t *prev;
     UT_hash_handle hh;
 };
 
@@ -150,16 +159,23 @@ struct radius_orphaned_resp {
     double tvsec;
     radius_attribute_t *savedattrs;
     radius_orphaned_resp_t *next;
+    radius_orphaned_resp_t *prev;
+    UT_hash_handle hh;
 };
 
 struct radius_nas_t {
     uint8_t *nasip;
     Pvoid_t user_map;
     radius_saved_req_t *request_map;
-
     radius_orphaned_resp_t *orphans;
-    radius_orphaned_resp_t *orphans_tail;
 
+    /* Saved requests and orphans are also linked into a wheel of one
+     * second buckets, so that old entries can be expired a bucket at a
+     * time without having to search for them */
+    radius_saved_req_t *reqwheel[RADIUS_WHEEL_SLOTS];
+    radius_orphaned_resp_t *orphanwheel[RADIUS_WHEEL_SLOTS];
+    uint64_t reqwheel_expired;
+    uint64_t orphanwheel_expired;
 };
 
 typedef struct radius_server {
@@ -204,6 +220,7 @@ typedef struct radius_global {
     uint8_t interesting_attributes[256];
     radius_attribute_t *freeattrs;
     radius_saved_req_t *freeaccreqs;
+    radius_orphaned_resp_t *freeorphans;
     radius_parsed_t *parsedpkt;
 
     Pvoid_t server_map;
@@ -318,6 +335,7 @@ static void radius_init_plugin_data(access_plugin_t *p) {
     glob = (radius_global_t *)(malloc(sizeof(radius_global_t)));
     glob->freeattrs = NULL;
     glob->freeaccreqs = NULL;
+    glob->freeorphans = NULL;
     glob->server_map = (Pvoid_t)NULL;
 
     memset(glob->interesting_attributes, 0,
@@ -359,6 +377,71 @@ static inline void free_attribute_list(radius_attribute_t *attrlist) {
     }
 }
 
+static inline void add_saved_request(radius_nas_t *nas,
+        radius_saved_req_t *req) {
+
+    int slot = RADIUS_WHEEL_SLOT(req->tvsec);
+
+    HASH_ADD_KEYPTR(hh, nas->request_map, &(req->reqid), sizeof(req->reqid),
+            req);
+
+    req->prev = NULL;
+    req->next = nas->reqwheel[slot];
+    if (req->next) {
+        req->next->prev = req;
+    }
+    nas->reqwheel[slot] = req;
+}
+
+static inline void unlink_saved_request(radius_nas_t *nas,
+        radius_saved_req_t *req) {
+
+    HASH_DELETE(hh, nas->request_map, req);
+
+    if (req->prev) {
+        req->prev->next = req->next;
+    } else {
+        nas->reqwheel[RADIUS_WHEEL_SLOT(req->tvsec)] = req->next;
+    }
+    if (req->next) {
+        req->next->prev = req->prev;
+    }
+    req->next = NULL;
+    req->prev = NULL;
+}
+
+static inline void add_orphan(radius_nas_t *nas,
+        radius_orphaned_resp_t *resp) {
+
+    int slot = RADIUS_WHEEL_SLOT(resp->tvsec);
+
+    HASH_ADD_KEYPTR(hh, nas->orphans, &(resp->key), sizeof(resp->key), resp);
+
+    resp->prev = NULL;
+    resp->next = nas->orphanwheel[slot];
+    if (resp->next) {
+        resp->next->prev = resp;
+    }
+    nas->orphanwheel[slot] = resp;
+}
+
+static inline void unlink_orphan(radius_nas_t *nas,
+        radius_orphaned_resp_t *resp) {
+
+    HASH_DELETE(hh, nas->orphans, resp);
+
+    if (resp->prev) {
+        resp->prev->next = resp->next;
+    } else {
+        nas->orphanwheel[RADIUS_WHEEL_SLOT(resp->tvsec)] = resp->next;
+    }
+    if (resp->next) {
+        resp->next->prev = resp->prev;
+    }
+    resp->next = NULL;
+    resp->prev = NULL;
+}
+
 static void destroy_radius_user(radius_user_t *user, unsigned char *userind) {
 
     Word_t res, index;
@@ -403,7 +486,7 @@ static void destroy_radius_user(radius_user_t *user, unsigned char *userind) {
             }
         }
         if (req->active_targets <= 0) {
-            HASH_DELETE(hh, user->parent_nas->request_map, req);
+            unlink_saved_request(user->parent_nas, req);
             free_attribute_list(req->attrs);
             free(req);
         }
@@ -439,12 +522,10 @@ static void destroy_radius_nas(radius_nas_t *nas) {
 
     }
 
-    orph = nas->orphans;
-    while (orph) {
-        tmporph = orph;
-        orph = orph->next;
-        free_attribute_list(tmporph->savedattrs);
-        free(tmporph);
+    HASH_ITER(hh, nas->orphans, orph, tmporph) {
+        HASH_DELETE(hh, nas->orphans, orph);
+        free_attribute_list(orph->savedattrs);
+        free(orph);
     }
 
     if (nas->nasip) {
@@ -481,6 +562,7 @@ static void radius_destroy_plugin_data(access_plugin_t *p) {
     radius_global_t *glob;
     radius_server_t *srv;
     radius_saved_req_t *req, *tmpreq;
+    radius_orphaned_resp_t *orph, *tmporph;
     PWord_t pval;
     unsigned char index[128];
     Word_t res;
@@ -499,6 +581,13 @@ static void radius_destroy_plugin_data(access_plugin_t *p) {
         free(tmpreq);
     }
 
+    orph = glob->freeorphans;
+    while (orph) {
+        tmporph = orph;
+        orph = orph->next;
+        free(tmporph);
+    }
+
     index[0] = '\0';
     JSLF(pval, glob->server_map, index);
     while (pval) {
@@ -556,6 +645,91 @@ static inline void release_saved_request(radius_saved_req_t **freelist,
     }
 }
 
+static inline void release_orphan(radius_global_t *glob,
+        radius_orphaned_resp_t *resp) {
+
+    release_attribute_list(&(glob->freeattrs), resp->savedattrs);
+    resp->savedattrs = NULL;
+    resp->prev = NULL;
+    resp->next = glob->freeorphans;
+    glob->freeorphans = resp;
+}
+
+static inline void discard_saved_request(radius_global_t *glob,
+        radius_nas_t *nas, radius_saved_req_t *req) {
+
+    int i, rcint;
+
+    for (i = 0; i < req->targetuser_count; i++) {
+        if (req->targetusers[i] == NULL) {
+            continue;
+        }
+        JLD(rcint, req->targetusers[i]->savedrequests, req->reqid);
+    }
+
+    unlink_saved_request(nas, req);
+    release_attribute_list(&(glob->freeattrs), req->attrs);
+    release_saved_request(&(glob->freeaccreqs), req);
+}
+
+/* Works out which one second buckets have become old enough to expire,
+ * given that the wheel has been expired up to and including 'expired' */
+static inline int get_expirable_buckets(uint64_t now, uint64_t lifetime,
+        uint64_t *expired, uint64_t *first, uint64_t *last) {
+
+    if (now <= lifetime + 1) {
+        return 0;
+    }
+
+    *last = now - lifetime - 1;
+    if (*last <= *expired) {
+        return 0;
+    }
+
+    if (*last - *expired > RADIUS_WHEEL_SLOTS) {
+        *first = *last - RADIUS_WHEEL_SLOTS + 1;
+    } else {
+        *first = *expired + 1;
+    }
+    *expired = *last;
+    return 1;
+}
+
+static void expire_radius_nas_state(radius_global_t *glob, radius_nas_t *nas,
+        double tvsec) {
+
+    uint64_t sec, first, last;
+    radius_orphaned_resp_t *orph;
+    radius_saved_req_t *req;
+
+    if (get_expirable_buckets((uint64_t)tvsec, ORPHAN_EXPIRY,
+                &(nas->orphanwheel_expired), &first, &last)) {
+        for (sec = first; sec <= last; sec++) {
+            while ((orph = nas->orphanwheel[RADIUS_WHEEL_SLOT(sec)])) {
+                unlink_orphan(nas, orph);
+                release_orphan(glob, orph);
+                if (!warned) {
+                    logger(LOG_INFO,
+                        "OpenLI RADIUS: expired orphaned response packet.");
+                    logger(LOG_INFO,
+                        "OpenLI RADIUS: capture is possibly dropping RADIUS packets?");
+                    warned = 1;
+                }
+            }
+        }
+    }
+
+    /* Requests that never got a response */
+    if (get_expirable_buckets((uint64_t)tvsec, REQUEST_EXPIRY,
+                &(nas->reqwheel_expired), &first, &last)) {
+        for (sec = first; sec <= last; sec++) {
+            while ((req = nas->reqwheel[RADIUS_WHEEL_SLOT(sec)])) {
+                discard_saved_request(glob, nas, req);
+            }
+        }
+    }
+}
+
 static void radius_destroy_parsed_data(access_plugin_t *p, void *parsed) {
 
     radius_global_t *glob;
@@ -593,9 +767,8 @@ static void radius_destroy_parsed_data(access_plugin_t *p, void *parsed) {
     }
 
     if (rparsed->savedresp) {
-        release_attribute_list(&(glob->freeattrs),
-                rparsed->savedresp->savedattrs);
-        free(rparsed->savedresp);
+        release_orphan(glob, rparsed->savedresp);
+        rparsed->savedresp = NULL;
     }
 
     if (rparsed->attached) {
@@ -617,51 +790,33 @@ static void radius_uncouple_parsed_data(access_plugin_t *p) {
 
 }
 
-static void create_orphan(radius_global_t *glob, radius_orphaned_resp_t **head,
-        radius_orphaned_resp_t **tail, libtrace_packet_t *pkt,
-        radius_parsed_t *raddata, uint32_t reqid) {
+static void create_orphan(radius_global_t *glob, radius_nas_t *nas,
+        libtrace_packet_t *pkt, radius_parsed_t *raddata, uint32_t reqid) {
+
+    radius_orphaned_resp_t *resp;
 
-    /* Hopefully this is rare enough that we don't need a freelist of
-     * orphaned responses */
+    /* A newer response for the same request ID replaces any older one */
+    HASH_FIND(hh, nas->orphans, &reqid, sizeof(reqid), resp);
+    if (resp) {
+        unlink_orphan(nas, resp);
+        release_orphan(glob, resp);
+    }
 
-    radius_orphaned_resp_t *resp, *iter;
+    if (glob->freeorphans) {
+        resp = glob->freeorphans;
+        glob->freeorphans = resp->next;
+    } else {
+        resp = (radius_orphaned_resp_t *)malloc(
+                sizeof(radius_orphaned_resp_t));
+    }
 
-    resp = (radius_orphaned_resp_t *)malloc(sizeof(radius_orphaned_resp_t));
     resp->key = reqid;
-    resp->next = NULL;
     resp->tvsec = trace_get_seconds(pkt);
     resp->resptype = raddata->msgtype;
     resp->savedattrs = raddata->attrs;
     //raddata->attrs = NULL;
 
-    if (*tail == NULL) {
-        *head = resp;
-        *tail = resp;
-        return;
-    }
-
-    (*tail)->next = resp;
-    (*tail) = resp;
-
-    /* Peel off any expired orphans */
-    iter = *head;
-    while (iter) {
-        if (iter->tvsec + ORPHAN_EXPIRY >= resp->tvsec) {
-            break;
-        }
-        (*head) = iter->next;
-        /* XXX should really put these back in the free list */
-        free_attribute_list(iter->savedattrs);
-        free(iter);
-        iter = *head;
-        if (!warned) {
-            logger(LOG_INFO,
-                "OpenLI RADIUS: expired orphaned response packet.");
-            logger(LOG_INFO,
-                "OpenLI RADIUS: capture is possibly dropping RADIUS packets?");
-            warned = 1;
-        }
-    }
+    add_orphan(nas, resp);
 }
 
 static inline int grab_nas_details_from_packet(radius_parsed_t *parsed,
@@ -776,11 +931,10 @@ static inline void update_known_servers(radius_global_t *glob,
     JSLG(pval, srv->nas_map, hashkey);
 
     if (pval == NULL) {
-        nas = (radius_nas_t *)malloc(sizeof(radius_nas_t));
+        nas = (radius_nas_t *)calloc(1, sizeof(radius_nas_t));
         nas->user_map = (Pvoid_t)NULL;
         nas->request_map = NULL;
         nas->orphans = NULL;
-        nas->orphans_tail = NULL;
         nas->nasip = (uint8_t *)malloc(socklen);
         memcpy(nas->nasip, sockkey, socklen);
 
@@ -847,6 +1001,9 @@ static void *radius_parse_packet(access_plugin_t *p, libtrace_packet_t *pkt) {
     }
 
     update_known_servers(glob, parsed);
+    if (parsed->matchednas) {
+        expire_radius_nas_state(glob, parsed->matchednas, parsed->tvsec);
+    }
 
     rem -= sizeof(radius_header_t);
     ptr = radstart + sizeof(radius_header_t);
@@ -1226,8 +1383,7 @@ static inline void find_matching_request(radius_global_t *glob,
                 sizeof(reqid), req);
 
         if (req == NULL) {
-            create_orphan(glob, &(raddata->matchednas->orphans),
-                    &(raddata->matchednas->orphans_tail), raddata->origpkt,
+            create_orphan(glob, raddata->matchednas, raddata->origpkt,
                     raddata, reqid);
             return;
         }
@@ -1246,7 +1402,7 @@ static inline void find_matching_request(radius_global_t *glob,
             }
         }
 
-        HASH_DELETE(hh, raddata->matchednas->request_map, req);
+        unlink_saved_request(raddata->matchednas, req);
     }
 
 }
@@ -1402,61 +1558,16 @@ static inline void apply_fsm_logic(radius_parsed_t *raddata,
     *newstate = radsess->current;
 }
 
-static radius_orphaned_resp_t *search_orphans(radius_orphaned_resp_t **head,
-        radius_orphaned_resp_t **tail, uint32_t reqid, double tvsec) {
-
-    radius_orphaned_resp_t *iter, *prev, *tmp;
-
-    prev = NULL;
-    iter = *head;
-    while (iter) {
-        if (iter == *head && iter->tvsec + ORPHAN_EXPIRY < tvsec) {
-            *head = iter->next;
-            if (*tail == iter) {
-                *tail = NULL;
-            }
-            /* XXX should really put these back in the free list */
-            free_attribute_list(iter->savedattrs);
-            tmp = iter;
-            iter = iter->next;
-            free(tmp);
-            if (!warned) {
-                logger(LOG_INFO,
-                    "OpenLI RADIUS: expired orphaned response packet.");
-                logger(LOG_INFO,
-                    "OpenLI RADIUS: capture is possibly dropping RADIUS packets?");
-                warned = 1;
-            }
-            continue;
-        }
-
-        if (iter->key == reqid) {
-            break;
-        }
-        prev = iter;
-        iter = iter->next;
-    }
-
-    if (iter == NULL) {
-        return iter;
-    }
+static radius_orphaned_resp_t *search_orphans(radius_nas_t *nas,
+        uint32_t reqid) {
 
-    if (prev == NULL) {
-        *head = iter->next;
-    } else {
-        prev->next = iter->next;
-    }
+    radius_orphaned_resp_t *found;
 
-    if (iter == *tail) {
-        *tail = prev;
-        if (prev) {
-            prev->next = NULL;
-        }
+    HASH_FIND(hh, nas->orphans, &reqid, sizeof(reqid), found);
+    if (found) {
+        unlink_orphan(nas, found);
     }
-
-    iter->next = NULL;
-    return iter;
-
+    return found;
 }
 
 static inline int64_t translate_term_cause(uint32_t *tcause) {
@@ -1650,10 +1761,8 @@ static access_session_t *radius_update_session_state(access_plugin_t *p,
 
         radius_orphaned_resp_t *orphan = NULL;
 
-        orphan = search_orphans(
-                &(raddata->matchednas->orphans),
-                &(raddata->matchednas->orphans_tail),
-                DERIVE_REQUEST_ID(raddata, raddata->msgtype), raddata->tvsec);
+        orphan = search_orphans(raddata->matchednas,
+                DERIVE_REQUEST_ID(raddata, raddata->msgtype));
         if (orphan) {
             raddata->savedresp = orphan;
         } else if (!raddata->savedresp) {
@@ -1675,18 +1784,7 @@ static access_session_t *radius_update_session_state(access_plugin_t *p,
                 if (check) {
                     /* The old one is probably an unanswered request, replace
                      * it with this one instead. */
-                    for (i = 0; i < check->targetuser_count; i++) {
-                        int rcint;
-                        if (check->targetusers[i] == NULL) {
-                            continue;
-                        }
-                        JLD(rcint, check->targetusers[i]->savedrequests, reqid);
-                    }
-
-                    release_attribute_list(&(glob->freeattrs), check->attrs);
-                    release_saved_request(&(glob->freeaccreqs), check);
-                    HASH_DELETE(hh, raddata->matchednas->request_map, check);
-
+                    discard_saved_request(glob, raddata->matchednas, check);
                 }
 
                 if (glob->freeaccreqs == NULL) {
@@ -1708,8 +1806,7 @@ static access_session_t *radius_update_session_state(access_plugin_t *p,
                 memcpy(req->targetusers, raddata->matchedusers,
                         sizeof(radius_user_t *) * USER_IDENT_MAX);
 
-                HASH_ADD_KEYPTR(hh, raddata->matchednas->request_map,
-                        &(req->reqid), sizeof(req->reqid), req);
+                add_saved_request(raddata->matchednas, req);
 
                 for (i = 0; i < raddata->muser_count; i++) {
                     JLI(pval, raddata->matchedusers[i]->savedrequests, req->reqid);
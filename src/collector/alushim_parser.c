@@ -101,7 +101,7 @@ static void push_alu_ipcc_job(colthread_local_t *loc, libtrace_packet_t *packet,
 
     memcpy(msg->data.ipcc.ipcontent, l3, rem);
 
-    publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
+    publish_openli_msg(loc->zmq_pubsocks[alu->common.seqtrackerid], msg);
 
 }
 
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <signal.h>
@@ -145,80 +146,74 @@ static void log_collector_stats(collector_global_t *glob) {
             glob->stats.voipsessions_ended_diff,
             glob->stats.voipsessions_ended_total);
 
+    log_dropped_record_counts();
+
     logger(LOG_INFO, "OpenLI: === statistics complete ===");
 }
 
-static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
-        void *global, void *local, uint64_t tick) {
-
-    collector_global_t *glob = (collector_global_t *)global;
-    colthread_local_t *loc = (colthread_local_t *)local;
-    libtrace_stat_t *stats;
-
-
-    if (trace_get_perpkt_thread_id(t) == 0) {
-
-        stats = trace_create_statistics();
-        trace_get_statistics(trace, stats);
-
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_dropped += (stats->dropped - loc->dropped);
-        glob->stats.packets_accepted += (stats->accepted - loc->accepted);
-        pthread_mutex_unlock(&(glob->stats_mutex));
-
-        if (stats->dropped > loc->dropped) {
-            logger(LOG_INFO,
-                    "%lu dropped %lu packets in last second (accepted %lu)",
-                    (tick >> 32),
-                    stats->dropped - loc->dropped,
-                    stats->accepted - loc->accepted);
-            loc->dropped = stats->dropped;
-        }
+/* Must be called while holding glob->stats_mutex */
+static void collect_thread_stats(collector_global_t *glob) {
+    int i;
+    uint64_t val;
+    colthread_local_t *loc;
 
-        pthread_rwlock_rdlock(&(glob->config_mutex));
-        if (glob->stat_frequency > 0) {
-            glob->ticks_since_last_stat ++;
+#define FOLD_THREAD_STAT(field) \
+    val = COLTHREAD_STAT_READ(loc, field); \
+    glob->stats.field += (val - loc->reported.field); \
+    loc->reported.field = val;
 
-            if (glob->ticks_since_last_stat >= glob->stat_frequency * 60) {
-                pthread_mutex_lock(&(glob->stats_mutex));
-                log_collector_stats(glob);
-                reset_collector_stats(glob);
-                pthread_mutex_unlock(&(glob->stats_mutex));
-                glob->ticks_since_last_stat = 0;
-            }
-        }
-        pthread_rwlock_unlock(&(glob->config_mutex));
-        loc->accepted = stats->accepted;
-        free(stats);
-    }
+    for (i = 0; i < glob->total_col_threads; i++) {
+        loc = &(glob->collocals[i]);
+        FOLD_THREAD_STAT(packets_intercepted);
+        FOLD_THREAD_STAT(packets_sync_ip);
+        FOLD_THREAD_STAT(packets_sync_voip);
+        FOLD_THREAD_STAT(ipcc_created);
+        FOLD_THREAD_STAT(ipmmcc_created);
+    }
+#undef FOLD_THREAD_STAT
 }
 
 static void init_collocal(colthread_local_t *loc, collector_global_t *glob,
         int threadid) {
 
-    int zero = 0, i;
+    int i;
     libtrace_message_queue_init(&(loc->fromsyncq_ip),
             sizeof(openli_pushed_t));
     libtrace_message_queue_init(&(loc->fromsyncq_voip),
             sizeof(openli_pushed_t));
 
-    loc->activeipv4intercepts = NULL;
+    loc->sharedv4 = glob->sharedv4;
+    loc->sharedreaderid = threadid;
     loc->activeipv6intercepts = NULL;
     loc->activertpintercepts = NULL;
+    loc->rtpstreamindex = NULL;
     loc->activemirrorintercepts = NULL;
     loc->activestaticintercepts = NULL;
     loc->radiusservers = NULL;
     loc->gtpservers = NULL;
     loc->sipservers = NULL;
+    loc->coreserverindex = NULL;
     loc->staticv4ranges = New_Patricia(32);
     loc->staticv6ranges = New_Patricia(128);
     loc->dynamicv6ranges = New_Patricia(128);
-    loc->staticcache = NULL;
+    init_static_lpm(&(loc->staticv4lpm), AF_INET);
+    init_static_lpm(&(loc->staticv6lpm), AF_INET6);
     loc->tosyncq_ip = NULL;
     loc->tosyncq_voip = NULL;
+    loc->zerocopy_cc = glob->zerocopy_cc;
+    loc->trace = NULL;
+    loc->curpktref = NULL;
+    loc->pktrefowner = create_packet_ref_owner();
+    loc->pktrefshalted = 0;
+    loc->ccjobpool = create_object_pool(sizeof(openli_export_recv_t),
+            CCJOB_POOL_MAX_FREE, free_pooled_ipcc_job);
+    loc->syncpktpool = create_object_pool(sizeof(openli_sync_packet_t),
+            SYNC_PACKET_POOL_MAX_FREE, NULL);
 
     loc->accepted = 0;
     loc->dropped = 0;
+    memset(&(loc->stats), 0, sizeof(colthread_stats_t));
+    memset(&(loc->reported), 0, sizeof(colthread_stats_t));
 
 
     loc->zmq_pubsocks = calloc(glob->seqtracker_threads, sizeof(void *));
@@ -227,19 +222,37 @@ static void init_collocal(colthread_local_t *loc, collector_global_t *glob,
 
         snprintf(pubsockname, 128, "inproc://openlipub-%d", i);
         loc->zmq_pubsocks[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
-        zmq_setsockopt(loc->zmq_pubsocks[i], ZMQ_SNDHWM, &zero, sizeof(zero));
+        zmq_setsockopt(loc->zmq_pubsocks[i], ZMQ_SNDHWM, &(glob->publish_hwm),
+                sizeof(glob->publish_hwm));
         zmq_connect(loc->zmq_pubsocks[i], pubsockname);
     }
 
     loc->fragreass = create_new_ipfrag_reassembler();
+    hash_radius_init_config(&(loc->ipsynchasher), 1);
+    loc->heldsipfrags = NULL;
+    loc->nextheldpurge = 0;
 
-    loc->tosyncq_ip = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
-    zmq_setsockopt(loc->tosyncq_ip, ZMQ_SNDHWM, &zero, sizeof(zero));
-    zmq_connect(loc->tosyncq_ip, "inproc://openli-ipsync");
+    loc->tosyncq_ip = calloc(glob->ipsync_threads, sizeof(void *));
+    for (i = 0; i < glob->ipsync_threads; i++) {
+        char syncsockname[128];
 
-    loc->tosyncq_voip = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
-    zmq_setsockopt(loc->tosyncq_voip, ZMQ_SNDHWM, &zero, sizeof(zero));
-    zmq_connect(loc->tosyncq_voip, "inproc://openli-voipsync");
+        snprintf(syncsockname, 128, "inproc://openli-ipsync-%d", i);
+        loc->tosyncq_ip[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
+        zmq_setsockopt(loc->tosyncq_ip[i], ZMQ_SNDHWM, &(glob->sync_hwm),
+                sizeof(glob->sync_hwm));
+        zmq_connect(loc->tosyncq_ip[i], syncsockname);
+    }
+
+    loc->tosyncq_voip = calloc(glob->voipsync_threads, sizeof(void *));
+    for (i = 0; i < glob->voipsync_threads; i++) {
+        char syncsockname[128];
+
+        snprintf(syncsockname, 128, "inproc://openli-voipsync-%d", i);
+        loc->tosyncq_voip[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
+        zmq_setsockopt(loc->tosyncq_voip[i], ZMQ_SNDHWM, &(glob->sync_hwm),
+                sizeof(glob->sync_hwm));
+        zmq_connect(loc->tosyncq_voip[i], syncsockname);
+    }
 
 }
 
@@ -254,10 +267,13 @@ static void *start_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
     glob->nextloc ++;
     pthread_rwlock_unlock(&(glob->config_mutex));
 
+    loc->trace = trace;
+    shared_ipv4_quiescent(loc->sharedv4, loc->sharedreaderid);
+
     register_sync_queues(&(glob->syncip), loc->tosyncq_ip,
-			&(loc->fromsyncq_ip), t);
+            glob->ipsync_threads, &(loc->fromsyncq_ip), t);
     register_sync_queues(&(glob->syncvoip), loc->tosyncq_voip,
-			&(loc->fromsyncq_voip), t);
+            glob->voipsync_threads, &(loc->fromsyncq_voip), t);
 
     return loc;
 }
@@ -274,15 +290,6 @@ static void free_staticrange_data(void *data) {
     }
 }
 
-static void free_staticcache(static_ipcache_t *cache) {
-    static_ipcache_t *ent, *tmp;
-
-    HASH_ITER(hh, cache, ent, tmp) {
-        HASH_DELETE(hh, cache, ent);
-        free(ent);
-    }
-}
-
 static void process_incoming_messages(libtrace_thread_t *t,
         collector_global_t *glob, colthread_local_t *loc,
         openli_pushed_t *syncpush) {
@@ -331,6 +338,108 @@ static void process_incoming_messages(libtrace_thread_t *t,
         handle_modify_iprange(t, loc, syncpush->data.iprange);
     }
 
+    if (syncpush->type == OPENLI_PUSH_BATCH) {
+        openli_pushed_batch_t *batch = syncpush->data.batch;
+        uint32_t i;
+
+        for (i = 0; i < batch->count; i++) {
+            process_incoming_messages(t, glob, loc, &(batch->msgs[i]));
+        }
+        free(batch);
+    }
+
+}
+
+/* Process up to 'budget' messages from a sync thread queue, or all of
+ * them if budget is negative. The count check is just a read, so this
+ * costs next to nothing when there is nothing waiting. */
+static inline void drain_sync_queue(libtrace_thread_t *t,
+        collector_global_t *glob, colthread_local_t *loc,
+        libtrace_message_queue_t *q, int budget) {
+
+    openli_pushed_t syncpush;
+
+    while (budget != 0 && libtrace_message_queue_count(q) > 0) {
+        if (libtrace_message_queue_try_get(q, (void *)&syncpush) ==
+                LIBTRACE_MQ_FAILED) {
+            break;
+        }
+        process_incoming_messages(t, glob, loc, &syncpush);
+        budget --;
+    }
+}
+
+static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
+        void *global, void *local, uint64_t tick) {
+
+    collector_global_t *glob = (collector_global_t *)global;
+    colthread_local_t *loc = (colthread_local_t *)local;
+
+    /* We hold no references into the shared IPv4 table between packets */
+    shared_ipv4_quiescent(loc->sharedv4, loc->sharedreaderid);
+
+    /* Catch up on anything that the per-packet budget didn't get to, or
+     * that arrived while we weren't seeing any packets at all */
+    drain_sync_queue(t, glob, loc, &(loc->fromsyncq_ip), -1);
+    drain_sync_queue(t, glob, loc, &(loc->fromsyncq_voip), -1);
+}
+
+/* Tick callback for inputs with 'reportdrops' enabled */
+static void process_tick_report_drops(libtrace_t *trace,
+        libtrace_thread_t *t, void *global, void *local, uint64_t tick) {
+
+    collector_global_t *glob = (collector_global_t *)global;
+    colthread_local_t *loc = (colthread_local_t *)local;
+    libtrace_stat_t *stats;
+
+    process_tick(trace, t, global, local, tick);
+
+    if (trace_get_perpkt_thread_id(t) == 0) {
+
+        stats = trace_create_statistics();
+        trace_get_statistics(trace, stats);
+
+        pthread_mutex_lock(&(glob->stats_mutex));
+        glob->stats.packets_dropped += (stats->dropped - loc->dropped);
+        glob->stats.packets_accepted += (stats->accepted - loc->accepted);
+        pthread_mutex_unlock(&(glob->stats_mutex));
+
+        if (stats->dropped > loc->dropped) {
+            logger(LOG_INFO,
+                    "%lu dropped %lu packets in last second (accepted %lu)",
+                    (tick >> 32),
+                    stats->dropped - loc->dropped,
+                    stats->accepted - loc->accepted);
+            loc->dropped = stats->dropped;
+        }
+
+        pthread_rwlock_rdlock(&(glob->config_mutex));
+        if (glob->stat_frequency > 0) {
+            glob->ticks_since_last_stat ++;
+
+            if (glob->ticks_since_last_stat >= glob->stat_frequency * 60) {
+                pthread_mutex_lock(&(glob->stats_mutex));
+                collect_thread_stats(glob);
+                log_collector_stats(glob);
+                reset_collector_stats(glob);
+                pthread_mutex_unlock(&(glob->stats_mutex));
+                glob->ticks_since_last_stat = 0;
+            }
+        }
+        pthread_rwlock_unlock(&(glob->config_mutex));
+        loc->accepted = stats->accepted;
+        free(stats);
+    }
+}
+
+static void release_held_sip_fragments(held_sip_fragments_t *held) {
+    int i;
+
+    for (i = 0; i < held->pktcount; i++) {
+        release_sync_packet(held->pkts[i]);
+    }
+    free(held->pkts);
+    free(held);
 }
 
 static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
@@ -338,8 +447,8 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
 
     collector_global_t *glob = (collector_global_t *)global;
     colthread_local_t *loc = (colthread_local_t *)tls;
-    ipv4_target_t *v4, *tmp;
     ipv6_target_t *v6, *tmp2;
+    held_sip_fragments_t *held, *tmpheld;
     openli_pushed_t syncpush;
     int zero = 0, i;
 
@@ -370,18 +479,20 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
         zmq_close(loc->zmq_pubsocks[i]);
     }
 
-    zmq_setsockopt(loc->tosyncq_ip, ZMQ_LINGER, &zero, sizeof(zero));
-    zmq_close(loc->tosyncq_ip);
-    zmq_setsockopt(loc->tosyncq_voip, ZMQ_LINGER, &zero, sizeof(zero));
-    zmq_close(loc->tosyncq_voip);
+    for (i = 0; i < glob->ipsync_threads; i++) {
+        zmq_setsockopt(loc->tosyncq_ip[i], ZMQ_LINGER, &zero, sizeof(zero));
+        zmq_close(loc->tosyncq_ip[i]);
+    }
+    for (i = 0; i < glob->voipsync_threads; i++) {
+        zmq_setsockopt(loc->tosyncq_voip[i], ZMQ_LINGER, &zero, sizeof(zero));
+        zmq_close(loc->tosyncq_voip[i]);
+    }
 
     free(loc->zmq_pubsocks);
+    free(loc->tosyncq_ip);
+    free(loc->tosyncq_voip);
 
-    HASH_ITER(hh, loc->activeipv4intercepts, v4, tmp) {
-        free_all_ipsessions(&(v4->intercepts));
-        HASH_DELETE(hh, loc->activeipv4intercepts, v4);
-        free(v4);
-    }
+    shared_ipv4_offline(loc->sharedv4, loc->sharedreaderid);
 
     HASH_ITER(hh, loc->activeipv6intercepts, v6, tmp2) {
         free_all_ipsessions(&(v6->intercepts));
@@ -392,66 +503,275 @@ static void stop_processing_thread(libtrace_t *trace, libtrace_thread_t *t,
 
 
     free_all_staticipsessions(&(loc->activestaticintercepts));
+    free_rtp_stream_index(loc);
     free_all_rtpstreams(&(loc->activertpintercepts));
     free_all_vendmirror_intercepts(&(loc->activemirrorintercepts));
     free_coreserver_list(loc->radiusservers);
     free_coreserver_list(loc->gtpservers);
     free_coreserver_list(loc->sipservers);
+    free_coreserver_index(&(loc->coreserverindex));
 
     destroy_ipfrag_reassembler(loc->fragreass);
+    hash_radius_cleanup(&(loc->ipsynchasher));
+    HASH_ITER(hh, loc->heldsipfrags, held, tmpheld) {
+        HASH_DELETE(hh, loc->heldsipfrags, held);
+        release_held_sip_fragments(held);
+    }
 
     Destroy_Patricia(loc->staticv4ranges, free_staticrange_data);
     Destroy_Patricia(loc->staticv6ranges, free_staticrange_data);
     Destroy_Patricia(loc->dynamicv6ranges, free_staticrange_data);
 
-    free_staticcache(loc->staticcache);
+    clear_static_lpm(&(loc->staticv4lpm));
+    clear_static_lpm(&(loc->staticv6lpm));
 }
 
-static inline void send_packet_to_sync(libtrace_packet_t *pkt,
-        void *q, uint8_t updatetype) {
+static inline void push_sync_packet(void *q, libtrace_packet_t *copy,
+        uint8_t updatetype) {
     openli_state_update_t syncup;
+
+    syncup.type = updatetype;
+    syncup.data.pkt = copy;
+
+    zmq_send(q, (void *)(&syncup), sizeof(syncup), 0);
+}
+
+static inline void send_packet_to_sync(colthread_local_t *loc,
+        libtrace_packet_t *pkt, void *q, uint8_t updatetype) {
     libtrace_packet_t *copy;
-    int caplen = trace_get_capture_length(pkt);
-    int framelen = trace_get_framing_length(pkt);
 
-    if (caplen == -1 || framelen == -1) {
-        logger(LOG_INFO, "OpenLI: unable to copy packet for sync thread (caplen=%d, framelen=%d)", caplen, framelen);
+    copy = copy_packet_for_sync(loc->syncpktpool, pkt);
+    if (!copy) {
         exit(1);
     }
 
-    /* We do this ourselves instead of calling trace_copy_packet() because
-     * we don't want to be allocating 64K per copied packet -- we could be
-     * doing this a lot and don't want to be wasteful */
-    copy = (libtrace_packet_t *)calloc((size_t)1, sizeof(libtrace_packet_t));
-    if (!copy) {
-        logger(LOG_INFO, "OpenLI: out of memory while copying packet for sync thread");
-        exit(1);
+    //trace_increment_packet_refcount(pkt);
+    push_sync_packet(q, copy, updatetype);
+}
+
+static inline int choose_ipsync_shard(collector_global_t *glob,
+        colthread_local_t *loc, libtrace_packet_t *pkt) {
+
+    uint64_t hashed;
+
+    if (glob->ipsync_threads <= 1) {
+        return 0;
     }
 
-    copy->trace = pkt->trace;
-    copy->buf_control = TRACE_CTRL_PACKET;
-    copy->buffer = malloc(framelen + caplen);
-    copy->type = pkt->type;
-    copy->header = copy->buffer;
-    copy->payload = ((char *)copy->buffer) + framelen;
-    copy->order = pkt->order;
-    copy->hash = pkt->hash;
-    copy->error = pkt->error;
-    copy->which_trace_start = pkt->which_trace_start;
-    copy->cached.capture_length = caplen;
-    copy->cached.framing_length = framelen;
-    copy->cached.wire_length = -1;
-    copy->cached.payload_length = -1;
-    /* everything else in cache should be 0 or NULL due to our earlier
-     * calloc() */
-    memcpy(copy->header, pkt->header, framelen);
-    memcpy(copy->payload, pkt->payload, caplen);
+    /* Each processing thread has its own hasher, which is fine as long
+     * as the input hasher gives a request and its response to the same
+     * processing thread */
+    hashed = hash_radius_packet(pkt, &(loc->ipsynchasher));
 
-    syncup.type = updatetype;
-    syncup.data.pkt = copy;
+    return hashed % glob->ipsync_threads;
+}
 
-    //trace_increment_packet_refcount(pkt);
-    zmq_send(q, (void *)(&syncup), sizeof(syncup), 0);
+static inline uint8_t *find_sip_callid_header(uint8_t *line, uint8_t *end) {
+
+    uint8_t *val = NULL;
+
+    if (end - line > 7 && strncasecmp((char *)line, "call-id", 7) == 0) {
+        val = line + 7;
+    } else if (end - line > 1 && (*line == 'i' || *line == 'I')) {
+        /* compact form */
+        val = line + 1;
+    } else {
+        return NULL;
+    }
+
+    while (val < end && (*val == ' ' || *val == '\t')) {
+        val ++;
+    }
+
+    if (val >= end || *val != ':') {
+        return NULL;
+    }
+    return val + 1;
+}
+
+/* Every message in a dialog carries the same Call-ID, so hashing it
+ * keeps all of the state for a call within a single sync thread */
+static int hash_sip_callid(collector_global_t *glob, uint8_t *payload,
+        uint32_t rem) {
+
+    uint8_t *end, *line, *val, *valend;
+
+    end = payload + rem;
+    line = payload;
+    while ((line = memchr(line, '\n', end - line)) != NULL) {
+        line ++;
+        if (line >= end || *line == '\r' || *line == '\n') {
+            /* end of the headers */
+            break;
+        }
+
+        val = find_sip_callid_header(line, end);
+        if (val == NULL) {
+            continue;
+        }
+
+        while (val < end && (*val == ' ' || *val == '\t')) {
+            val ++;
+        }
+        valend = val;
+        while (valend < end && *valend != '\r' && *valend != '\n') {
+            valend ++;
+        }
+        while (valend > val && (*(valend - 1) == ' ' ||
+                    *(valend - 1) == '\t')) {
+            valend --;
+        }
+
+        if (valend == val) {
+            break;
+        }
+        return hashlittle(val, valend - val, 0x5ee1ca11) %
+                glob->voipsync_threads;
+    }
+
+    return 0;
+}
+
+static inline int choose_voipsync_shard(collector_global_t *glob,
+        libtrace_packet_t *pkt) {
+
+    void *transport;
+    uint8_t *payload;
+    uint32_t rem;
+    uint8_t proto;
+
+    if (glob->voipsync_threads <= 1) {
+        return 0;
+    }
+
+    /* SIP over TCP needs to be reassembled before we can find the
+     * Call-ID, so the first VOIP sync thread has to look after it.
+     * Fragmented SIP never gets here, see hold_sip_fragment() */
+    transport = trace_get_transport(pkt, &proto, &rem);
+    if (transport == NULL || proto != TRACE_IPPROTO_UDP) {
+        return 0;
+    }
+
+    payload = (uint8_t *)trace_get_payload_from_udp(
+            (libtrace_udp_t *)transport, &rem);
+    if (payload == NULL || rem == 0) {
+        return 0;
+    }
+
+    return hash_sip_callid(glob, payload, rem);
+}
+
+static void purge_held_sip_fragments(colthread_local_t *loc, uint32_t ts) {
+
+    held_sip_fragments_t *held, *tmp;
+
+    if (ts < loc->nextheldpurge) {
+        return;
+    }
+
+    HASH_ITER(hh, loc->heldsipfrags, held, tmp) {
+        if (held->lastts + HELD_SIP_FRAGMENT_EXPIRY < ts) {
+            HASH_DELETE(hh, loc->heldsipfrags, held);
+            release_held_sip_fragments(held);
+        }
+    }
+    loc->nextheldpurge = ts + HELD_SIP_FRAGMENT_EXPIRY;
+}
+
+static void forward_held_sip_fragments(collector_global_t *glob,
+        colthread_local_t *loc, held_sip_fragments_t *held,
+        ip_reassemble_stream_t *ipstream) {
+
+    char *content = NULL;
+    uint16_t len = 0;
+    uint8_t proto = 0;
+    int i, shard = 0;
+
+    if (get_next_ip_reassembled(ipstream, &content, &len, &proto) > 0 &&
+            proto == TRACE_IPPROTO_UDP && len > sizeof(libtrace_udp_t)) {
+        shard = hash_sip_callid(glob,
+                ((uint8_t *)content) + sizeof(libtrace_udp_t),
+                len - sizeof(libtrace_udp_t));
+    }
+    if (content) {
+        free(content);
+    }
+
+    for (i = 0; i < held->pktcount; i++) {
+        push_sync_packet(loc->tosyncq_voip[shard], held->pkts[i],
+                OPENLI_UPDATE_SIP);
+    }
+    free(held->pkts);
+    free(held);
+}
+
+/* Keeps a copy of a SIP fragment until we have seen the whole datagram.
+ * The Call-ID could be in any fragment, and the VOIP sync thread must
+ * receive every fragment so that it can do its own reassembly, so we
+ * can't send anything until the datagram is complete.
+ */
+static void hold_sip_fragment(collector_global_t *glob,
+        colthread_local_t *loc, libtrace_packet_t *pkt,
+        ip_reassemble_stream_t *ipstream) {
+
+    held_sip_fragments_t *held;
+    libtrace_packet_t *copy;
+    struct timeval tv = trace_get_timeval(pkt);
+
+    purge_held_sip_fragments(loc, tv.tv_sec);
+
+    HASH_FIND(hh, loc->heldsipfrags, &(ipstream->streamid),
+            sizeof(ip_streamid_t), held);
+
+    if (held && held->lastts + HELD_SIP_FRAGMENT_EXPIRY < tv.tv_sec) {
+        /* IP ID has been reused since we last saw this datagram */
+        HASH_DELETE(hh, loc->heldsipfrags, held);
+        release_held_sip_fragments(held);
+        held = NULL;
+    }
+
+    if (!held) {
+        held = (held_sip_fragments_t *)calloc(1,
+                sizeof(held_sip_fragments_t));
+        if (!held) {
+            logger(LOG_INFO, "OpenLI: out of memory while holding SIP fragment");
+            return;
+        }
+        memcpy(&(held->streamid), &(ipstream->streamid),
+                sizeof(ip_streamid_t));
+        HASH_ADD_KEYPTR(hh, loc->heldsipfrags, &(held->streamid),
+                sizeof(held->streamid), held);
+    }
+    held->lastts = tv.tv_sec;
+
+    if (held->pktcount == held->pktsalloced) {
+        libtrace_packet_t **newpkts;
+
+        newpkts = realloc(held->pkts, (held->pktsalloced + 8) *
+                sizeof(libtrace_packet_t *));
+        if (!newpkts) {
+            logger(LOG_INFO, "OpenLI: out of memory while holding SIP fragment");
+            HASH_DELETE(hh, loc->heldsipfrags, held);
+            release_held_sip_fragments(held);
+            return;
+        }
+        held->pkts = newpkts;
+        held->pktsalloced += 8;
+    }
+
+    copy = copy_packet_for_sync(loc->syncpktpool, pkt);
+    if (!copy) {
+        HASH_DELETE(hh, loc->heldsipfrags, held);
+        release_held_sip_fragments(held);
+        return;
+    }
+    held->pkts[held->pktcount] = copy;
+    held->pktcount ++;
+
+    if (is_ip_reassembled(ipstream)) {
+        HASH_DELETE(hh, loc->heldsipfrags, held);
+        forward_held_sip_fragments(glob, loc, held, ipstream);
+    }
 }
 
 static inline uint8_t check_for_invalid_sip(libtrace_packet_t *pkt,
@@ -518,61 +838,21 @@ static inline uint8_t check_for_invalid_sip(libtrace_packet_t *pkt,
     return 0;
 }
 
-static inline int is_core_server_packet(libtrace_packet_t *pkt,
-        packet_info_t *pinfo, coreserver_t *servers) {
-
-    coreserver_t *rad, *tmp;
-
-    if (pinfo->srcport == 0 || pinfo->destport == 0) {
-        return 0;
-    }
+static inline libtrace_packet_t *release_current_packet_ref(
+        colthread_local_t *loc, libtrace_packet_t *pkt) {
 
-    HASH_ITER(hh, servers, rad, tmp) {
-        if (rad->info == NULL) {
-            rad->info = populate_addrinfo(rad->ipstr, rad->portstr,
-                    SOCK_DGRAM);
-            if (!rad->info) {
-                logger(LOG_INFO,
-                        "Removing %s:%s from %s server list due to getaddrinfo error",
-                        rad->ipstr, rad->portstr,
-                        coreserver_type_to_string(rad->servertype));
+    openli_pkt_ref_t *ref = loc->curpktref;
 
-                HASH_DELETE(hh, servers, rad);
-                continue;
-            }
-            if (rad->info->ai_family == AF_INET) {
-                rad->portswapped = ntohs(CS_TO_V4(rad)->sin_port);
-            } else if (rad->info->ai_family == AF_INET6) {
-                rad->portswapped = ntohs(CS_TO_V6(rad)->sin6_port);
-            }
-        }
+    loc->curpktref = NULL;
 
-        if (pinfo->family == AF_INET) {
-            struct sockaddr_in *sa;
-            sa = (struct sockaddr_in *)(&(pinfo->srcip));
-
-            if (CORESERVER_MATCH_V4(rad, sa, pinfo->srcport)) {
-                return 1;
-            }
-            sa = (struct sockaddr_in *)(&(pinfo->destip));
-            if (CORESERVER_MATCH_V4(rad, sa, pinfo->destport)) {
-                return 1;
-            }
-        } else if (pinfo->family == AF_INET6) {
-            struct sockaddr_in6 *sa6;
-            sa6 = (struct sockaddr_in6 *)(&(pinfo->srcip));
-            if (CORESERVER_MATCH_V6(rad, sa6, pinfo->srcport)) {
-                return 1;
-            }
-            sa6 = (struct sockaddr_in6 *)(&(pinfo->destip));
-            if (CORESERVER_MATCH_V6(rad, sa6, pinfo->destport)) {
-                return 1;
-            }
-        }
+    /* If every job that referred to this packet has already been
+     * released, we can hand the packet straight back to libtrace.
+     * Otherwise, the last job to be released will free the packet. */
+    if (__atomic_sub_fetch(&(ref->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+        finish_packet_ref(ref);
+        return pkt;
     }
-
-    /* Doesn't match any of our known core servers */
-    return 0;
+    return NULL;
 }
 
 static libtrace_packet_t *process_packet(libtrace_t *trace,
@@ -588,22 +868,15 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
     int forwarded = 0, ret;
     int ipsynced = 0, voipsynced = 0;
     uint16_t fragoff = 0;
+    ip_reassemble_stream_t *ipstream = NULL;
+    uint8_t fragcomplete = 0;
 
-    openli_pushed_t syncpush;
     packet_info_t pinfo;
+    uint32_t csmask = 0;
 
     /* Check for any messages from the sync threads */
-    while (libtrace_message_queue_try_get(&(loc->fromsyncq_ip),
-            (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
-
-        process_incoming_messages(t, glob, loc, &syncpush);
-    }
-
-    while (libtrace_message_queue_try_get(&(loc->fromsyncq_voip),
-            (void *)&syncpush) != LIBTRACE_MQ_FAILED) {
-
-        process_incoming_messages(t, glob, loc, &syncpush);
-    }
+    drain_sync_queue(t, glob, loc, &(loc->fromsyncq_ip), SYNC_PUSH_BUDGET);
+    drain_sync_queue(t, glob, loc, &(loc->fromsyncq_voip), SYNC_PUSH_BUDGET);
 
 
     l3 = trace_get_layer3(pkt, &ethertype, &rem);
@@ -616,7 +889,6 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
     iprem = rem;
     if (ethertype == TRACE_ETHERTYPE_IP) {
         uint8_t moreflag;
-        ip_reassemble_stream_t *ipstream;
         libtrace_ip_t *ipheader = (libtrace_ip_t *)l3;
         struct sockaddr_in *in4;
 
@@ -650,9 +922,9 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
                 return pkt;
             }
 
-            if (is_ip_reassembled(ipstream)) {
-                remove_ipfrag_reassemble_stream(loc->fragreass, ipstream);
-            }
+            /* Don't remove the stream until we're done with this packet,
+             * in case we need the reassembled SIP message */
+            fragcomplete = is_ip_reassembled(ipstream);
             if (rem <= ipheader->ip_hl * 4) {
                 proto = 0;
             } else {
@@ -689,6 +961,11 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         pinfo.family = 0;
     }
 
+    if (proto == TRACE_IPPROTO_UDP || proto == TRACE_IPPROTO_TCP) {
+        csmask = match_packet_to_coreserver_index(loc->coreserverindex,
+                &pinfo);
+    }
+
     /* All these special packets are UDP, so we can avoid a whole bunch
      * of these checks for TCP traffic */
     if (proto == TRACE_IPPROTO_UDP) {
@@ -698,9 +975,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if (glob->alumirrors && check_alu_intercept(&(glob->sharedinfo), loc,
                 pkt, &pinfo, glob->alumirrors, loc->activemirrorintercepts)) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += 1;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            COLTHREAD_STAT_ADD(loc, ipcc_created, 1);
             goto processdone;
         }
 
@@ -708,41 +983,45 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
                 pkt, &pinfo, glob->jmirrors, loc->activemirrorintercepts)) {
 
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += 1;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            COLTHREAD_STAT_ADD(loc, ipcc_created, 1);
             goto processdone;
         }
 
         /* Is this a RADIUS packet? -- if yes, create a state update */
-        if (loc->radiusservers && is_core_server_packet(pkt, &pinfo,
-                    loc->radiusservers)) {
-            send_packet_to_sync(pkt, loc->tosyncq_ip, OPENLI_UPDATE_RADIUS);
+        if (csmask & CORESERVER_TYPE_MASK(OPENLI_CORE_SERVER_RADIUS)) {
+            send_packet_to_sync(loc, pkt,
+                    loc->tosyncq_ip[choose_ipsync_shard(glob, loc, pkt)],
+                    OPENLI_UPDATE_RADIUS);
             ipsynced = 1;
             goto processdone;
         }
 
-        if (loc->gtpservers && is_core_server_packet(pkt, &pinfo,
-                    loc->gtpservers)) {
-            send_packet_to_sync(pkt, loc->tosyncq_ip, OPENLI_UPDATE_GTP);
+        if (csmask & CORESERVER_TYPE_MASK(OPENLI_CORE_SERVER_GTP)) {
+            /* GTP responses carry no user identity, so keep all GTP
+             * session tracking on the first IP sync thread */
+            send_packet_to_sync(loc, pkt, loc->tosyncq_ip[0],
+                    OPENLI_UPDATE_GTP);
             ipsynced = 1;
             goto processdone;
         }
 
         /* Is this a SIP packet? -- if yes, create a state update */
-        if (loc->sipservers && is_core_server_packet(pkt, &pinfo,
-                    loc->sipservers)) {
-            if (!check_for_invalid_sip(pkt, fragoff)) {
-                send_packet_to_sync(pkt, loc->tosyncq_voip,
+        if (csmask & CORESERVER_TYPE_MASK(OPENLI_CORE_SERVER_SIP)) {
+            if (ipstream && glob->voipsync_threads > 1) {
+                hold_sip_fragment(glob, loc, pkt, ipstream);
+                voipsynced = 1;
+            } else if (!check_for_invalid_sip(pkt, fragoff)) {
+                send_packet_to_sync(loc, pkt,
+                        loc->tosyncq_voip[choose_voipsync_shard(glob, pkt)],
                         OPENLI_UPDATE_SIP);
                 voipsynced = 1;
             }
         }
     } else if (proto == TRACE_IPPROTO_TCP) {
         /* Is this a SIP packet? -- if yes, create a state update */
-        if (loc->sipservers && is_core_server_packet(pkt, &pinfo,
-                    loc->sipservers)) {
-            send_packet_to_sync(pkt, loc->tosyncq_voip, OPENLI_UPDATE_SIP);
+        if (csmask & CORESERVER_TYPE_MASK(OPENLI_CORE_SERVER_SIP)) {
+            send_packet_to_sync(loc, pkt, loc->tosyncq_voip[0],
+                    OPENLI_UPDATE_SIP);
             voipsynced = 1;
         }
     }
@@ -753,9 +1032,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if ((ret = ipv4_comm_contents(pkt, &pinfo, (libtrace_ip_t *)l3, iprem,
                     loc))) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += ret;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            COLTHREAD_STAT_ADD(loc, ipcc_created, ret);
         }
 
         /* Is this an RTP packet? -- if yes, possible IPMM CC */
@@ -763,9 +1040,7 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
             if ((ret = ip4mm_comm_contents(pkt, &pinfo, (libtrace_ip_t *)l3,
                         iprem, loc))) {
                 forwarded = 1;
-                pthread_mutex_lock(&(glob->stats_mutex));
-                glob->stats.ipmmcc_created += ret;
-                pthread_mutex_unlock(&(glob->stats_mutex));
+                COLTHREAD_STAT_ADD(loc, ipmmcc_created, ret);
             }
         }
 
@@ -774,39 +1049,37 @@ static libtrace_packet_t *process_packet(libtrace_t *trace,
         if ((ret = ipv6_comm_contents(pkt, &pinfo, (libtrace_ip6_t *)l3, iprem,
                     loc))) {
             forwarded = 1;
-            pthread_mutex_lock(&(glob->stats_mutex));
-            glob->stats.ipcc_created += ret;
-            pthread_mutex_unlock(&(glob->stats_mutex));
+            COLTHREAD_STAT_ADD(loc, ipcc_created, ret);
         }
 
         if (proto == TRACE_IPPROTO_UDP) {
             if ((ret = ip6mm_comm_contents(pkt, &pinfo, (libtrace_ip6_t *)l3,
                         iprem, loc))) {
                 forwarded = 1;
-                pthread_mutex_lock(&(glob->stats_mutex));
-                glob->stats.ipmmcc_created += ret;
-                pthread_mutex_unlock(&(glob->stats_mutex));
+                COLTHREAD_STAT_ADD(loc, ipmmcc_created, ret);
             }
         }
     }
 
 processdone:
+    if (fragcomplete) {
+        remove_ipfrag_reassemble_stream(loc->fragreass, ipstream);
+    }
+
     if (ipsynced) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_sync_ip ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        COLTHREAD_STAT_ADD(loc, packets_sync_ip, 1);
     }
 
     if (voipsynced) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_sync_voip ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        COLTHREAD_STAT_ADD(loc, packets_sync_voip, 1);
     }
 
     if (forwarded) {
-        pthread_mutex_lock(&(glob->stats_mutex));
-        glob->stats.packets_intercepted ++;
-        pthread_mutex_unlock(&(glob->stats_mutex));
+        COLTHREAD_STAT_ADD(loc, packets_intercepted, 1);
+    }
+
+    if (loc->curpktref) {
+        return release_current_packet_ref(loc, pkt);
     }
 
     return pkt;
@@ -827,7 +1100,14 @@ static int start_input(collector_global_t *glob, colinput_t *inp,
     trace_set_stopping_cb(inp->pktcbs, stop_processing_thread);
     trace_set_packet_cb(inp->pktcbs, process_packet);
 
+    /* The tick is needed regardless of 'reportdrops', as each thread
+     * reports that it is quiescent from there -- otherwise nothing retired
+     * from the shared IPv4 table could ever be reclaimed. It is also the
+     * only place that updates from the sync threads get applied while the
+     * input is idle. */
     if (inp->report_drops) {
+        trace_set_tick_interval_cb(inp->pktcbs, process_tick_report_drops);
+    } else {
         trace_set_tick_interval_cb(inp->pktcbs, process_tick);
     }
 
@@ -858,6 +1138,10 @@ static int start_input(collector_global_t *glob, colinput_t *inp,
         trace_set_hasher(inp->trace, HASHER_BIDIRECTIONAL, NULL, NULL);
     } else if (inp->hasher_apply == OPENLI_HASHER_BALANCE) {
         logger(LOG_INFO, "OpenLI: collector is using a balanced hasher for input %s", inp->uri);
+        if (glob->ipsync_threads > 1) {
+            logger(LOG_INFO, "OpenLI: RADIUS responses may be sent to the wrong IP sync thread -- use the bidirectional or radius hasher for input %s",
+                    inp->uri);
+        }
         trace_set_hasher(inp->trace, HASHER_BALANCE, NULL, NULL);
     } else if (inp->hasher_apply == OPENLI_HASHER_RADIUS) {
         logger(LOG_INFO, "OpenLI: collector is using a RADIUS-session hasher for input %s", inp->uri);
@@ -882,6 +1166,91 @@ static int start_input(collector_global_t *glob, colinput_t *inp,
     return 1;
 }
 
+/* Jobs for CCs that are encoded straight from the captured packet keep
+ * the packet away from libtrace until the forwarder is done with them.
+ * Those packets must be handed back before the input is paused, as some
+ * formats unmap their packet buffers at that point.
+ *
+ * Records can be held indefinitely (e.g. by a reorderer waiting on a
+ * missing record), so if the packets are not back after a while we ask
+ * the threads holding them to copy the contents out instead. If even
+ * that doesn't work (e.g. the holder has exited or is stuck), we
+ * eventually give up on the packets so that the input can still stop --
+ * they will never be handed back to libtrace. */
+static void release_input_packet_refs(collector_global_t *glob,
+        colinput_t *inp) {
+
+    int i, waited = 0;
+    uint32_t remaining;
+
+    do {
+        remaining = 0;
+        for (i = 0; i < glob->total_col_threads; i++) {
+            colthread_local_t *loc = &(glob->collocals[i]);
+
+            if (loc->trace != inp->trace || loc->pktrefowner == NULL) {
+                continue;
+            }
+            __atomic_store_n(&(loc->pktrefshalted), 1, __ATOMIC_RELEASE);
+            if (waited == PKTREF_DRAIN_TIMEOUT_MS) {
+                __atomic_store_n(&(loc->pktrefowner->detach), 1,
+                        __ATOMIC_RELEASE);
+            }
+            if (waited == PKTREF_ABANDON_TIMEOUT_MS) {
+                __atomic_store_n(&(loc->pktrefowner->abandoned), 1,
+                        __ATOMIC_RELEASE);
+            }
+            remaining += packet_ref_owner_outstanding(loc->pktrefowner);
+        }
+
+        if (remaining == 0) {
+            return;
+        }
+
+        if (waited == PKTREF_ABANDON_TIMEOUT_MS) {
+            logger(LOG_INFO,
+                    "OpenLI: giving up on %u packets from %s that were never released, stopping the input anyway",
+                    remaining, inp->uri);
+            return;
+        }
+
+        if (waited == PKTREF_DRAIN_TIMEOUT_MS) {
+            logger(LOG_INFO,
+                    "OpenLI: %u packets from %s are still waiting to be exported while the input is stopping, copying them out of the input",
+                    remaining, inp->uri);
+            request_packet_ref_detach();
+        } else if (waited > PKTREF_DRAIN_TIMEOUT_MS &&
+                (waited % PKTREF_DRAIN_TIMEOUT_MS) == 0) {
+            logger(LOG_INFO,
+                    "OpenLI: still waiting for %u packets from %s to be released",
+                    remaining, inp->uri);
+        }
+        usleep(1000);
+        waited ++;
+    } while (1);
+}
+
+/* Once an input has stopped, give each of its processing threads a fresh
+ * set of packet reference state for the next time it runs. Any
+ * references that were abandoned keep the old state alive until they are
+ * released. */
+static void reset_input_packet_refs(collector_global_t *glob,
+        colinput_t *inp) {
+
+    int i;
+
+    for (i = 0; i < glob->total_col_threads; i++) {
+        colthread_local_t *loc = &(glob->collocals[i]);
+
+        if (loc->trace != inp->trace) {
+            continue;
+        }
+        put_packet_ref_owner(loc->pktrefowner);
+        loc->pktrefowner = create_packet_ref_owner();
+        __atomic_store_n(&(loc->pktrefshalted), 0, __ATOMIC_RELEASE);
+    }
+}
+
 static void reload_inputs(collector_global_t *glob,
         collector_global_t *newstate) {
 
@@ -896,7 +1265,9 @@ static void reload_inputs(collector_global_t *glob,
             logger(LOG_INFO,
                     "OpenLI collector: stop reading packets from %s\n",
                     oldinp->uri);
+            release_input_packet_refs(glob, oldinp);
             trace_pstop(oldinp->trace);
+            reset_input_packet_refs(glob, oldinp);
             HASH_DELETE(hh, glob->inputs, oldinp);
             libtrace_list_push_back(glob->expired_inputs, &oldinp);
             continue;
@@ -985,6 +1356,21 @@ static void destroy_collector_state(collector_global_t *glob) {
 	free_sync_thread_data(&(glob->syncip));
 	free_sync_thread_data(&(glob->syncvoip));
 
+    if (glob->ipsyncshards) {
+        for (i = 1; i < glob->ipsync_threads; i++) {
+            libtrace_message_queue_destroy(&(glob->ipsyncshards[i].provq));
+        }
+        free(glob->ipsyncshards);
+    }
+
+    if (glob->voipsyncshards) {
+        for (i = 1; i < glob->voipsync_threads; i++) {
+            libtrace_message_queue_destroy(
+                    &(glob->voipsyncshards[i].intersyncq));
+        }
+        free(glob->voipsyncshards);
+    }
+
     libtrace_message_queue_destroy(&(glob->intersyncq));
 
     if (glob->zmq_forwarder_ctrl) {
@@ -1001,6 +1387,10 @@ static void destroy_collector_state(collector_global_t *glob) {
         for (i = 0; i < glob->forwarding_threads; i++) {
             zmq_close(glob->forwarders[i].zmq_pullressock);
             pthread_mutex_destroy(&(glob->forwarders[i].sslmutex));
+            pthread_mutex_destroy(&(glob->forwarders[i].backlogmutex));
+            if (glob->forwarders[i].backlog) {
+                free(glob->forwarders[i].backlog);
+            }
         }
         free(glob->forwarders);
     }
@@ -1019,13 +1409,25 @@ static void destroy_collector_state(collector_global_t *glob) {
     }
 
     if (glob->encoders) {
+        for (i = 0; i < glob->encoding_threads; i++) {
+            release_encoder_pools(&(glob->encoders[i]));
+        }
         free(glob->encoders);
     }
 
     if (glob->collocals) {
+        for (i = 0; i < glob->total_col_threads; i++) {
+            destroy_object_pool(glob->collocals[i].ccjobpool);
+            destroy_object_pool(glob->collocals[i].syncpktpool);
+            put_packet_ref_owner(glob->collocals[i].pktrefowner);
+        }
         free(glob->collocals);
     }
 
+    destroy_shared_ipv4_table(glob->sharedv4);
+    free_published_record_counters();
+    free_dropped_record_counters();
+
     free_ssl_config(&(glob->sslconf));
     free(glob);
 }
@@ -1059,6 +1461,14 @@ static void clear_global_config(collector_global_t *glob) {
         free(glob->sharedinfo.provisionerport);
     }
 
+    if (glob->spilldir) {
+        free(glob->spilldir);
+    }
+
+    if (glob->statsport) {
+        free(glob->statsport);
+    }
+
     if (glob->RMQ_conf.name) {
         free(glob->RMQ_conf.name);
     }
@@ -1086,10 +1496,11 @@ static inline void push_hello_message(void *atob,
 }
 
 int register_sync_queues(sync_thread_global_t *glob,
-        void *recvq, libtrace_message_queue_t *sendq,
+        void **recvqs, int recvqcount, libtrace_message_queue_t *sendq,
         libtrace_thread_t *parent) {
 
     sync_sendq_t *syncq, *sendq_hash;
+    int i;
 
     syncq = (sync_sendq_t *)malloc(sizeof(sync_sendq_t));
     syncq->q = sendq;
@@ -1103,7 +1514,9 @@ int register_sync_queues(sync_thread_global_t *glob,
 
     pthread_mutex_unlock(&(glob->mutex));
 
-    push_hello_message(recvq, sendq);
+    for (i = 0; i < recvqcount; i++) {
+        push_hello_message(recvqs[i], sendq);
+    }
     return 0;
 }
 
@@ -1137,8 +1550,39 @@ static int prepare_collector_glob(collector_global_t *glob) {
     init_sync_thread_data(glob, &(glob->syncip));
     init_sync_thread_data(glob, &(glob->syncvoip));
 
-    glob->collocals = (colthread_local_t *)calloc(glob->total_col_threads,
-            sizeof(colthread_local_t));
+    glob->ipsyncshards = calloc(glob->ipsync_threads, sizeof(ipsync_shard_t));
+    for (i = 1; i < glob->ipsync_threads; i++) {
+        glob->ipsyncshards[i].shardid = i;
+        glob->ipsyncshards[i].glob = glob;
+        libtrace_message_queue_init(&(glob->ipsyncshards[i].provq),
+                sizeof(openli_intersync_msg_t));
+    }
+
+    /* The first VOIP sync thread uses glob->intersyncq */
+    glob->voipsyncshards = calloc(glob->voipsync_threads,
+            sizeof(voipsync_shard_t));
+    for (i = 1; i < glob->voipsync_threads; i++) {
+        glob->voipsyncshards[i].shardid = i;
+        glob->voipsyncshards[i].glob = glob;
+        libtrace_message_queue_init(&(glob->voipsyncshards[i].intersyncq),
+                sizeof(openli_intersync_msg_t));
+    }
+
+    glob->sharedv4 = create_shared_ipv4_table(glob->total_col_threads);
+    if (glob->sharedv4 == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to allocate memory for shared IPv4 intercept table.");
+        return -1;
+    }
+
+    /* Make sure the per-thread stat counters really do start on their own
+     * cache line */
+    if (posix_memalign((void **)&(glob->collocals), COLTHREAD_CACHE_LINE,
+            glob->total_col_threads * sizeof(colthread_local_t)) != 0) {
+        logger(LOG_INFO, "OpenLI: unable to allocate memory for collector processing thread state.");
+        return -1;
+    }
+    memset(glob->collocals, 0,
+            glob->total_col_threads * sizeof(colthread_local_t));
 
     for (i = 0; i < glob->total_col_threads; i++) {
         init_collocal(&(glob->collocals[i]), glob, i);
@@ -1173,7 +1617,21 @@ static collector_global_t *parse_global_config(char *configfile) {
     glob->inputs = NULL;
     glob->seqtracker_threads = 1;
     glob->forwarding_threads = 1;
+    glob->ipsync_threads = 1;
+    glob->ipsyncshards = NULL;
+    glob->voipsync_threads = 1;
+    glob->voipsyncshards = NULL;
+    glob->publish_hwm = 0;
+    glob->sync_hwm = 0;
+    glob->encoder_hwm = 1000000;
+    glob->forwarder_hwm = 1000000;
+    glob->overload_policy = OPENLI_OVERLOAD_BLOCK;
+    glob->reorder_limit = 65536;
     glob->encoding_threads = 2;
+    glob->encoder_spin_budget = 1000;
+    glob->spilldir = NULL;
+    glob->spillthresh = 1024;
+    glob->statsport = NULL;
     glob->sharedinfo.intpointid = NULL;
     glob->sharedinfo.intpointid_len = 0;
     glob->sharedinfo.operatorid = NULL;
@@ -1192,6 +1650,7 @@ static collector_global_t *parse_global_config(char *configfile) {
     glob->sipdebugfile = NULL;
     glob->nextloc = 0;
     glob->syncgenericfreelist = NULL;
+    glob->sharedv4 = NULL;
 
     glob->sslconf.certfile = NULL;
     glob->sslconf.keyfile = NULL;
@@ -1206,6 +1665,7 @@ static collector_global_t *parse_global_config(char *configfile) {
     glob->RMQ_conf.enabled = 0;
 
     glob->etsitls = 1;
+    glob->zerocopy_cc = 0;
     glob->ignore_sdpo_matches = 0;
     glob->encoding_method = OPENLI_ENCODING_DER;
 
@@ -1227,6 +1687,8 @@ static collector_global_t *parse_global_config(char *configfile) {
     logger(LOG_DEBUG, "OpenLI: Encoding Method: %s",
         glob->encoding_method == OPENLI_ENCODING_BER ? "BER" : "DER");
 
+    set_publish_overload_policy(glob->overload_policy);
+
     logger(LOG_DEBUG, "OpenLI: ETSI TLS encryption %s",
         glob->etsitls ? "enabled" : "disabled");
 
@@ -1356,7 +1818,7 @@ static void *start_voip_sync_thread(void *params) {
 
     collector_global_t *glob = (collector_global_t *)params;
     int ret;
-    collector_sync_voip_t *sync = init_voip_sync_data(glob);
+    collector_sync_voip_t *sync = init_voip_sync_data(glob, 0);
     sync_sendq_t *sq;
 
     while (collector_halt == 0) {
@@ -1386,7 +1848,9 @@ static void *start_voip_sync_thread(void *params) {
 void halt_processing_threads(collector_global_t *glob) {
     colinput_t *inp, *tmp;
     HASH_ITER(hh, glob->inputs, inp, tmp) {
+        release_input_packet_refs(glob, inp);
         trace_pstop(inp->trace);
+        reset_input_packet_refs(glob, inp);
     }
 }
 
@@ -1394,7 +1858,7 @@ static void *start_ip_sync_thread(void *params) {
 
     collector_global_t *glob = (collector_global_t *)params;
     int ret;
-    collector_sync_t *sync = init_sync_data(glob);
+    collector_sync_t *sync = init_sync_data(glob, 0);
     sync_sendq_t *sq;
 
     /* XXX For early development work, we will read intercept instructions
@@ -1462,6 +1926,43 @@ haltsyncthread:
 }
 
 
+static void *start_ip_sync_shard_thread(void *params) {
+
+    ipsync_shard_t *shard = (ipsync_shard_t *)params;
+    collector_sync_t *sync = init_sync_data(shard->glob, shard->shardid);
+
+    if (sync->zmq_colsock != NULL) {
+        while (collector_halt == 0) {
+            if (sync_thread_main(sync) == -1) {
+                break;
+            }
+        }
+    }
+
+    clean_sync_data(sync);
+    free(sync);
+    logger(LOG_DEBUG, "OpenLI: exiting IP sync thread %d.", shard->shardid);
+    pthread_exit(NULL);
+}
+
+static void *start_voip_sync_shard_thread(void *params) {
+
+    voipsync_shard_t *shard = (voipsync_shard_t *)params;
+    collector_sync_voip_t *sync = init_voip_sync_data(shard->glob,
+            shard->shardid);
+
+    while (collector_halt == 0) {
+        if (sync_voip_thread_main(sync) == -1) {
+            break;
+        }
+    }
+
+    clean_sync_voip_data(sync);
+    free(sync);
+    logger(LOG_DEBUG, "OpenLI: exiting VOIP sync thread %d.", shard->shardid);
+    pthread_exit(NULL);
+}
+
 int main(int argc, char *argv[]) {
 
 	struct sigaction sigact;
@@ -1557,6 +2058,10 @@ int main(int argc, char *argv[]) {
 
     /* TODO check pthread_create return values... */
 
+    /* Forwarders need to know where the encoders are so that they can
+     * return encoded message bodies for reuse */
+    glob->encoders = calloc(glob->encoding_threads, sizeof(openli_encoder_t));
+
     glob->forwarders = calloc(glob->forwarding_threads,
             sizeof(forwarding_thread_data_t));
 
@@ -1564,14 +2069,23 @@ int main(int argc, char *argv[]) {
         glob->forwarders[i].zmq_ctxt = glob->zmq_ctxt;
         glob->forwarders[i].forwardid = i;
         glob->forwarders[i].encoders = glob->encoding_threads;
+        glob->forwarders[i].encoderstate = glob->encoders;
         glob->forwarders[i].colthreads = glob->total_col_threads;
         glob->forwarders[i].zmq_ctrlsock = NULL;
         glob->forwarders[i].zmq_pullressock = NULL;
         pthread_mutex_init(&(glob->forwarders[i].sslmutex), NULL);
+        pthread_mutex_init(&(glob->forwarders[i].backlogmutex), NULL);
+        glob->forwarders[i].backlog = NULL;
+        glob->forwarders[i].backlogcount = 0;
+        glob->forwarders[i].backlogsize = 0;
+        glob->forwarders[i].nextbacklogupdate = 0;
         glob->forwarders[i].ctx =
                 (glob->sslconf.ctx && glob->etsitls) ? glob->sslconf.ctx : NULL;
         //forwarder only needs CTX if ctx exists and is enabled 
         glob->forwarders[i].RMQ_conf = glob->RMQ_conf;
+        glob->forwarders[i].spilldir = glob->spilldir;
+        glob->forwarders[i].spillthresh = glob->spillthresh * 1024 * 1024;
+        glob->forwarders[i].reordermax = glob->reorder_limit;
 
         pthread_create(&(glob->forwarders[i].threadid), NULL,
                 start_forwarding_thread, (void *)&(glob->forwarders[i]));
@@ -1584,10 +2098,12 @@ int main(int argc, char *argv[]) {
         glob->seqtrackers[i].zmq_ctxt = glob->zmq_ctxt;
         glob->seqtrackers[i].trackerid = i;
         glob->seqtrackers[i].zmq_pushjobsock = NULL;
+        glob->seqtrackers[i].jobbatch = NULL;
         glob->seqtrackers[i].zmq_recvpublished = NULL;
         glob->seqtrackers[i].intercepts = NULL;
         glob->seqtrackers[i].colident = &(glob->sharedinfo);
         glob->seqtrackers[i].encoding_method = glob->encoding_method;
+        glob->seqtrackers[i].jobhwm = glob->encoder_hwm;
 #ifdef HAVE_BER_ENCODING
         glob->seqtrackers[i].enc_ber = wandder_init_encoder_ber(1000, 512);
 #endif
@@ -1595,8 +2111,6 @@ int main(int argc, char *argv[]) {
                 start_seqtracker_thread, (void *)&(glob->seqtrackers[i]));
     }
 
-    glob->encoders = calloc(glob->encoding_threads, sizeof(openli_encoder_t));
-
     for (i = 0; i < glob->encoding_threads; i++) {
         glob->encoders[i].zmq_ctxt = glob->zmq_ctxt;
         glob->encoders[i].zmq_recvjobs = NULL;
@@ -1607,14 +2121,24 @@ int main(int argc, char *argv[]) {
         glob->encoders[i].shared = &(glob->sharedinfo);
         glob->encoders[i].encoder = NULL;
         glob->encoders[i].freegenerics = NULL;
+        glob->encoders[i].jobbatch = NULL;
+        glob->encoders[i].resbatch = NULL;
+        glob->encoders[i].rescount = NULL;
 
         glob->encoders[i].seqtrackers = glob->seqtracker_threads;
         glob->encoders[i].forwarders = glob->forwarding_threads;
+        glob->encoders[i].spinbudget = glob->encoder_spin_budget;
+        glob->encoders[i].resulthwm = glob->forwarder_hwm;
 
         pthread_create(&(glob->encoders[i].threadid), NULL,
                 run_encoder_worker, (void *)&(glob->encoders[i]));
     }
 
+    if (glob->statsport) {
+        pthread_create(&(glob->statstid), NULL, start_pipeline_stats_thread,
+                (void *)glob);
+    }
+
     /* Start IP intercept sync thread */
     ret = pthread_create(&(glob->syncip.threadid), NULL, start_ip_sync_thread,
             (void *)glob);
@@ -1623,6 +2147,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    for (i = 1; i < glob->ipsync_threads; i++) {
+        ret = pthread_create(&(glob->ipsyncshards[i].threadid), NULL,
+                start_ip_sync_shard_thread, (void *)&(glob->ipsyncshards[i]));
+        if (ret != 0) {
+            logger(LOG_INFO, "OpenLI: error creating IP sync thread. Exiting.");
+            return 1;
+        }
+    }
+
     /* Start VOIP intercept sync thread */
     ret = pthread_create(&(glob->syncvoip.threadid), NULL,
             start_voip_sync_thread, (void *)glob);
@@ -1631,6 +2164,16 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    for (i = 1; i < glob->voipsync_threads; i++) {
+        ret = pthread_create(&(glob->voipsyncshards[i].threadid), NULL,
+                start_voip_sync_shard_thread,
+                (void *)&(glob->voipsyncshards[i]));
+        if (ret != 0) {
+            logger(LOG_INFO, "OpenLI: error creating VOIP sync thread. Exiting.");
+            return 1;
+        }
+    }
+
     if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL)) {
         logger(LOG_INFO, "Unable to re-enable signals after starting threads.");
         return 1;
@@ -1698,7 +2241,13 @@ int main(int argc, char *argv[]) {
     }
 
     pthread_join(glob->syncip.threadid, NULL);
+    for (i = 1; i < glob->ipsync_threads; i++) {
+        pthread_join(glob->ipsyncshards[i].threadid, NULL);
+    }
     pthread_join(glob->syncvoip.threadid, NULL);
+    for (i = 1; i < glob->voipsync_threads; i++) {
+        pthread_join(glob->voipsyncshards[i].threadid, NULL);
+    }
     for (i = 0; i < glob->seqtracker_threads; i++) {
         pthread_join(glob->seqtrackers[i].threadid, NULL);
     }
@@ -1709,6 +2258,9 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < glob->forwarding_threads; i++) {
         pthread_join(glob->forwarders[i].threadid, NULL);
     }
+    if (glob->statsport) {
+        pthread_join(glob->statstid, NULL);
+    }
 
     logger(LOG_INFO, "OpenLI: exiting OpenLI Collector.");
     /* Tidy up, exit */
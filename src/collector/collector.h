@@ -50,6 +50,9 @@
 #include "collector_base.h"
 #include "openli_tls.h"
 #include "radius_hasher.h"
+#include "shared_ipv4.h"
+#include "static_lpm.h"
+#include "sync_packet.h"
 
 enum {
     OPENLI_PUSH_IPINTERCEPT = 1,
@@ -63,6 +66,7 @@ enum {
     OPENLI_PUSH_IPRANGE = 11,
     OPENLI_PUSH_REMOVE_IPRANGE = 12,
     OPENLI_PUSH_MODIFY_IPRANGE = 13,
+    OPENLI_PUSH_BATCH = 14,
 };
 
 enum {
@@ -79,6 +83,10 @@ typedef struct openli_intersync_msg {
     uint16_t msglen;
 } PACKED openli_intersync_msg_t;
 
+/* Intersync message type used by the other VOIP sync threads to tell the
+ * first one that they have withdrawn an intercept. The body is the LIID. */
+#define OPENLI_INTERSYNC_VOIP_HALTED 0xff
+
 typedef struct openli_state_msg {
 
     uint8_t type;
@@ -99,10 +107,19 @@ typedef struct openli_ii_msg {
         char *rtpstreamkey;
         coreserver_t *coreserver;
         staticipsession_t *iprange;
+        struct openli_pushed_batch *batch;
     } data;
 
 } PACKED openli_pushed_t;
 
+/* Several pushed messages for the same processing thread, sent as one */
+#define OPENLI_PUSH_BATCH_SIZE 64
+
+typedef struct openli_pushed_batch {
+    uint32_t count;
+    openli_pushed_t msgs[OPENLI_PUSH_BATCH_SIZE];
+} openli_pushed_batch_t;
+
 enum {
     OPENLI_HASHER_BALANCE,
     OPENLI_HASHER_BIDIR,
@@ -122,13 +139,6 @@ typedef struct colinput {
     UT_hash_handle hh;
 } colinput_t;
 
-typedef struct ipv4_target {
-    uint32_t address;
-    ipsession_t *intercepts;
-
-    UT_hash_handle hh;
-} ipv4_target_t;
-
 typedef struct ipv6_target {
     uint8_t address[16];
     uint8_t prefixlen;
@@ -176,33 +186,102 @@ typedef struct liid_set {
     UT_hash_handle hh;
 } liid_set_t;
 
-typedef struct staticip_cacheentry {
-    prefix_t prefix;
-    patricia_node_t *pnode;
+/* 5-tuple (minus the protocol, which is always UDP) for an RTP or RTCP
+ * flow that belongs to an intercepted VOIP call.
+ */
+typedef struct rtpstream_5tuple {
+    uint16_t family;
+    uint16_t targetport;
+    uint16_t otherport;
+    uint8_t targetip[16];
+    uint8_t otherip[16];
+} PACKED rtpstream_5tuple_t;
+
+/* All of the active RTP streams that match a given 5-tuple -- there can be
+ * more than one if the same call is being intercepted under multiple LIIDs.
+ */
+typedef struct rtpstream_index {
+    rtpstream_5tuple_t key;
+    rtpstreaminf_t **streams;
+    int streamcount;
+    int alloced;
     UT_hash_handle hh;
-} static_ipcache_t;
+} rtpstream_index_t;
+
+#define COLTHREAD_CACHE_LINE 64
+#define CCJOB_POOL_MAX_FREE 10000
+
+/* Fragments of a SIP datagram are held by the processing thread until the
+ * whole datagram has arrived, so that every fragment can be sent to the
+ * VoIP sync thread chosen by the Call-ID. Incomplete datagrams are given
+ * up on after this many seconds.
+ */
+#define HELD_SIP_FRAGMENT_EXPIRY 30
+
+typedef struct held_sip_fragments {
+    ip_streamid_t streamid;
+    libtrace_packet_t **pkts;
+    int pktcount;
+    int pktsalloced;
+    uint32_t lastts;
+    UT_hash_handle hh;
+} held_sip_fragments_t;
+
+/* How long to wait for retained packets to be released before asking
+ * whoever holds them to take copies instead */
+#define PKTREF_DRAIN_TIMEOUT_MS 5000
+
+/* How long to wait in total before giving up on the retained packets, so
+ * that a reference that is never released cannot hang a reload or
+ * shutdown */
+#define PKTREF_ABANDON_TIMEOUT_MS 30000
+
+/* Maximum number of sync thread messages (each possibly a batch) that a
+ * processing thread will handle before each packet */
+#define SYNC_PUSH_BUDGET 8
+
+/* Counters that are updated by each processing thread for every packet.
+ * Only the owning thread ever writes to these, so no locking is required;
+ * thread 0 reads them periodically and folds them into the global stats.
+ */
+typedef struct colthread_stats {
+    uint64_t packets_intercepted;
+    uint64_t packets_sync_ip;
+    uint64_t packets_sync_voip;
+    uint64_t ipcc_created;
+    uint64_t ipmmcc_created;
+} colthread_stats_t;
+
+#define COLTHREAD_STAT_ADD(loc, field, n) \
+    __atomic_store_n(&((loc)->stats.field), (loc)->stats.field + (n), \
+            __ATOMIC_RELAXED)
+
+#define COLTHREAD_STAT_READ(loc, field) \
+    __atomic_load_n(&((loc)->stats.field), __ATOMIC_RELAXED)
 
 typedef struct colthread_local {
 
-    /* Message queue for pushing updates to sync IP thread */
-    void *tosyncq_ip;
+    /* Message queues for pushing updates to each sync IP thread */
+    void **tosyncq_ip;
 
     /* Message queue for receiving IP intercept instructions from sync thread */
     libtrace_message_queue_t fromsyncq_ip;
 
-    /* Message queue for pushing updates to sync VOIP thread */
-    void *tosyncq_voip;
+    /* Message queues for pushing updates to each sync VOIP thread */
+    void **tosyncq_voip;
 
     /* Message queue for receiving VOIP intercept instructions from sync
        thread */
     libtrace_message_queue_t fromsyncq_voip;
 
 
-    /* Current intercepts */
-    ipv4_target_t *activeipv4intercepts;
+    /* Current intercepts -- IPv4 sessions are shared between all threads */
+    shared_ipv4_table_t *sharedv4;
+    int sharedreaderid;
     ipv6_target_t *activeipv6intercepts;
 
     rtpstreaminf_t *activertpintercepts;
+    rtpstream_index_t *rtpstreamindex;
     vendmirror_intercept_list_t *activemirrorintercepts;
 
     staticipsession_t *activestaticintercepts;
@@ -225,18 +304,78 @@ typedef struct colthread_local {
      */
     coreserver_t *gtpservers;
 
+    /* Index of all known core servers by (address, port) */
+    coreserver_index_t *coreserverindex;
+
     patricia_tree_t *staticv4ranges;
     patricia_tree_t *staticv6ranges;
     patricia_tree_t *dynamicv6ranges;
-    static_ipcache_t *staticcache;
+    static_lpm_t staticv4lpm;
+    static_lpm_t staticv6lpm;
 
     ipfrag_reassembler_t *fragreass;
 
+    /* Remembers which IP sync thread each RADIUS request was sent to, so
+     * that the response can follow it */
+    hash_radius_conf_t ipsynchasher;
+
+    /* Copies of SIP fragments waiting for the rest of their datagram */
+    held_sip_fragments_t *heldsipfrags;
+    uint32_t nextheldpurge;
+
+    /* If set, IP CCs are encoded directly from the captured packet rather
+     * than a copy of it */
+    uint8_t zerocopy_cc;
+    libtrace_t *trace;
+
+    /* Reference to the packet currently being processed, if any jobs have
+     * been created that point into it */
+    openli_pkt_ref_t *curpktref;
+
+    /* Packet references that have not been released yet. Once the input
+     * starts halting, no more references are created and CC jobs carry
+     * copies of the packet contents instead. */
+    openli_pkt_ref_owner_t *pktrefowner;
+    uint8_t pktrefshalted;
+
+    /* Recycled IPCC and IPMMCC jobs */
+    openli_pool_t *ccjobpool;
+
+    /* Slots for packets that we pass on to the sync threads */
+    openli_pool_t *syncpktpool;
+
     uint64_t accepted;
     uint64_t dropped;
 
+    /* Kept on their own cache lines so that the per-packet updates do not
+     * bounce between cores when thread 0 reads them.
+     */
+    colthread_stats_t stats __attribute__((aligned(COLTHREAD_CACHE_LINE)));
+
+    /* Counter values as of the last time they were added to the global
+     * stats -- only touched by thread 0 */
+    colthread_stats_t reported __attribute__((aligned(COLTHREAD_CACHE_LINE)));
+
 } colthread_local_t;
 
+typedef struct ipsync_shard {
+    pthread_t threadid;
+    int shardid;
+    struct collector_global *glob;
+
+    /* Provisioner instructions forwarded by the first IP sync thread */
+    libtrace_message_queue_t provq;
+} ipsync_shard_t;
+
+typedef struct voipsync_shard {
+    pthread_t threadid;
+    int shardid;
+    struct collector_global *glob;
+
+    /* VoIP intercept instructions forwarded by the first IP sync thread */
+    libtrace_message_queue_t intersyncq;
+} voipsync_shard_t;
+
 typedef struct collector_global {
 
     void *zmq_ctxt;
@@ -246,6 +385,28 @@ typedef struct collector_global {
     int seqtracker_threads;
     int encoding_threads;
     int forwarding_threads;
+    int ipsync_threads;
+    int voipsync_threads;
+    uint32_t encoder_spin_budget;
+
+    /* High-water marks for the internal queues (0 means unlimited) and
+     * what to do with records when the publishing queue is full */
+    int publish_hwm;
+    int sync_hwm;
+    int encoder_hwm;
+    int forwarder_hwm;
+    uint8_t overload_policy;
+
+    /* Maximum number of out-of-order records held by a forwarding thread
+     * for each LIID and CIN */
+    uint32_t reorder_limit;
+
+    char *spilldir;
+    uint64_t spillthresh;
+
+    /* Local TCP port for reporting pipeline latencies and queue depths */
+    char *statsport;
+    pthread_t statstid;
 
     void *zmq_forwarder_ctrl;
     void *zmq_encoder_ctrl;
@@ -254,7 +415,14 @@ typedef struct collector_global {
 
     sync_thread_global_t syncip;
     sync_thread_global_t syncvoip;
+
+    ipsync_shard_t *ipsyncshards;
+    voipsync_shard_t *voipsyncshards;
+
+    /* Used to pick the IP sync thread for each RADIUS packet, so that
+     * requests and responses for the same user end up in the same place */
     etsili_generic_freelist_t *syncgenericfreelist;
+    shared_ipv4_table_t *sharedv4;
 
     //support_thread_global_t *exporters;
 
@@ -284,6 +452,7 @@ typedef struct collector_global {
     pthread_mutex_t stats_mutex;
 
     uint8_t etsitls;
+    uint8_t zerocopy_cc;
 
     uint8_t encoding_method;
     openli_ssl_config_t sslconf;
@@ -291,8 +460,23 @@ typedef struct collector_global {
 
 } collector_global_t;
 
+static inline openli_pkt_ref_t *get_cc_packet_ref(colthread_local_t *loc,
+        libtrace_packet_t *pkt) {
+
+    if (!loc->zerocopy_cc || loc->pktrefowner == NULL ||
+            __atomic_load_n(&(loc->pktrefshalted), __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    if (loc->curpktref == NULL) {
+        loc->curpktref = create_packet_ref(loc->trace, pkt,
+                loc->pktrefowner);
+    }
+    return loc->curpktref;
+}
+
 int register_sync_queues(sync_thread_global_t *glob,
-        void *recvq, libtrace_message_queue_t *sendq,
+        void **recvqs, int recvqcount, libtrace_message_queue_t *sendq,
         libtrace_thread_t *parent);
 void deregister_sync_queues(sync_thread_global_t *glob,
         libtrace_thread_t *t);
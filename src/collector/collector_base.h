@@ -40,6 +40,8 @@
 #include "collector_publish.h"
 #include "export_buffer.h"
 #include "openli_tls.h"
+#include "object_pool.h"
+#include "pipeline_stats.h"
 
 typedef struct export_dest {
     int failmsg;
@@ -52,6 +54,7 @@ typedef struct export_dest {
     char *portstr;
     export_buffer_t buffer;
     uint8_t logallowed;
+    uint8_t carriestraffic;
 
     SSL *ssl;
     int waitingforhandshake;
@@ -59,6 +62,11 @@ typedef struct export_dest {
 
     amqp_bytes_t rmq_queueid;
 
+    /* Ring of sampled records that are waiting in the export buffer */
+    openli_write_mark_t *writemarks;
+    uint32_t markhead;
+    uint32_t markcount;
+
     UT_hash_handle hh_fd;
     UT_hash_handle hh_medid;
 } export_dest_t;
@@ -138,6 +146,16 @@ enum {
     OPENLI_ENCODING_BER
 };
 
+/* Encoding jobs and encoded results are passed between threads in batches
+ * of up to this many records per zeromq message. A partial batch is sent
+ * as soon as the sender runs out of input, or once the oldest record in
+ * it has been waiting for OPENLI_ENCODING_BATCH_MAX_WAIT nanoseconds.
+ */
+#define OPENLI_ENCODING_BATCH_MAX 64
+#define OPENLI_ENCODING_BATCH_MAX_WAIT (100 * 1000)
+
+struct encoder_job;
+
 typedef struct seqtracker_thread_data {
     void *zmq_ctxt;
     pthread_t threadid;
@@ -154,19 +172,33 @@ typedef struct seqtracker_thread_data {
     wandder_encoder_ber_t *enc_ber;
 #endif
 
-} seqtracker_thread_data_t;
+    /* High-water mark for the queue of jobs to the encoders */
+    int jobhwm;
+
+    struct encoder_job *jobbatch;
+    uint32_t jobcount;
 
-typedef struct stored_result {
-    openli_encoded_result_t res;
-    UT_hash_handle hh;
-} stored_result_t;
+    /* Set when the encoders were not keeping up the last time that we
+     * sent them a batch. While set, any records that the overload policy
+     * allows us to shed are dropped before they get a sequence number. */
+    uint8_t encodersbusy;
+
+    openli_stage_stats_t stats;
+
+} seqtracker_thread_data_t;
 
 typedef struct intercept_reorderer {
 
     char *liid;
     char *key;
     uint32_t expectedseqno;
-    stored_result_t *pending;
+
+    /* Ring of results that arrived ahead of expectedseqno, where a result
+     * with sequence number N lives in slot (N & (pendingsize - 1)). */
+    openli_encoded_result_t *pending;
+    uint8_t *occupied;
+    uint32_t pendingsize;
+    uint32_t pendingcount;
 
 } int_reorderer_t;
 
@@ -196,6 +228,10 @@ typedef struct forwarding_thread_data {
     Pvoid_t intreorderer_cc;
     Pvoid_t intreorderer_iri;
 
+    /* Used to hand encoded message bodies back to the encoder that
+     * created them */
+    struct encoder_state *encoderstate;
+
     SSL_CTX *ctx;
     pthread_mutex_t sslmutex;
 
@@ -203,6 +239,29 @@ typedef struct forwarding_thread_data {
     amqp_socket_t *ampq_sock;
     openli_RMQ_config_t RMQ_conf;
 
+    char *spilldir;
+    uint64_t spillthresh;
+
+    /* Maximum number of slots in each reorderer ring (a power of two) */
+    uint32_t reordermax;
+
+    openli_encoded_result_t *resbatch;
+
+    /* Last packet reference detach request that we have acted on */
+    uint32_t seendetachgen;
+
+    openli_stage_stats_t stats;
+    openli_latency_hist_t writelatency;
+    openli_latency_hist_t endtoend;
+
+    /* Snapshot of how much is buffered for each mediator, for reporting
+     * by the pipeline statistics thread */
+    pthread_mutex_t backlogmutex;
+    openli_backlog_entry_t *backlog;
+    uint32_t backlogcount;
+    uint32_t backlogsize;
+    uint64_t nextbacklogupdate;
+
 } forwarding_thread_data_t;
 
 typedef struct encoder_state {
@@ -218,9 +277,30 @@ typedef struct encoder_state {
     wandder_encoder_t *encoder;
     etsili_generic_freelist_t *freegenerics;
 
+    /* Containers for encoded message bodies that are not created by
+     * libwandder (i.e. BER and raw IP) */
+    openli_pool_t *bodypool;
+
+    /* DER message bodies that forwarders have finished with, waiting to
+     * be handed back to libwandder for reuse */
+    wandder_encoded_result_t *returnedbodies;
+
     int seqtrackers;
     int forwarders;
+    int resulthwm;
     uint8_t halted;
+
+    struct encoder_job *jobbatch;
+
+    /* Encoded results waiting to be sent to each forwarder */
+    openli_encoded_result_t **resbatch;
+    uint32_t *rescount;
+
+    /* Number of consecutive empty polls before blocking in zmq_poll() */
+    uint32_t spinbudget;
+    uint32_t idlespins;
+
+    openli_stage_stats_t stats;
 } openli_encoder_t;
 
 typedef struct encoder_job {
@@ -230,12 +310,16 @@ typedef struct encoder_job {
     wandder_etsili_child_t *child;
 #endif
     uint32_t seqno;
-    char *cinstr;
+    uint32_t cin;
     openli_export_recv_t *origreq;
     char *liid;
+    uint64_t queuedns;
 } PACKED openli_encoding_job_t;
 
 void destroy_encoder_worker(openli_encoder_t *enc);
+void release_encoder_pools(openli_encoder_t *enc);
+void return_encoded_body(openli_encoder_t *enc,
+        wandder_encoded_result_t *body);
 void *run_encoder_worker(void *encstate);
 
 void *start_seqtracker_thread(void *data);
@@ -42,32 +42,28 @@
 
 #define BUF_BATCH_SIZE (100 * 1024 * 1024)
 #define MIN_SEND_AMOUNT (1 * 1024 * 1024)
+#define REORDERER_INITIAL_SIZE 16
 #define AMPQ_BYTES_FROM(x) (amqp_bytes_t){.len=sizeof(x),.bytes=&x}
 #define AMQP_FRAME_MAX 131072
+#define BACKLOG_UPDATE_INTERVAL (100 * 1000000)
 
-static inline void free_encoded_result(openli_encoded_result_t *res) {
-    if (res->liid) {
-        free(res->liid);
-    }
+static inline void free_encoded_result(forwarding_thread_data_t *fwd,
+        openli_encoded_result_t *res) {
 
-    if (res->cinstr) {
-        free(res->cinstr);
-    }
+    /* res->liid belongs to the original request, so is freed with it */
 
     if (res->msgbody) {
-
-        if (res->msgbody->encoded) {
-#ifdef HAVE_BER_ENCODING
-            if (!res->child) {
-                //if child exists, then msgbody->encoded is owned by child
-                //dont free so it can be reused
-                free(res->msgbody->encoded);
-            }
-#else
-            free(res->msgbody->encoded);
-#endif
+        if (res->msgbody->encoder) {
+            /* DER body created by libwandder -- return it to the encoder
+             * that created it so the encoded buffer can be reused */
+            return_encoded_body(&(fwd->encoderstate[res->encodedby]),
+                    res->msgbody);
+        } else {
+            /* Raw IP and BER bodies: if a BER child exists, then
+             * msgbody->encoded is owned by the child so it can be reused.
+             */
+            release_pooled_object(res->msgbody);
         }
-        free(res->msgbody);
     }
 
     if (res->origreq) {
@@ -81,6 +77,140 @@ static inline void free_encoded_result(openli_encoded_result_t *res) {
 #endif
 }
 
+static inline void mark_appended_record(export_dest_t *med,
+        openli_encoded_result_t *res) {
+
+    openli_write_mark_t *mark;
+
+    if (med->writemarks == NULL) {
+        med->writemarks = (openli_write_mark_t *)calloc(
+                OPENLI_WRITE_MARK_RING_SIZE, sizeof(openli_write_mark_t));
+        if (med->writemarks == NULL) {
+            return;
+        }
+    }
+
+    if (med->markcount == OPENLI_WRITE_MARK_RING_SIZE) {
+        return;
+    }
+
+    mark = &(med->writemarks[(med->markhead + med->markcount) &
+            (OPENLI_WRITE_MARK_RING_SIZE - 1)]);
+    mark->endoffset = get_buffer_append_offset(&(med->buffer));
+    mark->arrivedns = res->queuedns;
+    if (res->origreq->type == OPENLI_EXPORT_IPCC ||
+            res->origreq->type == OPENLI_EXPORT_IPMMCC ||
+            res->origreq->type == OPENLI_EXPORT_UMTSCC) {
+        mark->capturens = timeval_to_ns(&(res->origreq->ts));
+    } else {
+        mark->capturens = 0;
+    }
+    med->markcount ++;
+}
+
+/* Adds a record to the export buffer for a mediator.
+ *
+ * Returns 0 if the buffer has no room for the record, 1 otherwise.
+ */
+static inline int export_encoded_result(export_dest_t *med,
+        openli_encoded_result_t *res) {
+
+    uint64_t ret;
+
+    if (res->skipped) {
+        /* Couldn't be encoded, so there is nothing to export -- we only
+         * needed it to move past its sequence number */
+        return 1;
+    }
+
+    ret = append_message_to_buffer(&(med->buffer), res, 0);
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret == EXPORT_BUFFER_RECORD_DROPPED) {
+        /* Nothing was written, so there is no latency to measure */
+        return 1;
+    }
+    mark_appended_record(med, res);
+    return 1;
+}
+
+/* Called after data has been written to a mediator, to work out how long
+ * the sampled records that have now left the buffer were waiting for.
+ */
+static void resolve_write_marks(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
+
+    openli_write_mark_t *mark;
+    uint64_t written, now, wallnow;
+
+    if (med->markcount == 0) {
+        return;
+    }
+
+    written = get_buffer_written_offset(&(med->buffer));
+    now = openli_now_ns();
+    wallnow = openli_wallclock_ns();
+
+    while (med->markcount > 0) {
+        mark = &(med->writemarks[med->markhead]);
+        if (mark->endoffset > written) {
+            break;
+        }
+
+        record_latency_since(&(fwd->writelatency), mark->arrivedns, now);
+        record_latency_since(&(fwd->endtoend), mark->capturens, wallnow);
+
+        med->markhead = (med->markhead + 1) & (OPENLI_WRITE_MARK_RING_SIZE - 1);
+        med->markcount --;
+    }
+}
+
+static void update_backlog_snapshot(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *med;
+    PWord_t jval;
+    Word_t index = 0, count = 0;
+    uint64_t now = openli_now_ns();
+
+    if (now < fwd->nextbacklogupdate) {
+        return;
+    }
+    fwd->nextbacklogupdate = now + BACKLOG_UPDATE_INTERVAL;
+
+    JLC(count, fwd->destinations_by_id, 0, -1);
+
+    pthread_mutex_lock(&(fwd->backlogmutex));
+    if (count > fwd->backlogsize) {
+        openli_backlog_entry_t *grown;
+
+        grown = (openli_backlog_entry_t *)realloc(fwd->backlog,
+                count * sizeof(openli_backlog_entry_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&(fwd->backlogmutex));
+            return;
+        }
+        fwd->backlog = grown;
+        fwd->backlogsize = count;
+    }
+
+    fwd->backlogcount = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval && fwd->backlogcount < fwd->backlogsize) {
+        med = (export_dest_t *)(*jval);
+
+        fwd->backlog[fwd->backlogcount].mediatorid = med->mediatorid;
+        fwd->backlog[fwd->backlogcount].connected = (med->fd != -1);
+        fwd->backlog[fwd->backlogcount].buffered =
+                get_buffered_amount(&(med->buffer));
+        fwd->backlog[fwd->backlogcount].spilled = med->buffer.spilled;
+        fwd->backlogcount ++;
+
+        JLN(jval, fwd->destinations_by_id, index);
+    }
+    pthread_mutex_unlock(&(fwd->backlogmutex));
+}
+
 static int add_new_destination(forwarding_thread_data_t *fwd,
         openli_export_recv_t *msg) {
 
@@ -101,6 +231,7 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
         newdest->awaitingconfirm = 0;
         newdest->halted = 0;
         newdest->logallowed = 1;
+        newdest->carriestraffic = 0;
         newdest->mediatorid = msg->data.med.mediatorid;
         newdest->ipstr = msg->data.med.ipstr;
         newdest->portstr = msg->data.med.portstr;
@@ -116,6 +247,8 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
         }
 
         init_export_buffer(&(newdest->buffer));
+        set_export_buffer_spill(&(newdest->buffer), fwd->spilldir,
+                fwd->spillthresh);
 
         JLI(jval, fwd->destinations_by_id, newdest->mediatorid);
         *jval = (Word_t)newdest;
@@ -217,6 +350,9 @@ static void remove_destination(forwarding_thread_data_t *fwd,
     }
 
     release_export_buffer(&(med->buffer));
+    if (med->writemarks) {
+        free(med->writemarks);
+    }
     if (med->ipstr) {
         free(med->ipstr);
     }
@@ -267,7 +403,7 @@ static void remove_reorderers(forwarding_thread_data_t *fwd, char *liid,
     PWord_t jval;
     uint8_t index[256];
     int_reorderer_t *reord;
-    stored_result_t *stored, *tmp;
+    uint32_t i;
     int err;
 
     index[0] = '\0';
@@ -280,11 +416,14 @@ static void remove_reorderers(forwarding_thread_data_t *fwd, char *liid,
             continue;
         }
         JSLD(err, *reorderer_array, index);
-        HASH_ITER(hh, reord->pending, stored, tmp) {
-            HASH_DELETE(hh, reord->pending, stored);
-            free_encoded_result(&(stored->res));
-            free(stored);
+        for (i = 0; i < reord->pendingsize && reord->pendingcount > 0; i++) {
+            if (reord->occupied[i]) {
+                free_encoded_result(fwd, &(reord->pending[i]));
+                reord->pendingcount --;
+            }
         }
+        free(reord->pending);
+        free(reord->occupied);
         free(reord->liid);
         free(reord->key);
         free(reord);
@@ -357,13 +496,135 @@ static int handle_ctrl_message(forwarding_thread_data_t *fwd,
     return 1;
 }
 
+/* Copies the IP content of a held record out of its captured packet if
+ * the processing thread that captured it is trying to stop */
+static inline void detach_held_result(openli_encoded_result_t *res) {
+    uint8_t *oldcontent, *copy;
+
+    if (res->origreq == NULL) {
+        return;
+    }
+
+    oldcontent = res->origreq->data.ipcc.ipcontent;
+    copy = detach_packet_ref(res->origreq);
+    if (copy != NULL && res->ipcontents == oldcontent) {
+        res->ipcontents = copy;
+    }
+}
+
+static void detach_reorderer_packets(Pvoid_t *reorderer_array) {
+
+    PWord_t jval;
+    uint8_t index[256];
+    int_reorderer_t *reord;
+    uint32_t i;
+
+    index[0] = '\0';
+    JSLF(jval, *reorderer_array, index);
+    while (jval != NULL) {
+        reord = (int_reorderer_t *)(*jval);
+        for (i = 0; i < reord->pendingsize; i++) {
+            if (reord->occupied[i]) {
+                detach_held_result(&(reord->pending[i]));
+            }
+        }
+        JSLN(jval, *reorderer_array, index);
+    }
+}
+
+static int grow_reorderer(forwarding_thread_data_t *fwd,
+        int_reorderer_t *reord, uint32_t needed) {
+
+    openli_encoded_result_t *newpending;
+    uint8_t *newoccupied;
+    uint32_t newsize = reord->pendingsize;
+    uint32_t i, slot;
+
+    if (newsize == 0) {
+        newsize = REORDERER_INITIAL_SIZE;
+    }
+    while (newsize <= needed && newsize < fwd->reordermax) {
+        newsize *= 2;
+    }
+    if (newsize <= needed) {
+        return -1;
+    }
+
+    newpending = (openli_encoded_result_t *)malloc(
+            sizeof(openli_encoded_result_t) * newsize);
+    newoccupied = (uint8_t *)calloc(newsize, sizeof(uint8_t));
+
+    if (newpending == NULL || newoccupied == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: unable to grow intercept record reorderer due to lack of memory");
+        free(newpending);
+        free(newoccupied);
+        return -1;
+    }
+
+    for (i = 0; i < reord->pendingsize; i++) {
+        if (!reord->occupied[i]) {
+            continue;
+        }
+        slot = reord->pending[i].seqno & (newsize - 1);
+        memcpy(&(newpending[slot]), &(reord->pending[i]),
+                sizeof(openli_encoded_result_t));
+        newoccupied[slot] = 1;
+    }
+
+    free(reord->pending);
+    free(reord->occupied);
+    reord->pending = newpending;
+    reord->occupied = newoccupied;
+    reord->pendingsize = newsize;
+    return 0;
+}
+
+/* Stop waiting for the records that are missing before 'seqno' and write
+ * out everything that we were holding, in order. */
+static int skip_reorderer_gap(forwarding_thread_data_t *fwd,
+        export_dest_t *med, int_reorderer_t *reord, uint32_t seqno) {
+
+    openli_encoded_result_t *next;
+    uint32_t i, slot;
+
+    logger(LOG_INFO,
+            "OpenLI: forwarder is skipping %u missing records for %s",
+            seqno - reord->expectedseqno - reord->pendingcount, reord->key);
+
+    for (i = 0; i < reord->pendingsize && reord->pendingcount > 0; i++) {
+        slot = (reord->expectedseqno + i) & (reord->pendingsize - 1);
+        if (!reord->occupied[slot]) {
+            continue;
+        }
+        next = &(reord->pending[slot]);
+        reord->occupied[slot] = 0;
+        reord->pendingcount --;
+
+        if (export_encoded_result(med, next) == 0) {
+            logger(LOG_INFO,
+                    "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate asap!",
+                    med->mediatorid);
+            free_encoded_result(fwd, next);
+            remove_destination(fwd, med);
+            return -1;
+        }
+        free_encoded_result(fwd, next);
+    }
+
+    reord->expectedseqno = seqno;
+    return 0;
+}
+
 static inline int enqueue_result(forwarding_thread_data_t *fwd,
         export_dest_t *med, openli_encoded_result_t *res) {
 
     PWord_t jval;
     int_reorderer_t *reord;
     Pvoid_t *reorderer;
-    stored_result_t *stored, *tmp;
+    openli_encoded_result_t *next;
+    uint32_t distance, slot;
+    char cinstr[1024];
 
     if (res->origreq->type == OPENLI_EXPORT_IPCC ||
             res->origreq->type == OPENLI_EXPORT_IPMMCC ||
@@ -376,9 +637,10 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
 
 
     /* reordering of results if required for each LIID/CIN */
-    JSLG(jval, *reorderer, (unsigned char *)res->cinstr);
+    snprintf(cinstr, 1024, "%s-%u", res->liid, res->cin);
+    JSLG(jval, *reorderer, (unsigned char *)cinstr);
     if (jval == NULL) {
-        JSLI(jval, *reorderer, (unsigned char *)res->cinstr);
+        JSLI(jval, *reorderer, (unsigned char *)cinstr);
 
         if (jval == NULL) {
             logger(LOG_INFO,
@@ -389,8 +651,11 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
 
         reord = (int_reorderer_t *)calloc(1, sizeof(int_reorderer_t));
         reord->liid = strdup(res->liid);
-        reord->key = strdup(res->cinstr);
+        reord->key = strdup(cinstr);
         reord->pending = NULL;
+        reord->occupied = NULL;
+        reord->pendingsize = 0;
+        reord->pendingcount = 0;
         reord->expectedseqno = 0;
 
         *jval = (Word_t)reord;
@@ -398,18 +663,36 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
         reord = (int_reorderer_t *)(*jval);
     }
 
-    if (res->seqno != reord->expectedseqno) {
-
-        stored = (stored_result_t *)calloc(1, sizeof(stored_result_t));
-        memcpy(&(stored->res), res, sizeof(openli_encoded_result_t));
-
-        HASH_ADD_KEYPTR(hh, reord->pending, &(stored->res.seqno),
-                sizeof(stored->res.seqno), stored);
-
-        return 0;
+    /* A "negative" distance means this record is from before our expected
+     * sequence number (e.g. the intercept was restarted), so there is no
+     * point holding on to it waiting for a gap to be filled.
+     */
+    distance = res->seqno - reord->expectedseqno;
+    if (distance != 0 && distance < 0x80000000) {
+        if (distance >= reord->pendingsize &&
+                grow_reorderer(fwd, reord, distance) < 0) {
+            /* Too far ahead to keep waiting for the gap to be filled */
+            if (skip_reorderer_gap(fwd, med, reord, res->seqno) < 0) {
+                return -1;
+            }
+            distance = 0;
+        } else {
+            slot = res->seqno & (reord->pendingsize - 1);
+            if (reord->occupied[slot]) {
+                /* Every held record has its own slot, so this must be a
+                 * duplicate of one we already have */
+                return 1;
+            }
+            memcpy(&(reord->pending[slot]), res,
+                    sizeof(openli_encoded_result_t));
+            detach_held_result(&(reord->pending[slot]));
+            reord->occupied[slot] = 1;
+            reord->pendingcount ++;
+            return 0;
+        }
     }
 
-    if (append_message_to_buffer(&(med->buffer), res, 0) == 0) {
+    if (export_encoded_result(med, res) == 0) {
         logger(LOG_INFO,
                 "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate now!",
                 med->mediatorid);
@@ -417,27 +700,31 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
         return 1;
     }
 
+    if (distance != 0) {
+        return 1;
+    }
     reord->expectedseqno = res->seqno + 1;
 
-    HASH_ITER(hh, reord->pending, stored, tmp) {
-        if (stored->res.seqno != reord->expectedseqno) {
+    /* Drain every consecutive record that was waiting on this one */
+    while (reord->pendingcount > 0) {
+        slot = reord->expectedseqno & (reord->pendingsize - 1);
+        if (!reord->occupied[slot]) {
             break;
         }
+        next = &(reord->pending[slot]);
+        reord->occupied[slot] = 0;
+        reord->pendingcount --;
 
-        HASH_DELETE(hh, reord->pending, stored);
-
-        if (append_message_to_buffer(&(med->buffer), &(stored->res), 0) == 0) {
+        if (export_encoded_result(med, next) == 0) {
             logger(LOG_INFO,
                     "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate asap!",
                     med->mediatorid);
+            free_encoded_result(fwd, next);
             remove_destination(fwd, med);
             return -1;
         }
-        reord->expectedseqno = stored->res.seqno + 1;
-
-        free_encoded_result(&(stored->res));
-        free(stored);
-
+        reord->expectedseqno ++;
+        free_encoded_result(fwd, next);
     }
 
     return 1;
@@ -475,18 +762,22 @@ static int handle_encoded_result(forwarding_thread_data_t *fwd,
         med->portstr = NULL;
         med->awaitingconfirm = 0;
         med->halted = 0;
+        med->carriestraffic = 0;
         med->mediatorid = res->destid;
         init_export_buffer(&(med->buffer));
+        set_export_buffer_spill(&(med->buffer), fwd->spilldir,
+                fwd->spillthresh);
 
         *jval = (Word_t) med;
     } else {
         med = (export_dest_t *)(*jval);
     }
 
+    med->carriestraffic = 1;
     ret = enqueue_result(fwd, med, res);
 
     if (ret != 0) {
-        free_encoded_result(res);
+        free_encoded_result(fwd, res);
     }
 
     return ret;
@@ -592,6 +883,14 @@ static void connect_export_targets(forwarding_thread_data_t *fwd) {
             continue;
         }
 
+        /* Results are spread across forwarders by LIID, so only the first
+         * forwarder keeps a connection to every mediator -- the others
+         * wait until they actually have something to send.
+         */
+        if (fwd->forwardid != 0 && !dest->carriestraffic) {
+            continue;
+        }
+
         pthread_mutex_lock(&(fwd->sslmutex));
         dest->fd = connect_single_target(dest, fwd->ctx);
         pthread_mutex_unlock(&(fwd->sslmutex));
@@ -654,11 +953,12 @@ static void connect_export_targets(forwarding_thread_data_t *fwd) {
 
 static int drain_incoming_etsi(forwarding_thread_data_t *fwd) {
 
-    int x, encoders_over = 0;
-    openli_encoded_result_t res;
+    int x, i, encoders_over = 0;
+    openli_encoded_result_t *res;
 
     do {
-        x = zmq_recv(fwd->zmq_pullressock, &res, sizeof(res),
+        x = zmq_recv(fwd->zmq_pullressock, fwd->resbatch,
+                OPENLI_ENCODING_BATCH_MAX * sizeof(openli_encoded_result_t),
                 ZMQ_DONTWAIT);
         if (x < 0 && errno != EAGAIN) {
             return -1;
@@ -668,24 +968,30 @@ static int drain_incoming_etsi(forwarding_thread_data_t *fwd) {
             continue;
         }
 
-        if (res.liid == NULL && res.destid == 0) {
-            logger(LOG_INFO, "encoder %d has ceased encoding", encoders_over);
-            encoders_over ++;
-        }
+        for (i = 0; i < x / (int)sizeof(openli_encoded_result_t); i++) {
+            res = &(fwd->resbatch[i]);
+            if (res->liid == NULL && res->destid == 0) {
+                logger(LOG_INFO, "encoder %d has ceased encoding",
+                        encoders_over);
+                encoders_over ++;
+            }
 
-        free_encoded_result(&res);
+            free_encoded_result(fwd, res);
+        }
     } while (encoders_over < fwd->encoders);
 
     return 1;
 }
 
 static int receive_incoming_etsi(forwarding_thread_data_t *fwd) {
-    int x, processed;
-    openli_encoded_result_t res;
+    int x, i, j, nres, processed;
+    openli_encoded_result_t *res;
+    uint64_t now;
 
     processed = 0;
     do {
-        x = zmq_recv(fwd->zmq_pullressock, &res, sizeof(res),
+        x = zmq_recv(fwd->zmq_pullressock, fwd->resbatch,
+                OPENLI_ENCODING_BATCH_MAX * sizeof(openli_encoded_result_t),
                 ZMQ_DONTWAIT);
         if (x < 0 && errno != EAGAIN) {
             logger(LOG_INFO,
@@ -698,10 +1004,25 @@ static int receive_incoming_etsi(forwarding_thread_data_t *fwd) {
             break;
         }
 
-        if (handle_encoded_result(fwd, &res) < 0) {
-            return -1;
+        nres = x / sizeof(openli_encoded_result_t);
+        now = openli_now_ns();
+        add_stage_counter(&(fwd->stats.received), nres);
+
+        for (i = 0; i < nres; i++) {
+            res = &(fwd->resbatch[i]);
+
+            /* From here on, queuedns is the time the record reached us */
+            record_latency_since(&(fwd->stats.latency), res->queuedns, now);
+            res->queuedns = now;
+
+            if (handle_encoded_result(fwd, res) < 0) {
+                for (j = i + 1; j < nres; j++) {
+                    free_encoded_result(fwd, &(fwd->resbatch[j]));
+                }
+                return -1;
+            }
         }
-        processed ++;
+        processed += nres;
     } while (x > 0 && processed < 100000);
     return 1;
 }
@@ -773,6 +1094,8 @@ static void rmq_write_buffered(forwarding_thread_data_t *fwd) {
                 dest->rmq_queueid,
                 BUF_BATCH_SIZE) < 0 ) {
             logger(LOG_INFO, "OpenLI: Error Publishing to RMQ");
+        } else {
+            resolve_write_marks(fwd, dest);
         }
     }
 }
@@ -830,6 +1153,12 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
         return -1;
     }
 
+    if (packet_ref_detach_requested(&(fwd->seendetachgen))) {
+        /* A processing thread wants its captured packets back, so stop
+         * holding on to any that are stuck in our reorderers */
+        detach_reorderer_packets(&(fwd->intreorderer_cc));
+    }
+
     if (fwd->topoll[0].revents & ZMQ_POLLIN) {
         x = process_control_message(fwd);
         if (x < 0) {
@@ -879,6 +1208,7 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
          */
         rmq_write_buffered(fwd);
         fwd->forcesend_rmq = 0;
+        update_backlog_snapshot(fwd);
         return 1;
     }
 
@@ -934,19 +1264,24 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
                     dest->ipstr, dest->portstr, strerror(errno));
             }
             disconnect_mediator(fwd, dest);
-        } else if (dest->logallowed == 0) {
-            logger(LOG_INFO,
-                    "OpenLI: successfully started transmitting records to mediator %s:%s", dest->ipstr, dest->portstr);
-            dest->logallowed = 1;
+        } else {
+            resolve_write_marks(fwd, dest);
+            if (dest->logallowed == 0) {
+                logger(LOG_INFO,
+                        "OpenLI: successfully started transmitting records to mediator %s:%s", dest->ipstr, dest->portstr);
+                dest->logallowed = 1;
+            }
         }
         fwd->forcesend[i] = 0;
     }
+    update_backlog_snapshot(fwd);
     return 1;
 }
 
 static void forwarder_main(forwarding_thread_data_t *fwd) {
 
     int x;
+    uint32_t ringsize;
     struct itimerspec its;
 
     fwd->destinations_by_id = NULL;
@@ -956,6 +1291,15 @@ static void forwarder_main(forwarding_thread_data_t *fwd) {
 
     fwd->intreorderer_cc = NULL;
     fwd->intreorderer_iri = NULL;
+    fwd->seendetachgen = 0;
+
+    /* Reorderer slots are found by masking the sequence number, so the
+     * ring size has to be a power of two */
+    ringsize = REORDERER_INITIAL_SIZE;
+    while (ringsize < fwd->reordermax && ringsize < 0x40000000) {
+        ringsize *= 2;
+    }
+    fwd->reordermax = ringsize;
 
     fwd->conntimerfd = timerfd_create(CLOCK_MONOTONIC, 0);
     if (fwd->conntimerfd == -1) {
@@ -1013,8 +1357,16 @@ void *start_forwarding_thread(void *data) {
 
     forwarding_thread_data_t *fwd = (forwarding_thread_data_t *)data;
     char sockname[128];
-    int zero = 0, x;
-    openli_encoded_result_t res;
+    int zero = 0, x, i;
+
+    fwd->resbatch = (openli_encoded_result_t *)calloc(
+            OPENLI_ENCODING_BATCH_MAX, sizeof(openli_encoded_result_t));
+    if (fwd->resbatch == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: forwarding thread %d failed to allocate result batch",
+                fwd->forwardid);
+        pthread_exit(NULL);
+    }
 
     fwd->zmq_ctrlsock = zmq_socket(fwd->zmq_ctxt, ZMQ_PULL);
     snprintf(sockname, 128, "inproc://openliforwardercontrol_sync-%d",
@@ -1089,7 +1441,9 @@ void *start_forwarding_thread(void *data) {
     forwarder_main(fwd);
 
     do {
-        x = zmq_recv(fwd->zmq_pullressock, &res, sizeof(res), ZMQ_DONTWAIT);
+        x = zmq_recv(fwd->zmq_pullressock, fwd->resbatch,
+                OPENLI_ENCODING_BATCH_MAX * sizeof(openli_encoded_result_t),
+                ZMQ_DONTWAIT);
         if (x < 0) {
             if (errno == EAGAIN) {
                 continue;
@@ -1097,17 +1451,8 @@ void *start_forwarding_thread(void *data) {
             break;
         }
 
-        if (res.msgbody) {
-            free(res.msgbody->encoded);
-            free(res.msgbody);
-        }
-
-        if (res.liid) {
-            free(res.liid);
-        }
-
-        if (res.ipcontents) {
-            free(res.ipcontents);
+        for (i = 0; i < x / (int)sizeof(openli_encoded_result_t); i++) {
+            free_encoded_result(fwd, &(fwd->resbatch[i]));
         }
     } while (x > 0);
 
@@ -1117,6 +1462,8 @@ haltforwarder:
     }
     zmq_close(fwd->zmq_ctrlsock);
     remove_all_destinations(fwd);
+    free(fwd->resbatch);
+    fwd->resbatch = NULL;
     logger(LOG_DEBUG, "OpenLI: halting forwarding thread %d",
             fwd->forwardid);
     pthread_exit(NULL);
@@ -27,22 +27,235 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 
 #include <pthread.h>
 #include <zmq.h>
+#include <uthash.h>
+#include <libtrace_parallel.h>
 
 #include "logger.h"
 #include "util.h"
 #include "collector_publish.h"
+#include "pipeline_stats.h"
+
+/* Records that were dropped because of the overload policy, counted
+ * per LIID. As with the published record counters, each publishing thread
+ * keeps its own table so the hot path only ever takes an uncontended lock.
+ */
+typedef struct dropped_liid {
+    char *liid;
+    uint64_t iris;
+    uint64_t ccs;
+    UT_hash_handle hh;
+} dropped_liid_t;
+
+typedef struct drop_counters drop_counters_t;
+
+struct drop_counters {
+    pthread_mutex_t mutex;
+    dropped_liid_t *byliid;
+    drop_counters_t *next;
+};
+
+static uint8_t overload_policy = OPENLI_OVERLOAD_BLOCK;
+static drop_counters_t *dropcounters = NULL;
+static pthread_mutex_t dropcounters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread drop_counters_t *mydropcounters = NULL;
+
+void set_publish_overload_policy(uint8_t policy) {
+    overload_policy = policy;
+}
+
+static inline int is_cc_record(openli_export_recv_t *msg) {
+    return (msg->type == OPENLI_EXPORT_IPCC ||
+            msg->type == OPENLI_EXPORT_IPMMCC ||
+            msg->type == OPENLI_EXPORT_UMTSCC);
+}
+
+static char *get_record_liid(openli_export_recv_t *msg) {
+
+    switch(msg->type) {
+        case OPENLI_EXPORT_IPCC:
+        case OPENLI_EXPORT_IPMMCC:
+        case OPENLI_EXPORT_UMTSCC:
+            return msg->data.ipcc.liid;
+        case OPENLI_EXPORT_IPMMIRI:
+            return msg->data.ipmmiri.liid;
+        case OPENLI_EXPORT_IPIRI:
+            return msg->data.ipiri.liid;
+        case OPENLI_EXPORT_UMTSIRI:
+            return msg->data.mobiri.liid;
+        case OPENLI_EXPORT_RAW_SYNC:
+            return msg->data.rawip.liid;
+    }
+    return NULL;
+}
+
+/* Returns 1 if the overload policy says this message may be dropped
+ * rather than waiting for room in the queue */
+int may_drop_record(openli_export_recv_t *msg) {
+
+    if (get_record_liid(msg) == NULL) {
+        return 0;
+    }
+
+    switch(overload_policy) {
+        case OPENLI_OVERLOAD_DROP:
+            return 1;
+        case OPENLI_OVERLOAD_SHED_IRI:
+            return !is_cc_record(msg);
+        case OPENLI_OVERLOAD_SHED_CC:
+            return is_cc_record(msg);
+    }
+    return 0;
+}
+
+void count_dropped_record(openli_export_recv_t *msg) {
+
+    dropped_liid_t *found;
+    char *liid = get_record_liid(msg);
+
+    if (liid == NULL) {
+        return;
+    }
+
+    if (mydropcounters == NULL) {
+        mydropcounters = (drop_counters_t *)calloc(1, sizeof(drop_counters_t));
+        if (mydropcounters == NULL) {
+            return;
+        }
+        pthread_mutex_init(&(mydropcounters->mutex), NULL);
+        pthread_mutex_lock(&dropcounters_mutex);
+        mydropcounters->next = dropcounters;
+        dropcounters = mydropcounters;
+        pthread_mutex_unlock(&dropcounters_mutex);
+    }
+
+    pthread_mutex_lock(&(mydropcounters->mutex));
+    HASH_FIND(hh, mydropcounters->byliid, liid, strlen(liid), found);
+    if (!found) {
+        found = (dropped_liid_t *)calloc(1, sizeof(dropped_liid_t));
+        found->liid = strdup(liid);
+        HASH_ADD_KEYPTR(hh, mydropcounters->byliid, found->liid,
+                strlen(found->liid), found);
+    }
+    if (is_cc_record(msg)) {
+        found->ccs ++;
+    } else {
+        found->iris ++;
+    }
+    pthread_mutex_unlock(&(mydropcounters->mutex));
+}
+
+static void free_dropped_liids(dropped_liid_t **byliid) {
+    dropped_liid_t *d, *tmp;
+
+    HASH_ITER(hh, *byliid, d, tmp) {
+        HASH_DELETE(hh, *byliid, d);
+        free(d->liid);
+        free(d);
+    }
+}
+
+/* Logs the number of records dropped for each LIID since the last time
+ * this was called */
+void log_dropped_record_counts(void) {
+
+    drop_counters_t *c;
+    dropped_liid_t *merged = NULL, *taken, *d, *tmp, *found;
+    uint64_t iris = 0, ccs = 0;
+
+    pthread_mutex_lock(&dropcounters_mutex);
+    for (c = dropcounters; c != NULL; c = c->next) {
+        pthread_mutex_lock(&(c->mutex));
+        taken = c->byliid;
+        c->byliid = NULL;
+        pthread_mutex_unlock(&(c->mutex));
+
+        HASH_ITER(hh, taken, d, tmp) {
+            HASH_FIND(hh, merged, d->liid, strlen(d->liid), found);
+            if (found) {
+                found->iris += d->iris;
+                found->ccs += d->ccs;
+                HASH_DELETE(hh, taken, d);
+                free(d->liid);
+                free(d);
+            } else {
+                HASH_DELETE(hh, taken, d);
+                HASH_ADD_KEYPTR(hh, merged, d->liid, strlen(d->liid), d);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dropcounters_mutex);
+
+    if (merged == NULL) {
+        return;
+    }
+
+    HASH_ITER(hh, merged, d, tmp) {
+        iris += d->iris;
+        ccs += d->ccs;
+    }
+    logger(LOG_INFO, "OpenLI: Records dropped due to overload... IRIs: %lu  CCs: %lu",
+            iris, ccs);
+    HASH_ITER(hh, merged, d, tmp) {
+        logger(LOG_INFO, "OpenLI: Records dropped for LIID %s... IRIs: %lu  CCs: %lu",
+                d->liid, d->iris, d->ccs);
+    }
+    free_dropped_liids(&merged);
+}
+
+void free_dropped_record_counters(void) {
+    drop_counters_t *c, *next;
+
+    pthread_mutex_lock(&dropcounters_mutex);
+    c = dropcounters;
+    while (c) {
+        next = c->next;
+        free_dropped_liids(&(c->byliid));
+        pthread_mutex_destroy(&(c->mutex));
+        free(c);
+        c = next;
+    }
+    dropcounters = NULL;
+    pthread_mutex_unlock(&dropcounters_mutex);
+}
 
 int publish_openli_msg(void *pubsock, openli_export_recv_t *msg) {
 
-    if (zmq_send(pubsock, &msg, sizeof(openli_export_recv_t *), 0) < 0) {
+    int flags = 0;
+    uint8_t msgtype = msg->type;
+
+    if (may_drop_record(msg)) {
+        flags = ZMQ_DONTWAIT;
+    }
+
+    if (zmq_send(pubsock, &msg, sizeof(openli_export_recv_t *), flags) < 0) {
+        if (errno == EAGAIN && flags == ZMQ_DONTWAIT) {
+            /* Queue is full and we're allowed to shed this record */
+            count_dropped_record(msg);
+            free_published_message(msg);
+            return 0;
+        }
         logger(LOG_INFO, "Error while publishing OpenLI export message: %s",
                 strerror(errno));
         return -1;
     }
 
+    /* msg now belongs to the seqtracker, so don't touch it again */
+    switch(msgtype) {
+        case OPENLI_EXPORT_IPCC:
+        case OPENLI_EXPORT_IPMMCC:
+        case OPENLI_EXPORT_IPMMIRI:
+        case OPENLI_EXPORT_IPIRI:
+        case OPENLI_EXPORT_UMTSCC:
+        case OPENLI_EXPORT_UMTSIRI:
+        case OPENLI_EXPORT_RAW_SYNC:
+            count_published_record();
+            break;
+    }
+
     return 0;
 }
 
@@ -50,6 +263,19 @@ void free_published_message(openli_export_recv_t *msg) {
 
     if (msg->type == OPENLI_EXPORT_IPCC || msg->type == OPENLI_EXPORT_IPMMCC
             || msg->type == OPENLI_EXPORT_UMTSCC) {
+        if (msg->data.ipcc.pktref) {
+            /* ipcontent points into the referenced packet */
+            release_packet_ref(msg->data.ipcc.pktref);
+            msg->data.ipcc.pktref = NULL;
+            msg->data.ipcc.ipcontent = NULL;
+        }
+
+        if (msg->data.ipcc.pooled) {
+            /* Hang on to the LIID and content buffers for the next job */
+            release_pooled_object(msg);
+            return;
+        }
+
         if (msg->data.ipcc.liid) {
             free(msg->data.ipcc.liid);
         }
@@ -89,8 +315,142 @@ void free_published_message(openli_export_recv_t *msg) {
     free(msg);
 }
 
+/* Destructor for IPCC jobs that are sitting in an object pool */
+void free_pooled_ipcc_job(void *obj) {
+    openli_export_recv_t *msg = (openli_export_recv_t *)obj;
+
+    if (msg->data.ipcc.liid) {
+        free(msg->data.ipcc.liid);
+    }
+    if (msg->data.ipcc.ipcalloc > 0 && msg->data.ipcc.ipcontent) {
+        free(msg->data.ipcc.ipcontent);
+    }
+}
+
+openli_pkt_ref_owner_t *create_packet_ref_owner(void) {
+    openli_pkt_ref_owner_t *owner;
+
+    owner = (openli_pkt_ref_owner_t *)calloc(1,
+            sizeof(openli_pkt_ref_owner_t));
+    if (owner == NULL) {
+        return NULL;
+    }
+    owner->refs = 1;
+    return owner;
+}
+
+void put_packet_ref_owner(openli_pkt_ref_owner_t *owner) {
+    if (owner == NULL) {
+        return;
+    }
+    if (__atomic_sub_fetch(&(owner->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+        free(owner);
+    }
+}
+
+/* Only meaningful while the processing thread still holds its own
+ * reference to the owner */
+uint32_t packet_ref_owner_outstanding(openli_pkt_ref_owner_t *owner) {
+    return __atomic_load_n(&(owner->refs), __ATOMIC_ACQUIRE) - 1;
+}
+
+openli_pkt_ref_t *create_packet_ref(libtrace_t *trace,
+        libtrace_packet_t *pkt, openli_pkt_ref_owner_t *owner) {
+
+    openli_pkt_ref_t *ref;
+
+    ref = (openli_pkt_ref_t *)malloc(sizeof(openli_pkt_ref_t));
+    if (ref == NULL) {
+        return NULL;
+    }
+
+    ref->trace = trace;
+    ref->packet = pkt;
+    /* The processing thread that created the reference holds the first
+     * reference until it has finished with the packet */
+    ref->refs = 1;
+    ref->owner = owner;
+    __atomic_add_fetch(&(owner->refs), 1, __ATOMIC_RELAXED);
+    return ref;
+}
+
+/* Frees the reference itself, once the packet has been handed back */
+void finish_packet_ref(openli_pkt_ref_t *ref) {
+    put_packet_ref_owner(ref->owner);
+    free(ref);
+}
+
+void release_packet_ref(openli_pkt_ref_t *ref) {
+
+    if (__atomic_sub_fetch(&(ref->refs), 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    /* If the input has stopped without this packet, the trace may
+     * already be gone */
+    if (!__atomic_load_n(&(ref->owner->abandoned), __ATOMIC_ACQUIRE)) {
+        trace_free_packet(ref->trace, ref->packet);
+    }
+    finish_packet_ref(ref);
+}
+
+/* Bumped whenever a processing thread asks for its packet references to
+ * be detached, so that threads holding on to jobs know to check them */
+static uint32_t pktref_detach_gen = 0;
+
+void request_packet_ref_detach(void) {
+    __atomic_add_fetch(&pktref_detach_gen, 1, __ATOMIC_RELEASE);
+}
+
+int packet_ref_detach_requested(uint32_t *seen) {
+    uint32_t gen = __atomic_load_n(&pktref_detach_gen, __ATOMIC_ACQUIRE);
+
+    if (gen == *seen) {
+        return 0;
+    }
+    *seen = gen;
+    return 1;
+}
+
+/* Copies the IP content of a zero-copy CC job out of its packet, if the
+ * processing thread that captured the packet has asked for that, and
+ * releases the job's reference to the packet.
+ *
+ * Returns the new location of the IP content, or NULL if the job was
+ * left untouched.
+ */
+uint8_t *detach_packet_ref(openli_export_recv_t *msg) {
+    openli_pkt_ref_t *ref;
+    uint8_t *copy;
+
+    if (msg->type != OPENLI_EXPORT_IPCC && msg->type != OPENLI_EXPORT_IPMMCC
+            && msg->type != OPENLI_EXPORT_UMTSCC) {
+        return NULL;
+    }
+
+    ref = msg->data.ipcc.pktref;
+    if (ref == NULL ||
+            !__atomic_load_n(&(ref->owner->detach), __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    copy = (uint8_t *)malloc(msg->data.ipcc.ipclen + 1);
+    if (copy == NULL) {
+        /* Leave the reference alone and try again next time */
+        return NULL;
+    }
+    memcpy(copy, msg->data.ipcc.ipcontent, msg->data.ipcc.ipclen);
+
+    release_packet_ref(ref);
+    msg->data.ipcc.pktref = NULL;
+    msg->data.ipcc.ipcontent = copy;
+    msg->data.ipcc.ipcalloc = msg->data.ipcc.ipclen + 1;
+    return copy;
+}
+
 openli_export_recv_t *create_ipcc_job(uint32_t cin, char *liid,
-        uint32_t destid, libtrace_packet_t *pkt, uint8_t dir) {
+        uint32_t destid, libtrace_packet_t *pkt, uint8_t dir,
+        openli_pkt_ref_t *pktref, openli_pool_t *pool) {
 
     void *l3;
     uint32_t rem;
@@ -99,10 +459,18 @@ openli_export_recv_t *create_ipcc_job(uint32_t cin, char *liid,
     uint32_t x;
     size_t liidlen = strlen(liid);
 
-    msg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
+    if (pool) {
+        /* Recycled jobs still have their LIID and content buffers from
+         * last time, so the reallocs below will rarely need to do
+         * anything. */
+        msg = (openli_export_recv_t *)get_pooled_object(pool);
+    } else {
+        msg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
+    }
     if (msg == NULL) {
         return msg;
     }
+    msg->data.ipcc.pooled = (pool != NULL);
 
     l3 = trace_get_layer3(pkt, &ethertype, &rem);
 
@@ -121,13 +489,34 @@ openli_export_recv_t *create_ipcc_job(uint32_t cin, char *liid,
     }
     if (msg->data.ipcc.liid == NULL) {
         msg->data.ipcc.liidalloc = 0;
-        free(msg);
+        free_published_message(msg);
         return NULL;
     }
 
     memcpy(msg->data.ipcc.liid, liid, liidlen);
     msg->data.ipcc.liid[liidlen] = '\0';
 
+    msg->data.ipcc.cin = cin;
+    msg->data.ipcc.dir = dir;
+
+    if (pktref) {
+        /* Encode directly from the packet buffer -- the packet will be
+         * released once the forwarder is done with the encoded record.
+         *
+         * Nothing can fail after this point, so a job that we return NULL
+         * for never holds a reference to the packet.
+         */
+        if (msg->data.ipcc.ipcalloc > 0) {
+            free(msg->data.ipcc.ipcontent);
+            msg->data.ipcc.ipcalloc = 0;
+        }
+        __atomic_add_fetch(&(pktref->refs), 1, __ATOMIC_RELAXED);
+        msg->data.ipcc.pktref = pktref;
+        msg->data.ipcc.ipcontent = (uint8_t *)l3;
+        msg->data.ipcc.ipclen = rem;
+        return msg;
+    }
+
     if (rem > msg->data.ipcc.ipcalloc) {
         if (rem < 512) {
             x = 512;
@@ -140,13 +529,11 @@ openli_export_recv_t *create_ipcc_job(uint32_t cin, char *liid,
 
     if (msg->data.ipcc.ipcontent == NULL) {
         msg->data.ipcc.ipcalloc = 0;
-        free(msg);
+        free_published_message(msg);
         return NULL;
     }
     memcpy(msg->data.ipcc.ipcontent, l3, rem);
     msg->data.ipcc.ipclen = rem;
-    msg->data.ipcc.cin = cin;
-    msg->data.ipcc.dir = dir;
 
     return msg;
 }
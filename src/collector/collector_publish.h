@@ -34,6 +34,7 @@
 #include "etsili_core.h"
 #include "intercept.h"
 #include "internetaccess.h"
+#include "object_pool.h"
 
 enum {
     OPENLI_EXPORT_HALT_WORKER = 1,
@@ -57,6 +58,47 @@ enum {
 
 };
 
+/* What to do with a record when the queue to its sequence tracker is full.
+ * Control messages (intercept details, halts etc) are never dropped.
+ */
+enum {
+    OPENLI_OVERLOAD_BLOCK = 0,      /* wait for space in the queue */
+    OPENLI_OVERLOAD_DROP = 1,       /* drop any record */
+    OPENLI_OVERLOAD_SHED_IRI = 2,   /* drop IRIs, wait for space for CCs */
+    OPENLI_OVERLOAD_SHED_CC = 3,    /* drop CCs, wait for space for IRIs */
+};
+
+/* Tracks the packet references that a processing thread has created while
+ * reading from an input. References may have to be abandoned if they are
+ * not released by the time the input stops, so this is shared with every
+ * reference and freed by whichever of them lets go of it last.
+ */
+typedef struct openli_pkt_ref_owner {
+    /* Unreleased references, plus one for the processing thread */
+    uint32_t refs;
+
+    /* Set by the processing thread once it has given up waiting for its
+     * references to be released normally -- whoever is holding a job
+     * that refers to one of its packets should copy the contents out */
+    uint8_t detach;
+
+    /* Set if the input had to stop before every reference was released.
+     * The packets are never handed back to libtrace in that case. */
+    uint8_t abandoned;
+} openli_pkt_ref_owner_t;
+
+/* A reference to a captured packet that has been retained by a processing
+ * thread so that IP content can be encoded straight from the packet buffer,
+ * rather than being copied. The packet is returned to libtrace once every
+ * job that refers to it has been released.
+ */
+typedef struct openli_pkt_ref {
+    libtrace_t *trace;
+    libtrace_packet_t *packet;
+    uint32_t refs;
+    openli_pkt_ref_owner_t *owner;
+} openli_pkt_ref_t;
+
 /* This structure is also used for IPMMCCs since they require the same
  * raw information.
  */
@@ -68,6 +110,8 @@ typedef struct openli_ipcc_job {
     uint16_t liidalloc;
     uint32_t cin;
     uint8_t dir;
+    openli_pkt_ref_t *pktref;
+    uint8_t pooled;
 } PACKED openli_ipcc_job_t;
 
 typedef struct openli_ipmmiri_job {
@@ -156,9 +200,27 @@ struct openli_export_recv {
 int publish_openli_msg(void *pubsock, openli_export_recv_t *msg);
 void free_published_message(openli_export_recv_t *msg);
 
+void set_publish_overload_policy(uint8_t policy);
+int may_drop_record(openli_export_recv_t *msg);
+void count_dropped_record(openli_export_recv_t *msg);
+void log_dropped_record_counts(void);
+void free_dropped_record_counters(void);
+
 openli_export_recv_t *create_ipcc_job(
         uint32_t cin, char *liid, uint32_t destid, libtrace_packet_t *pkt,
-        uint8_t dir);
+        uint8_t dir, openli_pkt_ref_t *pktref, openli_pool_t *pool);
+void free_pooled_ipcc_job(void *obj);
+
+openli_pkt_ref_owner_t *create_packet_ref_owner(void);
+void put_packet_ref_owner(openli_pkt_ref_owner_t *owner);
+uint32_t packet_ref_owner_outstanding(openli_pkt_ref_owner_t *owner);
+openli_pkt_ref_t *create_packet_ref(libtrace_t *trace,
+        libtrace_packet_t *pkt, openli_pkt_ref_owner_t *owner);
+void finish_packet_ref(openli_pkt_ref_t *ref);
+void release_packet_ref(openli_pkt_ref_t *ref);
+uint8_t *detach_packet_ref(openli_export_recv_t *msg);
+void request_packet_ref_detach(void);
+int packet_ref_detach_requested(uint32_t *seen);
 
 #endif
 
@@ -34,6 +34,7 @@
 #include "collector_push_messaging.h"
 #include "intercept.h"
 #include "internetaccess.h"
+#include "ipmmcc.h"
 
 static int remove_rtp_stream(colthread_local_t *loc, char *rtpstreamkey) {
     rtpstreaminf_t *rtp;
@@ -48,6 +49,7 @@ static int remove_rtp_stream(colthread_local_t *loc, char *rtpstreamkey) {
     }
 
     HASH_DELETE(hh, loc->activertpintercepts, rtp);
+    remove_rtp_stream_from_index(loc, rtp);
     free_single_rtpstream(rtp);
     return 1;
 }
@@ -163,43 +165,6 @@ bailremoverange:
     return;
 }
 
-static int add_ipv4_intercept(colthread_local_t *loc, ipsession_t *sess) {
-
-    uint32_t v4addr;
-    struct sockaddr_in *sin;
-    ipv4_target_t *tgt;
-    ipsession_t *check;
-
-    sin = (struct sockaddr_in *)(sess->targetip);
-    if (sin == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to add IPv4 intercept but target IP was NULL?");
-        return -1;
-    }
-
-    v4addr = sin->sin_addr.s_addr;
-
-    HASH_FIND(hh, loc->activeipv4intercepts, &v4addr, sizeof(v4addr), tgt);
-    if (tgt == NULL) {
-        tgt = (ipv4_target_t *)malloc(sizeof(ipv4_target_t));
-        if (!tgt) {
-            logger(LOG_INFO, "OpenLI: ran out of memory while adding IPv4 intercept address.");
-            return -1;
-        }
-        tgt->address = v4addr;
-        tgt->intercepts = NULL;
-        HASH_ADD(hh, loc->activeipv4intercepts, address, sizeof(uint32_t),
-                tgt);
-    }
-
-    HASH_FIND(hh, tgt->intercepts, sess->streamkey, strlen(sess->streamkey),
-            check);
-    assert(check == NULL);
-    HASH_ADD_KEYPTR(hh, tgt->intercepts, sess->streamkey,
-            strlen(sess->streamkey), sess);
-
-    return 0;
-}
-
 static int add_ipv6_intercept(colthread_local_t *loc, ipsession_t *sess) {
 
     struct sockaddr_in6 *sin6;
@@ -251,42 +216,6 @@ static int add_ipv6_intercept(colthread_local_t *loc, ipsession_t *sess) {
     return 0;
 }
 
-static int remove_ipv4_intercept(colthread_local_t *loc, ipsession_t *torem) {
-
-    ipv4_target_t *v4;
-    struct sockaddr_in *sin;
-    uint32_t v4addr;
-    ipsession_t *found;
-
-    sin = (struct sockaddr_in *)(torem->targetip);
-    if (sin == NULL) {
-        logger(LOG_INFO, "OpenLI: attempted to remove IPv4 intercept but target IP was NULL?");
-        return -1;
-    }
-
-    v4addr = sin->sin_addr.s_addr;
-    HASH_FIND(hh, loc->activeipv4intercepts, &v4addr, sizeof(v4addr), v4);
-    if (!v4) {
-        return 0;
-    }
-
-    HASH_FIND(hh, v4->intercepts, torem->streamkey, strlen(torem->streamkey),
-            found);
-    if (!found) {
-        return 0;
-    }
-
-    HASH_DELETE(hh, v4->intercepts, found);
-    free_single_ipsession(found);
-
-    if (HASH_CNT(hh, v4->intercepts) == 0) {
-        HASH_DELETE(hh, loc->activeipv4intercepts, v4);
-        free(v4);
-    }
-
-    return 1;
-}
-
 static int remove_ipv6_intercept(colthread_local_t *loc, ipsession_t *torem) {
 
     ipv6_target_t *v6;
@@ -401,12 +330,9 @@ void handle_halt_mirror_intercept(libtrace_thread_t *t,
 void handle_push_ipintercept(libtrace_thread_t *t, colthread_local_t *loc,
         ipsession_t *sess) {
 
-    if (sess->ai_family == AF_INET) {
-        if (add_ipv4_intercept(loc, sess) != 0) {
-            free_single_ipsession(sess);
-            return;
-        }
-    } else if (sess->ai_family == AF_INET6) {
+    /* IPv4 sessions live in the shared table, so should never be pushed
+     * to an individual thread */
+    if (sess->ai_family == AF_INET6) {
         if (add_ipv6_intercept(loc, sess) != 0) {
             free_single_ipsession(sess);
             return;
@@ -431,6 +357,7 @@ void handle_push_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
 
     HASH_ADD_KEYPTR(hh, loc->activertpintercepts, rtp->streamkey,
             strlen(rtp->streamkey), rtp);
+    add_rtp_stream_to_index(loc, rtp);
     /*
     logger(LOG_INFO,
             "OpenLI: collector thread %d has started intercepting RTP stream %s",
@@ -453,16 +380,7 @@ void handle_halt_ipmmintercept(libtrace_thread_t *t, colthread_local_t *loc,
 void handle_halt_ipintercept(libtrace_thread_t *t , colthread_local_t *loc,
         ipsession_t *sess) {
 
-    if (sess->ai_family == AF_INET) {
-        if (remove_ipv4_intercept(loc, sess) > 0) {
-            /*
-            logger(LOG_INFO,
-                    "OpenLI: collector thread %d has stopped intercepting IP session %s",
-                    trace_get_perpkt_thread_id(t), sess->streamkey);
-            */
-
-        }
-    } else if (sess->ai_family == AF_INET6) {
+    if (sess->ai_family == AF_INET6) {
         if (remove_ipv6_intercept(loc, sess) > 0) {
             /*
             logger(LOG_INFO,
@@ -501,8 +419,19 @@ void handle_push_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
     }
     HASH_FIND(hh, *servlist, cs->serverkey, strlen(cs->serverkey), found);
     if (!found) {
+        /* The sync thread should have already resolved this server */
+        if (!cs->resolved) {
+            logger(LOG_INFO,
+                    "OpenLI: collector thread %d is ignoring unresolved %s server %s",
+                    trace_get_perpkt_thread_id(t),
+                    coreserver_type_to_string(cs->servertype),
+                    cs->serverkey);
+            free_single_coreserver(cs);
+            return;
+        }
         HASH_ADD_KEYPTR(hh, *servlist, cs->serverkey, strlen(cs->serverkey),
                 cs);
+        add_coreserver_to_index(&(loc->coreserverindex), cs);
         /*
         logger(LOG_INFO, "OpenLI: collector thread %d has added %s to its %s core server list.",
                 trace_get_perpkt_thread_id(t),
@@ -537,6 +466,7 @@ void handle_remove_coreserver(libtrace_thread_t *t, colthread_local_t *loc,
     HASH_FIND(hh, *servlist, cs->serverkey, strlen(cs->serverkey), found);
     if (found) {
         HASH_DELETE(hh, *servlist, found);
+        remove_coreserver_from_index(&(loc->coreserverindex), found);
         /*
         logger(LOG_INFO, "OpenLI: collector thread %d has removed %s from its %s core server list.",
                 trace_get_perpkt_thread_id(t),
@@ -552,11 +482,15 @@ void handle_iprange(libtrace_thread_t *t, colthread_local_t *loc,
 
     staticipsession_t *ipr_exist;
     patricia_tree_t *ptree = NULL;
+    static_lpm_t *lpm;
+    prefix_t *prefix;
 
     if (strchr(ipr->rangestr, ':')) {
         ptree = loc->staticv6ranges;
+        lpm = &(loc->staticv6lpm);
     } else {
         ptree = loc->staticv4ranges;
+        lpm = &(loc->staticv4lpm);
     }
 
     if (add_iprange_to_patricia(ptree, ipr->rangestr, &(ipr->common),
@@ -566,16 +500,27 @@ void handle_iprange(libtrace_thread_t *t, colthread_local_t *loc,
         return;
     }
 
+    /* add_iprange_to_patricia() has already checked that this parses */
+    prefix = ascii2prefix(0, ipr->rangestr);
+
     HASH_FIND(hh, loc->activestaticintercepts, ipr->key,
             strlen(ipr->key), ipr_exist);
     if (!ipr_exist) {
         ipr->references = 1;
         HASH_ADD_KEYPTR(hh, loc->activestaticintercepts, ipr->key,
                 strlen(ipr->key), ipr);
+        ipr_exist = ipr;
     } else {
         ipr_exist->references ++;
         free_single_staticipsession(ipr);
     }
+
+    if (prefix == NULL) {
+        lpm->dirty = 1;
+        return;
+    }
+    add_static_lpm_range(lpm, prefix, ipr_exist);
+    free(prefix);
 }
 
 void handle_modify_iprange(libtrace_thread_t *t, colthread_local_t *loc,
@@ -649,6 +594,15 @@ void handle_modify_iprange(libtrace_thread_t *t, colthread_local_t *loc,
         ipr_exist->references ++;
     }
 
+    /* The sessions for this range have changed, so the old entries have
+     * to go. Rebuilding is simpler than finding every slot they were
+     * expanded into, but we leave it until the next lookup so that a
+     * batch of changes only costs us one rebuild. */
+    if (prefix->family == AF_INET) {
+        loc->staticv4lpm.dirty = 1;
+    } else {
+        loc->staticv6lpm.dirty = 1;
+    }
 
 bailmodrange:
     if (prefix) {
@@ -665,11 +619,14 @@ void handle_remove_iprange(libtrace_thread_t *t, colthread_local_t *loc,
 
     staticipsession_t *sessrec;
     patricia_tree_t *ptree;
+    static_lpm_t *lpm;
 
     if (strchr(ipr->rangestr, ':')) {
         ptree = loc->staticv6ranges;
+        lpm = &(loc->staticv6lpm);
     } else {
         ptree = loc->staticv4ranges;
+        lpm = &(loc->staticv4lpm);
     }
 
     remove_iprange_from_patricia(ptree, ipr->rangestr, &(ipr->common));
@@ -688,6 +645,10 @@ void handle_remove_iprange(libtrace_thread_t *t, colthread_local_t *loc,
                 ipr->key);
     }
 
+    /* The session may have just been freed, so the table must be rebuilt
+     * before the next lookup */
+    lpm->dirty = 1;
+
     free_single_staticipsession(ipr);
     return;
 }
@@ -34,6 +34,8 @@
 #include "collector_base.h"
 #include "collector_publish.h"
 
+extern volatile int collector_halt;
+
 static inline void free_intercept_msg(exporter_intercept_msg_t *msg) {
     if (msg->liid) {
         free(msg->liid);
@@ -51,9 +53,6 @@ static inline void free_cinsequencing(exporter_intercept_state_t *intstate) {
 
     HASH_ITER(hh, intstate->cinsequencing, c, tmp) {
         HASH_DELETE(hh, intstate->cinsequencing, c);
-        if (c->cin_string) {
-            free(c->cin_string);
-        }
         free(c);
     }
 }
@@ -275,6 +274,9 @@ static int remove_tracked_intercept(seqtracker_thread_data_t *seqdata,
     if (!intstate) {
         logger(LOG_INFO, "OpenLI collector: tracker thread was told to end intercept LIID %s, but it is not a valid ID?",
                 msg->liid);
+        free(msg->liid);
+        free(msg->authcc);
+        free(msg->delivcc);
         return -1;
     }
 
@@ -296,6 +298,59 @@ static int remove_tracked_intercept(seqtracker_thread_data_t *seqdata,
     return 1;
 }
 
+static inline int encoders_have_room(seqtracker_thread_data_t *seqdata) {
+    int events = 0;
+    size_t len = sizeof(events);
+
+    if (zmq_getsockopt(seqdata->zmq_pushjobsock, ZMQ_EVENTS, &events,
+                &len) < 0) {
+        return 1;
+    }
+    return (events & ZMQ_POLLOUT) ? 1 : 0;
+}
+
+static int flush_encoding_jobs(seqtracker_thread_data_t *seqdata) {
+
+    uint32_t i;
+    int flags = ZMQ_DONTWAIT;
+
+    if (seqdata->jobcount == 0) {
+        return 0;
+    }
+
+    /* These jobs already have sequence numbers, so dropping them would
+     * leave the forwarders waiting on a gap. Wait for the encoders to
+     * make room instead -- the send times out every so often so that we
+     * can give up if the collector is halting. */
+    while (zmq_send(seqdata->zmq_pushjobsock, (char *)seqdata->jobbatch,
+            seqdata->jobcount * sizeof(openli_encoding_job_t), flags) < 0) {
+        if (errno == EAGAIN && !collector_halt) {
+            if (flags == ZMQ_DONTWAIT) {
+                seqdata->encodersbusy = 1;
+                flags = 0;
+            }
+            continue;
+        }
+        logger(LOG_INFO,
+                "Error while pushing encoding jobs to worker threads: %s",
+                strerror(errno));
+        for (i = 0; i < seqdata->jobcount; i++) {
+            count_dropped_record(seqdata->jobbatch[i].origreq);
+            free_published_message(seqdata->jobbatch[i].origreq);
+        }
+        seqdata->jobcount = 0;
+        return -1;
+    }
+
+    if (flags == ZMQ_DONTWAIT) {
+        seqdata->encodersbusy = 0;
+    }
+
+    add_stage_counter(&(seqdata->stats.sent), seqdata->jobcount);
+    seqdata->jobcount = 0;
+    return 1;
+}
+
 static int run_encoding_job(seqtracker_thread_data_t *seqdata,
         openli_export_recv_t *recvd) {
 
@@ -304,9 +359,12 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
     cin_seqno_t *cinseq;
     exporter_intercept_state_t *intstate;
     int ret = 1;
-    openli_encoding_job_t job;
+    openli_encoding_job_t *job;
 
-    memset(&job, 0, sizeof(job));
+    /* Build the job in place at the end of the current batch -- it only
+     * becomes part of the batch once jobcount is incremented */
+    job = &(seqdata->jobbatch[seqdata->jobcount]);
+    memset(job, 0, sizeof(openli_encoding_job_t));
     liid = extract_liid_from_job(recvd);
     cin = extract_cin_from_job(recvd);
 
@@ -318,10 +376,19 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
         return 0;
     }
 
+    if (seqdata->encodersbusy && may_drop_record(recvd)) {
+        if (encoders_have_room(seqdata)) {
+            seqdata->encodersbusy = 0;
+        } else {
+            /* Shed the record now, before it is given a sequence number */
+            count_dropped_record(recvd);
+            free_published_message(recvd);
+            return 0;
+        }
+    }
+
     HASH_FIND(hh, intstate->cinsequencing, &cin, sizeof(cin), cinseq);
     if (!cinseq) {
-        char cinstr[1024];
-
         cinseq = (cin_seqno_t *)malloc(sizeof(cin_seqno_t));
 
         if (!cinseq) {
@@ -330,19 +397,16 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
             return -1;
         }
 
-        snprintf(cinstr, 1024, "%s-%u", liid, cin);
-
         cinseq->cin = cin;
         cinseq->iri_seqno = 0;
         cinseq->cc_seqno = 0;
-        cinseq->cin_string = strdup(cinstr);
 
         HASH_ADD_KEYPTR(hh, intstate->cinsequencing, &(cinseq->cin),
                 sizeof(cin), cinseq);
     }
 
 
-	job.preencoded = intstate->preencoded;
+	job->preencoded = intstate->preencoded;
 
 #ifdef HAVE_BER_ENCODING
     wandder_etsili_child_t * child = NULL; 
@@ -389,31 +453,34 @@ static int run_encoding_job(seqtracker_thread_data_t *seqdata,
             default:
                 logger(LOG_INFO, "OpenLI: Error Unknown encoding type");
         }
-        job.top = top;
+        job->top = top;
 
     }
 #endif
-	job.origreq = recvd;
-	job.liid = strdup(liid);
-    job.cinstr = strdup(cinseq->cin_string);
+	job->origreq = recvd;
+    /* The LIID belongs to the original request, which lives until the
+     * forwarder has finished with the encoded record */
+	job->liid = liid;
+    job->cin = cin;
 
 	if (recvd->type == OPENLI_EXPORT_IPMMCC ||
 			recvd->type == OPENLI_EXPORT_IPCC ||
             recvd->type == OPENLI_EXPORT_UMTSCC) {
-	    job.seqno = cinseq->cc_seqno;
+	    job->seqno = cinseq->cc_seqno;
         cinseq->cc_seqno ++;
 	} else {
-		job.seqno = cinseq->iri_seqno;
+		job->seqno = cinseq->iri_seqno;
         cinseq->iri_seqno ++;
 	}
 
 
-    if (zmq_send(seqdata->zmq_pushjobsock, (char *)&job,
-            sizeof(openli_encoding_job_t), 0) < 0) {
-        logger(LOG_INFO,
-                "Error while pushing encoding job to worker threads: %s",
-                strerror(errno));
-        return -1;
+    job->queuedns = openli_now_ns();
+    seqdata->jobcount ++;
+
+    if (seqdata->jobcount == OPENLI_ENCODING_BATCH_MAX ||
+            job->queuedns - seqdata->jobbatch[0].queuedns >=
+            OPENLI_ENCODING_BATCH_MAX_WAIT) {
+        return flush_encoding_jobs(seqdata);
     }
 
     return ret;
@@ -427,7 +494,14 @@ static void seqtracker_main(seqtracker_thread_data_t *seqdata) {
     int sincepurge = 0;
 
     while (!halted) {
-        x = zmq_recv(seqdata->zmq_recvpublished, &job, sizeof(job), 0);
+        x = zmq_recv(seqdata->zmq_recvpublished, &job, sizeof(job),
+                ZMQ_DONTWAIT);
+        if (x < 0 && errno == EAGAIN) {
+            /* Nothing else is waiting, so send whatever jobs we have
+             * batched up before we go to sleep */
+            flush_encoding_jobs(seqdata);
+            x = zmq_recv(seqdata->zmq_recvpublished, &job, sizeof(job), 0);
+        }
         if (x < 0) {
             logger(LOG_INFO, "OpenLI: tracker thread %d got an error receiving from publish queue: %s",
                     seqdata->trackerid, strerror(errno));
@@ -440,11 +514,15 @@ static void seqtracker_main(seqtracker_thread_data_t *seqdata) {
         if (job) {
             switch(job->type) {
                 case OPENLI_EXPORT_HALT:
+                    flush_encoding_jobs(seqdata);
                     halted = 1;
                     free(job);
                     break;
 
                 case OPENLI_EXPORT_RECONFIGURE_INTERCEPTS:
+                    /* Batched jobs may refer to intercept state that is
+                     * about to change */
+                    flush_encoding_jobs(seqdata);
                     reconfigure_intercepts(seqdata);
                     free(job);
                     break;
@@ -455,20 +533,27 @@ static void seqtracker_main(seqtracker_thread_data_t *seqdata) {
                     break;
 
                 case OPENLI_EXPORT_INTERCEPT_OVER:
+                    flush_encoding_jobs(seqdata);
 					remove_tracked_intercept(seqdata, &(job->data.cept));
 					free(job);
 					break;
 
-                case OPENLI_EXPORT_IPMMCC:
                 case OPENLI_EXPORT_IPMMIRI:
                 case OPENLI_EXPORT_IPIRI:
-                case OPENLI_EXPORT_UMTSCC:
                 case OPENLI_EXPORT_UMTSIRI:
                 case OPENLI_EXPORT_RAW_SYNC:
+                    bump_stage_counter(&(seqdata->stats.received));
 					run_encoding_job(seqdata, job);
                     sincepurge ++;
                     break;
                 case OPENLI_EXPORT_IPCC:
+                case OPENLI_EXPORT_IPMMCC:
+                case OPENLI_EXPORT_UMTSCC:
+                    /* CC records carry the timestamp of the packet they
+                     * were derived from */
+                    bump_stage_counter(&(seqdata->stats.received));
+                    record_latency_since(&(seqdata->stats.latency),
+                            timeval_to_ns(&(job->ts)), openli_wallclock_ns());
 					run_encoding_job(seqdata, job);
                     sincepurge ++;
 					break;
@@ -492,7 +577,7 @@ void *start_seqtracker_thread(void *data) {
     char sockname[128];
     seqtracker_thread_data_t *seqdata = (seqtracker_thread_data_t *)data;
     openli_export_recv_t *job = NULL;
-    int x, zero = 0, large=1000000, sndtimeo=1000;
+    int x, zero = 0, sndtimeo=1000;
     exporter_intercept_state_t *intstate, *tmpexp;
 
     seqdata->zmq_recvpublished = zmq_socket(seqdata->zmq_ctxt, ZMQ_PULL);
@@ -522,8 +607,8 @@ void *start_seqtracker_thread(void *data) {
                 seqdata->trackerid, strerror(errno));
         goto haltseqtracker;
     }
-    if (zmq_setsockopt(seqdata->zmq_pushjobsock, ZMQ_SNDHWM, &large,
-                sizeof(large)) != 0) {
+    if (zmq_setsockopt(seqdata->zmq_pushjobsock, ZMQ_SNDHWM,
+                &(seqdata->jobhwm), sizeof(seqdata->jobhwm)) != 0) {
         logger(LOG_INFO,
                 "OpenLI: tracker thread %d failed to configure push zmq: %s",
                 seqdata->trackerid, strerror(errno));
@@ -544,8 +629,25 @@ void *start_seqtracker_thread(void *data) {
     }
 
 	seqdata->removedints = NULL;
+    seqdata->jobcount = 0;
+    seqdata->encodersbusy = 0;
+    seqdata->jobbatch = (openli_encoding_job_t *)calloc(
+            OPENLI_ENCODING_BATCH_MAX, sizeof(openli_encoding_job_t));
+    if (seqdata->jobbatch == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: tracker thread %d failed to allocate job batch",
+                seqdata->trackerid);
+        goto haltseqtracker;
+    }
+
     seqtracker_main(seqdata);
 
+    /* Release any jobs that we never got to send */
+    for (x = 0; x < (int)seqdata->jobcount; x++) {
+        free_published_message(seqdata->jobbatch[x].origreq);
+    }
+    seqdata->jobcount = 0;
+
     /* we're done but we should still drain any remaining items in the queue
      * and free their memory */
     do {
@@ -575,6 +677,10 @@ haltseqtracker:
     }
 #endif
 
+    if (seqdata->jobbatch) {
+        free(seqdata->jobbatch);
+        seqdata->jobbatch = NULL;
+    }
     zmq_close(seqdata->zmq_recvpublished);
     zmq_close(seqdata->zmq_pushjobsock);
     pthread_exit(NULL);
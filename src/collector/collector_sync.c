@@ -49,7 +49,7 @@
 #include "umtsiri.h"
 #include "ipiri.h"
 
-collector_sync_t *init_sync_data(collector_global_t *glob) {
+collector_sync_t *init_sync_data(collector_global_t *glob, int shardid) {
 
 	collector_sync_t *sync = (collector_sync_t *)
 			malloc(sizeof(collector_sync_t));
@@ -57,6 +57,11 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     char sockname[128];
 
     sync->glob = &(glob->syncip);
+    sync->shardid = shardid;
+    sync->shardcount = glob->ipsync_threads;
+    sync->shards = glob->ipsyncshards;
+    sync->provq = NULL;
+    sync->provq_fd = -1;
     sync->intersyncq = &(glob->intersyncq);
     sync->allusers = NULL;
     sync->ipintercepts = NULL;
@@ -73,6 +78,7 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     sync->outgoing = NULL;
     sync->incoming = NULL;
     sync->info = &(glob->sharedinfo);
+    sync->pushbatches = NULL;
 
     sync->radiusplugin = init_access_plugin(ACCESS_RADIUS);
     sync->gtpplugin = init_access_plugin(ACCESS_GTP);
@@ -80,7 +86,16 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     sync->activeips = NULL;
 
     sync->pubsockcount = glob->seqtracker_threads;
-    sync->forwardcount = glob->forwarding_threads;
+    sync->sharedv4 = glob->sharedv4;
+
+    /* Only the first shard talks to the forwarding threads */
+    if (shardid == 0) {
+        sync->forwardcount = glob->forwarding_threads;
+    } else {
+        sync->forwardcount = 0;
+        sync->provq = &(glob->ipsyncshards[shardid].provq);
+        sync->provq_fd = libtrace_message_queue_get_fd(sync->provq);
+    }
 
     sync->zmq_pubsocks = calloc(sync->pubsockcount, sizeof(void *));
     sync->zmq_fwdctrlsocks = calloc(sync->forwardcount, sizeof(void *));
@@ -89,7 +104,8 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     sync->ssl = NULL;
 
     sync->zmq_colsock = zmq_socket(glob->zmq_ctxt, ZMQ_PULL);
-    if (zmq_bind(sync->zmq_colsock, "inproc://openli-ipsync") != 0) {
+    snprintf(sockname, 128, "inproc://openli-ipsync-%d", shardid);
+    if (zmq_bind(sync->zmq_colsock, sockname) != 0) {
         logger(LOG_INFO, "OpenLI: colsync thread unable to bind to zmq socket for collector updates: %s",
                 strerror(errno));
         zmq_close(sync->zmq_colsock);
@@ -109,6 +125,10 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
 
     for (i = 0; i < sync->pubsockcount; i++) {
         sync->zmq_pubsocks[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
+        if (glob->publish_hwm > 0) {
+            zmq_setsockopt(sync->zmq_pubsocks[i], ZMQ_SNDHWM,
+                    &(glob->publish_hwm), sizeof(glob->publish_hwm));
+        }
         snprintf(sockname, 128, "inproc://openlipub-%d", i);
         if (zmq_connect(sync->zmq_pubsocks[i], sockname) < 0) {
             logger(LOG_INFO,
@@ -117,8 +137,6 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
             zmq_close(sync->zmq_pubsocks[i]);
             sync->zmq_pubsocks[i] = NULL;
         }
-
-        /* Do we need to set a HWM? */
     }
 
     return sync;
@@ -154,6 +172,7 @@ void clean_sync_data(collector_sync_t *sync) {
     }
 
 
+    free_pushed_batches(&(sync->pushbatches));
     free_all_users(sync->allusers);
     clear_user_intercept_list(sync->userintercepts);
     free_all_ipintercepts(&(sync->ipintercepts));
@@ -191,6 +210,34 @@ void clean_sync_data(collector_sync_t *sync) {
     sync->gtpplugin = NULL;
     sync->activeips = NULL;
 
+    if (sync->shardid != 0) {
+        openli_intersync_msg_t leftover;
+
+        /* Halting the tracker and forwarding threads is left to shard 0 */
+        while (libtrace_message_queue_try_get(sync->provq,
+                (void *)&leftover) != LIBTRACE_MQ_FAILED) {
+            free(leftover.msgbody);
+        }
+
+        if (sync->zmq_colsock) {
+            zmq_setsockopt(sync->zmq_colsock, ZMQ_LINGER, &zero, sizeof(zero));
+            zmq_close(sync->zmq_colsock);
+            sync->zmq_colsock = NULL;
+        }
+        for (i = 0; i < sync->pubsockcount; i++) {
+            if (sync->zmq_pubsocks[i] == NULL) {
+                continue;
+            }
+            zmq_setsockopt(sync->zmq_pubsocks[i], ZMQ_LINGER, &zero,
+                    sizeof(zero));
+            zmq_close(sync->zmq_pubsocks[i]);
+            sync->zmq_pubsocks[i] = NULL;
+        }
+        free(sync->zmq_pubsocks);
+        free(sync->zmq_fwdctrlsocks);
+        return;
+    }
+
     while (haltattempts < 10) {
         haltfails = 0;
 
@@ -270,16 +317,42 @@ static int forward_provmsg_to_voipsync(collector_sync_t *sync,
 
     openli_intersync_msg_t topush;
 
+    /* The first VOIP sync thread passes this on to the others once it
+     * has dealt with it, so that intercepts are announced to the
+     * seqtrackers before any other sync thread can produce IRIs for them */
     topush.msgtype = msgtype;
-    topush.msgbody = (uint8_t *)malloc(msglen);
-    memcpy(topush.msgbody, provmsg, msglen);
+    topush.msgbody = NULL;
     topush.msglen = msglen;
+    if (msglen > 0) {
+        topush.msgbody = (uint8_t *)malloc(msglen);
+        memcpy(topush.msgbody, provmsg, msglen);
+    }
 
     libtrace_message_queue_put(sync->intersyncq, &topush);
     return 1;
 
 }
 
+static int forward_provmsg_to_ipsync_shards(collector_sync_t *sync,
+        uint8_t *provmsg, uint16_t msglen, openli_proto_msgtype_t msgtype) {
+
+    openli_intersync_msg_t topush;
+    int i;
+
+    for (i = 1; i < sync->shardcount; i++) {
+        topush.msgtype = msgtype;
+        topush.msgbody = NULL;
+        topush.msglen = msglen;
+        if (msglen > 0) {
+            topush.msgbody = (uint8_t *)malloc(msglen);
+            memcpy(topush.msgbody, provmsg, msglen);
+        }
+
+        libtrace_message_queue_put(&(sync->shards[i].provq), &topush);
+    }
+    return 1;
+}
+
 static inline void push_coreserver_msg(collector_sync_t *sync,
         coreserver_t *cs, uint8_t msgtype) {
 
@@ -291,7 +364,7 @@ static inline void push_coreserver_msg(collector_sync_t *sync,
         memset(&msg, 0, sizeof(openli_pushed_t));
         msg.type = msgtype;
         msg.data.coreserver = deep_copy_coreserver(cs);
-        libtrace_message_queue_put(sendq->q, (void *)(&msg));
+        batch_pushed_message(&(sync->pushbatches), sendq->q, &msg);
     }
     pthread_mutex_unlock(&(sync->glob->mutex));
 }
@@ -369,7 +442,7 @@ static int create_iri_from_session(collector_sync_t *sync,
 }
 
 static inline void push_static_iprange_to_collectors(
-        libtrace_message_queue_t *q, ipintercept_t *ipint,
+        collector_sync_t *sync, libtrace_message_queue_t *q, ipintercept_t *ipint,
         static_ipranges_t *ipr) {
 
     openli_pushed_t msg;
@@ -385,12 +458,12 @@ static inline void push_static_iprange_to_collectors(
     msg.type = OPENLI_PUSH_IPRANGE;
     msg.data.iprange = staticsess;
 
-    libtrace_message_queue_put(q, (void *)(&msg));
+    batch_pushed_message(&(sync->pushbatches), q, &msg);
 
 }
 
 static inline void push_static_iprange_modify_to_collectors(
-        libtrace_message_queue_t *q, ipintercept_t *ipint,
+        collector_sync_t *sync, libtrace_message_queue_t *q, ipintercept_t *ipint,
         static_ipranges_t *ipr) {
 
     openli_pushed_t msg;
@@ -405,11 +478,11 @@ static inline void push_static_iprange_modify_to_collectors(
     msg.type = OPENLI_PUSH_MODIFY_IPRANGE;
     msg.data.iprange = staticsess;
 
-    libtrace_message_queue_put(q, (void *)(&msg));
+    batch_pushed_message(&(sync->pushbatches), q, &msg);
 }
 
 static inline void push_static_iprange_remove_to_collectors(
-        libtrace_message_queue_t *q, ipintercept_t *ipint,
+        collector_sync_t *sync, libtrace_message_queue_t *q, ipintercept_t *ipint,
         static_ipranges_t *ipr) {
 
     openli_pushed_t msg;
@@ -424,7 +497,7 @@ static inline void push_static_iprange_remove_to_collectors(
     msg.type = OPENLI_PUSH_REMOVE_IPRANGE;
     msg.data.iprange = staticsess;
 
-    libtrace_message_queue_put(q, (void *)(&msg));
+    batch_pushed_message(&(sync->pushbatches), q, &msg);
 
 }
 
@@ -438,6 +511,11 @@ static inline void push_single_ipintercept(collector_sync_t *sync,
 
     for (i = 0; i < session->sessipcount; i++) {
 
+        /* IPv4 sessions are shared by all threads instead */
+        if (session->sessionips[i].ipfamily == AF_INET) {
+            continue;
+        }
+
         ipsess = create_ipsession(ipint, session->cin,
             session->sessionips[i].ipfamily,
             (struct sockaddr *)&(session->sessionips[i].assignedip),
@@ -452,12 +530,40 @@ static inline void push_single_ipintercept(collector_sync_t *sync,
         msg.type = OPENLI_PUSH_IPINTERCEPT;
         msg.data.ipsess = ipsess;
 
-        libtrace_message_queue_put(q, (void *)(&msg));
+        batch_pushed_message(&(sync->pushbatches), q, &msg);
     }
 }
 
-static inline void push_single_vendmirrorid(libtrace_message_queue_t *q,
-        ipintercept_t *ipint, uint8_t msgtype) {
+static inline void share_ipv4_sessions(collector_sync_t *sync,
+        ipintercept_t *ipint, access_session_t *session) {
+
+    ipsession_t *ipsess;
+    int i;
+
+    for (i = 0; i < session->sessipcount; i++) {
+        if (session->sessionips[i].ipfamily != AF_INET) {
+            continue;
+        }
+
+        ipsess = create_ipsession(ipint, session->cin,
+            session->sessionips[i].ipfamily,
+            (struct sockaddr *)&(session->sessionips[i].assignedip),
+            session->sessionips[i].prefixbits);
+
+        if (!ipsess) {
+            logger(LOG_INFO,
+                    "OpenLI: ran out of memory while creating IP session message.");
+            return;
+        }
+
+        if (shared_ipv4_add_session(sync->sharedv4, ipsess) <= 0) {
+            free_single_ipsession(ipsess);
+        }
+    }
+}
+
+static inline void push_single_vendmirrorid(collector_sync_t *sync,
+        libtrace_message_queue_t *q, ipintercept_t *ipint, uint8_t msgtype) {
 
     vendmirror_intercept_t *jm;
     openli_pushed_t msg;
@@ -477,11 +583,11 @@ static inline void push_single_vendmirrorid(libtrace_message_queue_t *q,
     msg.type = msgtype;
     msg.data.mirror = jm;
 
-    libtrace_message_queue_put(q, (void *)(&msg));
+    batch_pushed_message(&(sync->pushbatches), q, &msg);
 }
 
-static void push_all_coreservers(coreserver_t *servers,
-        libtrace_message_queue_t *q) {
+static void push_all_coreservers(collector_sync_t *sync,
+        coreserver_t *servers, libtrace_message_queue_t *q) {
 
     coreserver_t *cs, *tmp;
     HASH_ITER(hh, servers, cs, tmp) {
@@ -490,7 +596,7 @@ static void push_all_coreservers(coreserver_t *servers,
         memset(&msg, 0, sizeof(openli_pushed_t));
         msg.type = OPENLI_PUSH_CORESERVER;
         msg.data.coreserver = deep_copy_coreserver(cs);
-        libtrace_message_queue_put(q, (void *)(&msg));
+        batch_pushed_message(&(sync->pushbatches), q, &msg);
     }
 }
 
@@ -575,7 +681,7 @@ static int new_staticiprange(collector_sync_t *sync, uint8_t *intmsg,
 
     HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
             sendq, tmp) {
-        push_static_iprange_to_collectors(sendq->q, ipint, ipr);
+        push_static_iprange_to_collectors(sync, sendq->q, ipint, ipr);
     }
 
     return 1;
@@ -607,7 +713,8 @@ static int modify_staticiprange(collector_sync_t *sync, static_ipranges_t *ipr)
         found->cin = ipr->cin;
         HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
                 sendq, tmp) {
-            push_static_iprange_modify_to_collectors(sendq->q, ipint, found);
+            push_static_iprange_modify_to_collectors(sync, sendq->q, ipint,
+                    found);
         }
     }
 
@@ -639,7 +746,8 @@ static int remove_staticiprange(collector_sync_t *sync, static_ipranges_t *ipr)
                 OPENLI_IPIRI_ENDWHILEACTIVE);
         HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
                 sendq, tmp) {
-            push_static_iprange_remove_to_collectors(sendq->q, ipint, ipr);
+            push_static_iprange_remove_to_collectors(sync, sendq->q, ipint,
+                    ipr);
         }
 
         logger(LOG_INFO, "OpenLI: removing capture of IP prefix %s for LIID %s",
@@ -661,7 +769,7 @@ static int remove_staticiprange(collector_sync_t *sync, static_ipranges_t *ipr)
     return 1;
 }
 
-static inline void push_session_halt_to_threads(void *sendqs,
+static inline void push_session_halt_to_threads(collector_sync_t *sync,
         access_session_t *sess, ipintercept_t *ipint) {
 
     sync_sendq_t *sendq, *tmp;
@@ -671,7 +779,20 @@ static inline void push_session_halt_to_threads(void *sendqs,
         openli_pushed_t pmsg;
         ipsession_t *sessdup;
 
-        HASH_ITER(hh, (sync_sendq_t *)sendqs, sendq, tmp) {
+        if (sess->sessionips[i].ipfamily == AF_INET) {
+            sessdup = create_ipsession(ipint, sess->cin,
+                    sess->sessionips[i].ipfamily,
+                    (struct sockaddr *)&(sess->sessionips[i].assignedip),
+                    sess->sessionips[i].prefixbits);
+            if (sessdup) {
+                shared_ipv4_remove_session(sync->sharedv4, sessdup);
+                free_single_ipsession(sessdup);
+            }
+            continue;
+        }
+
+        HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
+                sendq, tmp) {
             memset(&pmsg, 0, sizeof(openli_pushed_t));
             pmsg.type = OPENLI_PUSH_HALT_IPINTERCEPT;
             sessdup = create_ipsession(ipint, sess->cin,
@@ -680,7 +801,7 @@ static inline void push_session_halt_to_threads(void *sendqs,
                     sess->sessionips[i].prefixbits);
 
             pmsg.data.ipsess = sessdup;
-            libtrace_message_queue_put(sendq->q, &pmsg);
+            batch_pushed_message(&(sync->pushbatches), sendq->q, &pmsg);
         }
 
     }
@@ -693,7 +814,9 @@ static inline void push_ipintercept_halt_to_threads(collector_sync_t *sync,
     access_session_t *sess, *tmp2;
     static_ipranges_t *ipr, *tmpr;
 
-    logger(LOG_INFO, "OpenLI: collector will stop intercepting traffic for target %s (LIID = %s)", ipint->username, ipint->common.liid);
+    if (sync->shardid == 0) {
+        logger(LOG_INFO, "OpenLI: collector will stop intercepting traffic for target %s (LIID = %s)", ipint->username, ipint->common.liid);
+    }
 
     /* Remove all static IP ranges for this intercept -- its over */
     HASH_ITER(hh, ipint->statics, ipr, tmpr) {
@@ -712,8 +835,7 @@ static inline void push_ipintercept_halt_to_threads(collector_sync_t *sync,
         /* TODO skip sessions that were never active */
 
         create_iri_from_session(sync, sess, ipint, OPENLI_IPIRI_ENDWHILEACTIVE);
-        push_session_halt_to_threads(sync->glob->collector_queues, sess,
-                ipint);
+        push_session_halt_to_threads(sync, sess, ipint);
     }
 
 }
@@ -800,6 +922,18 @@ static int forward_new_coreserver(collector_sync_t *sync, uint8_t *provmsg,
         found->awaitingconfirm = 0;
         free_single_coreserver(cs);
     } else {
+        /* Resolve the server here, once, so the collector threads can
+         * just use the resulting address instead of each having to call
+         * getaddrinfo() themselves */
+        if (resolve_coreserver(cs) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: collector is ignoring %s:%s as a %s server due to getaddrinfo error",
+                    cs->ipstr, cs->portstr,
+                    coreserver_type_to_string(cs->servertype));
+            free_single_coreserver(cs);
+            return 1;
+        }
+
         /* New core server, pass on to all collector threads */
         HASH_ADD_KEYPTR(hh, sync->coreservers, cs->serverkey,
                 strlen(cs->serverkey), cs);
@@ -868,7 +1002,7 @@ static inline void announce_vendormirror_id(collector_sync_t *sync,
             ipint->username ? ipint->username : "unknown");
     HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
             sendq, tmp) {
-        push_single_vendmirrorid(sendq->q, ipint,
+        push_single_vendmirrorid(sync, sendq->q, ipint,
                 OPENLI_PUSH_VENDMIRROR_INTERCEPT);
     }
 
@@ -891,6 +1025,7 @@ static void push_existing_user_sessions(collector_sync_t *sync,
         access_session_t *sess, *tmp2;
 
         HASH_ITER(hh, user->sessions, sess, tmp2) {
+            share_ipv4_sessions(sync, cept, sess);
             HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
                     sendq, tmp) {
                 push_single_ipintercept(sync, sendq->q, cept, sess);
@@ -908,6 +1043,26 @@ static int insert_new_ipintercept(collector_sync_t *sync, ipintercept_t *cept) {
     openli_export_recv_t *expmsg;
     int i;
 
+    /* Must be set before any copies of the intercept are made, since
+     * the capture threads use it to pick which tracker to publish to */
+    if (sync->pubsockcount <= 1) {
+        cept->common.seqtrackerid = 0;
+    } else {
+        cept->common.seqtrackerid = hash_liid(cept->common.liid) % sync->pubsockcount;
+    }
+
+    if (sync->shardid != 0) {
+        /* Shard 0 has already announced this intercept, we just need to
+         * look after any sessions that we are tracking for the target */
+        HASH_ADD_KEYPTR(hh_liid, sync->ipintercepts, cept->common.liid,
+                cept->common.liid_len, cept);
+        if (cept->username) {
+            push_existing_user_sessions(sync, cept);
+            add_intercept_to_user_intercept_list(&sync->userintercepts, cept);
+        }
+        return 1;
+    }
+
     if (cept->vendmirrorid != OPENLI_VENDOR_MIRROR_NONE) {
 
         /* Don't need to wait for a session to start an ALU intercept.
@@ -926,12 +1081,6 @@ static int insert_new_ipintercept(collector_sync_t *sync, ipintercept_t *cept) {
                 cept->username, cept->common.liid, cept->common.authcc);
     }
 
-    if (sync->pubsockcount <= 1) {
-        cept->common.seqtrackerid = 0;
-    } else {
-        cept->common.seqtrackerid = hash_liid(cept->common.liid) % sync->pubsockcount;
-    }
-
     HASH_ADD_KEYPTR(hh_liid, sync->ipintercepts, cept->common.liid,
             cept->common.liid_len, cept);
 
@@ -967,7 +1116,7 @@ static inline void remove_vendormirror_id(collector_sync_t *sync,
 
     HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
             sendq, tmp) {
-        push_single_vendmirrorid(sendq->q, ipint,
+        push_single_vendmirrorid(sync, sendq->q, ipint,
                 OPENLI_PUSH_HALT_VENDMIRROR_INTERCEPT);
     }
     pthread_mutex_lock(sync->glob->stats_mutex);
@@ -993,6 +1142,11 @@ static void remove_ip_intercept(collector_sync_t *sync, ipintercept_t *ipint) {
         remove_intercept_from_user_intercept_list(&sync->userintercepts, ipint);
     }
 
+    if (sync->shardid != 0) {
+        free_single_ipintercept(ipint);
+        return;
+    }
+
     expmsg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
     expmsg->type = OPENLI_EXPORT_INTERCEPT_OVER;
     expmsg->data.cept.liid = strdup(ipint->common.liid);
@@ -1041,10 +1195,14 @@ static int modify_ipintercept(collector_sync_t *sync, uint8_t *intmsg,
         add_intercept_to_user_intercept_list(&sync->userintercepts, ipint);
 
         push_existing_user_sessions(sync, ipint);
-        logger(LOG_INFO, "OpenLI: IP intercept %s is now using '%s' as the designated target", ipint->common.liid, ipint->username);
+        if (sync->shardid == 0) {
+            logger(LOG_INFO, "OpenLI: IP intercept %s is now using '%s' as the designated target", ipint->common.liid, ipint->username);
+        }
     }
 
-    if (ipint->vendmirrorid != modified.vendmirrorid) {
+    if (sync->shardid != 0) {
+        ipint->vendmirrorid = modified.vendmirrorid;
+    } else if (ipint->vendmirrorid != modified.vendmirrorid) {
         if (ipint->vendmirrorid != OPENLI_VENDOR_MIRROR_NONE) {
             remove_vendormirror_id(sync, ipint);
         }
@@ -1153,8 +1311,11 @@ static int new_default_radius(collector_sync_t *sync, uint8_t *provmsg,
 
     HASH_ADD_KEYPTR(hh, sync->defaultradiususers, defrad->name, defrad->namelen,
             defrad);
-    logger(LOG_INFO, "OpenLI: added %s to list of default RADIUS usernames.",
-            defrad->name);
+    if (sync->shardid == 0) {
+        logger(LOG_INFO,
+                "OpenLI: added %s to list of default RADIUS usernames.",
+                defrad->name);
+    }
     return 1;
 }
 
@@ -1166,9 +1327,11 @@ static inline int remove_default_radius(collector_sync_t *sync,
     }
 
     HASH_DELETE(hh, sync->defaultradiususers, defrad);
-    logger(LOG_INFO,
-            "OpenLI: removed %s from list of default RADIUS usernames.",
-            defrad->name);
+    if (sync->shardid == 0) {
+        logger(LOG_INFO,
+                "OpenLI: removed %s from list of default RADIUS usernames.",
+                defrad->name);
+    }
     free(defrad->name);
     free(defrad);
 
@@ -1393,6 +1556,8 @@ static int recv_from_provisioner(collector_sync_t *sync) {
                 if (ret == -1) {
                     return -1;
                 }
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 break;
             case OPENLI_PROTO_ADD_STATICIPS:
                 ret = new_staticiprange(sync, provmsg, msglen);
@@ -1443,18 +1608,24 @@ static int recv_from_provisioner(collector_sync_t *sync) {
                 if (ret == -1) {
                     return -1;
                 }
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 break;
             case OPENLI_PROTO_ANNOUNCE_DEFAULT_RADIUS:
                 ret = new_default_radius(sync, provmsg, msglen);
                 if (ret == -1) {
                     return -1;
                 }
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 break;
             case OPENLI_PROTO_WITHDRAW_DEFAULT_RADIUS:
                 ret = withdraw_default_radius(sync, provmsg, msglen);
                 if (ret == -1) {
                     return -1;
                 }
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 break;
             case OPENLI_PROTO_ANNOUNCE_CORESERVER:
                 ret = forward_new_coreserver(sync, provmsg, msglen);
@@ -1485,6 +1656,8 @@ static int recv_from_provisioner(collector_sync_t *sync) {
                 if (ret < 0) {
                     return -1;
                 }
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 break;
 
             case OPENLI_PROTO_HALT_VOIPINTERCEPT:
@@ -1499,6 +1672,8 @@ static int recv_from_provisioner(collector_sync_t *sync) {
                 break;
             case OPENLI_PROTO_NOMORE_INTERCEPTS:
                 disable_unconfirmed_intercepts(sync);
+                forward_provmsg_to_ipsync_shards(sync, provmsg, msglen,
+                        msgtype);
                 ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
                         msgtype);
                 break;
@@ -1648,8 +1823,9 @@ void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds) {
     touch_all_coreservers(sync->coreservers);
     touch_all_defaultradius(sync->defaultradiususers);
 
-    /* Tell other sync thread to flag its intercepts too */
+    /* Tell other sync threads to flag their intercepts too */
     forward_provmsg_to_voipsync(sync, NULL, 0, OPENLI_PROTO_DISCONNECT);
+    forward_provmsg_to_ipsync_shards(sync, NULL, 0, OPENLI_PROTO_DISCONNECT);
 
     /* Same with mediators -- keep exporting to them, but flag them to be
      * disconnected if they are not announced after we reconnect. */
@@ -1687,11 +1863,13 @@ static void push_all_active_intercepts(collector_sync_t *sync,
                 }
             }
         }
-        if (orig->vendmirrorid != OPENLI_VENDOR_MIRROR_NONE) {
-            push_single_vendmirrorid(q, orig, OPENLI_PUSH_VENDMIRROR_INTERCEPT);
+        if (orig->vendmirrorid != OPENLI_VENDOR_MIRROR_NONE &&
+                sync->shardid == 0) {
+            push_single_vendmirrorid(sync, q, orig,
+                    OPENLI_PUSH_VENDMIRROR_INTERCEPT);
         }
         HASH_ITER(hh, orig->statics, ipr, tmpr) {
-            push_static_iprange_to_collectors(q, orig, ipr);
+            push_static_iprange_to_collectors(sync, q, orig, ipr);
         }
     }
 }
@@ -1779,7 +1957,7 @@ static inline int report_silent_logoffs(collector_sync_t *sync,
                 create_iri_from_session(sync,
                         prev->session[i],
                         ipint, OPENLI_IPIRI_SILENTLOGOFF);
-                push_session_halt_to_threads(sync->glob->collector_queues,
+                push_session_halt_to_threads(sync,
                         prev->session[i], ipint);
             }
         }
@@ -1893,6 +2071,7 @@ static int newly_active_session(collector_sync_t *sync,
      * packets involving the session IP.
      */
     HASH_ITER(hh_user, userint->intlist, ipint, tmp) {
+        share_ipv4_sessions(sync, ipint, sess);
         HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues),
                 sendq, tmpq) {
             push_single_ipintercept(sync, sendq->q, ipint, sess);
@@ -2028,8 +2207,7 @@ static int update_user_sessions(collector_sync_t *sync, libtrace_packet_t *pkt,
                 if (userint) {
                     HASH_ITER(hh_user, userint->intlist, ipint, tmp) {
                         if (identity_match_intercept(ipint, &(identities[i]))) {
-                            push_session_halt_to_threads(
-                                    sync->glob->collector_queues,
+                            push_session_halt_to_threads(sync,
                                     sess, ipint);
                         }
                     }
@@ -2098,7 +2276,46 @@ endupdate:
     return 1;
 }
 
-int sync_thread_main(collector_sync_t *sync) {
+static void process_forwarded_provmsg(collector_sync_t *sync) {
+
+    openli_intersync_msg_t syncmsg;
+
+    while (libtrace_message_queue_try_get(sync->provq,
+            (void *)&syncmsg) != LIBTRACE_MQ_FAILED) {
+
+        switch(syncmsg.msgtype) {
+            case OPENLI_PROTO_START_IPINTERCEPT:
+                new_ipintercept(sync, syncmsg.msgbody, syncmsg.msglen);
+                break;
+            case OPENLI_PROTO_MODIFY_IPINTERCEPT:
+                modify_ipintercept(sync, syncmsg.msgbody, syncmsg.msglen);
+                break;
+            case OPENLI_PROTO_HALT_IPINTERCEPT:
+                halt_ipintercept(sync, syncmsg.msgbody, syncmsg.msglen);
+                break;
+            case OPENLI_PROTO_ANNOUNCE_DEFAULT_RADIUS:
+                new_default_radius(sync, syncmsg.msgbody, syncmsg.msglen);
+                break;
+            case OPENLI_PROTO_WITHDRAW_DEFAULT_RADIUS:
+                withdraw_default_radius(sync, syncmsg.msgbody,
+                        syncmsg.msglen);
+                break;
+            case OPENLI_PROTO_NOMORE_INTERCEPTS:
+                disable_unconfirmed_intercepts(sync);
+                break;
+            case OPENLI_PROTO_DISCONNECT:
+                touch_all_intercepts(sync->ipintercepts);
+                touch_all_defaultradius(sync->defaultradiususers);
+                break;
+        }
+
+        if (syncmsg.msgbody) {
+            free(syncmsg.msgbody);
+        }
+    }
+}
+
+static int process_sync_events(collector_sync_t *sync) {
     zmq_pollitem_t items[2];
     openli_state_update_t recvd;
     int rc;
@@ -2107,14 +2324,25 @@ int sync_thread_main(collector_sync_t *sync) {
     items[0].events = ZMQ_POLLIN;
 
     items[1].socket = NULL;
-    items[1].fd = sync->instruct_fd;
-    items[1].events = sync->instruct_events;
+    if (sync->shardid == 0) {
+        items[1].fd = sync->instruct_fd;
+        items[1].events = sync->instruct_events;
+    } else {
+        items[1].fd = sync->provq_fd;
+        items[1].events = ZMQ_POLLIN;
+    }
 
     if (zmq_poll(items, 2, 50) < 0) {
         return -1;
     }
 
-    if (items[1].revents & ZMQ_POLLOUT) {
+    shared_ipv4_reclaim(sync->sharedv4);
+
+    if (sync->shardid != 0) {
+        if (items[1].revents & ZMQ_POLLIN) {
+            process_forwarded_provmsg(sync);
+        }
+    } else if (items[1].revents & ZMQ_POLLOUT) {
         if (send_to_provisioner(sync) <= 0) {
             sync_disconnect_provisioner(sync, 0);
             return 0;
@@ -2133,7 +2361,7 @@ int sync_thread_main(collector_sync_t *sync) {
      * to push messages onto the queue for a processing thread, even if
      * the thread itself is still in the process of starting up.
      */
-    if ((items[1].revents & ZMQ_POLLIN) &&
+    if (sync->shardid == 0 && (items[1].revents & ZMQ_POLLIN) &&
             sync->hellosreceived >= sync->glob->total_col_threads) {
         if (recv_from_provisioner(sync) <= 0) {
             sync_disconnect_provisioner(sync, 0);
@@ -2157,10 +2385,11 @@ int sync_thread_main(collector_sync_t *sync) {
             if (recvd.type == OPENLI_UPDATE_HELLO) {
                 push_all_active_intercepts(sync, sync->allusers,
                         sync->ipintercepts, recvd.data.replyq);
-                push_all_coreservers(sync->coreservers, recvd.data.replyq);
+                push_all_coreservers(sync, sync->coreservers, recvd.data.replyq);
                 sync->hellosreceived ++;
 
-                if (sync->hellosreceived == sync->glob->total_col_threads) {
+                if (sync->hellosreceived == sync->glob->total_col_threads &&
+                        sync->shardid == 0) {
                     logger(LOG_INFO, "openli-collector: all processing threads have reported for duty");
                 }
             }
@@ -2191,7 +2420,7 @@ int sync_thread_main(collector_sync_t *sync) {
                     logger(LOG_INFO,
                             "OpenLI: sync thread received an invalid packet");
                 }
-                trace_destroy_packet(recvd.data.pkt);
+                release_sync_packet(recvd.data.pkt);
             }
 
         } while (rc > 0);
@@ -2200,4 +2429,14 @@ int sync_thread_main(collector_sync_t *sync) {
     return 0;
 }
 
+int sync_thread_main(collector_sync_t *sync) {
+    int ret;
+
+    ret = process_sync_events(sync);
+
+    /* Hand over everything we queued up for the processing threads */
+    flush_pushed_batches(&(sync->pushbatches), sync->glob);
+    return ret;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
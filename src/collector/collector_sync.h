@@ -38,10 +38,21 @@
 #include "internetaccess.h"
 #include "coreserver.h"
 #include "sipparsing.h"
+#include "push_batch.h"
 
 typedef struct colsync_data {
 
     sync_thread_global_t *glob;
+
+    /* RADIUS and GTP session tracking is spread across several IP sync
+     * threads. Shard 0 also manages the provisioner connection and forwards
+     * any intercept instructions on to the other shards via their provq. */
+    int shardid;
+    int shardcount;
+    ipsync_shard_t *shards;
+    libtrace_message_queue_t *provq;
+    int provq_fd;
+
     collector_identity_t *info;
 
     int pubsockcount;
@@ -67,6 +78,7 @@ typedef struct colsync_data {
     net_buffer_t *incoming;
 
     libtrace_message_queue_t *intersyncq;
+    push_batcher_t *pushbatches;
     wandder_encoder_t *encoder;
 
     access_plugin_t *radiusplugin;
@@ -74,6 +86,7 @@ typedef struct colsync_data {
     etsili_generic_freelist_t *freegenerics;
 
     ip_to_session_t *activeips;
+    shared_ipv4_table_t *sharedv4;
 
     SSL *ssl;
     SSL_CTX *ctx;
@@ -82,7 +95,7 @@ typedef struct colsync_data {
 
 } collector_sync_t;
 
-collector_sync_t *init_sync_data(collector_global_t *glob);
+collector_sync_t *init_sync_data(collector_global_t *glob, int shardid);
 void clean_sync_data(collector_sync_t *sync);
 void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds);
 int sync_connect_provisioner(collector_sync_t *sync, SSL_CTX *ctx);
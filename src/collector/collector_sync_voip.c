@@ -47,7 +47,8 @@
 #include "ipmmiri.h"
 
 
-collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
+collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob,
+        int shardid) {
 
     int i;
     char sockname[128];
@@ -70,11 +71,25 @@ collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
 
     sync->timeouts = NULL;
 
-    sync->intersyncq = &(glob->intersyncq);
+    sync->shardid = shardid;
+    if (shardid == 0) {
+        sync->intersyncq = &(glob->intersyncq);
+    } else {
+        sync->intersyncq = &(glob->voipsyncshards[shardid].intersyncq);
+    }
     sync->intersync_fd = libtrace_message_queue_get_fd(sync->intersyncq);
+    sync->pushbatches = NULL;
+    sync->shardcount = glob->voipsync_threads;
+    sync->shards = glob->voipsyncshards;
+    sync->firstq = &(glob->intersyncq);
+    sync->haltspending = NULL;
 
     for (i = 0; i < sync->pubsockcount; i++) {
         sync->zmq_pubsocks[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
+        if (glob->publish_hwm > 0) {
+            zmq_setsockopt(sync->zmq_pubsocks[i], ZMQ_SNDHWM,
+                    &(glob->publish_hwm), sizeof(glob->publish_hwm));
+        }
         snprintf(sockname, 128, "inproc://openlipub-%d", i);
         if (zmq_connect(sync->zmq_pubsocks[i], sockname) < 0) {
             logger(LOG_INFO,
@@ -83,12 +98,11 @@ collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
             zmq_close(sync->zmq_pubsocks[i]);
             sync->zmq_pubsocks[i] = NULL;
         }
-
-        /* Do we need to set a HWM? */
     }
 
     sync->zmq_colsock = zmq_socket(glob->zmq_ctxt, ZMQ_PULL);
-    if (zmq_bind(sync->zmq_colsock, "inproc://openli-voipsync") != 0) {
+    snprintf(sockname, 128, "inproc://openli-voipsync-%d", shardid);
+    if (zmq_bind(sync->zmq_colsock, sockname) != 0) {
         logger(LOG_INFO, "OpenLI: colsync VOIP thread unable to bind to zmq socket for collector updates: %s",
                 strerror(errno));
         zmq_close(sync->zmq_colsock);
@@ -99,16 +113,19 @@ collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
     sync->voipintercepts = NULL;
     sync->knowncallids = NULL;
     sync->sipparser = NULL;
+    sync->targetusers = NULL;
+    sync->targetusers_stale = 1;
 
     sync->sipdebugupdate = NULL;
     sync->sipdebugout = NULL;
     sync->ignore_sdpo_matches = glob->ignore_sdpo_matches;
 
-    if (glob->ignore_sdpo_matches) {
+    if (glob->ignore_sdpo_matches && shardid == 0) {
         logger(LOG_INFO, "OpenLI: disabling tracking of multiple SIP legs using SDP O identifier");
     }
 
-    if (glob->sipdebugfile) {
+    /* Only the first VOIP sync thread writes the SIP debug file */
+    if (glob->sipdebugfile && shardid == 0) {
         sync->sipdebugfile = glob->sipdebugfile;
         glob->sipdebugfile = NULL;
     } else {
@@ -118,10 +135,22 @@ collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
     return sync;
 }
 
+static void free_sip_target_usernames(collector_sync_voip_t *sync) {
+    sip_target_username_t *tu, *tmp;
+
+    HASH_ITER(hh, sync->targetusers, tu, tmp) {
+        HASH_DELETE(hh, sync->targetusers, tu);
+        free(tu->username);
+        free(tu);
+    }
+}
+
 void clean_sync_voip_data(collector_sync_voip_t *sync) {
     int zero = 0, i;
     sync_epoll_t *syncev, *tmp;
 
+    free_pushed_batches(&(sync->pushbatches));
+    free_pending_halts(sync);
     free_voip_cinmap(sync->knowncallids);
     if (sync->voipintercepts) {
         free_all_voipintercepts(&(sync->voipintercepts));
@@ -129,6 +158,7 @@ void clean_sync_voip_data(collector_sync_voip_t *sync) {
     if (sync->sipparser) {
         release_sip_parser(sync->sipparser);
     }
+    free_sip_target_usernames(sync);
 
     if (sync->topoll) {
         free(sync->topoll);
@@ -201,7 +231,7 @@ static inline void push_single_voipstreamintercept(collector_sync_voip_t *sync,
     sync->glob->stats->voipsessions_added_total ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
 
-    libtrace_message_queue_put(q, (void *)(&msg));
+    batch_pushed_message(&(sync->pushbatches), q, &msg);
 }
 
 static void push_halt_active_voipstreams(collector_sync_voip_t *sync,
@@ -229,7 +259,7 @@ static void push_halt_active_voipstreams(collector_sync_voip_t *sync,
         sync->glob->stats->voipsessions_ended_total ++;
         pthread_mutex_unlock(sync->glob->stats_mutex);
 
-        libtrace_message_queue_put(q, (void *)(&msg));
+        batch_pushed_message(&(sync->pushbatches), q, &msg);
 
         /* If we were already about to time this intercept out, make sure
          * we kill the timer.
@@ -1159,11 +1189,85 @@ static int modify_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
 
 }
 
+static void publish_voipintercept_over(collector_sync_voip_t *sync,
+        char *liid, char *authcc, char *delivcc, int seqtrackerid) {
+
+    openli_export_recv_t *expmsg;
+
+    expmsg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
+    expmsg->type = OPENLI_EXPORT_INTERCEPT_OVER;
+    expmsg->data.cept.liid = liid;
+    expmsg->data.cept.authcc = authcc;
+    expmsg->data.cept.delivcc = delivcc;
+
+    publish_openli_msg(sync->zmq_pubsocks[seqtrackerid], expmsg);
+}
+
+/* Tells the first VOIP sync thread that we have stopped intercepting
+ * an LIID */
+static void ack_voipintercept_halt(collector_sync_voip_t *sync, char *liid) {
+
+    openli_intersync_msg_t ack;
+
+    ack.msgtype = OPENLI_INTERSYNC_VOIP_HALTED;
+    ack.msglen = strlen(liid) + 1;
+    ack.msgbody = (uint8_t *)strdup(liid);
+    libtrace_message_queue_put(sync->firstq, &ack);
+}
+
+/* Called by the first VOIP sync thread when another VOIP sync thread has
+ * stopped intercepting an LIID. Once they all have, the seqtracker can be
+ * told that the intercept is over -- any IRIs that the other threads
+ * created for the intercept will have been published by then. */
+static void voipintercept_halt_acked(collector_sync_voip_t *sync,
+        uint8_t *msgbody, uint16_t msglen) {
+
+    voip_halt_pending_t *pend;
+
+    if (msgbody == NULL || msglen == 0 || msgbody[msglen - 1] != '\0') {
+        return;
+    }
+
+    HASH_FIND(hh, sync->haltspending, msgbody, strlen((char *)msgbody),
+            pend);
+    if (!pend) {
+        return;
+    }
+
+    pend->awaiting --;
+    if (pend->awaiting > 0) {
+        return;
+    }
+
+    HASH_DELETE(hh, sync->haltspending, pend);
+    if (pend->cancelled) {
+        free(pend->liid);
+        free(pend->authcc);
+        free(pend->delivcc);
+    } else {
+        publish_voipintercept_over(sync, pend->liid, pend->authcc,
+                pend->delivcc, pend->seqtrackerid);
+    }
+    free(pend);
+}
+
+static void free_pending_halts(collector_sync_voip_t *sync) {
+    voip_halt_pending_t *pend, *tmp;
+
+    HASH_ITER(hh, sync->haltspending, pend, tmp) {
+        HASH_DELETE(hh, sync->haltspending, pend);
+        free(pend->liid);
+        free(pend->authcc);
+        free(pend->delivcc);
+        free(pend);
+    }
+}
+
 static int halt_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
         uint16_t msglen) {
 
     voipintercept_t *vint, torem;
-    openli_export_recv_t *expmsg;
+    voip_halt_pending_t *pend;
 
     if (decode_voipintercept_halt(intmsg, msglen, &torem) == -1) {
         if (sync->log_bad_instruct) {
@@ -1176,26 +1280,54 @@ static int halt_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
     HASH_FIND(hh_liid, sync->voipintercepts, torem.common.liid,
             torem.common.liid_len, vint);
     if (!vint) {
+        /* Every VOIP sync thread sees the same sequence of instructions,
+         * so the first one won't be waiting on us for this LIID */
         return 0;
     }
 
     sync->log_bad_instruct = 1;
-    logger(LOG_INFO, "OpenLI: sync thread withdrawing VOIP intercept %s",
-            torem.common.liid);
-
     push_voipintercept_halt_to_threads(sync, vint);
 
-    expmsg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
-    expmsg->type = OPENLI_EXPORT_INTERCEPT_OVER;
-    expmsg->data.cept.liid = strdup(vint->common.liid);
-    expmsg->data.cept.authcc = strdup(vint->common.authcc);
-    expmsg->data.cept.delivcc = strdup(vint->common.delivcc);
+    if (sync->shardid != 0) {
+        ack_voipintercept_halt(sync, vint->common.liid);
+        HASH_DELETE(hh_liid, sync->voipintercepts, vint);
+        free_single_voipintercept(vint);
+        return 0;
+    }
+
+    logger(LOG_INFO, "OpenLI: sync thread withdrawing VOIP intercept %s",
+            torem.common.liid);
 
     pthread_mutex_lock(sync->glob->stats_mutex);
     sync->glob->stats->voipintercepts_ended_diff ++;
     sync->glob->stats->voipintercepts_ended_total ++;
     pthread_mutex_unlock(sync->glob->stats_mutex);
-    publish_openli_msg(sync->zmq_pubsocks[vint->common.seqtrackerid], expmsg);
+
+    if (sync->shardcount <= 1) {
+        publish_voipintercept_over(sync, strdup(vint->common.liid),
+                strdup(vint->common.authcc), strdup(vint->common.delivcc),
+                vint->common.seqtrackerid);
+    } else {
+        /* Wait for the other sync threads to stop creating IRIs for this
+         * intercept before we tell the seqtracker that it is over */
+        HASH_FIND(hh, sync->haltspending, vint->common.liid,
+                vint->common.liid_len, pend);
+        if (!pend) {
+            pend = (voip_halt_pending_t *)calloc(1,
+                    sizeof(voip_halt_pending_t));
+            pend->liid = strdup(vint->common.liid);
+            HASH_ADD_KEYPTR(hh, sync->haltspending, pend->liid,
+                    strlen(pend->liid), pend);
+        } else {
+            free(pend->authcc);
+            free(pend->delivcc);
+        }
+        pend->authcc = strdup(vint->common.authcc);
+        pend->delivcc = strdup(vint->common.delivcc);
+        pend->seqtrackerid = vint->common.seqtrackerid;
+        pend->awaiting += (sync->shardcount - 1);
+        pend->cancelled = 0;
+    }
 
     HASH_DELETE(hh_liid, sync->voipintercepts, vint);
     free_single_voipintercept(vint);
@@ -1230,7 +1362,7 @@ static int halt_single_rtpstream(collector_sync_voip_t *sync, rtpstreaminf_t *rt
            memset(&msg, 0, sizeof(openli_pushed_t));
            msg.type = OPENLI_PUSH_HALT_IPMMINTERCEPT;
            msg.data.rtpstreamkey = strdup(rtp->streamkey);
-           libtrace_message_queue_put(sendq->q, (void *)(&msg));
+           batch_pushed_message(&(sync->pushbatches), sendq->q, &msg);
         }
     }
 
@@ -1439,6 +1571,7 @@ static int new_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
     voipintercept_t *vint, *toadd;
     sync_sendq_t *sendq, *tmp;
     openli_export_recv_t *expmsg;
+    voip_halt_pending_t *pend;
 
     toadd = (voipintercept_t *)malloc(sizeof(voipintercept_t));
     if (decode_voipintercept_start(intmsg, msglen, toadd) == -1) {
@@ -1472,18 +1605,32 @@ static int new_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
     HASH_ADD_KEYPTR(hh_liid, sync->voipintercepts, vint->common.liid,
             vint->common.liid_len, vint);
 
-    expmsg = (openli_export_recv_t *)calloc(1, sizeof(openli_export_recv_t));
-    expmsg->type = OPENLI_EXPORT_INTERCEPT_DETAILS;
-    expmsg->data.cept.liid = strdup(vint->common.liid);
-    expmsg->data.cept.authcc = strdup(vint->common.authcc);
-    expmsg->data.cept.delivcc = strdup(vint->common.delivcc);
+    /* Only the first sync thread announces the intercept. The others are
+     * not told about it until after we have done so. */
+    if (sync->shardid == 0) {
+        HASH_FIND(hh, sync->haltspending, vint->common.liid,
+                vint->common.liid_len, pend);
+        if (pend) {
+            /* Restarted before the previous withdrawal was complete, so
+             * don't end it when the other sync threads catch up */
+            pend->cancelled = 1;
+        }
 
-    pthread_mutex_lock(sync->glob->stats_mutex);
-    sync->glob->stats->voipintercepts_added_diff ++;
-    sync->glob->stats->voipintercepts_added_total ++;
-    pthread_mutex_unlock(sync->glob->stats_mutex);
+        expmsg = (openli_export_recv_t *)calloc(1,
+                sizeof(openli_export_recv_t));
+        expmsg->type = OPENLI_EXPORT_INTERCEPT_DETAILS;
+        expmsg->data.cept.liid = strdup(vint->common.liid);
+        expmsg->data.cept.authcc = strdup(vint->common.authcc);
+        expmsg->data.cept.delivcc = strdup(vint->common.delivcc);
+
+        pthread_mutex_lock(sync->glob->stats_mutex);
+        sync->glob->stats->voipintercepts_added_diff ++;
+        sync->glob->stats->voipintercepts_added_total ++;
+        pthread_mutex_unlock(sync->glob->stats_mutex);
 
-    publish_openli_msg(sync->zmq_pubsocks[vint->common.seqtrackerid], expmsg);
+        publish_openli_msg(sync->zmq_pubsocks[vint->common.seqtrackerid],
+                expmsg);
+    }
 
     pthread_mutex_lock(&(sync->glob->mutex));
     HASH_ITER(hh, (sync_sendq_t *)(sync->glob->collector_queues), sendq, tmp) {
@@ -1493,8 +1640,10 @@ static int new_voipintercept(collector_sync_voip_t *sync, uint8_t *intmsg,
     }
 
     pthread_mutex_unlock(&(sync->glob->mutex));
-    logger(LOG_INFO,
-            "OpenLI: adding new VOIP intercept %s", vint->common.liid);
+    if (sync->shardid == 0) {
+        logger(LOG_INFO,
+                "OpenLI: adding new VOIP intercept %s", vint->common.liid);
+    }
     return 0;
 }
 
@@ -1587,6 +1736,122 @@ static inline void get_ip_addresses(libtrace_packet_t *pkt,
 }
 
 
+/* Rebuilds the set of usernames across all of our SIP targets, following
+ * a change to our VOIP intercepts. */
+static void rebuild_sip_target_usernames(collector_sync_voip_t *sync) {
+
+    voipintercept_t *vint, *tmp;
+    libtrace_list_node_t *n;
+    openli_sip_identity_t *sipid;
+    sip_target_username_t *tu;
+
+    free_sip_target_usernames(sync);
+
+    HASH_ITER(hh_liid, sync->voipintercepts, vint, tmp) {
+        n = vint->targets->head;
+        while (n) {
+            sipid = *((openli_sip_identity_t **)(n->data));
+            n = n->next;
+
+            if (sipid->username == NULL) {
+                continue;
+            }
+
+            HASH_FIND(hh, sync->targetusers, sipid->username,
+                    strlen(sipid->username), tu);
+            if (tu) {
+                continue;
+            }
+            tu = (sip_target_username_t *)malloc(sizeof(sip_target_username_t));
+            tu->username = strdup(sipid->username);
+            HASH_ADD_KEYPTR(hh, sync->targetusers, tu->username,
+                    strlen(tu->username), tu);
+        }
+    }
+    sync->targetusers_stale = 0;
+}
+
+static inline int is_sip_target_username(collector_sync_voip_t *sync,
+        const char *user, uint16_t userlen) {
+
+    sip_target_username_t *tu;
+
+    if (user == NULL || userlen == 0) {
+        return 0;
+    }
+    HASH_FIND(hh, sync->targetusers, user, userlen, tu);
+    return (tu != NULL);
+}
+
+/* Decides whether the current SIP message could be of interest to any
+ * of our VOIP intercepts, using only a quick scan of the SIP headers.
+ * Messages that fail this check do not need to be parsed by libosip.
+ *
+ * This errs on the side of caution -- if anything about the message
+ * looks unusual, we say it is interesting and let the full parser and
+ * update_sip_state() decide.
+ */
+static int sip_message_may_be_relevant(collector_sync_voip_t *sync) {
+
+    openli_sip_scan_t scan;
+    voipcinmap_t *lookup;
+    voipintercept_t *vint, *tmp;
+    int i;
+
+    /* Anything we can't scan goes to the full parser, even if we have
+     * no intercepts, so that invalid SIP is still counted and written to
+     * the SIP debug output */
+    if (scan_sip_headers(sync->sipparser, &scan) < 0) {
+        return 1;
+    }
+
+    if (sync->voipintercepts == NULL) {
+        return 0;
+    }
+
+    HASH_FIND(hh_callid, sync->knowncallids, scan.callid, scan.callidlen,
+            lookup);
+    if (lookup) {
+        return 1;
+    }
+
+    /* Only INVITEs and REGISTERs can start something new */
+    if (scan.method == NULL) {
+        return 0;
+    }
+
+    if (scan.methodlen == 6 && memcmp(scan.method, "INVITE", 6) == 0) {
+        if (!sync->ignore_sdpo_matches) {
+            /* Could match an existing session via the SDP O identifier,
+             * which we'd need the full parser to work out */
+            HASH_ITER(hh_liid, sync->voipintercepts, vint, tmp) {
+                if (vint->cin_sdp_map != NULL) {
+                    return 1;
+                }
+            }
+        }
+    } else if (scan.methodlen != 8 || memcmp(scan.method, "REGISTER", 8)) {
+        return 0;
+    }
+
+    if (sync->targetusers_stale) {
+        rebuild_sip_target_usernames(sync);
+    }
+
+    if (scan.touser == NULL ||
+            is_sip_target_username(sync, scan.touser, scan.touserlen)) {
+        return 1;
+    }
+
+    for (i = 0; i < scan.authcount; i++) {
+        if (is_sip_target_username(sync, scan.authusers[i],
+                scan.authuserlens[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void examine_sip_update(collector_sync_voip_t *sync,
         libtrace_packet_t *recvdpkt) {
 
@@ -1648,11 +1913,18 @@ static void examine_sip_update(collector_sync_voip_t *sync,
     /* reassembled TCP streams can contain multiple messages, so
      * we need to keep trying until we have no new usable messages. */
     do {
-        ret = parse_next_sip_message(sync->sipparser, pktref);
+        ret = get_next_sip_message(sync->sipparser, pktref);
         if (ret == 0) {
             break;
         }
 
+        if (ret > 0) {
+            if (!sip_message_may_be_relevant(sync)) {
+                continue;
+            }
+            ret = parse_sip_message(sync->sipparser);
+        }
+
         if (ret < 0) {
             if (sync->log_bad_sip) {
                 logger(LOG_INFO,
@@ -1735,7 +2007,7 @@ static inline int process_colthread_message(collector_sync_voip_t *sync) {
 
         if (recvd.type == OPENLI_UPDATE_SIP) {
             examine_sip_update(sync, recvd.data.pkt);
-            trace_destroy_packet(recvd.data.pkt);
+            release_sync_packet(recvd.data.pkt);
         }
     } while (rc > 0);
 
@@ -1785,12 +2057,40 @@ static void disable_unconfirmed_voip_intercepts(collector_sync_voip_t *sync) {
 
 }
 
+/* Passes an instruction that the first VOIP sync thread has dealt with on
+ * to the other VOIP sync threads */
+static void relay_intersync_msg(collector_sync_voip_t *sync,
+        openli_intersync_msg_t *syncmsg) {
+
+    openli_intersync_msg_t topush;
+    int i;
+
+    for (i = 1; i < sync->shardcount; i++) {
+        topush.msgtype = syncmsg->msgtype;
+        topush.msgbody = NULL;
+        topush.msglen = syncmsg->msglen;
+        if (syncmsg->msglen > 0) {
+            topush.msgbody = (uint8_t *)malloc(syncmsg->msglen);
+            memcpy(topush.msgbody, syncmsg->msgbody, syncmsg->msglen);
+        }
+        libtrace_message_queue_put(&(sync->shards[i].intersyncq), &topush);
+    }
+}
+
 static inline int process_intersync_msg(collector_sync_voip_t *sync) {
 
     openli_intersync_msg_t syncmsg;
 
     libtrace_message_queue_get(sync->intersyncq, (void *)(&syncmsg));
 
+    if (syncmsg.msgtype == OPENLI_INTERSYNC_VOIP_HALTED) {
+        voipintercept_halt_acked(sync, syncmsg.msgbody, syncmsg.msglen);
+        if (syncmsg.msgbody) {
+            free(syncmsg.msgbody);
+        }
+        return 0;
+    }
+
     switch(syncmsg.msgtype) {
         case OPENLI_PROTO_START_VOIPINTERCEPT:
             if (new_voipintercept(sync, syncmsg.msgbody, syncmsg.msglen) < 0) {
@@ -1836,6 +2136,13 @@ static inline int process_intersync_msg(collector_sync_voip_t *sync) {
             break;
     }
 
+    /* Our set of SIP targets may have changed */
+    sync->targetusers_stale = 1;
+
+    if (sync->shardid == 0) {
+        relay_intersync_msg(sync, &syncmsg);
+    }
+
     if (syncmsg.msgbody) {
         free(syncmsg.msgbody);
     }
@@ -1843,7 +2150,7 @@ static inline int process_intersync_msg(collector_sync_voip_t *sync) {
 }
 
 
-int sync_voip_thread_main(collector_sync_voip_t *sync) {
+static int process_voip_sync_events(collector_sync_voip_t *sync) {
 
     int i, rc;
     sync_epoll_t *syncev, *tmp;
@@ -1900,5 +2207,15 @@ int sync_voip_thread_main(collector_sync_voip_t *sync) {
     return 1;
 }
 
+int sync_voip_thread_main(collector_sync_voip_t *sync) {
+    int ret;
+
+    ret = process_voip_sync_events(sync);
+
+    /* Hand over everything we queued up for the processing threads */
+    flush_pushed_batches(&(sync->pushbatches), sync->glob);
+    return ret;
+}
+
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -34,11 +34,34 @@
 #include "collector.h"
 #include "sipparsing.h"
 #include "util.h"
+#include "push_batch.h"
+
+/* A SIP target username, used to quickly discard SIP messages that can't
+ * possibly match any of our targets */
+typedef struct sip_target_username {
+    char *username;
+    UT_hash_handle hh;
+} sip_target_username_t;
+
+/* A withdrawn VOIP intercept that the first VOIP sync thread cannot
+ * announce as over until every other VOIP sync thread has withdrawn it */
+typedef struct voip_halt_pending {
+    char *liid;
+    char *authcc;
+    char *delivcc;
+    int seqtrackerid;
+    int awaiting;
+
+    /* Set if the intercept was started again while we were waiting */
+    uint8_t cancelled;
+    UT_hash_handle hh;
+} voip_halt_pending_t;
 
 typedef struct collector_sync_voip_data {
 
     sync_thread_global_t *glob;
     collector_identity_t *info;
+    int shardid;
 
     int pubsockcount;
     void **zmq_pubsocks;
@@ -49,10 +72,20 @@ typedef struct collector_sync_voip_data {
 
     libtrace_message_queue_t *intersyncq;
     int intersync_fd;
+    push_batcher_t *pushbatches;
+
+    /* Instructions all arrive at the first VOIP sync thread, which passes
+     * them on to the others once it has dealt with them itself. */
+    int shardcount;
+    voipsync_shard_t *shards;
+    libtrace_message_queue_t *firstq;
+    voip_halt_pending_t *haltspending;
 
     sync_epoll_t *timeouts;
 
     openli_sip_parser_t *sipparser;
+    sip_target_username_t *targetusers;
+    uint8_t targetusers_stale;
 
     char *sipdebugfile;
     libtrace_out_t *sipdebugout;
@@ -68,7 +101,8 @@ typedef struct collector_sync_voip_data {
 
 } collector_sync_voip_t;
 
-collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob);
+collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob,
+        int shardid);
 void clean_sync_voip_data(collector_sync_voip_t *sync);
 int sync_voip_thread_main(collector_sync_voip_t *sync);
 
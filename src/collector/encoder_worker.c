@@ -35,37 +35,86 @@
 #include "umtsiri.h"
 #include "collector_base.h"
 #include "logger.h"
+#include "util.h"
+
+#define ENCODED_BODY_POOL_MAX_FREE 10000
+#define ENCODER_POLL_TIMEOUT 1000
+#define ENCODER_JOBS_PER_PASS 256
+
+/* Called by a forwarding thread once it has finished with a DER message
+ * body that was produced by this encoder's libwandder encoder */
+void return_encoded_body(openli_encoder_t *enc,
+        wandder_encoded_result_t *body) {
+
+    body->next = __atomic_load_n(&(enc->returnedbodies), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(enc->returnedbodies),
+                &(body->next), body, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void recycle_returned_bodies(openli_encoder_t *enc) {
+
+    wandder_encoded_result_t *body, *next;
+
+    body = __atomic_exchange_n(&(enc->returnedbodies), NULL,
+            __ATOMIC_ACQUIRE);
+
+    while (body) {
+        next = body->next;
+        /* libwandder will reuse these (and their encoded buffers) for
+         * subsequent records */
+        wandder_release_encoded_result(enc->encoder, body);
+        body = next;
+    }
+}
+
+/* Only call this once the forwarding threads have exited */
+void release_encoder_pools(openli_encoder_t *enc) {
+
+    wandder_encoded_result_t *body, *next;
+
+    destroy_object_pool(enc->bodypool);
+    enc->bodypool = NULL;
+
+    /* Our libwandder encoder is already gone by this point */
+    body = enc->returnedbodies;
+    while (body) {
+        next = body->next;
+        free(body->encoded);
+        free(body);
+        body = next;
+    }
+    enc->returnedbodies = NULL;
+}
 
 static int init_worker(openli_encoder_t *enc) {
-    int zero = 0, rto = 10;
-    int hwm = 1000000;
-    int i;
+    int zero = 0;
+    int hwm = enc->resulthwm;
+    int i, connected = 0;
     char sockname[128];
 
     enc->encoder = init_wandder_encoder();
     enc->freegenerics = create_etsili_generic_freelist(0);
+    enc->bodypool = create_object_pool(sizeof(wandder_encoded_result_t),
+            ENCODED_BODY_POOL_MAX_FREE, NULL);
+    enc->returnedbodies = NULL;
     enc->halted = 0;
-
-    enc->zmq_recvjobs = calloc(enc->seqtrackers, sizeof(void *));
-    for (i = 0; i < enc->seqtrackers; i++) {
-        enc->zmq_recvjobs[i] = zmq_socket(enc->zmq_ctxt, ZMQ_PULL);
-        snprintf(sockname, 128, "inproc://openliseqpush-%d", i);
-        if (zmq_setsockopt(enc->zmq_recvjobs[i], ZMQ_LINGER, &zero,
-                sizeof(zero)) != 0) {
-            logger(LOG_INFO, "OpenLI: error configuring connection to zmq pull socket");
-            return -1;
-        }
-
-        if (zmq_setsockopt(enc->zmq_recvjobs[i], ZMQ_RCVTIMEO, &rto,
-                sizeof(rto)) != 0) {
-            logger(LOG_INFO, "OpenLI: error configuring connection to zmq pull socket");
-            return -1;
-        }
-        if (zmq_connect(enc->zmq_recvjobs[i], sockname) != 0) {
-            logger(LOG_INFO, "OpenLI: error connecting to zmq pull socket");
+    enc->idlespins = 0;
+
+    enc->jobbatch = calloc(OPENLI_ENCODING_BATCH_MAX,
+            sizeof(openli_encoding_job_t));
+    enc->resbatch = calloc(enc->forwarders, sizeof(openli_encoded_result_t *));
+    enc->rescount = calloc(enc->forwarders, sizeof(uint32_t));
+    if (!enc->jobbatch || !enc->resbatch || !enc->rescount) {
+        logger(LOG_INFO, "OpenLI: unable to allocate encoder batches");
+        return -1;
+    }
+    for (i = 0; i < enc->forwarders; i++) {
+        enc->resbatch[i] = calloc(OPENLI_ENCODING_BATCH_MAX,
+                sizeof(openli_encoded_result_t));
+        if (!enc->resbatch[i]) {
+            logger(LOG_INFO, "OpenLI: unable to allocate encoder batches");
             return -1;
         }
-
     }
 
     enc->zmq_pushresults = calloc(enc->forwarders, sizeof(void *));
@@ -98,6 +147,38 @@ static int init_worker(openli_encoder_t *enc) {
             enc->zmq_pushresults[i] = NULL;
             continue;
         }
+        connected ++;
+    }
+
+    if (connected == 0) {
+        logger(LOG_INFO,
+                "OpenLI: encoder worker %d could not connect to any forwarders",
+                enc->workerid);
+        return -1;
+    }
+    if (connected < enc->forwarders) {
+        logger(LOG_INFO,
+                "OpenLI: encoder worker %d will send results for the unreachable forwarders to the others instead",
+                enc->workerid);
+    }
+
+    /* Only start taking jobs once we know there is somewhere to send the
+     * results */
+    enc->zmq_recvjobs = calloc(enc->seqtrackers, sizeof(void *));
+    for (i = 0; i < enc->seqtrackers; i++) {
+        enc->zmq_recvjobs[i] = zmq_socket(enc->zmq_ctxt, ZMQ_PULL);
+        snprintf(sockname, 128, "inproc://openliseqpush-%d", i);
+        if (zmq_setsockopt(enc->zmq_recvjobs[i], ZMQ_LINGER, &zero,
+                sizeof(zero)) != 0) {
+            logger(LOG_INFO, "OpenLI: error configuring connection to zmq pull socket");
+            return -1;
+        }
+
+        if (zmq_connect(enc->zmq_recvjobs[i], sockname) != 0) {
+            logger(LOG_INFO, "OpenLI: error connecting to zmq pull socket");
+            return -1;
+        }
+
     }
 
     enc->zmq_control = zmq_socket(enc->zmq_ctxt, ZMQ_SUB);
@@ -134,11 +215,11 @@ static int init_worker(openli_encoder_t *enc) {
 }
 
 void destroy_encoder_worker(openli_encoder_t *enc) {
-    int x, i;
-    openli_encoding_job_t job;
+    int x, i, j;
     uint32_t drained = 0;
 
     if (enc->encoder) {
+        recycle_returned_bodies(enc);
         free_wandder_encoder(enc->encoder);
     }
 
@@ -146,10 +227,11 @@ void destroy_encoder_worker(openli_encoder_t *enc) {
         free_etsili_generics(enc->freegenerics);
     }
 
-    for (i = 0; i < enc->seqtrackers; i++) {
+    for (i = 0; enc->zmq_recvjobs && i < enc->seqtrackers; i++) {
         do {
-            x = zmq_recv(enc->zmq_recvjobs[i], &job,
-                    sizeof(openli_encoding_job_t), 0);
+            x = zmq_recv(enc->zmq_recvjobs[i], enc->jobbatch,
+                    OPENLI_ENCODING_BATCH_MAX * sizeof(openli_encoding_job_t),
+                    ZMQ_DONTWAIT);
             if (x < 0) {
                 if (errno == EAGAIN) {
                     continue;
@@ -157,18 +239,10 @@ void destroy_encoder_worker(openli_encoder_t *enc) {
                 break;
             }
 
-            if (job.origreq->type == OPENLI_EXPORT_IPCC) {
-                free_published_message(job.origreq);
-            } else {
-                free(job.origreq);
-            }
-            if (job.liid) {
-                free(job.liid);
-            }
-            if (job.cinstr) {
-                free(job.cinstr);
+            for (j = 0; j < x / (int)sizeof(openli_encoding_job_t); j++) {
+                free_published_message(enc->jobbatch[j].origreq);
+                drained ++;
             }
-            drained ++;
 
         } while (x > 0);
         zmq_close(enc->zmq_recvjobs[i]);
@@ -191,6 +265,15 @@ void destroy_encoder_worker(openli_encoder_t *enc) {
     free(enc->zmq_pushresults);
     free(enc->topoll);
 
+    if (enc->resbatch) {
+        for (i = 0; i < enc->forwarders; i++) {
+            free(enc->resbatch[i]);
+        }
+        free(enc->resbatch);
+    }
+    free(enc->rescount);
+    free(enc->jobbatch);
+
 }
 
 static int encode_rawip(openli_encoder_t *enc, openli_encoding_job_t *job,
@@ -200,7 +283,12 @@ static int encode_rawip(openli_encoder_t *enc, openli_encoding_job_t *job,
 
     memset(res, 0, sizeof(openli_encoded_result_t));
 
-    res->msgbody = calloc(1, sizeof(wandder_encoded_result_t));
+    res->msgbody = get_pooled_object(enc->bodypool);
+    if (res->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding raw IP record");
+        return -1;
+    }
     res->msgbody->encoder = NULL;
     res->msgbody->encoded = NULL;
     res->msgbody->len = job->origreq->data.rawip.ipclen;
@@ -243,7 +331,8 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->ipcc));
                 ret = encode_ipcc_ber(
                         &(job->origreq->data.ipcc), job->seqno,
-                        &(job->origreq->ts), res, job->child, enc->encoder);
+                        &(job->origreq->ts), res, job->child, enc->encoder,
+                        enc->bodypool);
 #endif
             }
             break;
@@ -258,8 +347,8 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->ipiri));
                 ret = encode_ipiri_ber(
                         &(job->origreq->data.ipiri), enc->freegenerics,
-                        job->seqno, &(job->origreq->ts), res, job->child, 
-                        enc->encoder);
+                        job->seqno, &(job->origreq->ts), res, job->child,
+                        enc->encoder, enc->bodypool);
 #endif
             }
             break;
@@ -273,7 +362,8 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->ipmmiri));          
                 ret = encode_ipmmiri_ber(
                         &(job->origreq->data.ipmmiri), job->seqno,
-                        &(job->origreq->ts), res, job->child, enc->encoder);
+                        &(job->origreq->ts), res, job->child, enc->encoder,
+                        enc->bodypool);
 #endif
             }
             break;
@@ -287,7 +377,8 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->ipmmcc));
                 ret = encode_ipmmcc_ber(
                         &(job->origreq->data.ipcc), job->seqno,
-                        &(job->origreq->ts), res, job->child, enc->encoder);
+                        &(job->origreq->ts), res, job->child, enc->encoder,
+                        enc->bodypool);
 #endif
             }
             break;
@@ -302,7 +393,8 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->umtscc));
                 ret = encode_umtscc_ber(
                         &(job->origreq->data.ipcc), job->seqno,
-                        &(job->origreq->ts), res, job->child, enc->encoder);
+                        &(job->origreq->ts), res, job->child, enc->encoder,
+                        enc->bodypool);
 
 #endif
             }
@@ -334,7 +426,7 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
                 job->child = wandder_create_etsili_child(job->top, &(job->top->umtsiri));
                 ret = encode_umtsiri_ber(
                         &(job->origreq->data.mobiri), enc->freegenerics,
-                        job->seqno, res, job->child);
+                        job->seqno, res, job->child, enc->bodypool);
 #endif
             }
             break;
@@ -347,15 +439,59 @@ static int encode_etsi(openli_encoder_t *enc, openli_encoding_job_t *job,
 }
 
 
+/* All results for a given LIID and CIN must go to the same forwarder, so
+ * that they can be put back into sequence order before export. */
+static inline int choose_forwarder(openli_encoder_t *enc, char *liid,
+        uint32_t cin) {
+
+    int fwdind = 0, i;
+
+    if (enc->forwarders > 1 && liid != NULL) {
+        fwdind = (hash_liid(liid) + cin) % enc->forwarders;
+    }
+
+    /* Skip over any forwarders that we failed to connect to in
+     * init_worker() */
+    for (i = 0; i < enc->forwarders; i++) {
+        if (enc->zmq_pushresults[fwdind] != NULL) {
+            return fwdind;
+        }
+        fwdind = (fwdind + 1) % enc->forwarders;
+    }
+    return -1;
+}
+
+static int flush_encoded_results(openli_encoder_t *enc, int fwdind) {
+
+    uint32_t count = enc->rescount[fwdind];
+
+    if (count == 0) {
+        return 0;
+    }
+    enc->rescount[fwdind] = 0;
+
+    if (zmq_send(enc->zmq_pushresults[fwdind], enc->resbatch[fwdind],
+                count * sizeof(openli_encoded_result_t), 0) < 0) {
+        logger(LOG_INFO, "OpenLI: error while pushing encoded results back to exporter (worker=%d)", enc->workerid);
+        return -1;
+    }
+    add_stage_counter(&(enc->stats.sent), count);
+    return 1;
+}
+
 static int process_job(openli_encoder_t *enc, void *socket) {
-    int x;
+    int x, fwdind, i, njobs, ret;
     int batch = 0;
-    openli_encoding_job_t job;
-    openli_encoded_result_t result;
+    openli_encoding_job_t *job;
+    openli_encoded_result_t *result;
+    uint64_t now;
 
-    while (batch < 50) {
-        memset(&job, 0, sizeof(openli_encoding_job_t));
-        x = zmq_recv(socket, &job, sizeof(openli_encoding_job_t), 0);
+    recycle_returned_bodies(enc);
+
+    while (batch < ENCODER_JOBS_PER_PASS) {
+        x = zmq_recv(socket, enc->jobbatch,
+                OPENLI_ENCODING_BATCH_MAX * sizeof(openli_encoding_job_t),
+                ZMQ_DONTWAIT);
         if (x < 0 && errno != EAGAIN) {
             logger(LOG_INFO,
                     "OpenLI: error reading job in encoder worker %d",
@@ -367,38 +503,72 @@ static int process_job(openli_encoder_t *enc, void *socket) {
             return 0;
         }
 
-        if (job.origreq->type == OPENLI_EXPORT_RAW_SYNC) {
-            encode_rawip(enc, &job, &result);
-        } else {
+        njobs = x / sizeof(openli_encoding_job_t);
+        now = openli_now_ns();
+        add_stage_counter(&(enc->stats.received), njobs);
 
-            if (encode_etsi(enc, &job, &result) < 0) {
-                /* What do we do in the event of an error? */
-                logger(LOG_INFO,
-                        "OpenLI: encoder worker had an error when encoding %d record",
-                        job.origreq->type);
+        for (i = 0; i < njobs; i++) {
+            job = &(enc->jobbatch[i]);
+            record_latency_since(&(enc->stats.latency), job->queuedns, now);
 
+            /* Encode straight into the batch for the forwarder that will
+             * be handling this LIID and CIN */
+            fwdind = choose_forwarder(enc, job->liid, job->cin);
+            if (fwdind < 0) {
+                /* Can't happen: init_worker() fails if we have no
+                 * forwarders, before we start taking jobs */
+                logger(LOG_INFO,
+                        "OpenLI: encoder worker %d has no forwarder to send results to, dropping record",
+                        enc->workerid);
+                free_published_message(job->origreq);
                 continue;
             }
-        }
+            result = &(enc->resbatch[fwdind][enc->rescount[fwdind]]);
+            memset(result, 0, sizeof(openli_encoded_result_t));
+
+            if (job->origreq->type == OPENLI_EXPORT_RAW_SYNC) {
+                ret = encode_rawip(enc, job, result);
+            } else {
+                ret = encode_etsi(enc, job, result);
+            }
+
+            if (ret < 0) {
+                logger(LOG_INFO,
+                        "OpenLI: encoder worker had an error when encoding %d record",
+                        job->origreq->type);
+
+                /* Still pass the record on, so that the forwarder does
+                 * not wait for this sequence number forever. It will
+                 * release the original request (and anything that the
+                 * encoder managed to produce) for us. */
+                result->skipped = 1;
+                result->ipcontents = NULL;
+                result->ipclen = 0;
+            }
 
-        result.cinstr = job.cinstr;
-        result.liid = job.liid;
-        result.seqno = job.seqno;
-        result.destid = job.origreq->destid;
-        result.origreq = job.origreq;
-        result.encodedby = enc->workerid;
+            result->cin = job->cin;
+            result->liid = job->liid;
+            result->seqno = job->seqno;
+            result->destid = job->origreq->destid;
+            result->origreq = job->origreq;
+            result->encodedby = enc->workerid;
+            result->queuedns = openli_now_ns();
 
 #ifdef HAVE_BER_ENCODING
-        result.child = job.child;
+            result->child = job->child;
 #endif
 
-        // FIXME -- hash result based on LIID (and CIN?)
-        assert(enc->zmq_pushresults[0] != NULL);
-        if (zmq_send(enc->zmq_pushresults[0], &result, sizeof(result), 0) < 0) {
-            logger(LOG_INFO, "OpenLI: error while pushing encoded result back to exporter (worker=%d)", enc->workerid);
-            break;
+            enc->rescount[fwdind] ++;
+            if (enc->rescount[fwdind] == OPENLI_ENCODING_BATCH_MAX) {
+                flush_encoded_results(enc, fwdind);
+            }
         }
-        batch++;
+        batch += njobs;
+    }
+
+    /* Don't sit on any partial batches while we go looking for more work */
+    for (i = 0; i < enc->forwarders; i++) {
+        flush_encoded_results(enc, i);
     }
     return batch;
 }
@@ -406,6 +576,7 @@ static int process_job(openli_encoder_t *enc, void *socket) {
 static inline void poll_nextjob(openli_encoder_t *enc) {
     int x, i;
     int tmpbuf;
+    int processed = 0;
 
     x = zmq_recv(enc->zmq_control, &tmpbuf, sizeof(tmpbuf), ZMQ_DONTWAIT);
 
@@ -423,9 +594,30 @@ static inline void poll_nextjob(openli_encoder_t *enc) {
     /* TODO better error checking / handling for multiple seqtrackers */
     for (i = 0; i < enc->seqtrackers; i++) {
         x = process_job(enc, enc->topoll[i+1].socket);
+        if (x > 0) {
+            processed += x;
+        }
+    }
+
+    if (processed > 0) {
+        enc->idlespins = 0;
+        return;
     }
 
-    return;
+    /* Nothing to do -- keep spinning for a little while in case more
+     * jobs arrive shortly, then go to sleep until one of our sockets
+     * has something for us. */
+    if (enc->idlespins < enc->spinbudget) {
+        enc->idlespins ++;
+        return;
+    }
+
+    if (zmq_poll(enc->topoll, enc->seqtrackers + 1,
+                ENCODER_POLL_TIMEOUT) < 0 && errno != EINTR) {
+        logger(LOG_INFO,
+                "OpenLI: error while polling in encoder worker %d: %s",
+                enc->workerid, strerror(errno));
+    }
 }
 
 void *run_encoder_worker(void *encstate) {
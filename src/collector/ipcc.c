@@ -68,7 +68,8 @@ int encode_ipcc(wandder_encoder_t *encoder, wandder_encode_job_t *precomputed,
 
 int encode_ipcc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
-        openli_encoded_result_t *msg, wandder_etsili_child_t *child, wandder_encoder_t *encoder) {
+        openli_encoded_result_t *msg, wandder_etsili_child_t *child, wandder_encoder_t *encoder,
+        openli_pool_t *bodypool) {
 
     uint32_t liidlen = (uint32_t)((size_t)child->owner->preencoded[WANDDER_PREENCODE_LIID_LEN]);
 
@@ -83,7 +84,12 @@ int encode_ipcc_ber(
         job->dir, 
         child);
 
-    msg->msgbody = malloc(sizeof(wandder_encoded_result_t));
+    msg->msgbody = get_pooled_object(bodypool);
+    if (msg->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding IPCC record");
+        return -1;
+    }
 
     msg->msgbody->encoder = NULL;
     msg->msgbody->encoded = child->buf;
@@ -104,105 +110,50 @@ int encode_ipcc_ber(
 #endif
 
 
-static inline static_ipcache_t *find_static_cached(prefix_t *prefix,
-        colthread_local_t *loc) {
-
-    static_ipcache_t *found;
-    HASH_FIND(hh, loc->staticcache, prefix, sizeof(prefix_t), found);
-
-    if (found) {
-        /* Push it back to the front of the queue so it doesn't expire */
-        HASH_DELETE(hh, loc->staticcache, found);
-        HASH_ADD_KEYPTR(hh, loc->staticcache, &(found->prefix),
-                sizeof(prefix_t), found);
-    }
-    return found;
-
-}
-
-static inline int add_static_cached(prefix_t *prefix, patricia_node_t *pnode,
-        colthread_local_t *loc) {
-
-    static_ipcache_t *ent, *tmp;
-
-    ent = (static_ipcache_t *)malloc(sizeof(static_ipcache_t));
-    memcpy(&(ent->prefix), prefix, sizeof(prefix_t));
-    ent->pnode = pnode;
-
-    HASH_ADD_KEYPTR(hh, loc->staticcache, &(ent->prefix), sizeof(prefix_t),
-            ent);
-
-    if (HASH_COUNT(loc->staticcache) >= 1000000) {
-        HASH_ITER(hh, loc->staticcache, ent, tmp) {
-            HASH_DELETE(hh, loc->staticcache, ent);
-            free(ent);
-            break;
-        }
-    }
-    return 0;
-}
-
 static inline int lookup_static_ranges(struct sockaddr *cmp,
         int family, libtrace_packet_t *pkt, uint8_t dir,
         colthread_local_t *loc) {
 
-    int matched = 0;
-    patricia_node_t *pnode = NULL;
-    prefix_t prefix;
+    int i;
+    static_lpm_t *lpm;
+    patricia_tree_t *ptree;
+    static_lpm_matches_t *matches;
+    uint8_t *addrbytes;
     openli_export_recv_t *msg;
-    static_ipcache_t *cached = NULL;
-
-    memset(&prefix, 0, sizeof(prefix_t));
 
     if (family == AF_INET) {
-        struct sockaddr_in *in = (struct sockaddr_in *)cmp;
-        memcpy(&(prefix.add.sin), &(in->sin_addr), 4);
-        prefix.bitlen = 32;
-        prefix.family = AF_INET;
-        prefix.ref_count = 0;
+        lpm = &(loc->staticv4lpm);
+        ptree = loc->staticv4ranges;
+        addrbytes = (uint8_t *)&(((struct sockaddr_in *)cmp)->sin_addr);
     } else {
-        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)cmp;
-        memcpy(&(prefix.add.sin6), &(in6->sin6_addr), 16);
-        prefix.bitlen = 128;
-        prefix.family = AF_INET6;
-        prefix.ref_count = 0;
+        lpm = &(loc->staticv6lpm);
+        ptree = loc->staticv6ranges;
+        addrbytes = (uint8_t *)&(((struct sockaddr_in6 *)cmp)->sin6_addr);
     }
 
+    /* Ranges have been modified or removed since the last lookup (or an
+     * earlier update ran out of memory) */
+    if (lpm->dirty) {
+        rebuild_static_lpm(lpm, ptree, loc->activestaticintercepts);
+    }
 
-    //cached = find_static_cached(&prefix, loc);
-    if (cached) {
-        pnode = cached->pnode;
-    } else {
-        if (family == AF_INET) {
-            pnode = patricia_search_best2(loc->staticv4ranges, &prefix, 1);
-        } else {
-            pnode = patricia_search_best2(loc->staticv6ranges, &prefix, 1);
-        }
-        //add_static_cached(&prefix, pnode, loc);
+    matches = lookup_static_lpm(lpm, addrbytes);
+    if (matches == NULL) {
+        return 0;
     }
 
-    while (pnode) {
-        liid_set_t **all, *sliid, *tmp2;
+    for (i = 0; i < matches->count; i++) {
+        staticipsession_t *matchsess = matches->sessions[i];
 
-        all = (liid_set_t **)(&(pnode->data));
-        HASH_ITER(hh, *all, sliid, tmp2) {
-            staticipsession_t *matchsess;
-            HASH_FIND(hh, loc->activestaticintercepts, sliid->key,
-                    sliid->keylen, matchsess);
-            if (!matchsess) {
-                logger(LOG_INFO,
-                        "OpenLI: matched an IP range for intercept %s but this is not present in activestaticintercepts",
-                        sliid->key);
-            } else {
-                matched ++;
-                msg = create_ipcc_job(matchsess->cin, matchsess->common.liid,
-                        matchsess->common.destid, pkt, dir);
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-            }
+        msg = create_ipcc_job(matchsess->cin, matchsess->common.liid,
+                matchsess->common.destid, pkt, dir,
+                get_cc_packet_ref(loc, pkt), loc->ccjobpool);
+        if (msg != NULL) {
+            publish_openli_msg(
+                    loc->zmq_pubsocks[matchsess->common.seqtrackerid], msg);
         }
-        pnode = pnode->parent;
     }
-    return matched;
+    return matches->count;
 }
 
 static void singlev6_conn_contents(struct sockaddr_in6 *cmp,
@@ -237,13 +188,17 @@ static void singlev6_conn_contents(struct sockaddr_in6 *cmp,
                 HASH_ITER(hh, tgt->intercepts, sess, tmp) {
                     *matched = ((*matched) + 1);
                     msg = create_ipcc_job(sess->cin, sess->common.liid,
-                            sess->common.destid, pkt, 0);
+                            sess->common.destid, pkt, 0,
+                            get_cc_packet_ref(loc, pkt),
+                            loc->ccjobpool);
                     if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg)
                     {
                         msg->type = OPENLI_EXPORT_UMTSCC;
                     }
                     if (msg != NULL) {
-                        publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
+                        publish_openli_msg(
+                                loc->zmq_pubsocks[sess->common.seqtrackerid],
+                                msg);
                     }
                 }
             }
@@ -283,14 +238,45 @@ int ipv6_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
 }
 
 
+static int shared_v4_conn_contents(struct sockaddr_in *cmp,
+        colthread_local_t *loc, libtrace_packet_t *pkt, uint8_t dir) {
+
+    shared_ipv4_bucket_t *bucket;
+    openli_export_recv_t *msg;
+    ipsession_t *sess;
+    uint32_t i;
+    int matched = 0;
+
+    bucket = shared_ipv4_lookup(loc->sharedv4, cmp->sin_addr.s_addr);
+    if (bucket == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < bucket->count; i++) {
+        if (bucket->entries[i].address != cmp->sin_addr.s_addr) {
+            continue;
+        }
+        sess = bucket->entries[i].sess;
+        matched ++;
+        msg = create_ipcc_job(sess->cin, sess->common.liid,
+                sess->common.destid, pkt, dir,
+                get_cc_packet_ref(loc, pkt), loc->ccjobpool);
+        if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
+            msg->type = OPENLI_EXPORT_UMTSCC;
+        }
+        if (msg != NULL) {
+            publish_openli_msg(
+                    loc->zmq_pubsocks[sess->common.seqtrackerid], msg);
+        }
+    }
+    return matched;
+}
+
 int ipv4_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
         libtrace_ip_t *ip, uint32_t rem, colthread_local_t *loc) {
 
     struct sockaddr_in *cmp;
-    openli_export_recv_t *msg;
     int matched = 0;
-    ipv4_target_t *tgt;
-    ipsession_t *sess, *tmp;
 
     if (rem < sizeof(libtrace_ip_t)) {
         /* Truncated IP header */
@@ -303,40 +289,10 @@ int ipv4_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
      */
 
     cmp = (struct sockaddr_in *)(&pinfo->srcip);
-    HASH_FIND(hh, loc->activeipv4intercepts, &(cmp->sin_addr.s_addr),
-            sizeof(cmp->sin_addr.s_addr), tgt);
-
-    if (tgt) {
-        HASH_ITER(hh, tgt->intercepts, sess, tmp) {
-            matched ++;
-            msg = create_ipcc_job(sess->cin, sess->common.liid,
-                    sess->common.destid, pkt, 0);
-            if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
-                msg->type = OPENLI_EXPORT_UMTSCC;
-            }
-            if (msg != NULL) {
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-            }
-        }
-    }
+    matched += shared_v4_conn_contents(cmp, loc, pkt, 0);
 
     cmp = (struct sockaddr_in *)(&pinfo->destip);
-    HASH_FIND(hh, loc->activeipv4intercepts, &(cmp->sin_addr.s_addr),
-            sizeof(cmp->sin_addr.s_addr), tgt);
-
-    if (tgt) {
-        HASH_ITER(hh, tgt->intercepts, sess, tmp) {
-            matched ++;
-            msg = create_ipcc_job(sess->cin, sess->common.liid,
-                    sess->common.destid, pkt, 1);
-            if (sess->accesstype == INTERNET_ACCESS_TYPE_MOBILE && msg) {
-                msg->type = OPENLI_EXPORT_UMTSCC;
-            }
-            if (msg != NULL) {
-                publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
-            }
-        }
-    }
+    matched += shared_v4_conn_contents(cmp, loc, pkt, 1);
 
     if (loc->staticv4ranges == NULL) {
         goto ipv4ccdone;
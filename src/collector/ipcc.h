@@ -42,7 +42,7 @@ int ipv6_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
 int encode_ipcc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *msg, wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder);
+        wandder_encoder_t *encoder, openli_pool_t *bodypool);
 #endif
 #endif
 
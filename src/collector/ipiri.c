@@ -348,7 +348,7 @@ int encode_ipiri_ber(
         uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *res,
         wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder) {
+        wandder_encoder_t *encoder, openli_pool_t *bodypool) {
 
     memset(res, 0, sizeof(openli_encoded_result_t));
 
@@ -376,7 +376,13 @@ int encode_ipiri_ber(
             iritype,
             child);
 
-    res->msgbody = malloc(sizeof(wandder_encoded_result_t));
+    res->msgbody = get_pooled_object(bodypool);
+    if (res->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding IPIRI record");
+        free_ipiri_parameters(params);
+        return -1;
+    }
     res->msgbody->encoder = NULL;
     res->msgbody->encoded = child->buf;
     res->msgbody->len = child->len;
@@ -147,7 +147,7 @@ int encode_ipiri_ber(
         uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *res,
         wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder);
+        wandder_encoder_t *encoder, openli_pool_t *bodypool);
 #endif
 
 /* TODO consider adding free lists to these APIs to avoid excess mallocs */
@@ -69,7 +69,7 @@ int encode_ipmmcc(wandder_encoder_t *encoder,
 int encode_ipmmcc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *msg, wandder_etsili_child_t *child,
-        wandder_encoder_t *encoder) {
+        wandder_encoder_t *encoder, openli_pool_t *bodypool) {
 
     uint32_t liidlen = (uint32_t)((size_t)child->owner->preencoded[WANDDER_PREENCODE_LIID_LEN]);
 
@@ -84,7 +84,12 @@ int encode_ipmmcc_ber(
         job->dir, 
         child);
 
-    msg->msgbody = malloc(sizeof(wandder_encoded_result_t));
+    msg->msgbody = get_pooled_object(bodypool);
+    if (msg->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding IPMMCC record");
+        return -1;
+    }
 
     msg->msgbody->encoder = NULL;
     msg->msgbody->encoded = child->buf;
@@ -137,89 +142,225 @@ static inline uint8_t is_rtp_comfort_noise(libtrace_packet_t *packet) {
     return 0;
 }
 
-static inline int match_rtp_stream(rtpstreaminf_t *rtp, uint16_t porta,
-        uint16_t portb, struct sockaddr *ipa, struct sockaddr *ipb,
-        uint8_t *is_comfort, libtrace_packet_t *pkt) {
+static inline int copy_sockaddr_ip(int family, struct sockaddr *sa,
+        uint8_t *dest) {
+
+    if (family == AF_INET) {
+        memcpy(dest, &(((struct sockaddr_in *)sa)->sin_addr.s_addr), 4);
+        return 0;
+    }
 
-    struct sockaddr *tgt, *other;
+    if (family == AF_INET6) {
+        memcpy(dest, ((struct sockaddr_in6 *)sa)->sin6_addr.s6_addr, 16);
+        return 0;
+    }
+    return -1;
+}
+
+static inline int populate_rtp_5tuple(rtpstream_5tuple_t *key, int family,
+        struct sockaddr *tgt, uint16_t tgtport, struct sockaddr *other,
+        uint16_t otherport) {
+
+    memset(key, 0, sizeof(rtpstream_5tuple_t));
+    key->family = (uint16_t)family;
+    key->targetport = tgtport;
+    key->otherport = otherport;
+
+    if (copy_sockaddr_ip(family, tgt, key->targetip) < 0) {
+        return -1;
+    }
+    if (copy_sockaddr_ip(family, other, key->otherip) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void index_rtp_5tuple(colthread_local_t *loc, rtpstreaminf_t *rtp,
+        uint16_t tgtport, uint16_t otherport) {
+
+    rtpstream_5tuple_t key;
+    rtpstream_index_t *found;
     int i;
 
-    tgt = (struct sockaddr *)(rtp->targetaddr);
-    other = (struct sockaddr *)(rtp->otheraddr);
+    if (populate_rtp_5tuple(&key, rtp->ai_family,
+            (struct sockaddr *)rtp->targetaddr, tgtport,
+            (struct sockaddr *)rtp->otheraddr, otherport) < 0) {
+        return;
+    }
 
-    for (i = 0; i < rtp->streamcount; i++) {
+    HASH_FIND(hh, loc->rtpstreamindex, &key, sizeof(key), found);
+    if (!found) {
+        found = (rtpstream_index_t *)calloc(1, sizeof(rtpstream_index_t));
+        memcpy(&(found->key), &key, sizeof(key));
+        HASH_ADD(hh, loc->rtpstreamindex, key, sizeof(key), found);
+    }
 
-        if ((rtp->mediastreams[i].targetport == porta &&
-                rtp->mediastreams[i].otherport == portb) ||
-                (rtp->mediastreams[i].targetport + 1 == porta &&
-                rtp->mediastreams[i].otherport + 1 == portb)) {
+    for (i = 0; i < found->streamcount; i++) {
+        if (found->streams[i] == rtp) {
+            return;
+        }
+    }
 
-            if (sockaddr_match(rtp->ai_family, ipa, tgt) &&
-                    sockaddr_match(rtp->ai_family, ipb, other)) {
+    if (found->streamcount == found->alloced) {
+        found->alloced += 4;
+        found->streams = realloc(found->streams,
+                found->alloced * sizeof(rtpstreaminf_t *));
+    }
+    found->streams[found->streamcount] = rtp;
+    found->streamcount ++;
+}
 
-                if (rtp->skip_comfort) {
-                    if (*is_comfort == 255) {
-                        *is_comfort = is_rtp_comfort_noise(pkt);
-                    }
-                    if (*is_comfort == 1) {
-                        return 0;
-                    }
-                }
+static void unindex_rtp_5tuple(colthread_local_t *loc, rtpstreaminf_t *rtp,
+        uint16_t tgtport, uint16_t otherport) {
 
-                return 1;
-            }
+    rtpstream_5tuple_t key;
+    rtpstream_index_t *found;
+    int i;
+
+    if (populate_rtp_5tuple(&key, rtp->ai_family,
+            (struct sockaddr *)rtp->targetaddr, tgtport,
+            (struct sockaddr *)rtp->otheraddr, otherport) < 0) {
+        return;
+    }
+
+    HASH_FIND(hh, loc->rtpstreamindex, &key, sizeof(key), found);
+    if (!found) {
+        return;
+    }
+
+    for (i = 0; i < found->streamcount; i++) {
+        if (found->streams[i] == rtp) {
+            found->streams[i] = found->streams[found->streamcount - 1];
+            found->streamcount --;
+            break;
         }
     }
-    return 0;
+
+    if (found->streamcount == 0) {
+        HASH_DELETE(hh, loc->rtpstreamindex, found);
+        free(found->streams);
+        free(found);
+    }
 }
 
-static inline int generic_mm_comm_contents(int family, libtrace_packet_t *pkt,
-        packet_info_t *pinfo, colthread_local_t *loc) {
+void add_rtp_stream_to_index(colthread_local_t *loc, rtpstreaminf_t *rtp) {
+    int i;
+
+    if (rtp->targetaddr == NULL || rtp->otheraddr == NULL) {
+        return;
+    }
+
+    /* Index both the RTP ports and the RTCP ports (RTP port + 1) */
+    for (i = 0; i < rtp->streamcount; i++) {
+        index_rtp_5tuple(loc, rtp, rtp->mediastreams[i].targetport,
+                rtp->mediastreams[i].otherport);
+        index_rtp_5tuple(loc, rtp, rtp->mediastreams[i].targetport + 1,
+                rtp->mediastreams[i].otherport + 1);
+    }
+}
+
+void remove_rtp_stream_from_index(colthread_local_t *loc,
+        rtpstreaminf_t *rtp) {
+    int i;
+
+    if (rtp->targetaddr == NULL || rtp->otheraddr == NULL) {
+        return;
+    }
+
+    for (i = 0; i < rtp->streamcount; i++) {
+        unindex_rtp_5tuple(loc, rtp, rtp->mediastreams[i].targetport,
+                rtp->mediastreams[i].otherport);
+        unindex_rtp_5tuple(loc, rtp, rtp->mediastreams[i].targetport + 1,
+                rtp->mediastreams[i].otherport + 1);
+    }
+}
+
+void free_rtp_stream_index(colthread_local_t *loc) {
+    rtpstream_index_t *iter, *tmp;
+
+    HASH_ITER(hh, loc->rtpstreamindex, iter, tmp) {
+        HASH_DELETE(hh, loc->rtpstreamindex, iter);
+        free(iter->streams);
+        free(iter);
+    }
+}
+
+static inline int publish_matching_rtp_streams(rtpstream_index_t *found,
+        libtrace_packet_t *pkt, uint8_t *is_comfort, uint8_t dir,
+        colthread_local_t *loc) {
 
     openli_export_recv_t *msg;
-    rtpstreaminf_t *rtp, *tmp;
-    int matched = 0;
-    uint8_t is_comfort = 255;
+    rtpstreaminf_t *rtp;
+    int i, matched = 0;
+
+    for (i = 0; i < found->streamcount; i++) {
+        rtp = found->streams[i];
 
-    /* TODO change active RTP so we can look up by 5 tuple? */
-    HASH_ITER(hh, loc->activertpintercepts, rtp, tmp) {
         if (!rtp->active) {
             continue;
         }
 
-        if (rtp->targetaddr == NULL || rtp->otheraddr == NULL) {
-            continue;
+        if (rtp->skip_comfort) {
+            if (*is_comfort == 255) {
+                *is_comfort = is_rtp_comfort_noise(pkt);
+            }
+            if (*is_comfort == 1) {
+                continue;
+            }
         }
 
-        if (pinfo->family != rtp->ai_family) {
+        msg = create_ipcc_job(rtp->cin, rtp->common.liid,
+                rtp->common.destid, pkt, dir,
+                get_cc_packet_ref(loc, pkt), loc->ccjobpool);
+        if (msg == NULL) {
             continue;
         }
+        msg->type = OPENLI_EXPORT_IPMMCC;
+        publish_openli_msg(loc->zmq_pubsocks[rtp->common.seqtrackerid], msg);
+        matched ++;
+    }
+    return matched;
+}
 
-        /* Check for src = target, dest = other */
-        if (match_rtp_stream(rtp, pinfo->srcport, pinfo->destport,
-                (struct sockaddr *)(&pinfo->srcip),
-                (struct sockaddr *)(&pinfo->destip), &is_comfort, pkt)) {
+static inline int generic_mm_comm_contents(int family, libtrace_packet_t *pkt,
+        packet_info_t *pinfo, colthread_local_t *loc) {
 
-            msg = create_ipcc_job(rtp->cin, rtp->common.liid,
-                    rtp->common.destid, pkt, ETSI_DIR_FROM_TARGET);
-            msg->type = OPENLI_EXPORT_IPMMCC;
-            publish_openli_msg(loc->zmq_pubsocks[0], msg); // FIXME
-            matched ++;
-            continue;
-        }
+    rtpstream_5tuple_t fromkey, tokey;
+    rtpstream_index_t *found;
+    int matched = 0;
+    uint8_t is_comfort = 255;
+
+    if (loc->rtpstreamindex == NULL) {
+        return 0;
+    }
 
-        /* Check for dst = target, src = other */
-        if (match_rtp_stream(rtp, pinfo->destport, pinfo->srcport,
-                (struct sockaddr *)(&pinfo->destip),
-                (struct sockaddr *)(&pinfo->srcip), &is_comfort, pkt)) {
+    /* Check for src = target, dest = other */
+    if (populate_rtp_5tuple(&fromkey, family,
+            (struct sockaddr *)(&pinfo->srcip), pinfo->srcport,
+            (struct sockaddr *)(&pinfo->destip), pinfo->destport) < 0) {
+        return 0;
+    }
 
-            msg = create_ipcc_job(rtp->cin, rtp->common.liid,
-                    rtp->common.destid, pkt, ETSI_DIR_TO_TARGET);
-            msg->type = OPENLI_EXPORT_IPMMCC;
-            publish_openli_msg(loc->zmq_pubsocks[0], msg); // FIXME
-            matched ++;
-            continue;
-        }
+    HASH_FIND(hh, loc->rtpstreamindex, &fromkey, sizeof(fromkey), found);
+    if (found) {
+        matched += publish_matching_rtp_streams(found, pkt, &is_comfort,
+                ETSI_DIR_FROM_TARGET, loc);
+    }
+
+    /* Check for dst = target, src = other */
+    populate_rtp_5tuple(&tokey, family,
+            (struct sockaddr *)(&pinfo->destip), pinfo->destport,
+            (struct sockaddr *)(&pinfo->srcip), pinfo->srcport);
+
+    /* Don't intercept the same packet twice if both ends are identical */
+    if (memcmp(&fromkey, &tokey, sizeof(fromkey)) == 0) {
+        return matched;
+    }
+
+    HASH_FIND(hh, loc->rtpstreamindex, &tokey, sizeof(tokey), found);
+    if (found) {
+        matched += publish_matching_rtp_streams(found, pkt, &is_comfort,
+                ETSI_DIR_TO_TARGET, loc);
     }
 
     return matched;
@@ -40,11 +40,15 @@ int ip4mm_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
 int ip6mm_comm_contents(libtrace_packet_t *pkt, packet_info_t *pinfo,
         libtrace_ip6_t *ip6, uint32_t rem, colthread_local_t *loc);
 
+void add_rtp_stream_to_index(colthread_local_t *loc, rtpstreaminf_t *rtp);
+void remove_rtp_stream_from_index(colthread_local_t *loc, rtpstreaminf_t *rtp);
+void free_rtp_stream_index(colthread_local_t *loc);
+
 #ifdef HAVE_BER_ENCODING
 int encode_ipmmcc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *msg, wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder);
+        wandder_encoder_t *encoder, openli_pool_t *bodypool);
 #endif
 
 #endif
@@ -76,7 +76,7 @@ int encode_ipmmiri(wandder_encoder_t *encoder,
 int encode_ipmmiri_ber(
         openli_ipmmiri_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *res, wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder) {
+        wandder_encoder_t *encoder, openli_pool_t *bodypool) {
 
     uint32_t liidlen = (uint32_t)((size_t)child->owner->preencoded[WANDDER_PREENCODE_LIID_LEN]);
 
@@ -100,7 +100,12 @@ int encode_ipmmiri_ber(
             job->ipfamily,
             child);
 
-        res->msgbody = malloc(sizeof(wandder_encoded_result_t));
+        res->msgbody = get_pooled_object(bodypool);
+        if (res->msgbody == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: ran out of memory while encoding IPMMIRI record");
+            return -1;
+        }
 
         res->msgbody->encoder = NULL;
         res->msgbody->encoded = child->buf;
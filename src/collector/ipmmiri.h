@@ -50,7 +50,7 @@ int encode_ipmmiri(wandder_encoder_t *encoder,
 int encode_ipmmiri_ber(
         openli_ipmmiri_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *res, wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder);
+        wandder_encoder_t *encoder, openli_pool_t *bodypool);
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
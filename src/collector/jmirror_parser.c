@@ -63,7 +63,7 @@ static void push_jmirror_ipcc_job(colthread_local_t *loc,
 
     memcpy(msg->data.ipcc.ipcontent, l3, rem);
 
-    publish_openli_msg(loc->zmq_pubsocks[0], msg);  //FIXME
+    publish_openli_msg(loc->zmq_pubsocks[cept->common.seqtrackerid], msg);
 
 }
 
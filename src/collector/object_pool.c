@@ -0,0 +1,145 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <string.h>
+
+#include "object_pool.h"
+
+#define POOL_ITEM(obj) (((openli_pool_item_t *)(obj)) - 1)
+#define POOL_OBJECT(item) ((void *)(((openli_pool_item_t *)(item)) + 1))
+
+openli_pool_t *create_object_pool(size_t objsize, uint32_t maxavail,
+        void (*destructor)(void *obj)) {
+
+    openli_pool_t *pool;
+
+    pool = (openli_pool_t *)calloc(1, sizeof(openli_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->available = NULL;
+    pool->availcount = 0;
+    pool->maxavail = maxavail;
+    pool->returned = NULL;
+    pool->objsize = objsize;
+    pool->destructor = destructor;
+    return pool;
+}
+
+static inline void free_pool_item(openli_pool_t *pool,
+        openli_pool_item_t *item) {
+
+    if (pool->destructor) {
+        pool->destructor(POOL_OBJECT(item));
+    }
+    free(item);
+}
+
+static void reclaim_returned_objects(openli_pool_t *pool) {
+
+    openli_pool_item_t *item, *next;
+
+    /* Taking the whole stack in one go means we never pop individual
+     * items, so there is no ABA problem to worry about. */
+    item = __atomic_exchange_n(&(pool->returned), NULL, __ATOMIC_ACQUIRE);
+
+    while (item) {
+        next = item->next;
+        if (pool->availcount >= pool->maxavail) {
+            free_pool_item(pool, item);
+        } else {
+            item->next = pool->available;
+            pool->available = item;
+            pool->availcount ++;
+        }
+        item = next;
+    }
+}
+
+/* Must only be called by the thread that owns the pool.
+ *
+ * Recycled objects are returned as they were released, so that any buffers
+ * that they refer to can be reused. Newly allocated objects are zeroed.
+ * Returns NULL if a new object could not be allocated.
+ */
+void *get_pooled_object(openli_pool_t *pool) {
+
+    openli_pool_item_t *item;
+
+    if (pool->available == NULL) {
+        reclaim_returned_objects(pool);
+    }
+
+    if (pool->available) {
+        item = pool->available;
+        pool->available = item->next;
+        pool->availcount --;
+        return POOL_OBJECT(item);
+    }
+
+    item = (openli_pool_item_t *)calloc(1, sizeof(openli_pool_item_t) +
+            pool->objsize);
+    if (item == NULL) {
+        return NULL;
+    }
+    item->owner = pool;
+    return POOL_OBJECT(item);
+}
+
+/* Can be called by any thread */
+void release_pooled_object(void *obj) {
+
+    openli_pool_item_t *item = POOL_ITEM(obj);
+    openli_pool_t *pool = item->owner;
+
+    item->next = __atomic_load_n(&(pool->returned), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(pool->returned), &(item->next),
+                item, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Only call this once no other thread can release objects into the pool */
+void destroy_object_pool(openli_pool_t *pool) {
+
+    openli_pool_item_t *item, *next;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pool->maxavail = 0;
+    reclaim_returned_objects(pool);
+
+    item = pool->available;
+    while (item) {
+        next = item->next;
+        free_pool_item(pool, item);
+        item = next;
+    }
+    free(pool);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
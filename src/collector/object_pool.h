@@ -0,0 +1,69 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_OBJECT_POOL_H_
+#define OPENLI_OBJECT_POOL_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A pool of fixed-size objects that belongs to a single thread.
+ *
+ * Only the owning thread may take objects from the pool, but objects can
+ * be released from any thread -- released objects are pushed onto a
+ * lock-free stack and the owner reclaims them in bulk once its own
+ * freelist runs dry. This avoids handing memory back and forth between
+ * the malloc arenas of the threads that produce and consume our records.
+ */
+
+typedef struct openli_pool openli_pool_t;
+
+typedef struct openli_pool_item {
+    struct openli_pool_item *next;
+    openli_pool_t *owner;
+} openli_pool_item_t;
+
+struct openli_pool {
+    openli_pool_item_t *available;
+    uint32_t availcount;
+    uint32_t maxavail;
+
+    /* Objects released by other threads, waiting to be reclaimed */
+    openli_pool_item_t *returned;
+
+    size_t objsize;
+    void (*destructor)(void *obj);
+};
+
+openli_pool_t *create_object_pool(size_t objsize, uint32_t maxavail,
+        void (*destructor)(void *obj));
+void *get_pooled_object(openli_pool_t *pool);
+void release_pooled_object(void *obj);
+void destroy_object_pool(openli_pool_t *pool);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,348 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "util.h"
+#include "collector.h"
+#include "pipeline_stats.h"
+
+#define STATS_POLL_TIMEOUT 1000
+
+extern volatile int collector_halt;
+
+/* Each thread that publishes records keeps its own counter, so that the
+ * processing threads are never contending over a shared cache line. The
+ * counters are never removed from the list, so the total remains correct
+ * even after the thread that owned a counter has gone away.
+ */
+typedef struct published_counter published_counter_t;
+
+struct published_counter {
+    uint64_t count;
+    published_counter_t *next;
+};
+
+static published_counter_t *pubcounters = NULL;
+static pthread_mutex_t pubcounters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread published_counter_t *mypubcounter = NULL;
+
+void count_published_record(void) {
+
+    if (mypubcounter == NULL) {
+        mypubcounter = (published_counter_t *)calloc(1,
+                sizeof(published_counter_t));
+        if (mypubcounter == NULL) {
+            return;
+        }
+        pthread_mutex_lock(&pubcounters_mutex);
+        mypubcounter->next = pubcounters;
+        pubcounters = mypubcounter;
+        pthread_mutex_unlock(&pubcounters_mutex);
+    }
+    bump_stage_counter(&(mypubcounter->count));
+}
+
+uint64_t total_published_records(void) {
+    published_counter_t *c;
+    uint64_t total = 0;
+
+    pthread_mutex_lock(&pubcounters_mutex);
+    for (c = pubcounters; c != NULL; c = c->next) {
+        total += read_stage_counter(&(c->count));
+    }
+    pthread_mutex_unlock(&pubcounters_mutex);
+    return total;
+}
+
+void free_published_record_counters(void) {
+    published_counter_t *c, *next;
+
+    pthread_mutex_lock(&pubcounters_mutex);
+    c = pubcounters;
+    while (c) {
+        next = c->next;
+        free(c);
+        c = next;
+    }
+    pubcounters = NULL;
+    pthread_mutex_unlock(&pubcounters_mutex);
+}
+
+void merge_latency_hist(openli_latency_hist_t *dst,
+        openli_latency_hist_t *src) {
+
+    int i;
+    uint64_t max;
+
+    /* Acquire on total so that we see at least as many bucket updates as
+     * the total claims */
+    dst->total += __atomic_load_n(&(src->total), __ATOMIC_ACQUIRE);
+    for (i = 0; i < OPENLI_HIST_BUCKETS; i++) {
+        dst->counts[i] += __atomic_load_n(&(src->counts[i]),
+                __ATOMIC_RELAXED);
+    }
+    dst->sum += __atomic_load_n(&(src->sum), __ATOMIC_RELAXED);
+    max = __atomic_load_n(&(src->max), __ATOMIC_RELAXED);
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+static inline uint64_t bucket_upper_bound(uint32_t b) {
+    uint32_t shift;
+
+    if (b < OPENLI_HIST_SUBCOUNT) {
+        return b;
+    }
+    shift = (b >> OPENLI_HIST_SUBBITS) - 1;
+    return (((uint64_t)(OPENLI_HIST_SUBCOUNT +
+            (b & (OPENLI_HIST_SUBCOUNT - 1)))) << shift) +
+            ((1ULL << shift) - 1);
+}
+
+uint64_t latency_hist_percentile(openli_latency_hist_t *hist,
+        double percentile) {
+
+    uint64_t counted = 0, seen = 0, want, bound;
+    int i;
+
+    for (i = 0; i < OPENLI_HIST_BUCKETS; i++) {
+        counted += hist->counts[i];
+    }
+    if (counted == 0) {
+        return 0;
+    }
+
+    want = (uint64_t)((percentile / 100.0) * counted);
+    if (want == 0) {
+        want = 1;
+    }
+
+    for (i = 0; i < OPENLI_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= want) {
+            bound = bucket_upper_bound(i);
+            /* Don't report anything beyond what we've actually seen */
+            return bound > hist->max ? hist->max : bound;
+        }
+    }
+    return hist->max;
+}
+
+static void report_latency(FILE *out, const char *stage,
+        openli_latency_hist_t *hist) {
+
+    double mean = 0;
+
+    if (hist->total > 0) {
+        mean = ((double)hist->sum / hist->total) / 1000.0;
+    }
+
+    fprintf(out, "latency %-22s count %-12lu mean %10.1f p50 %10.1f p90 %10.1f p99 %10.1f p99.9 %10.1f max %10.1f\n",
+            stage, hist->total, mean,
+            latency_hist_percentile(hist, 50.0) / 1000.0,
+            latency_hist_percentile(hist, 90.0) / 1000.0,
+            latency_hist_percentile(hist, 99.0) / 1000.0,
+            latency_hist_percentile(hist, 99.9) / 1000.0,
+            hist->max / 1000.0);
+}
+
+static inline uint64_t queue_depth(uint64_t in, uint64_t out) {
+    /* The counters are read at slightly different times, so the consumer
+     * may appear to be ahead of the producer */
+    if (out >= in) {
+        return 0;
+    }
+    return in - out;
+}
+
+static void write_pipeline_report(collector_global_t *glob, FILE *out) {
+
+    openli_latency_hist_t *hists;
+    uint64_t published = 0, seqrecv = 0, seqsent = 0, encrecv = 0;
+    uint64_t encsent = 0, fwdrecv = 0;
+    openli_backlog_entry_t *backlog;
+    uint32_t i, j, count;
+    forwarding_thread_data_t *fwd;
+
+    /* capture->seqtracker, seqtracker->encoder, encoder->forwarder,
+     * forwarder->socket, capture->socket */
+    hists = (openli_latency_hist_t *)calloc(5, sizeof(openli_latency_hist_t));
+    if (hists == NULL) {
+        return;
+    }
+
+    for (i = 0; i < glob->seqtracker_threads; i++) {
+        merge_latency_hist(&(hists[0]), &(glob->seqtrackers[i].stats.latency));
+        seqrecv += read_stage_counter(&(glob->seqtrackers[i].stats.received));
+        seqsent += read_stage_counter(&(glob->seqtrackers[i].stats.sent));
+    }
+
+    for (i = 0; i < glob->encoding_threads; i++) {
+        merge_latency_hist(&(hists[1]), &(glob->encoders[i].stats.latency));
+        encrecv += read_stage_counter(&(glob->encoders[i].stats.received));
+        encsent += read_stage_counter(&(glob->encoders[i].stats.sent));
+    }
+
+    for (i = 0; i < glob->forwarding_threads; i++) {
+        merge_latency_hist(&(hists[2]), &(glob->forwarders[i].stats.latency));
+        merge_latency_hist(&(hists[3]), &(glob->forwarders[i].writelatency));
+        merge_latency_hist(&(hists[4]), &(glob->forwarders[i].endtoend));
+        fwdrecv += read_stage_counter(&(glob->forwarders[i].stats.received));
+    }
+
+    published = total_published_records();
+
+    fprintf(out, "# OpenLI collector pipeline statistics (latencies in microseconds)\n");
+    report_latency(out, "capture->seqtracker", &(hists[0]));
+    report_latency(out, "seqtracker->encoder", &(hists[1]));
+    report_latency(out, "encoder->forwarder", &(hists[2]));
+    report_latency(out, "forwarder->socket", &(hists[3]));
+    report_latency(out, "capture->socket", &(hists[4]));
+
+    fprintf(out, "queue %-24s depth %lu\n", "published->seqtracker",
+            queue_depth(published, seqrecv));
+    fprintf(out, "queue %-24s depth %lu\n", "seqtracker->encoder",
+            queue_depth(seqsent, encrecv));
+    fprintf(out, "queue %-24s depth %lu\n", "encoder->forwarder",
+            queue_depth(encsent, fwdrecv));
+
+    for (i = 0; i < glob->forwarding_threads; i++) {
+        fwd = &(glob->forwarders[i]);
+
+        pthread_mutex_lock(&(fwd->backlogmutex));
+        count = fwd->backlogcount;
+        backlog = NULL;
+        if (count > 0) {
+            backlog = (openli_backlog_entry_t *)calloc(count,
+                    sizeof(openli_backlog_entry_t));
+            if (backlog) {
+                memcpy(backlog, fwd->backlog,
+                        count * sizeof(openli_backlog_entry_t));
+            }
+        }
+        pthread_mutex_unlock(&(fwd->backlogmutex));
+
+        if (backlog == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < count; j++) {
+            fprintf(out, "mediator %-10u forwarder %-3u connected %-3s buffered %lu spilled %lu\n",
+                    backlog[j].mediatorid, i,
+                    backlog[j].connected ? "yes" : "no",
+                    backlog[j].buffered, backlog[j].spilled);
+        }
+        free(backlog);
+    }
+
+    free(hists);
+}
+
+static void serve_stats_request(collector_global_t *glob, int listenfd) {
+
+    int fd;
+    char *report = NULL;
+    size_t reportlen = 0, written = 0;
+    ssize_t ret;
+    FILE *out;
+
+    fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    out = open_memstream(&report, &reportlen);
+    if (out == NULL) {
+        close(fd);
+        return;
+    }
+    write_pipeline_report(glob, out);
+    fclose(out);
+
+    while (written < reportlen) {
+        ret = write(fd, report + written, reportlen - written);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += ret;
+    }
+
+    free(report);
+    close(fd);
+}
+
+void *start_pipeline_stats_thread(void *data) {
+
+    collector_global_t *glob = (collector_global_t *)data;
+    struct pollfd pfd;
+    int listenfd;
+
+    listenfd = create_listener("127.0.0.1", glob->statsport,
+            "pipeline statistics");
+    if (listenfd < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to start pipeline statistics listener on port %s",
+                glob->statsport);
+        pthread_exit(NULL);
+    }
+
+    while (!collector_halt) {
+        pfd.fd = listenfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, STATS_POLL_TIMEOUT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_INFO,
+                    "OpenLI: error while polling pipeline statistics listener: %s",
+                    strerror(errno));
+            break;
+        }
+
+        if (pfd.revents & POLLIN) {
+            serve_stats_request(glob, listenfd);
+        }
+    }
+
+    close(listenfd);
+    pthread_exit(NULL);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
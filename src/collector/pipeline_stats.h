@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_PIPELINE_STATS_H_
+#define OPENLI_PIPELINE_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Log-linear latency histogram, in the style of HdrHistogram: every
+ * power-of-two range of values is split into OPENLI_HIST_SUBCOUNT equal
+ * buckets, so any recorded value is known to within 1/8th of itself.
+ *
+ * Each histogram has exactly one writer (the thread that owns it), so
+ * updates are plain relaxed stores that other threads can read at any
+ * time without locking.
+ */
+#define OPENLI_HIST_SUBBITS 3
+#define OPENLI_HIST_SUBCOUNT (1 << OPENLI_HIST_SUBBITS)
+#define OPENLI_HIST_BUCKETS ((64 - OPENLI_HIST_SUBBITS + 1) * \
+        OPENLI_HIST_SUBCOUNT)
+
+/* Number of records per mediator that we can track on their way through
+ * the export buffer at any one time -- records appended while the ring is
+ * full are simply not sampled.
+ */
+#define OPENLI_WRITE_MARK_RING_SIZE 1024
+
+typedef struct openli_latency_hist {
+    uint64_t counts[OPENLI_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} openli_latency_hist_t;
+
+typedef struct openli_stage_stats {
+    /* Time taken by records to arrive at this stage from the previous one */
+    openli_latency_hist_t latency;
+
+    /* Records received from the previous stage and passed on to the next */
+    uint64_t received;
+    uint64_t sent;
+} openli_stage_stats_t;
+
+/* A sampled record sitting in a mediator's export buffer */
+typedef struct openli_write_mark {
+    uint64_t endoffset;
+    uint64_t arrivedns;
+    uint64_t capturens;
+} openli_write_mark_t;
+
+typedef struct openli_backlog_entry {
+    uint32_t mediatorid;
+    uint8_t connected;
+    uint64_t buffered;
+    uint64_t spilled;
+} openli_backlog_entry_t;
+
+static inline uint64_t openli_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static inline uint64_t openli_wallclock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static inline uint64_t timeval_to_ns(struct timeval *tv) {
+    return ((uint64_t)tv->tv_sec * 1000000000ULL) +
+            ((uint64_t)tv->tv_usec * 1000);
+}
+
+static inline uint32_t latency_bucket(uint64_t val) {
+    uint32_t msb;
+
+    if (val < OPENLI_HIST_SUBCOUNT) {
+        return (uint32_t)val;
+    }
+    msb = 63 - __builtin_clzll(val);
+    return ((msb - OPENLI_HIST_SUBBITS + 1) << OPENLI_HIST_SUBBITS) +
+            ((val >> (msb - OPENLI_HIST_SUBBITS)) &
+            (OPENLI_HIST_SUBCOUNT - 1));
+}
+
+static inline void record_latency(openli_latency_hist_t *hist, uint64_t val) {
+    uint32_t b = latency_bucket(val);
+
+    __atomic_store_n(&(hist->counts[b]), hist->counts[b] + 1,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&(hist->sum), hist->sum + val, __ATOMIC_RELAXED);
+    if (val > hist->max) {
+        __atomic_store_n(&(hist->max), val, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&(hist->total), hist->total + 1, __ATOMIC_RELEASE);
+}
+
+/* Records the time elapsed since 'then', ignoring timestamps that are
+ * missing or appear to be from the future */
+static inline void record_latency_since(openli_latency_hist_t *hist,
+        uint64_t then, uint64_t now) {
+
+    if (then == 0 || now < then) {
+        return;
+    }
+    record_latency(hist, now - then);
+}
+
+static inline void bump_stage_counter(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline void add_stage_counter(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t read_stage_counter(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void merge_latency_hist(openli_latency_hist_t *dst,
+        openli_latency_hist_t *src);
+uint64_t latency_hist_percentile(openli_latency_hist_t *hist,
+        double percentile);
+void count_published_record(void);
+uint64_t total_published_records(void);
+void free_published_record_counters(void);
+void *start_pipeline_stats_thread(void *data);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,185 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "intercept.h"
+#include "coreserver.h"
+#include "push_batch.h"
+
+/* Releases whatever a pushed message owns, for messages that will never
+ * reach the processing thread that they were intended for */
+static void free_pushed_message(openli_pushed_t *msg) {
+
+    /* Every payload is a pointer, so any member will do for this check */
+    if (msg->data.ipsess == NULL) {
+        return;
+    }
+
+    switch(msg->type) {
+        case OPENLI_PUSH_IPINTERCEPT:
+        case OPENLI_PUSH_HALT_IPINTERCEPT:
+            free_single_ipsession(msg->data.ipsess);
+            break;
+        case OPENLI_PUSH_IPMMINTERCEPT:
+            free_single_rtpstream(msg->data.ipmmint);
+            break;
+        case OPENLI_PUSH_HALT_IPMMINTERCEPT:
+            free(msg->data.rtpstreamkey);
+            break;
+        case OPENLI_PUSH_CORESERVER:
+        case OPENLI_PUSH_REMOVE_CORESERVER:
+            free_single_coreserver(msg->data.coreserver);
+            break;
+        case OPENLI_PUSH_VENDMIRROR_INTERCEPT:
+        case OPENLI_PUSH_HALT_VENDMIRROR_INTERCEPT:
+            free_single_vendmirror_intercept(msg->data.mirror);
+            break;
+        case OPENLI_PUSH_IPRANGE:
+        case OPENLI_PUSH_REMOVE_IPRANGE:
+        case OPENLI_PUSH_MODIFY_IPRANGE:
+            free_single_staticipsession(msg->data.iprange);
+            break;
+    }
+}
+
+static void free_batch(openli_pushed_batch_t *batch) {
+
+    uint32_t i;
+
+    if (batch == NULL) {
+        return;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        free_pushed_message(&(batch->msgs[i]));
+    }
+    free(batch);
+}
+
+static void send_batch(libtrace_message_queue_t *q,
+        openli_pushed_batch_t *batch) {
+
+    openli_pushed_t msg;
+
+    /* Not worth wrapping a single message */
+    if (batch->count == 1) {
+        libtrace_message_queue_put(q, (void *)&(batch->msgs[0]));
+        free(batch);
+        return;
+    }
+
+    memset(&msg, 0, sizeof(openli_pushed_t));
+    msg.type = OPENLI_PUSH_BATCH;
+    msg.data.batch = batch;
+    libtrace_message_queue_put(q, (void *)(&msg));
+}
+
+void batch_pushed_message(push_batcher_t **batchers,
+        libtrace_message_queue_t *q, openli_pushed_t *msg) {
+
+    push_batcher_t *b;
+
+    HASH_FIND_PTR(*batchers, &q, b);
+    if (b == NULL) {
+        b = (push_batcher_t *)calloc(1, sizeof(push_batcher_t));
+        b->q = q;
+        HASH_ADD_PTR(*batchers, q, b);
+    }
+
+    if (b->batch == NULL) {
+        b->batch = (openli_pushed_batch_t *)malloc(
+                sizeof(openli_pushed_batch_t));
+        if (b->batch == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: ran out of memory while batching messages for processing threads.");
+            libtrace_message_queue_put(q, (void *)msg);
+            return;
+        }
+        b->batch->count = 0;
+    }
+
+    b->batch->msgs[b->batch->count] = *msg;
+    b->batch->count ++;
+
+    if (b->batch->count == OPENLI_PUSH_BATCH_SIZE) {
+        send_batch(q, b->batch);
+        b->batch = NULL;
+    }
+}
+
+void flush_pushed_batches(push_batcher_t **batchers,
+        sync_thread_global_t *glob) {
+
+    push_batcher_t *b, *tmp;
+    sync_sendq_t *sendq, *tmp2;
+    int registered;
+
+    if (*batchers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(glob->mutex));
+    HASH_ITER(hh, *batchers, b, tmp) {
+        /* Make sure the processing thread hasn't gone away since we
+         * started batching messages for it */
+        registered = 0;
+        HASH_ITER(hh, (sync_sendq_t *)(glob->collector_queues), sendq, tmp2) {
+            if (sendq->q == b->q) {
+                registered = 1;
+                break;
+            }
+        }
+
+        if (!registered) {
+            HASH_DELETE(hh, *batchers, b);
+            free_batch(b->batch);
+            free(b);
+            continue;
+        }
+
+        if (b->batch) {
+            send_batch(b->q, b->batch);
+            b->batch = NULL;
+        }
+    }
+    pthread_mutex_unlock(&(glob->mutex));
+}
+
+void free_pushed_batches(push_batcher_t **batchers) {
+
+    push_batcher_t *b, *tmp;
+
+    HASH_ITER(hh, *batchers, b, tmp) {
+        HASH_DELETE(hh, *batchers, b);
+        free_batch(b->batch);
+        free(b);
+    }
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
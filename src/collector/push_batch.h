@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_PUSH_BATCH_H_
+#define OPENLI_PUSH_BATCH_H_
+
+#include <libtrace/message_queue.h>
+#include <uthash.h>
+#include "collector.h"
+
+/* Messages pushed by a sync thread are collected into per-queue batches
+ * and only handed over to the processing threads when the batches are
+ * flushed (or fill up). Every message that a sync thread sends to a
+ * processing thread must go through its batcher, otherwise the messages
+ * can arrive out of order.
+ */
+
+typedef struct push_batcher {
+    libtrace_message_queue_t *q;
+    openli_pushed_batch_t *batch;
+    UT_hash_handle hh;
+} push_batcher_t;
+
+void batch_pushed_message(push_batcher_t **batchers,
+        libtrace_message_queue_t *q, openli_pushed_t *msg);
+void flush_pushed_batches(push_batcher_t **batchers,
+        sync_thread_global_t *glob);
+void free_pushed_batches(push_batcher_t **batchers);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,306 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+#include "shared_ipv4.h"
+
+shared_ipv4_table_t *create_shared_ipv4_table(int readercount) {
+
+    shared_ipv4_table_t *table;
+    int i;
+
+    table = (shared_ipv4_table_t *)calloc(1, sizeof(shared_ipv4_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->buckets = (shared_ipv4_bucket_t **)calloc(
+            1 << SHARED_IPV4_BUCKET_BITS, sizeof(shared_ipv4_bucket_t *));
+    if (posix_memalign((void **)&(table->readers), 64,
+            readercount * sizeof(shared_ipv4_reader_t)) != 0) {
+        table->readers = NULL;
+    }
+
+    if (table->buckets == NULL || table->readers == NULL) {
+        free(table->buckets);
+        free(table->readers);
+        free(table);
+        return NULL;
+    }
+
+    /* Readers are treated as offline until they start processing packets */
+    for (i = 0; i < readercount; i++) {
+        table->readers[i].epoch = SHARED_IPV4_OFFLINE;
+    }
+    table->readercount = readercount;
+    table->epoch = 0;
+    table->retired = NULL;
+    table->retiredtail = NULL;
+    table->sessions = 0;
+    pthread_mutex_init(&(table->writelock), NULL);
+    return table;
+}
+
+static void free_retired(shared_ipv4_retired_t *ret) {
+    if (ret->bucket) {
+        free(ret->bucket);
+    }
+    if (ret->sess) {
+        free_single_ipsession(ret->sess);
+    }
+    free(ret);
+}
+
+void destroy_shared_ipv4_table(shared_ipv4_table_t *table) {
+
+    shared_ipv4_retired_t *ret;
+    shared_ipv4_bucket_t *bucket;
+    uint32_t i, j;
+
+    if (table == NULL) {
+        return;
+    }
+
+    while (table->retired) {
+        ret = table->retired;
+        table->retired = ret->next;
+        free_retired(ret);
+    }
+
+    for (i = 0; i < (1 << SHARED_IPV4_BUCKET_BITS); i++) {
+        bucket = table->buckets[i];
+        if (bucket == NULL) {
+            continue;
+        }
+        for (j = 0; j < bucket->count; j++) {
+            free_single_ipsession(bucket->entries[j].sess);
+        }
+        free(bucket);
+    }
+
+    free(table->buckets);
+    free(table->readers);
+    pthread_mutex_destroy(&(table->writelock));
+    free(table);
+}
+
+/* Hands a bucket (and optionally a session) that readers may still be
+ * looking at over to the reclaimer. Bumping the epoch afterwards means
+ * any reader that reports a later epoch can no longer see them.
+ */
+static void retire(shared_ipv4_table_t *table, shared_ipv4_bucket_t *bucket,
+        ipsession_t *sess) {
+
+    shared_ipv4_retired_t *ret;
+
+    if (bucket == NULL && sess == NULL) {
+        return;
+    }
+
+    ret = (shared_ipv4_retired_t *)malloc(sizeof(shared_ipv4_retired_t));
+    if (ret == NULL) {
+        /* Leaking is the only safe option if we can't track it */
+        logger(LOG_INFO, "OpenLI: ran out of memory while retiring shared IPv4 intercept state.");
+        return;
+    }
+    ret->epoch = __atomic_fetch_add(&(table->epoch), 1, __ATOMIC_SEQ_CST);
+    ret->bucket = bucket;
+    ret->sess = sess;
+    ret->next = NULL;
+
+    if (table->retiredtail) {
+        table->retiredtail->next = ret;
+    } else {
+        table->retired = ret;
+    }
+    table->retiredtail = ret;
+}
+
+void shared_ipv4_reclaim(shared_ipv4_table_t *table) {
+
+    uint64_t oldest = SHARED_IPV4_OFFLINE;
+    uint64_t seen;
+    shared_ipv4_retired_t *ret;
+    int i;
+
+    pthread_mutex_lock(&(table->writelock));
+    if (table->retired == NULL) {
+        pthread_mutex_unlock(&(table->writelock));
+        return;
+    }
+
+    for (i = 0; i < table->readercount; i++) {
+        seen = __atomic_load_n(&(table->readers[i].epoch), __ATOMIC_SEQ_CST);
+        if (seen < oldest) {
+            oldest = seen;
+        }
+    }
+
+    /* Retired entries are in epoch order, so stop at the first one that
+     * a reader might still be using */
+    while (table->retired && table->retired->epoch < oldest) {
+        ret = table->retired;
+        table->retired = ret->next;
+        free_retired(ret);
+    }
+
+    if (table->retired == NULL) {
+        table->retiredtail = NULL;
+    }
+    pthread_mutex_unlock(&(table->writelock));
+}
+
+static inline uint32_t session_v4_address(ipsession_t *sess) {
+    return ((struct sockaddr_in *)(sess->targetip))->sin_addr.s_addr;
+}
+
+static int add_session(shared_ipv4_table_t *table, ipsession_t *sess) {
+
+    shared_ipv4_bucket_t *old, *bucket;
+    uint32_t address, ind, i, count = 0;
+
+    if (sess->targetip == NULL) {
+        logger(LOG_INFO, "OpenLI: attempted to add IPv4 intercept but target IP was NULL?");
+        return -1;
+    }
+
+    address = session_v4_address(sess);
+    ind = SHARED_IPV4_BUCKET_INDEX(address);
+    old = table->buckets[ind];
+
+    if (old) {
+        count = old->count;
+        for (i = 0; i < count; i++) {
+            if (old->entries[i].address == address &&
+                    strcmp(old->entries[i].sess->streamkey,
+                        sess->streamkey) == 0) {
+                /* Already intercepting this session */
+                return 0;
+            }
+        }
+    }
+
+    bucket = (shared_ipv4_bucket_t *)malloc(sizeof(shared_ipv4_bucket_t) +
+            (count + 1) * sizeof(shared_ipv4_entry_t));
+    if (bucket == NULL) {
+        logger(LOG_INFO, "OpenLI: ran out of memory while adding IPv4 intercept address.");
+        return -1;
+    }
+
+    if (old) {
+        memcpy(bucket->entries, old->entries,
+                count * sizeof(shared_ipv4_entry_t));
+    }
+    bucket->entries[count].address = address;
+    bucket->entries[count].sess = sess;
+    bucket->count = count + 1;
+
+    __atomic_store_n(&(table->buckets[ind]), bucket, __ATOMIC_RELEASE);
+    retire(table, old, NULL);
+    table->sessions ++;
+    return 1;
+}
+
+static int remove_session(shared_ipv4_table_t *table, ipsession_t *torem) {
+
+    shared_ipv4_bucket_t *old, *bucket = NULL;
+    ipsession_t *found = NULL;
+    uint32_t address, ind, i, j;
+
+    if (torem->targetip == NULL) {
+        logger(LOG_INFO, "OpenLI: attempted to remove IPv4 intercept but target IP was NULL?");
+        return -1;
+    }
+
+    address = session_v4_address(torem);
+    ind = SHARED_IPV4_BUCKET_INDEX(address);
+    old = table->buckets[ind];
+
+    if (old == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < old->count; i++) {
+        if (old->entries[i].address == address &&
+                strcmp(old->entries[i].sess->streamkey,
+                    torem->streamkey) == 0) {
+            found = old->entries[i].sess;
+            break;
+        }
+    }
+
+    if (found == NULL) {
+        return 0;
+    }
+
+    if (old->count > 1) {
+        bucket = (shared_ipv4_bucket_t *)malloc(sizeof(shared_ipv4_bucket_t) +
+                (old->count - 1) * sizeof(shared_ipv4_entry_t));
+        if (bucket == NULL) {
+            logger(LOG_INFO, "OpenLI: ran out of memory while removing IPv4 intercept address.");
+            return -1;
+        }
+        for (i = 0, j = 0; i < old->count; i++) {
+            if (old->entries[i].sess != found) {
+                bucket->entries[j] = old->entries[i];
+                j++;
+            }
+        }
+        bucket->count = old->count - 1;
+    }
+
+    __atomic_store_n(&(table->buckets[ind]), bucket, __ATOMIC_RELEASE);
+    retire(table, old, found);
+    table->sessions --;
+    return 1;
+}
+
+int shared_ipv4_add_session(shared_ipv4_table_t *table, ipsession_t *sess) {
+    int ret;
+
+    pthread_mutex_lock(&(table->writelock));
+    ret = add_session(table, sess);
+    pthread_mutex_unlock(&(table->writelock));
+    return ret;
+}
+
+int shared_ipv4_remove_session(shared_ipv4_table_t *table,
+        ipsession_t *torem) {
+    int ret;
+
+    pthread_mutex_lock(&(table->writelock));
+    ret = remove_session(table, torem);
+    pthread_mutex_unlock(&(table->writelock));
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,130 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_SHARED_IPV4_H_
+#define OPENLI_SHARED_IPV4_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "intercept.h"
+
+/* A single table of active IPv4 intercept sessions that is shared by all
+ * of the packet processing threads.
+ *
+ * The IP sync threads are the only writers (and take turns using
+ * writelock). Each bucket is an immutable array of sessions: to change a
+ * bucket, the writer builds a new copy and swaps the bucket pointer, then
+ * retires the old array (and any removed sessions). Readers never take a lock -- instead, each reader reports
+ * the table epoch at a point where it holds no references into the table
+ * (i.e. every tick), and retired memory is only freed once every reader
+ * has moved past the epoch in which it was retired.
+ *
+ * Only IPv4 sessions live here, because they are matched on an exact
+ * address and so fit a flat hash of copy-on-write buckets. The rest of
+ * the intercept state is still kept separately by each processing thread:
+ *  - IPv6 sessions are matched by prefix, using a longest-prefix walk of
+ *    a patricia tree that is modified in place.
+ *  - Static ranges already use a read-only LPM per thread, and they
+ *    rarely change.
+ *  - RTP streams have their 5-tuple index updated in place as SDP
+ *    changes.
+ *  - Vendor mirror intercepts are few, and are keyed on session ID.
+ * Sharing any of these would need its own reclaimable structure.
+ */
+
+#define SHARED_IPV4_BUCKET_BITS 16
+#define SHARED_IPV4_OFFLINE ((uint64_t)-1)
+#define SHARED_IPV4_BUCKET_INDEX(addr) \
+        (((addr) * 2654435761U) >> (32 - SHARED_IPV4_BUCKET_BITS))
+
+typedef struct shared_ipv4_entry {
+    uint32_t address;
+    ipsession_t *sess;
+} shared_ipv4_entry_t;
+
+typedef struct shared_ipv4_bucket {
+    uint32_t count;
+    shared_ipv4_entry_t entries[];
+} shared_ipv4_bucket_t;
+
+typedef struct shared_ipv4_reader {
+    uint64_t epoch;
+} __attribute__((aligned(64))) shared_ipv4_reader_t;
+
+typedef struct shared_ipv4_retired {
+    uint64_t epoch;
+    shared_ipv4_bucket_t *bucket;
+    ipsession_t *sess;
+    struct shared_ipv4_retired *next;
+} shared_ipv4_retired_t;
+
+typedef struct shared_ipv4_table {
+    shared_ipv4_bucket_t **buckets;
+    uint64_t epoch;
+
+    shared_ipv4_reader_t *readers;
+    int readercount;
+
+    /* Only touched by a writer holding writelock */
+    pthread_mutex_t writelock;
+    shared_ipv4_retired_t *retired;
+    shared_ipv4_retired_t *retiredtail;
+    uint64_t sessions;
+} shared_ipv4_table_t;
+
+shared_ipv4_table_t *create_shared_ipv4_table(int readercount);
+void destroy_shared_ipv4_table(shared_ipv4_table_t *table);
+
+/* Writer API */
+int shared_ipv4_add_session(shared_ipv4_table_t *table, ipsession_t *sess);
+int shared_ipv4_remove_session(shared_ipv4_table_t *table,
+        ipsession_t *torem);
+void shared_ipv4_reclaim(shared_ipv4_table_t *table);
+
+/* Reader API */
+static inline shared_ipv4_bucket_t *shared_ipv4_lookup(
+        shared_ipv4_table_t *table, uint32_t address) {
+
+    return __atomic_load_n(&(table->buckets[SHARED_IPV4_BUCKET_INDEX(address)]),
+            __ATOMIC_ACQUIRE);
+}
+
+static inline void shared_ipv4_quiescent(shared_ipv4_table_t *table,
+        int readerid) {
+    __atomic_store_n(&(table->readers[readerid].epoch),
+            __atomic_load_n(&(table->epoch), __ATOMIC_SEQ_CST),
+            __ATOMIC_SEQ_CST);
+}
+
+static inline void shared_ipv4_offline(shared_ipv4_table_t *table,
+        int readerid) {
+    __atomic_store_n(&(table->readers[readerid].epoch), SHARED_IPV4_OFFLINE,
+            __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
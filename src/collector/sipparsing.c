@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <libtrace.h>
 #include <osip2/osip.h>
 #include <osipparser2/osip_message.h>
@@ -109,7 +110,7 @@ char *get_sip_contents(openli_sip_parser_t *p, uint16_t *siplen) {
     return p->sipmessage + p->sipoffset;
 }
 
-int parse_next_sip_message(openli_sip_parser_t *p,
+int get_next_sip_message(openli_sip_parser_t *p,
         libtrace_packet_t *packet) {
 
     int ret;
@@ -144,6 +145,13 @@ int parse_next_sip_message(openli_sip_parser_t *p,
         }
     }
 
+    return 1;
+}
+
+int parse_sip_message(openli_sip_parser_t *p) {
+
+    int ret;
+
     osip_message_init(&(p->osip));
     ret = osip_message_parse(p->osip,
             (const char *)(p->sipmessage + p->sipoffset), p->siplen);
@@ -156,6 +164,244 @@ int parse_next_sip_message(openli_sip_parser_t *p,
     return 1;
 }
 
+int parse_next_sip_message(openli_sip_parser_t *p,
+        libtrace_packet_t *packet) {
+
+    int ret;
+
+    ret = get_next_sip_message(p, packet);
+    if (ret <= 0) {
+        return ret;
+    }
+    return parse_sip_message(p);
+}
+
+/* Trims leading and trailing whitespace from a header value */
+static inline void trim_sip_value(const char **start, const char **end) {
+    while (*start < *end && (**start == ' ' || **start == '\t')) {
+        (*start) ++;
+    }
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t' ||
+                (*end)[-1] == '\r')) {
+        (*end) --;
+    }
+}
+
+/* Finds the user portion of the URI in a To: header value, using the
+ * same rules as libosip (i.e. the bit between the scheme and any
+ * password or the '@').
+ */
+static int scan_to_username(openli_sip_scan_t *scan, const char *start,
+        const char *end) {
+
+    const char *uri, *uriend, *c, *at;
+
+    if (start < end && *start == '"') {
+        /* Skip the quoted display name, in case it contains a '<' */
+        c = memchr(start + 1, '"', end - (start + 1));
+        if (c == NULL) {
+            return -1;
+        }
+        start = c + 1;
+    }
+
+    uri = memchr(start, '<', end - start);
+    if (uri) {
+        uri ++;
+        uriend = memchr(uri, '>', end - uri);
+        if (uriend == NULL) {
+            return -1;
+        }
+    } else {
+        uri = start;
+        uriend = memchr(start, ';', end - start);
+        if (uriend == NULL) {
+            uriend = end;
+        }
+    }
+
+    c = memchr(uri, ':', uriend - uri);
+    if (c == NULL) {
+        return -1;
+    }
+    c ++;
+
+    at = memchr(c, '@', uriend - c);
+    if (at == NULL) {
+        /* No user part -- leave it to libosip to decide what to do */
+        return -1;
+    }
+
+    scan->touser = c;
+    while (c < at && *c != ':') {
+        if (*c == '%') {
+            /* Escaped usernames get unescaped by libosip, so we can't
+             * compare them directly */
+            return -1;
+        }
+        c ++;
+    }
+    scan->touserlen = c - scan->touser;
+    return 0;
+}
+
+/* Finds the username parameter in an Authorization or Proxy-Authorization
+ * header value, without the surrounding quotes.
+ */
+static int scan_auth_username(openli_sip_scan_t *scan, const char *start,
+        const char *end) {
+
+    const char *c = start, *uend;
+
+    while (c + 9 <= end) {
+        if (strncasecmp(c, "username", 8) == 0 &&
+                (c == start || c[-1] == ' ' || c[-1] == ',' ||
+                 c[-1] == '\t')) {
+            c += 8;
+            while (c < end && (*c == ' ' || *c == '\t')) {
+                c ++;
+            }
+            if (c >= end || *c != '=') {
+                continue;
+            }
+            c ++;
+            while (c < end && (*c == ' ' || *c == '\t')) {
+                c ++;
+            }
+            if (c < end && *c == '"') {
+                c ++;
+                uend = memchr(c, '"', end - c);
+                if (uend == NULL) {
+                    return -1;
+                }
+            } else {
+                uend = c;
+                while (uend < end && *uend != ',' && *uend != ' ') {
+                    uend ++;
+                }
+            }
+
+            if (scan->authcount == SIP_SCAN_MAX_AUTH) {
+                return -1;
+            }
+            scan->authusers[scan->authcount] = c;
+            scan->authuserlens[scan->authcount] = uend - c;
+            scan->authcount ++;
+            return 0;
+        }
+        c ++;
+    }
+
+    /* No username in this header, so libosip will complain about it */
+    return -1;
+}
+
+static inline int sip_header_is(const char *name, size_t namelen,
+        const char *full, const char *compact) {
+
+    if (namelen == strlen(full) && strncasecmp(name, full, namelen) == 0) {
+        return 1;
+    }
+    if (compact && namelen == 1 && (*name | 0x20) == *compact) {
+        return 1;
+    }
+    return 0;
+}
+
+int scan_sip_headers(openli_sip_parser_t *p, openli_sip_scan_t *scan) {
+
+    const char *msg = (const char *)(p->sipmessage + p->sipoffset);
+    const char *end = msg + p->siplen;
+    const char *line, *eol, *colon, *vstart, *vend, *sp;
+    size_t namelen;
+
+    memset(scan, 0, sizeof(openli_sip_scan_t));
+
+    if (p->sipmessage == NULL || p->siplen == 0) {
+        return -1;
+    }
+
+    /* Request line: METHOD sip:uri SIP/2.0, or a status line for responses */
+    eol = memchr(msg, '\n', end - msg);
+    if (eol == NULL) {
+        return -1;
+    }
+    if (eol - msg > 8 && memcmp(msg, "SIP/2.0 ", 8) == 0) {
+        scan->method = NULL;
+    } else {
+        sp = memchr(msg, ' ', eol - msg);
+        if (sp == NULL) {
+            return -1;
+        }
+        scan->method = msg;
+        scan->methodlen = sp - msg;
+    }
+
+    line = eol + 1;
+    while (line < end) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        if (*line == '\r' || *line == '\n') {
+            /* Blank line, end of the headers */
+            break;
+        }
+
+        if (*line == ' ' || *line == '\t') {
+            /* Folded header -- rare enough to just let libosip deal
+             * with it */
+            return -1;
+        }
+
+        colon = memchr(line, ':', eol - line);
+        if (colon == NULL) {
+            return -1;
+        }
+
+        namelen = colon - line;
+        while (namelen > 0 && (line[namelen - 1] == ' ' ||
+                    line[namelen - 1] == '\t')) {
+            namelen --;
+        }
+
+        vstart = colon + 1;
+        vend = eol;
+        trim_sip_value(&vstart, &vend);
+
+        if (sip_header_is(line, namelen, "Call-ID", "i")) {
+            /* libosip splits the Call-ID at the '@' and we only track the
+             * first part */
+            scan->callid = vstart;
+            sp = memchr(vstart, '@', vend - vstart);
+            scan->callidlen = (sp ? sp : vend) - vstart;
+        } else if (sip_header_is(line, namelen, "To", "t")) {
+            if (scan_to_username(scan, vstart, vend) < 0) {
+                return -1;
+            }
+        } else if (sip_header_is(line, namelen, "CSeq", NULL)) {
+            sp = memchr(vstart, ' ', vend - vstart);
+            if (sp) {
+                scan->cseqmethod = sp + 1;
+                scan->cseqmethodlen = vend - (sp + 1);
+            }
+        } else if (sip_header_is(line, namelen, "Authorization", NULL) ||
+                sip_header_is(line, namelen, "Proxy-Authorization", NULL)) {
+            if (scan_auth_username(scan, vstart, vend) < 0) {
+                return -1;
+            }
+        }
+
+        line = eol + 1;
+    }
+
+    if (scan->callid == NULL || scan->callidlen == 0) {
+        return -1;
+    }
+    return 0;
+}
+
 
 static int _add_sip_packet(openli_sip_parser_t *p, libtrace_packet_t *packet,
         struct timeval *tv) {
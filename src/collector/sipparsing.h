@@ -86,10 +86,32 @@ typedef struct openli_sip_parser {
 
 } openli_sip_parser_t;
 
+#define SIP_SCAN_MAX_AUTH 4
+
+/* Header fields located by scan_sip_headers(). These point directly into
+ * the SIP message and are NOT null-terminated. */
+typedef struct openli_sip_scan {
+    const char *method;         /* NULL if the message is a response */
+    uint16_t methodlen;
+    const char *callid;
+    uint16_t callidlen;
+    const char *touser;         /* NULL if there was no To: header */
+    uint16_t touserlen;
+    const char *cseqmethod;
+    uint16_t cseqmethodlen;
+    const char *authusers[SIP_SCAN_MAX_AUTH];
+    uint16_t authuserlens[SIP_SCAN_MAX_AUTH];
+    uint8_t authcount;
+} openli_sip_scan_t;
+
 int add_sip_packet_to_parser(openli_sip_parser_t **parser,
         libtrace_packet_t *packet, uint8_t logallowed);
+int get_next_sip_message(openli_sip_parser_t *parser,
+        libtrace_packet_t *packet);
+int parse_sip_message(openli_sip_parser_t *parser);
 int parse_next_sip_message(openli_sip_parser_t *parser,
         libtrace_packet_t *packet);
+int scan_sip_headers(openli_sip_parser_t *parser, openli_sip_scan_t *scan);
 void release_sip_parser(openli_sip_parser_t *parser);
 
 char *get_sip_contents(openli_sip_parser_t *parser, uint16_t *siplen);
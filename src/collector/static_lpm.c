@@ -0,0 +1,288 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "collector.h"
+#include "static_lpm.h"
+
+static static_lpm_node_t *create_lpm_node(int stride,
+        static_lpm_matches_t *inherit) {
+
+    static_lpm_node_t *node;
+    int i, slots = 1 << stride;
+
+    node = (static_lpm_node_t *)malloc(sizeof(static_lpm_entry_t) * slots);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < slots; i++) {
+        node->entries[i].child = NULL;
+        node->entries[i].matches = inherit;
+    }
+    return node;
+}
+
+static void free_lpm_node(static_lpm_node_t *node, int stride) {
+    int i, slots = 1 << stride;
+
+    for (i = 0; i < slots; i++) {
+        if (node->entries[i].child) {
+            free_lpm_node(node->entries[i].child, STATIC_LPM_STRIDE);
+        }
+    }
+    free(node);
+}
+
+void init_static_lpm(static_lpm_t *lpm, int family) {
+    lpm->root = NULL;
+    lpm->addrlen = (family == AF_INET6) ? 16 : 4;
+    lpm->dirty = 0;
+    lpm->allmatches = NULL;
+}
+
+void clear_static_lpm(static_lpm_t *lpm) {
+
+    static_lpm_matches_t *m;
+
+    if (lpm->root) {
+        free_lpm_node(lpm->root, STATIC_LPM_ROOT_STRIDE);
+        lpm->root = NULL;
+    }
+
+    while (lpm->allmatches) {
+        m = lpm->allmatches;
+        lpm->allmatches = m->nextalloc;
+        free(m);
+    }
+}
+
+static static_lpm_matches_t *merge_matches(static_lpm_t *lpm,
+        static_lpm_matches_t *existing, staticipsession_t **sessions,
+        uint32_t count) {
+
+    static_lpm_matches_t *m;
+    uint32_t prev = existing ? existing->count : 0;
+
+    m = (static_lpm_matches_t *)malloc(sizeof(static_lpm_matches_t) +
+            (prev + count) * sizeof(staticipsession_t *));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    if (existing) {
+        memcpy(m->sessions, existing->sessions,
+                prev * sizeof(staticipsession_t *));
+    }
+    memcpy(m->sessions + prev, sessions, count * sizeof(staticipsession_t *));
+    m->count = prev + count;
+
+    m->nextalloc = lpm->allmatches;
+    lpm->allmatches = m;
+    return m;
+}
+
+/* Adds the sessions to every slot in the given range of a node, including
+ * any slots in child nodes beneath them. Neighbouring slots usually share
+ * the same match list, so we reuse the merged list wherever we can.
+ */
+static int expand_into_node(static_lpm_t *lpm, static_lpm_node_t *node,
+        uint32_t first, uint32_t slots, staticipsession_t **sessions,
+        uint32_t count) {
+
+    static_lpm_matches_t *lastold = NULL, *lastnew = NULL;
+    static_lpm_entry_t *ent;
+    uint32_t i;
+
+    for (i = first; i < first + slots; i++) {
+        ent = &(node->entries[i]);
+
+        if (ent->child) {
+            if (expand_into_node(lpm, ent->child, 0, 1 << STATIC_LPM_STRIDE,
+                        sessions, count) < 0) {
+                return -1;
+            }
+        }
+
+        if (lastnew == NULL || ent->matches != lastold) {
+            lastold = ent->matches;
+            lastnew = merge_matches(lpm, ent->matches, sessions, count);
+            if (lastnew == NULL) {
+                return -1;
+            }
+        }
+        ent->matches = lastnew;
+    }
+    return 0;
+}
+
+static int insert_lpm_prefix(static_lpm_t *lpm, uint8_t *addr,
+        uint32_t bitlen, staticipsession_t **sessions, uint32_t count) {
+
+    static_lpm_node_t *node;
+    static_lpm_entry_t *ent;
+    uint32_t startbit = 0, stride = STATIC_LPM_ROOT_STRIDE;
+    uint32_t index, span;
+    int byte = 0;
+
+    if (lpm->root == NULL) {
+        lpm->root = create_lpm_node(STATIC_LPM_ROOT_STRIDE, NULL);
+        if (lpm->root == NULL) {
+            return -1;
+        }
+    }
+    node = lpm->root;
+
+    while (1) {
+        if (stride == STATIC_LPM_ROOT_STRIDE) {
+            index = (addr[0] << 8) | addr[1];
+        } else {
+            index = addr[byte];
+        }
+
+        if (bitlen <= startbit + stride) {
+            span = 1 << (startbit + stride - bitlen);
+            index &= ~(span - 1);
+            return expand_into_node(lpm, node, index, span, sessions, count);
+        }
+
+        ent = &(node->entries[index]);
+        if (ent->child == NULL) {
+            ent->child = create_lpm_node(STATIC_LPM_STRIDE, ent->matches);
+            if (ent->child == NULL) {
+                return -1;
+            }
+        }
+
+        node = ent->child;
+        byte += (stride / 8);
+        startbit += stride;
+        stride = STATIC_LPM_STRIDE;
+    }
+    return 0;
+}
+
+static int compare_prefix_length(const void *a, const void *b) {
+    patricia_node_t *pa = *((patricia_node_t **)a);
+    patricia_node_t *pb = *((patricia_node_t **)b);
+
+    return (int)pa->prefix->bitlen - (int)pb->prefix->bitlen;
+}
+
+int rebuild_static_lpm(static_lpm_t *lpm, patricia_tree_t *ptree,
+        staticipsession_t *active) {
+
+    patricia_node_t *pnode, **pnodes = NULL;
+    staticipsession_t **sessions = NULL, *sess;
+    liid_set_t *all, *sliid, *tmp;
+    int pcount = 0, palloced = 0, i, ret = 0;
+    uint32_t scount;
+
+    clear_static_lpm(lpm);
+    lpm->dirty = 0;
+
+    if (ptree == NULL || ptree->head == NULL) {
+        return 0;
+    }
+
+    PATRICIA_WALK(ptree->head, pnode) {
+        if (pnode->data) {
+            if (pcount == palloced) {
+                palloced += 64;
+                pnodes = (patricia_node_t **)realloc(pnodes,
+                        palloced * sizeof(patricia_node_t *));
+            }
+            pnodes[pcount] = pnode;
+            pcount ++;
+        }
+    } PATRICIA_WALK_END;
+
+    /* Shorter prefixes must go in first, so that any child nodes created
+     * for longer prefixes inherit the sessions that cover them */
+    qsort(pnodes, pcount, sizeof(patricia_node_t *), compare_prefix_length);
+
+    for (i = 0; i < pcount; i++) {
+        all = (liid_set_t *)(pnodes[i]->data);
+        sessions = (staticipsession_t **)realloc(sessions,
+                HASH_CNT(hh, all) * sizeof(staticipsession_t *));
+        scount = 0;
+
+        HASH_ITER(hh, all, sliid, tmp) {
+            HASH_FIND(hh, active, sliid->key, sliid->keylen, sess);
+            if (!sess) {
+                logger(LOG_INFO,
+                        "OpenLI: IP range for intercept %s is not present in activestaticintercepts",
+                        sliid->key);
+                continue;
+            }
+            sessions[scount] = sess;
+            scount ++;
+        }
+
+        if (scount == 0) {
+            continue;
+        }
+
+        if (insert_lpm_prefix(lpm, (uint8_t *)&(pnodes[i]->prefix->add),
+                    pnodes[i]->prefix->bitlen, sessions, scount) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: ran out of memory while building static IP range table");
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        lpm->dirty = 1;
+    }
+    free(sessions);
+    free(pnodes);
+    return ret;
+}
+
+int add_static_lpm_range(static_lpm_t *lpm, prefix_t *prefix,
+        staticipsession_t *sess) {
+
+    if (lpm->dirty) {
+        /* the whole table is going to be rebuilt anyway */
+        return 0;
+    }
+
+    if (insert_lpm_prefix(lpm, (uint8_t *)&(prefix->add), prefix->bitlen,
+                &sess, 1) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while adding to static IP range table");
+        lpm->dirty = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,107 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_STATIC_LPM_H_
+#define OPENLI_STATIC_LPM_H_
+
+#include <stdint.h>
+#include "patricia.h"
+#include "intercept.h"
+
+/* A flattened longest-prefix-match table for static IP range intercepts.
+ *
+ * This is a multibit trie with a 16 bit root stride followed by 8 bit
+ * strides (so a DIR-16-8-8 table for IPv4, and up to 15 levels for IPv6).
+ * Prefixes are expanded to fill every slot they cover, and each slot
+ * lists *all* of the static sessions whose ranges cover it, so a lookup
+ * is a handful of array indexes with no walk back up through the parents.
+ *
+ * New ranges are expanded straight into the existing table when the
+ * processing thread receives the update. Modifying or removing a range
+ * flags the table as dirty instead, and the next lookup recompiles the
+ * table for that address family from the patricia tree of static ranges,
+ * so a batch of withdrawals costs a single rebuild. Running out of memory
+ * part way through an update also flags the table as dirty.
+ *
+ * A dirty table may still refer to sessions that have been freed, so it
+ * must never be searched without being rebuilt first.
+ */
+
+#define STATIC_LPM_ROOT_STRIDE 16
+#define STATIC_LPM_STRIDE 8
+
+typedef struct static_lpm_matches {
+    uint32_t count;
+    struct static_lpm_matches *nextalloc;
+    staticipsession_t *sessions[];
+} static_lpm_matches_t;
+
+typedef struct static_lpm_node static_lpm_node_t;
+
+typedef struct static_lpm_entry {
+    static_lpm_node_t *child;
+    static_lpm_matches_t *matches;
+} static_lpm_entry_t;
+
+struct static_lpm_node {
+    static_lpm_entry_t entries[0];
+};
+
+typedef struct static_lpm {
+    static_lpm_node_t *root;
+    uint8_t addrlen;
+    uint8_t dirty;
+    static_lpm_matches_t *allmatches;
+} static_lpm_t;
+
+void init_static_lpm(static_lpm_t *lpm, int family);
+void clear_static_lpm(static_lpm_t *lpm);
+int rebuild_static_lpm(static_lpm_t *lpm, patricia_tree_t *ptree,
+        staticipsession_t *active);
+int add_static_lpm_range(static_lpm_t *lpm, prefix_t *prefix,
+        staticipsession_t *sess);
+
+static inline static_lpm_matches_t *lookup_static_lpm(static_lpm_t *lpm,
+        uint8_t *addr) {
+
+    static_lpm_entry_t *ent;
+    int byte = 2;
+
+    if (lpm->root == NULL) {
+        return NULL;
+    }
+
+    ent = &(lpm->root->entries[(addr[0] << 8) | addr[1]]);
+    while (ent->child && byte < lpm->addrlen) {
+        ent = &(ent->child->entries[addr[byte]]);
+        byte ++;
+    }
+    return ent->matches;
+}
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
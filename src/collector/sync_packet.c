@@ -0,0 +1,120 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libtrace.h>
+
+#include "logger.h"
+#include "sync_packet.h"
+
+/* We do this ourselves instead of calling trace_copy_packet() because
+ * we don't want to be allocating 64K per copied packet -- we could be
+ * doing this a lot and don't want to be wasteful */
+libtrace_packet_t *copy_packet_for_sync(openli_pool_t *pool,
+        libtrace_packet_t *pkt) {
+
+    libtrace_packet_t *copy;
+    openli_sync_packet_t *slot = NULL;
+    int caplen = trace_get_capture_length(pkt);
+    int framelen = trace_get_framing_length(pkt);
+
+    if (caplen == -1 || framelen == -1) {
+        logger(LOG_INFO, "OpenLI: unable to copy packet for sync thread (caplen=%d, framelen=%d)", caplen, framelen);
+        return NULL;
+    }
+
+    if (framelen + caplen <= SYNC_PACKET_SLOT_SIZE) {
+        slot = (openli_sync_packet_t *)get_pooled_object(pool);
+    }
+
+    if (slot) {
+        copy = &(slot->packet);
+        memset(copy, 0, sizeof(libtrace_packet_t));
+        /* The slot goes back into our pool once the sync thread is done,
+         * so libtrace must not try to free the buffer itself */
+        copy->buf_control = TRACE_CTRL_EXTERNAL;
+        copy->buffer = slot->buffer;
+    } else {
+        copy = (libtrace_packet_t *)calloc((size_t)1,
+                sizeof(libtrace_packet_t));
+        if (!copy) {
+            logger(LOG_INFO, "OpenLI: out of memory while copying packet for sync thread");
+            return NULL;
+        }
+        copy->buf_control = TRACE_CTRL_PACKET;
+        copy->buffer = malloc(framelen + caplen);
+        if (!copy->buffer) {
+            logger(LOG_INFO, "OpenLI: out of memory while copying packet for sync thread");
+            free(copy);
+            return NULL;
+        }
+    }
+
+    copy->trace = pkt->trace;
+    copy->type = pkt->type;
+    copy->header = copy->buffer;
+    copy->payload = ((char *)copy->buffer) + framelen;
+    copy->order = pkt->order;
+    copy->hash = pkt->hash;
+    copy->error = pkt->error;
+    copy->which_trace_start = pkt->which_trace_start;
+    copy->cached.capture_length = caplen;
+    copy->cached.framing_length = framelen;
+    copy->cached.wire_length = -1;
+    copy->cached.payload_length = -1;
+    /* everything else in cache should be 0 or NULL due to our earlier
+     * calloc() or memset() */
+    memcpy(copy->header, pkt->header, framelen);
+    memcpy(copy->payload, pkt->payload, caplen);
+
+    return copy;
+}
+
+/* Called by the sync threads once they are finished with a packet that
+ * was given to them by copy_packet_for_sync().
+ *
+ * The copy still points at the input trace so that the format callbacks
+ * work while the sync thread parses it, but the buffer was never handed
+ * out by that format. Detach the copy from the trace before releasing it,
+ * otherwise the format's fin_packet hook gets a buffer it does not own
+ * (e.g. DPDK would try to free our slot as if it were an mbuf).
+ */
+void release_sync_packet(libtrace_packet_t *pkt) {
+
+    pkt->trace = NULL;
+
+    if (pkt->buf_control == TRACE_CTRL_PACKET) {
+        trace_destroy_packet(pkt);
+        return;
+    }
+
+    memset(&(pkt->cached), 0, sizeof(pkt->cached));
+    /* packet is the first member of the slot */
+    release_pooled_object((openli_sync_packet_t *)pkt);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,51 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_SYNC_PACKET_H_
+#define OPENLI_SYNC_PACKET_H_
+
+#include <libtrace.h>
+#include "object_pool.h"
+
+/* Packets copied for the sync threads are carved out of fixed-size slots
+ * from a pool owned by the processing thread. Anything too big for a slot
+ * (e.g. jumbo frames) falls back to a regular heap copy.
+ */
+#define SYNC_PACKET_SLOT_SIZE 2048
+#define SYNC_PACKET_POOL_MAX_FREE 4096
+
+typedef struct openli_sync_packet {
+    libtrace_packet_t packet;
+    uint8_t buffer[SYNC_PACKET_SLOT_SIZE];
+} openli_sync_packet_t;
+
+libtrace_packet_t *copy_packet_for_sync(openli_pool_t *pool,
+        libtrace_packet_t *pkt);
+void release_sync_packet(libtrace_packet_t *pkt);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -66,7 +66,8 @@ int encode_umtscc(wandder_encoder_t *encoder,
 
 int encode_umtscc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
-        openli_encoded_result_t *msg, wandder_etsili_child_t *child, wandder_encoder_t *encoder) {
+        openli_encoded_result_t *msg, wandder_etsili_child_t *child, wandder_encoder_t *encoder,
+        openli_pool_t *bodypool) {
 
     uint32_t liidlen = (uint32_t)((size_t)child->owner->preencoded[WANDDER_PREENCODE_LIID_LEN]);
 
@@ -81,7 +82,12 @@ int encode_umtscc_ber(
             job->dir,
             child);
 
-    msg->msgbody = malloc(sizeof(wandder_encoded_result_t));
+    msg->msgbody = get_pooled_object(bodypool);
+    if (msg->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding UMTSCC record");
+        return -1;
+    }
 
     msg->msgbody->encoder = NULL;
     msg->msgbody->encoded = child->buf;
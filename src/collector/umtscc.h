@@ -39,7 +39,7 @@ int encode_umtscc(wandder_encoder_t *encoder, wandder_encode_job_t *precomputed,
 int encode_umtscc_ber(
         openli_ipcc_job_t *job, uint32_t seqno, struct timeval *tv,
         openli_encoded_result_t *msg, wandder_etsili_child_t *child, 
-        wandder_encoder_t *encoder);
+        wandder_encoder_t *encoder, openli_pool_t *bodypool);
 #endif
 
 #endif
@@ -75,7 +75,8 @@ int encode_umtsiri_ber(
         etsili_generic_freelist_t *freegenerics,
         uint32_t seqno,
         openli_encoded_result_t *res,
-        wandder_etsili_child_t *child) {
+        wandder_etsili_child_t *child,
+        openli_pool_t *bodypool) {
 
     struct timeval current_tv;
 
@@ -92,7 +93,13 @@ int encode_umtsiri_ber(
         job->iritype, 
         child);
 
-    res->msgbody = malloc(sizeof(wandder_encoded_result_t));
+    res->msgbody = get_pooled_object(bodypool);
+    if (res->msgbody == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: ran out of memory while encoding UMTSIRI record");
+        free_umtsiri_parameters(job->customparams);
+        return -1;
+    }
     res->msgbody->encoder = NULL;
     res->msgbody->encoded = child->buf;
     res->msgbody->len = child->len;
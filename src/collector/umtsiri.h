@@ -76,7 +76,8 @@ int encode_umtsiri_ber(
         etsili_generic_freelist_t *freegenerics,
         uint32_t seqno,
         openli_encoded_result_t *res,
-        wandder_etsili_child_t *child);
+        wandder_etsili_child_t *child,
+        openli_pool_t *bodypool);
 #endif
 
 int create_mobiri_job_from_session(collector_sync_t *sync,
@@ -272,6 +272,7 @@ static int parse_core_server_list(coreserver_t **servlist, uint8_t cstype,
 
         cs->serverkey = NULL;
         cs->info = NULL;
+        cs->resolved = 0;
         cs->ipstr = NULL;
         cs->portstr = NULL;
         cs->servertype = cstype;
@@ -928,6 +929,32 @@ static int global_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "encoderspinbudget") == 0) {
+        glob->encoder_spin_budget = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "bufferspilldir") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->spilldir, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "bufferspillthreshold") == 0) {
+        glob->spillthresh = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "statsport") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->statsport, value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "forwardingthreads") == 0) {
@@ -939,6 +966,84 @@ static int global_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "ipsyncthreads") == 0) {
+        glob->ipsync_threads = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+        if (glob->ipsync_threads <= 0) {
+            glob->ipsync_threads = 1;
+            logger(LOG_INFO, "OpenLI: must have at least one IP sync thread per collector!");
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "voipsyncthreads") == 0) {
+        glob->voipsync_threads = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+        if (glob->voipsync_threads <= 0) {
+            glob->voipsync_threads = 1;
+            logger(LOG_INFO, "OpenLI: must have at least one VOIP sync thread per collector!");
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "publishqueuehwm") == 0) {
+        glob->publish_hwm = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "syncqueuehwm") == 0) {
+        glob->sync_hwm = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "encoderqueuehwm") == 0) {
+        glob->encoder_hwm = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "forwarderqueuehwm") == 0) {
+        glob->forwarder_hwm = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "reorderlimit") == 0) {
+        glob->reorder_limit = strtoul((char *) value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "overloadpolicy") == 0) {
+        if (strcasecmp((char *)value->data.scalar.value, "block") == 0) {
+            glob->overload_policy = OPENLI_OVERLOAD_BLOCK;
+        } else if (strcasecmp((char *)value->data.scalar.value,
+                    "drop") == 0) {
+            glob->overload_policy = OPENLI_OVERLOAD_DROP;
+        } else if (strcasecmp((char *)value->data.scalar.value,
+                    "shediri") == 0) {
+            glob->overload_policy = OPENLI_OVERLOAD_SHED_IRI;
+        } else if (strcasecmp((char *)value->data.scalar.value,
+                    "shedcc") == 0) {
+            glob->overload_policy = OPENLI_OVERLOAD_SHED_CC;
+        } else {
+            logger(LOG_INFO, "OpenLI: unknown overload policy '%s', using 'block' instead",
+                    (char *)value->data.scalar.value);
+            glob->overload_policy = OPENLI_OVERLOAD_BLOCK;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "logstatfrequency") == 0) {
@@ -970,6 +1075,12 @@ static int global_parser(void *arg, yaml_document_t *doc,
         glob->etsitls = check_onoff((char *)value->data.scalar.value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "zerocopycc") == 0) {
+        glob->zerocopy_cc = check_onoff((char *)value->data.scalar.value);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "sipignoresdpo") == 0) {
@@ -1076,6 +1187,19 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->pcapdirectory, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "bufferspilldir") == 0) {
+        SET_CONFIG_STRING_OPTION(state->spilldir, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "bufferspillthreshold") == 0) {
+        state->spillthresh = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "operatorid") == 0) {
@@ -1104,6 +1228,17 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "collectorthreads") == 0) {
+        state->collthreads = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (state->collthreads == 0) {
+            logger(LOG_INFO, "OpenLI: 0 is not a valid value for the 'collectorthreads' config option.");
+            return -1;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "tlscert") == 0) {
@@ -27,7 +27,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libtrace/linked_list.h>
 #include "coreserver.h"
 #include "logger.h"
@@ -64,6 +66,8 @@ coreserver_t *deep_copy_coreserver(coreserver_t *cs) {
     cscopy->info = NULL;
     cscopy->portswapped = cs->portswapped;
     cscopy->awaitingconfirm = 0;
+    memcpy(&(cscopy->addrkey), &(cs->addrkey), sizeof(coreserver_addrkey_t));
+    cscopy->resolved = cs->resolved;
     return cscopy;
 }
 
@@ -154,4 +158,137 @@ coreserver_t *match_packet_to_coreserver(coreserver_t *serverlist,
 	return NULL;
 }
 
+static inline void fill_addrkey(coreserver_addrkey_t *key, int family,
+        struct sockaddr_storage *sa, uint16_t port) {
+
+    memset(key, 0, sizeof(coreserver_addrkey_t));
+    key->family = family;
+    key->port = port;
+
+    if (family == AF_INET) {
+        memcpy(key->addr, &(((struct sockaddr_in *)sa)->sin_addr),
+                sizeof(struct in_addr));
+    } else {
+        memcpy(key->addr, &(((struct sockaddr_in6 *)sa)->sin6_addr),
+                sizeof(struct in6_addr));
+    }
+}
+
+int resolve_coreserver(coreserver_t *cs) {
+
+    if (cs->resolved) {
+        return 1;
+    }
+
+    if (cs->info == NULL) {
+        cs->info = populate_addrinfo(cs->ipstr, cs->portstr, SOCK_DGRAM);
+        if (!cs->info) {
+            return -1;
+        }
+    }
+
+    if (cs->info->ai_family == AF_INET) {
+        cs->portswapped = ntohs(CS_TO_V4(cs)->sin_port);
+    } else if (cs->info->ai_family == AF_INET6) {
+        cs->portswapped = ntohs(CS_TO_V6(cs)->sin6_port);
+    } else {
+        freeaddrinfo(cs->info);
+        cs->info = NULL;
+        return -1;
+    }
+
+    fill_addrkey(&(cs->addrkey), cs->info->ai_family,
+            (struct sockaddr_storage *)(cs->info->ai_addr), cs->portswapped);
+    cs->resolved = 1;
+    return 1;
+}
+
+int add_coreserver_to_index(coreserver_index_t **index, coreserver_t *cs) {
+
+    coreserver_index_t *ent;
+
+    /* The server must already have been resolved by whoever passed it
+     * to us -- we don't want to be calling getaddrinfo() from here */
+    if (!cs->resolved || cs->servertype >= OPENLI_CORE_SERVER_TYPE_COUNT) {
+        return -1;
+    }
+
+    HASH_FIND(hh, *index, &(cs->addrkey), sizeof(coreserver_addrkey_t), ent);
+    if (!ent) {
+        ent = (coreserver_index_t *)calloc(1, sizeof(coreserver_index_t));
+        memcpy(&(ent->key), &(cs->addrkey), sizeof(coreserver_addrkey_t));
+        HASH_ADD(hh, *index, key, sizeof(coreserver_addrkey_t), ent);
+    }
+
+    ent->refs[cs->servertype] ++;
+    ent->typemask |= CORESERVER_TYPE_MASK(cs->servertype);
+    return 1;
+}
+
+void remove_coreserver_from_index(coreserver_index_t **index,
+        coreserver_t *cs) {
+
+    coreserver_index_t *ent;
+
+    if (!cs->resolved || cs->servertype >= OPENLI_CORE_SERVER_TYPE_COUNT) {
+        return;
+    }
+
+    HASH_FIND(hh, *index, &(cs->addrkey), sizeof(coreserver_addrkey_t), ent);
+    if (!ent || ent->refs[cs->servertype] == 0) {
+        return;
+    }
+
+    ent->refs[cs->servertype] --;
+    if (ent->refs[cs->servertype] == 0) {
+        ent->typemask &= ~(CORESERVER_TYPE_MASK(cs->servertype));
+    }
+
+    if (ent->typemask == 0) {
+        HASH_DELETE(hh, *index, ent);
+        free(ent);
+    }
+}
+
+void free_coreserver_index(coreserver_index_t **index) {
+    coreserver_index_t *ent, *tmp;
+
+    HASH_ITER(hh, *index, ent, tmp) {
+        HASH_DELETE(hh, *index, ent);
+        free(ent);
+    }
+}
+
+/* Returns a mask of the core server types that either end of the
+ * packet belongs to */
+uint32_t match_packet_to_coreserver_index(coreserver_index_t *index,
+        packet_info_t *pinfo) {
+
+    coreserver_addrkey_t key;
+    coreserver_index_t *ent;
+    uint32_t mask = 0;
+
+    if (index == NULL || pinfo->srcport == 0 || pinfo->destport == 0) {
+        return 0;
+    }
+
+    if (pinfo->family != AF_INET && pinfo->family != AF_INET6) {
+        return 0;
+    }
+
+    fill_addrkey(&key, pinfo->family, &(pinfo->srcip), pinfo->srcport);
+    HASH_FIND(hh, index, &key, sizeof(key), ent);
+    if (ent) {
+        mask |= ent->typemask;
+    }
+
+    fill_addrkey(&key, pinfo->family, &(pinfo->destip), pinfo->destport);
+    HASH_FIND(hh, index, &key, sizeof(key), ent);
+    if (ent) {
+        mask |= ent->typemask;
+    }
+
+    return mask;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
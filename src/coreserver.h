@@ -43,8 +43,11 @@ enum {
     OPENLI_CORE_SERVER_SIP,
     OPENLI_CORE_SERVER_ALUMIRROR,
     OPENLI_CORE_SERVER_GTP,
+    OPENLI_CORE_SERVER_TYPE_COUNT,
 };
 
+#define CORESERVER_TYPE_MASK(t) (1U << (t))
+
 typedef struct packetinfo {
     int family;
     struct sockaddr_storage srcip;
@@ -54,6 +57,16 @@ typedef struct packetinfo {
 } packet_info_t;
 
 
+/* Resolved address and port of a core server. This is also the key for
+ * the index of core server addresses, so that a packet can be matched
+ * against every known core server using a single lookup for each endpoint.
+ */
+typedef struct coreserver_addrkey {
+    uint8_t addr[16];
+    uint16_t port;
+    uint16_t family;
+} coreserver_addrkey_t;
+
 typedef struct coreserver {
     char *serverkey;
     uint8_t servertype;
@@ -63,9 +76,23 @@ typedef struct coreserver {
     uint16_t portswapped;
     uint8_t awaitingconfirm;
 
+    /* Filled in by resolve_coreserver() and carried over by
+     * deep_copy_coreserver(), so that only the thread that resolved the
+     * server needs to call getaddrinfo() */
+    coreserver_addrkey_t addrkey;
+    uint8_t resolved;
+
     UT_hash_handle hh;
 } coreserver_t;
 
+typedef struct coreserver_index {
+    coreserver_addrkey_t key;
+    uint16_t refs[OPENLI_CORE_SERVER_TYPE_COUNT];
+    uint32_t typemask;
+
+    UT_hash_handle hh;
+} coreserver_index_t;
+
 void free_single_coreserver(coreserver_t *cs);
 char *construct_coreserver_key(coreserver_t *cs);
 void free_coreserver_list(coreserver_t *servlist);
@@ -75,6 +102,14 @@ coreserver_t *deep_copy_coreserver(coreserver_t *cs);
 coreserver_t *match_packet_to_coreserver(coreserver_t *serverlist,
         packet_info_t *pinfo);
 
+int resolve_coreserver(coreserver_t *cs);
+int add_coreserver_to_index(coreserver_index_t **index, coreserver_t *cs);
+void remove_coreserver_from_index(coreserver_index_t **index,
+        coreserver_t *cs);
+void free_coreserver_index(coreserver_index_t **index);
+uint32_t match_packet_to_coreserver_index(coreserver_index_t *index,
+        packet_info_t *pinfo);
+
 #define CS_TO_V4(cs) ((struct sockaddr_in *)(cs->info->ai_addr))
 #define CS_TO_V6(cs) ((struct sockaddr_in6 *)(cs->info->ai_addr))
 
@@ -27,90 +27,458 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <libwandder_etsili.h>
 
 #include "logger.h"
 #include "export_buffer.h"
 #include "netcomms.h"
 
-#define BUFFER_ALLOC_SIZE (1024 * 1024 * 50)
+#define BUFFER_CHUNK_SIZE (1024 * 1024)
+#define BUFFER_MAX_SPARE_CHUNKS 16
+#define BUFFER_MAX_IOV 64
 #define BUFFER_WARNING_THRESH (1024 * 1024 * 1024)
+#define BUFFER_SPILL_SEGMENT_CHUNKS 256
+
+#define SPILL_UNAVAILABLE -2
 
 void init_export_buffer(export_buffer_t *buf) {
-    buf->bufhead = NULL;
-    buf->buftail = NULL;
+    buf->head = NULL;
+    buf->tail = NULL;
+    buf->spare = NULL;
+    buf->sparecount = 0;
     buf->alloced = 0;
+    buf->buffered = 0;
+    buf->spilldir = NULL;
+    buf->spillthresh = 0;
+    buf->spilled = 0;
+    buf->spillseg = NULL;
+    buf->sparespill = NULL;
+    buf->spilldrops = 0;
+    buf->spillfailing = 0;
     buf->partialfront = 0;
     buf->deadfront = 0;
     buf->nextwarn = BUFFER_WARNING_THRESH;
+    buf->appendedtotal = 0;
+    buf->consumedtotal = 0;
 }
 
-void release_export_buffer(export_buffer_t *buf) {
-    free(buf->bufhead);
+void set_export_buffer_spill(export_buffer_t *buf, char *spilldir,
+        uint64_t spillthresh) {
+    buf->spilldir = spilldir;
+    buf->spillthresh = spillthresh;
 }
 
-uint64_t get_buffered_amount(export_buffer_t *buf) {
-    return (buf->buftail - (buf->bufhead + buf->deadfront));
+static void unmap_spill_segment(export_spill_segment_t *seg) {
+    munmap(seg->base, (size_t)BUFFER_CHUNK_SIZE * BUFFER_SPILL_SEGMENT_CHUNKS);
+    free(seg);
+}
+
+/* Called once every chunk in a segment has been drained. The segment that
+ * we are still carving chunks from just starts again from the front;
+ * otherwise we keep one empty segment for reuse and unmap the rest.
+ */
+static void retire_spill_segment(export_buffer_t *buf,
+        export_spill_segment_t *seg) {
+
+    seg->nextchunk = 0;
+    if (seg == buf->spillseg) {
+        return;
+    }
+    if (buf->sparespill == NULL) {
+        buf->sparespill = seg;
+        return;
+    }
+    unmap_spill_segment(seg);
+}
+
+static void free_chunk(export_buffer_t *buf, export_buffer_chunk_t *chunk) {
+    if (chunk->segment) {
+        buf->spilled -= BUFFER_CHUNK_SIZE;
+        chunk->segment->inuse --;
+        if (chunk->segment->inuse == 0) {
+            retire_spill_segment(buf, chunk->segment);
+        }
+    } else {
+        free(chunk->data);
+        buf->alloced -= BUFFER_CHUNK_SIZE;
+    }
+    free(chunk);
+}
+
+static void free_chunk_list(export_buffer_t *buf,
+        export_buffer_chunk_t *chunk) {
+    export_buffer_chunk_t *tmp;
+
+    while (chunk) {
+        tmp = chunk;
+        chunk = chunk->next;
+        free_chunk(buf, tmp);
+    }
+}
+
+/* Creates a new segment file in the spill directory. The file is unlinked
+ * straight away, so the space is given back as soon as the segment is
+ * unmapped (or if we exit unexpectedly). Each segment holds many chunks,
+ * so we only need one mapping per BUFFER_SPILL_SEGMENT_CHUNKS chunks.
+ */
+static export_spill_segment_t *map_spill_segment(export_buffer_t *buf) {
+
+    char path[4096];
+    export_spill_segment_t *seg;
+    size_t seglen = (size_t)BUFFER_CHUNK_SIZE * BUFFER_SPILL_SEGMENT_CHUNKS;
+    uint8_t *space;
+    int fd;
+
+    snprintf(path, 4096, "%s/openli-spill-XXXXXX", buf->spilldir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        if (!buf->spillfailing) {
+            logger(LOG_INFO, "OpenLI: unable to create buffer spill file in %s: %s",
+                    buf->spilldir, strerror(errno));
+        }
+        return NULL;
+    }
+    unlink(path);
+
+    if (ftruncate(fd, seglen) < 0) {
+        if (!buf->spillfailing) {
+            logger(LOG_INFO, "OpenLI: unable to size buffer spill file: %s",
+                    strerror(errno));
+        }
+        close(fd);
+        return NULL;
+    }
+
+    space = (uint8_t *)mmap(NULL, seglen, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (space == MAP_FAILED) {
+        if (!buf->spillfailing) {
+            logger(LOG_INFO, "OpenLI: unable to mmap buffer spill file: %s",
+                    strerror(errno));
+        }
+        return NULL;
+    }
+
+    seg = (export_spill_segment_t *)malloc(sizeof(export_spill_segment_t));
+    if (seg == NULL) {
+        munmap(space, seglen);
+        return NULL;
+    }
+    seg->base = space;
+    seg->nextchunk = 0;
+    seg->inuse = 0;
+    return seg;
 }
 
+static uint8_t *get_spill_space(export_buffer_t *buf,
+        export_spill_segment_t **segused) {
+
+    export_spill_segment_t *seg = buf->spillseg;
+
+    if (seg && seg->nextchunk == BUFFER_SPILL_SEGMENT_CHUNKS) {
+        /* Full -- it will be retired once its chunks have drained */
+        buf->spillseg = NULL;
+        seg = NULL;
+    }
+
+    if (seg == NULL) {
+        if (buf->sparespill) {
+            seg = buf->sparespill;
+            buf->sparespill = NULL;
+        } else {
+            seg = map_spill_segment(buf);
+        }
+        if (seg == NULL) {
+            return NULL;
+        }
+        buf->spillseg = seg;
+    }
 
-static inline uint64_t extend_buffer(export_buffer_t *buf) {
+    if (buf->spilled == 0) {
+        logger(LOG_INFO, "OpenLI: export buffer has reached %lu bytes in memory, spilling further records to %s",
+                buf->alloced, buf->spilldir);
+    }
+    buf->spilled += BUFFER_CHUNK_SIZE;
 
-    /* Add some space to the buffer */
-    uint8_t *space = NULL;
-    uint64_t bufused = buf->buftail - (buf->bufhead + buf->deadfront);
+    *segused = seg;
+    seg->inuse ++;
+    seg->nextchunk ++;
+    return seg->base + ((size_t)(seg->nextchunk - 1) * BUFFER_CHUNK_SIZE);
+}
 
-    if (buf->deadfront > 0) {
-        memmove(buf->bufhead, buf->bufhead + buf->deadfront, bufused);
+void release_export_buffer(export_buffer_t *buf) {
+    free_chunk_list(buf, buf->head);
+    free_chunk_list(buf, buf->spare);
+    if (buf->spillseg) {
+        unmap_spill_segment(buf->spillseg);
+    }
+    if (buf->sparespill) {
+        unmap_spill_segment(buf->sparespill);
     }
+    buf->spillseg = NULL;
+    buf->sparespill = NULL;
+    buf->head = NULL;
+    buf->tail = NULL;
+    buf->spare = NULL;
+    buf->sparecount = 0;
+    buf->buffered = 0;
+}
+
+uint64_t get_buffered_amount(export_buffer_t *buf) {
+    return buf->buffered;
+}
+
+/* Offset (counting from when the buffer was created) of the end of the
+ * most recently appended record */
+uint64_t get_buffer_append_offset(export_buffer_t *buf) {
+    return buf->appendedtotal;
+}
+
+/* Offset up to which the buffer contents have been written out */
+uint64_t get_buffer_written_offset(export_buffer_t *buf) {
+    return buf->consumedtotal + buf->partialfront;
+}
+
+static int add_spare_chunk(export_buffer_t *buf) {
 
-    space = (uint8_t *)realloc(buf->bufhead, buf->alloced + BUFFER_ALLOC_SIZE);
+    export_buffer_chunk_t *chunk;
 
-    if (space == NULL) {
-        /* OOM -- bad! */
-        /* TODO: maybe dump to disk at this point? */
+    chunk = (export_buffer_chunk_t *)malloc(sizeof(export_buffer_chunk_t));
+    if (chunk == NULL) {
         logger(LOG_INFO, "OpenLI: no more free memory to use as buffer space!");
         logger(LOG_INFO, "OpenLI: fix the connection between your collector and your mediator.");
-        return 0;
+        return -1;
+    }
+    chunk->data = NULL;
+    chunk->segment = NULL;
+
+    /* Always keep at least one chunk in memory, so there is somewhere to
+     * put records even when nothing can be spilled */
+    if (buf->spilldir && buf->alloced > 0 &&
+            buf->alloced >= buf->spillthresh) {
+        chunk->data = get_spill_space(buf, &(chunk->segment));
+        if (chunk->data == NULL) {
+            free(chunk);
+            if (!buf->spillfailing) {
+                logger(LOG_INFO, "OpenLI: unable to spill export buffer to %s, dropping records until space is available",
+                        buf->spilldir);
+                buf->spillfailing = 1;
+            }
+            return SPILL_UNAVAILABLE;
+        }
+        if (buf->spillfailing) {
+            logger(LOG_INFO, "OpenLI: export buffer is spilling to %s again, %lu records were dropped",
+                    buf->spilldir, buf->spilldrops);
+            buf->spillfailing = 0;
+        }
+    } else {
+        chunk->data = (uint8_t *)malloc(BUFFER_CHUNK_SIZE);
+        if (chunk->data == NULL) {
+            free(chunk);
+            logger(LOG_INFO, "OpenLI: no more free memory to use as buffer space!");
+            logger(LOG_INFO, "OpenLI: fix the connection between your collector and your mediator.");
+            return -1;
+        }
     }
 
+    chunk->used = 0;
+    chunk->next = buf->spare;
+    buf->spare = chunk;
+    buf->sparecount ++;
 
-    buf->deadfront = 0;
-    buf->bufhead = space;
-    buf->buftail = space + bufused;
-    buf->alloced = buf->alloced + BUFFER_ALLOC_SIZE;
+    if (chunk->segment) {
+        return 0;
+    }
+    buf->alloced += BUFFER_CHUNK_SIZE;
 
-    if (buf->alloced - BUFFER_ALLOC_SIZE < buf->nextwarn &&
+    if (buf->alloced - BUFFER_CHUNK_SIZE < buf->nextwarn &&
             buf->alloced >= buf->nextwarn) {
         /* TODO add email alerts */
         logger(LOG_INFO, "OpenLI: buffer space for missing mediator has exceeded warning threshold %lu.", buf->nextwarn);
         buf->nextwarn += BUFFER_WARNING_THRESH;
     }
+    return 0;
+}
+
+static void recycle_chunk(export_buffer_t *buf, export_buffer_chunk_t *chunk) {
+
+    if (chunk->segment || buf->sparecount >= BUFFER_MAX_SPARE_CHUNKS) {
+        free_chunk(buf, chunk);
+        return;
+    }
 
-    return buf->alloced - bufused;
+    chunk->used = 0;
+    chunk->next = buf->spare;
+    buf->spare = chunk;
+    buf->sparecount ++;
 }
 
-uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
-        uint8_t *pdustart, uint32_t pdulen, uint32_t beensent) {
+/* Make sure that we can fit 'len' more bytes into the buffer before we
+ * start copying anything, so a record is never half-appended.
+ */
+static int reserve_buffer_space(export_buffer_t *buf, uint64_t len) {
 
-    uint64_t bufused = buf->buftail - (buf->bufhead);
-    uint64_t spaceleft = buf->alloced - bufused;
+    uint64_t avail = (uint64_t)buf->sparecount * BUFFER_CHUNK_SIZE;
+    int ret;
 
-    if (bufused == 0) {
-        buf->partialfront = beensent;
+    if (buf->tail) {
+        avail += (BUFFER_CHUNK_SIZE - buf->tail->used);
     }
 
-    while (spaceleft < pdulen) {
-        spaceleft = extend_buffer(buf);
-        if (spaceleft == 0) {
-            return 0;
+    while (avail < len) {
+        if ((ret = add_spare_chunk(buf)) < 0) {
+            return ret;
         }
+        avail += BUFFER_CHUNK_SIZE;
     }
+    return 0;
+}
 
-    memcpy(buf->buftail, (void *)pdustart, pdulen);
+static void copy_into_buffer(export_buffer_t *buf, const uint8_t *src,
+        uint64_t len) {
+
+    export_buffer_chunk_t *chunk;
+    uint32_t tocopy;
+
+    while (len > 0) {
+        if (buf->tail == NULL || buf->tail->used == BUFFER_CHUNK_SIZE) {
+            chunk = buf->spare;
+            assert(chunk != NULL);
+            buf->spare = chunk->next;
+            buf->sparecount --;
+            chunk->next = NULL;
+            chunk->used = 0;
+
+            if (buf->tail == NULL) {
+                buf->head = chunk;
+                buf->deadfront = 0;
+            } else {
+                buf->tail->next = chunk;
+            }
+            buf->tail = chunk;
+        }
 
-    buf->buftail += pdulen;
-    return (buf->buftail - buf->bufhead);
+        tocopy = BUFFER_CHUNK_SIZE - buf->tail->used;
+        if (len < tocopy) {
+            tocopy = (uint32_t)len;
+        }
+
+        memcpy(buf->tail->data + buf->tail->used, src, tocopy);
+        buf->tail->used += tocopy;
+        buf->buffered += tocopy;
+        buf->appendedtotal += tocopy;
+        src += tocopy;
+        len -= tocopy;
+    }
+}
+
+/* Discard 'amount' bytes from the front of the buffer, handing any chunks
+ * that have been completely drained back to the spare list.
+ */
+static void consume_buffer(export_buffer_t *buf, uint64_t amount) {
+
+    export_buffer_chunk_t *old;
+    uint64_t inhead;
+
+    while (amount > 0 && buf->head) {
+        inhead = buf->head->used - buf->deadfront;
+
+        if (amount < inhead) {
+            buf->deadfront += (uint32_t)amount;
+            buf->buffered -= amount;
+            buf->consumedtotal += amount;
+            break;
+        }
+
+        amount -= inhead;
+        buf->buffered -= inhead;
+        buf->consumedtotal += inhead;
+
+        if (buf->head == buf->tail) {
+            buf->head->used = 0;
+            buf->deadfront = 0;
+            break;
+        }
+
+        old = buf->head;
+        buf->head = old->next;
+        buf->deadfront = 0;
+        recycle_chunk(buf, old);
+    }
+}
+
+/* Describe the unsent portion of the buffer (i.e. skipping anything
+ * covered by partialfront) as a list of iovecs, stopping once we reach
+ * either 'maxiov' segments or 'bytelimit' bytes.
+ */
+static int fill_buffer_iovecs(export_buffer_t *buf, struct iovec *iov,
+        int maxiov, uint64_t bytelimit, uint64_t *total) {
+
+    export_buffer_chunk_t *chunk = buf->head;
+    uint64_t offset = buf->deadfront + buf->partialfront;
+    uint64_t seglen;
+    int niov = 0;
+
+    *total = 0;
+
+    while (chunk && offset >= chunk->used) {
+        offset -= chunk->used;
+        chunk = chunk->next;
+    }
+
+    while (chunk && niov < maxiov && *total < bytelimit) {
+        seglen = chunk->used - offset;
+        if (seglen > bytelimit - *total) {
+            seglen = bytelimit - *total;
+        }
+        if (seglen > 0) {
+            iov[niov].iov_base = chunk->data + offset;
+            iov[niov].iov_len = seglen;
+            niov ++;
+            *total += seglen;
+        }
+        offset = 0;
+        chunk = chunk->next;
+    }
+
+    return niov;
+}
+
+/* Records that don't fit because the spill directory is full (or broken)
+ * are counted and dropped, but the buffer itself is still usable so we
+ * don't report an error to the caller -- just that the record was
+ * dropped. */
+static inline uint64_t drop_unbufferable_record(export_buffer_t *buf,
+        int reason) {
+
+    if (reason != SPILL_UNAVAILABLE) {
+        return 0;
+    }
+    buf->spilldrops ++;
+    return EXPORT_BUFFER_RECORD_DROPPED;
+}
+
+uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
+        uint8_t *pdustart, uint32_t pdulen, uint32_t beensent) {
+
+    int ret;
+
+    if ((ret = reserve_buffer_space(buf, pdulen)) < 0) {
+        return drop_unbufferable_record(buf, ret);
+    }
+
+    if (buf->buffered == 0) {
+        buf->partialfront = beensent;
+    }
+
+    copy_into_buffer(buf, pdustart, pdulen);
+    return buf->buffered;
 
 }
 
@@ -118,10 +486,8 @@ uint64_t append_message_to_buffer(export_buffer_t *buf,
         openli_encoded_result_t *res, uint32_t beensent) {
 
     uint32_t enclen = res->msgbody->len - res->ipclen;
-    uint64_t bufused = buf->buftail - buf->bufhead;
-    uint64_t spaceleft = buf->alloced - bufused;
-
-    int liidlen;
+    uint16_t l;
+    int liidlen, ret;
 
     if (res->liid == NULL) {
         return 0;
@@ -129,47 +495,37 @@ uint64_t append_message_to_buffer(export_buffer_t *buf,
 
     liidlen = strlen(res->liid);
 
-    if (bufused == 0) {
-        buf->partialfront = beensent;
+    if ((ret = reserve_buffer_space(buf, res->msgbody->len +
+                    sizeof(res->header) + liidlen + 2)) < 0) {
+        return drop_unbufferable_record(buf, ret);
     }
 
-    while (spaceleft < res->msgbody->len + sizeof(res->header) + liidlen + 2) {
-        /* Add some space to the buffer */
-        spaceleft = extend_buffer(buf);
-        if (spaceleft == 0) {
-            return 0;
-        }
+    if (buf->buffered == 0) {
+        buf->partialfront = beensent;
     }
 
-    memcpy(buf->buftail, &res->header, sizeof(res->header));
-    buf->buftail += sizeof(res->header);
+    copy_into_buffer(buf, (uint8_t *)&res->header, sizeof(res->header));
 
-    if (res->liid) {
-        uint16_t l = htons(liidlen);
-        memcpy(buf->buftail, &l, sizeof(uint16_t));
-        memcpy(buf->buftail + 2, res->liid, liidlen);
-        buf->buftail += (liidlen + 2);
-    }
+    l = htons(liidlen);
+    copy_into_buffer(buf, (uint8_t *)&l, sizeof(uint16_t));
+    copy_into_buffer(buf, (uint8_t *)res->liid, liidlen);
 
     if (res->isDer){
         if (enclen > 0) {
-            memcpy(buf->buftail, res->msgbody->encoded, enclen);
-            buf->buftail += enclen;
+            copy_into_buffer(buf, res->msgbody->encoded, enclen);
         }
 
         if (res->ipclen > 0) {
-            memcpy(buf->buftail, res->ipcontents, res->ipclen);
-            buf->buftail += res->ipclen;
+            copy_into_buffer(buf, res->ipcontents, res->ipclen);
         }
     }
     else {
-        memcpy(buf->buftail, res->msgbody->encoded, res->msgbody->len);
-        buf->buftail += res->msgbody->len;
+        copy_into_buffer(buf, res->msgbody->encoded, res->msgbody->len);
         //BER has the payload already encoded into the result, DER leaves the payload out untill now
         //BER has a set of trailing ending octets (number varies by msg type)
     }
 
-    return (buf->buftail - buf->bufhead);
+    return buf->buffered;
 }
 
 int transmit_heartbeat(int fd, SSL *ssl) {
@@ -220,27 +576,25 @@ int transmit_heartbeat(int fd, SSL *ssl) {
 int transmit_buffered_records(export_buffer_t *buf, int fd,
         uint64_t bytelimit, SSL *ssl) {
 
+    struct iovec iov[BUFFER_MAX_IOV];
     uint64_t sent = 0;
-    uint64_t rem = 0;
-    uint8_t *bhead = buf->bufhead + buf->deadfront;
-    uint64_t offset = buf->partialfront;
-    int ret;
-
-    sent = (buf->buftail - (bhead + offset));
+    int64_t ret = 0;
+    int niov, i;
 
-    if (sent > bytelimit) {
-        sent = bytelimit;
+    niov = fill_buffer_iovecs(buf, iov, BUFFER_MAX_IOV, bytelimit, &sent);
+    if (niov == 0) {
+        return 0;
     }
 
-    if (sent != 0) {
-
-        if (ssl != NULL) {
+    if (ssl != NULL) {
+        for (i = 0; i < niov; i++) {
+            int r;
             while (1) {
-                ret = SSL_write(ssl, bhead + offset, (int)sent);
+                r = SSL_write(ssl, iov[i].iov_base, (int)iov[i].iov_len);
 
-                if ((ret) <= 0 ) {
+                if (r <= 0) {
                     char errstring[128];
-                    int errr = SSL_get_error(ssl, ret);
+                    int errr = SSL_get_error(ssl, r);
                     if (errr == SSL_ERROR_WANT_WRITE) {
                         continue;
                     }
@@ -251,50 +605,32 @@ int transmit_buffered_records(export_buffer_t *buf, int fd,
                 }
                 break;
             }
+            ret += r;
         }
-        else {
-            ret = send(fd, bhead + offset, (int)sent, MSG_DONTWAIT);
-        }
+    }
+    else {
+        struct msghdr msg;
 
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+
+        ret = sendmsg(fd, &msg, MSG_DONTWAIT);
         if (ret < 0) {
             if (errno != EAGAIN) {
                 return -1;
             }
             return 0;
-        } else if (ret < sent) {
-            /* Partial send, move partialfront ahead by whatever we did send. */
-            buf->partialfront += (uint32_t)ret;
-            return ret;
         }
-        buf->deadfront += ((uint32_t)ret + buf->partialfront);
     }
 
-    assert(buf->buftail >= buf->bufhead + buf->deadfront);
-    rem = (buf->buftail - (buf->bufhead + buf->deadfront));
-
-    /* Consider shrinking buffer if it is now way too large */
-    if (rem < buf->alloced / 2 && buf->alloced > 10 * BUFFER_ALLOC_SIZE) {
-
-        uint8_t *newbuf = NULL;
-        uint64_t resize = 0;
-        resize = ((rem / BUFFER_ALLOC_SIZE) + 1) * BUFFER_ALLOC_SIZE;
-
-        memmove(buf->bufhead, bhead + sent + offset, rem);
-        newbuf = (uint8_t *)realloc(buf->bufhead, resize);
-        buf->buftail = newbuf + rem;
-        buf->bufhead = newbuf;
-        buf->alloced = resize;
-        buf->deadfront = 0;
-    } else if (buf->alloced - (buf->buftail - buf->bufhead) <
-            0.25 * buf->alloced && buf->deadfront >= 0.25 * buf->alloced) {
-        if (rem > 0) {
-            memmove(buf->bufhead, bhead + sent + offset, rem);
-        }
-        buf->buftail = buf->bufhead + rem;
-        assert(buf->buftail < buf->bufhead + buf->alloced);
-        buf->deadfront = 0;
+    if ((uint64_t)ret < sent) {
+        /* Partial send, move partialfront ahead by whatever we did send. */
+        buf->partialfront += (uint32_t)ret;
+        return ret;
     }
 
+    consume_buffer(buf, sent + buf->partialfront);
     buf->partialfront = 0;
     return sent;
 }
@@ -304,75 +640,42 @@ int transmit_buffered_records_RMQ(export_buffer_t *buf,
         amqp_bytes_t exchange, amqp_bytes_t routing_key,
         uint64_t bytelimit) {
 
+    struct iovec iov;
     uint64_t sent = 0;
-    uint64_t rem = 0;
-    uint8_t *bhead = buf->bufhead + buf->deadfront;
-    uint64_t offset = buf->partialfront;
-    int ret;
-    ii_header_t *header = NULL;
-
-    sent = (buf->buftail - (bhead + offset));
-
-    if (sent > bytelimit) {
-        sent = bytelimit;
-    }
-
-    if (sent != 0) {
-       
-        amqp_bytes_t message_bytes;
-        amqp_basic_properties_t props;
-        message_bytes.len = sent;
-        message_bytes.bytes = bhead + offset;
-
-        props._flags = AMQP_BASIC_DELIVERY_MODE_FLAG;
-        props.delivery_mode = 2;        /* persistent mode */
-
-        int pub_ret = amqp_basic_publish(
-                amqp_state,
-                channel,
-                exchange,
-                routing_key,
-                0, 
-                0, 
-                &props,
-                message_bytes);
-
-        if ( pub_ret != 0 ){
-            logger(LOG_INFO,
-                    "OpenLI: RMQ publish error %d", pub_ret);
-        } else {
-            ret = sent;
-        }
-
-        buf->deadfront += ((uint32_t)ret + buf->partialfront);
+    amqp_bytes_t message_bytes;
+    amqp_basic_properties_t props;
+    int pub_ret;
+
+    /* Each publish has to be a contiguous span, so we only send from the
+     * first chunk here -- anything left over goes in the next publish.
+     */
+    if (fill_buffer_iovecs(buf, &iov, 1, bytelimit, &sent) == 0) {
+        return 0;
     }
 
-    assert(buf->buftail >= buf->bufhead + buf->deadfront);
-    rem = (buf->buftail - (buf->bufhead + buf->deadfront));
-
-    /* Consider shrinking buffer if it is now way too large */
-    if (rem < buf->alloced / 2 && buf->alloced > 10 * BUFFER_ALLOC_SIZE) {
-
-        uint8_t *newbuf = NULL;
-        uint64_t resize = 0;
-        resize = ((rem / BUFFER_ALLOC_SIZE) + 1) * BUFFER_ALLOC_SIZE;
-
-        memmove(buf->bufhead, bhead + sent + offset, rem);
-        newbuf = (uint8_t *)realloc(buf->bufhead, resize);
-        buf->buftail = newbuf + rem;
-        buf->bufhead = newbuf;
-        buf->alloced = resize;
-        buf->deadfront = 0;
-    } else if (buf->alloced - (buf->buftail - buf->bufhead) <
-            0.25 * buf->alloced && buf->deadfront >= 0.25 * buf->alloced) {
-        if (rem > 0) {
-            memmove(buf->bufhead, bhead + sent + offset, rem);
-        }
-        buf->buftail = buf->bufhead + rem;
-        assert(buf->buftail < buf->bufhead + buf->alloced);
-        buf->deadfront = 0;
+    message_bytes.len = sent;
+    message_bytes.bytes = iov.iov_base;
+
+    props._flags = AMQP_BASIC_DELIVERY_MODE_FLAG;
+    props.delivery_mode = 2;        /* persistent mode */
+
+    pub_ret = amqp_basic_publish(
+            amqp_state,
+            channel,
+            exchange,
+            routing_key,
+            0, 
+            0, 
+            &props,
+            message_bytes);
+
+    if ( pub_ret != 0 ){
+        logger(LOG_INFO,
+                "OpenLI: RMQ publish error %d", pub_ret);
+        return -1;
     }
 
+    consume_buffer(buf, sent + buf->partialfront);
     buf->partialfront = 0;
     return sent;
 }
@@ -41,31 +41,86 @@ typedef struct encoder_result {
     uint32_t seqno;
     uint32_t destid;
     char *liid;
-    char *cinstr;
+    uint32_t cin;
     uint8_t encodedby;
     uint8_t isDer;
+
+    /* Set if the record could not be encoded -- the forwarder only needs
+     * this result so that it can stop waiting for the sequence number */
+    uint8_t skipped;
     openli_export_recv_t *origreq;
+    uint64_t queuedns;
 #ifdef HAVE_BER_ENCODING
     wandder_etsili_child_t *child;
 #endif
 } PACKED openli_encoded_result_t;
 
 
+typedef struct export_buffer_chunk export_buffer_chunk_t;
+
+/* A single large mmap'd file in the spill directory, which is carved up
+ * into chunks from the front */
+typedef struct export_spill_segment {
+    uint8_t *base;
+    uint32_t nextchunk;
+    uint32_t inuse;
+} export_spill_segment_t;
+
+struct export_buffer_chunk {
+    uint8_t *data;
+    uint32_t used;
+    /* NULL unless the chunk lives in a spill segment */
+    export_spill_segment_t *segment;
+    export_buffer_chunk_t *next;
+};
+
 typedef struct export_buffer {
-    uint8_t *bufhead;
-    uint8_t *buftail;
+    export_buffer_chunk_t *head;
+    export_buffer_chunk_t *tail;
+    export_buffer_chunk_t *spare;
+    uint32_t sparecount;
+
     uint64_t alloced;
+    uint64_t buffered;
+
+    /* If spilldir is set, chunks beyond the first 'spillthresh' bytes of
+     * memory are backed by mmap'd files in that directory instead */
+    char *spilldir;
+    uint64_t spillthresh;
+    uint64_t spilled;
+
+    /* Segment that new spilled chunks are taken from, plus one emptied
+     * segment that is kept around to be reused */
+    export_spill_segment_t *spillseg;
+    export_spill_segment_t *sparespill;
+
+    /* Records dropped because nothing more could be spilled */
+    uint64_t spilldrops;
+    uint8_t spillfailing;
 
     uint32_t deadfront;
     uint32_t partialfront;
 
     uint64_t nextwarn;
+
+    /* Running totals of bytes added to and removed from the buffer */
+    uint64_t appendedtotal;
+    uint64_t consumedtotal;
 } export_buffer_t;
 
 
+/* Returned by the append functions when a record was dropped because
+ * there was no room to spill it -- the buffer is still usable, but
+ * nothing was added to it */
+#define EXPORT_BUFFER_RECORD_DROPPED ((uint64_t)-1)
+
 void init_export_buffer(export_buffer_t *buf);
 void release_export_buffer(export_buffer_t *buf);
+void set_export_buffer_spill(export_buffer_t *buf, char *spilldir,
+        uint64_t spillthresh);
 uint64_t get_buffered_amount(export_buffer_t *buf);
+uint64_t get_buffer_append_offset(export_buffer_t *buf);
+uint64_t get_buffer_written_offset(export_buffer_t *buf);
 uint64_t append_message_to_buffer(export_buffer_t *buf,
         openli_encoded_result_t *msg, uint32_t beensent);
 uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
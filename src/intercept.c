@@ -45,6 +45,7 @@ static inline void copy_intercept_common(intercept_common_t *src,
     dest->authcc_len = src->authcc_len;
     dest->delivcc_len = src->delivcc_len;
     dest->destid = src->destid;
+    dest->seqtrackerid = src->seqtrackerid;
 }
 
 int are_sip_identities_same(openli_sip_identity_t *a,
@@ -107,12 +107,15 @@ int xmit_handover(med_epoll_ev_t *mev) {
              * we can disable write on this handover and go back to the
              * epoll loop.
              */
+            pthread_mutex_lock(&(ho->ho_state->buf_mutex));
             if (get_buffered_amount(&(ho->ho_state->buf)) == 0) {
                 if (disable_handover_writing(ho) < 0)
                 {
+                    pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
                     return -1;
                 }
             }
+            pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
 
         } else {
             /* Partial send -- try the rest next time */
@@ -137,13 +140,21 @@ int xmit_handover(med_epoll_ev_t *mev) {
      * a time -- we need to go back to our epoll loop to handle other events
      * rather than getting stuck trying to send massive amounts of data in
      * one go.
+     *
+     * The collector receive threads may be appending to the buffer at the
+     * same time, so hold the buffer lock until we've decided whether
+     * writing can be disabled -- otherwise a record that arrives just
+     * after we empty the buffer could be left sitting there.
      */
+    pthread_mutex_lock(&(ho->ho_state->buf_mutex));
     if ((ret = transmit_buffered_records(&(ho->ho_state->buf), mev->fd,
 			16000, NULL)) == -1) {
+        pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
         return -1;
     }
 
     if (ret == 0) {
+        pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
         return 0;
     }
 
@@ -152,9 +163,11 @@ int xmit_handover(med_epoll_ev_t *mev) {
      */
     if (get_buffered_amount(&(ho->ho_state->buf)) == 0) {
         if (disable_handover_writing(ho) < 0) {
+            pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
             return -1;
         }
     }
+    pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
 
     /* Reset the keep alive timer */
     gettimeofday(&tv, NULL);
@@ -269,6 +282,7 @@ static void free_handover(handover_t *ho) {
     if (ho->ho_state) {
     	release_export_buffer(&(ho->ho_state->buf));
 	    pthread_mutex_destroy(&(ho->ho_state->ho_mutex));
+	    pthread_mutex_destroy(&(ho->ho_state->buf_mutex));
         free(ho->ho_state);
     }
 
@@ -416,6 +430,10 @@ static int connect_handover(handover_state_t *state, handover_t *ho) {
 
     /* If we've got records to send via this handover, enable it for
      * write events in epoll.
+     *
+     * No buf_mutex here (we already hold ho_mutex) -- if a receive thread
+     * appends a record concurrently, its call to enable_handover_writing()
+     * will block on ho_mutex and fix outenabled once we're done.
      */
     if (get_buffered_amount(&(ho->ho_state->buf)) > 0) {
         epollev = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
@@ -594,6 +612,7 @@ static handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
     ho->ho_state->kawait = kawait;
 
 	pthread_mutex_init(&(ho->ho_state->ho_mutex), NULL);
+	pthread_mutex_init(&(ho->ho_state->buf_mutex), NULL);
 
     /* Keep alive frequency of 0 (or less) will mean that no keep alives are
      * sent (this may necessary for some agencies).
@@ -658,6 +677,15 @@ static void create_new_agency(handover_state_t *state, liagency_t *lea) {
 			lea->hi3_ipstr, lea->hi3_portstr,
             HANDOVER_HI3, lea->keepalivefreq, lea->keepalivewait);
 
+    if (newagency.hi2) {
+        set_export_buffer_spill(&(newagency.hi2->ho_state->buf),
+                state->spilldir, state->spillthresh);
+    }
+    if (newagency.hi3) {
+        set_export_buffer_spill(&(newagency.hi3->ho_state->buf),
+                state->spilldir, state->spillthresh);
+    }
+
     /* This lock protects the agency list that may be being iterated over
      * by the handover connection thread */
     pthread_mutex_lock(state->agency_mutex);
@@ -51,6 +51,9 @@ typedef struct per_handover_state {
     uint32_t kafreq;
     uint32_t kawait;
     pthread_mutex_t ho_mutex;
+    /* Protects buf, which the collector receive threads append to. If
+     * both are needed, take buf_mutex before ho_mutex. */
+    pthread_mutex_t buf_mutex;
 } per_handover_state_t;
 
 typedef struct handover {
@@ -71,6 +74,8 @@ typedef struct handover_state {
     pthread_mutex_t *agency_mutex;
     int halt_flag;
     pthread_t connectthread;
+    char *spilldir;
+    uint64_t spillthresh;
 } handover_state_t;
 
 typedef struct mediator_agency {
@@ -24,11 +24,40 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <Judy.h>
 #include "liidmapping.h"
 #include "med_epoll.h"
 #include "logger.h"
 
+/** Initialises the locks that protect an LIID map.
+ *
+ *  @param map          The LIID map to initialise the locks for
+ */
+void init_liid_map_locks(liid_map_t *map) {
+    pthread_rwlockattr_t attr;
+
+    /* Mapping changes are rare, but the receive threads will take the read
+     * lock for every record so make sure that writers don't get starved.
+     */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(map->maplock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    pthread_mutex_init(&(map->missing_mutex), NULL);
+}
+
+/** Destroys the locks that protect an LIID map.
+ *
+ *  @param map          The LIID map to destroy the locks for
+ */
+void destroy_liid_map_locks(liid_map_t *map) {
+    pthread_rwlock_destroy(&(map->maplock));
+    pthread_mutex_destroy(&(map->missing_mutex));
+}
+
 /** Finds an LIID in an LIID map and returns its corresponding agency
  *
  *  @param map          The LIID map to search
@@ -105,10 +134,12 @@ int add_liid_agency_mapping(liid_map_t *map, char *liidstr,
         /* If this was previously a "unknown" LIID, we can now remove
          * it from our missing LIID list -- if it gets withdrawn later,
          * we will then alert again about it being missing. */
+        pthread_mutex_lock(&(map->missing_mutex));
         JSLG(jval, map->missing_liids, (unsigned char *)liidstr);
         if (jval != NULL) {
             JSLD(err, map->missing_liids, (unsigned char *)liidstr);
         }
+        pthread_mutex_unlock(&(map->missing_mutex));
     }
     m->liid = liidstr;
     m->agency = agency;
@@ -134,8 +165,10 @@ int add_liid_agency_mapping(liid_map_t *map, char *liidstr,
 int add_missing_liid(liid_map_t *map, char *liidstr) {
     PWord_t jval;
 
+    pthread_mutex_lock(&(map->missing_mutex));
     JSLI(jval, map->missing_liids, (unsigned char *)liidstr);
     if (jval == NULL) {
+        pthread_mutex_unlock(&(map->missing_mutex));
         logger(LOG_INFO, "OpenLI Mediator: OOM when allocating memory for missing LIID.");
         return -1;
     }
@@ -145,6 +178,7 @@ int add_missing_liid(liid_map_t *map, char *liidstr) {
     }
 
     (*jval) = 1;
+    pthread_mutex_unlock(&(map->missing_mutex));
     return 0;
 }
 
@@ -186,6 +220,8 @@ void purge_liid_map(liid_map_t *map) {
 void purge_missing_liids(liid_map_t *map) {
     Word_t bytes;
 
+    pthread_mutex_lock(&(map->missing_mutex));
     JSLFA(bytes, map->missing_liids);
+    pthread_mutex_unlock(&(map->missing_mutex));
 }
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
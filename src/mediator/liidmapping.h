@@ -28,6 +28,7 @@
 #define OPENLI_LIID_AGENCY_MAPPING_H_
 
 #include <Judy.h>
+#include <pthread.h>
 #include "med_epoll.h"
 #include "handover.h"
 
@@ -53,8 +54,31 @@ typedef struct liid_map {
 	Pvoid_t liid_array;
     /** A set of LIIDs which have no known corresponding agency (yet) */
 	Pvoid_t missing_liids;
+
+    /** Must be held for reading by the collector receive threads while
+     *  they use a mapping (and the agency it points to), and for writing
+     *  by anything that changes or frees mappings or agencies.
+     */
+    pthread_rwlock_t maplock;
+
+    /** Protects the missing LIID set, which the collector receive
+     *  threads can add to while only holding the read lock.
+     */
+    pthread_mutex_t missing_mutex;
 } liid_map_t;
 
+/** Initialises the locks that protect an LIID map.
+ *
+ *  @param map          The LIID map to initialise the locks for
+ */
+void init_liid_map_locks(liid_map_t *map);
+
+/** Destroys the locks that protect an LIID map.
+ *
+ *  @param map          The LIID map to destroy the locks for
+ */
+void destroy_liid_map_locks(liid_map_t *map);
+
 /** Finds an LIID in an LIID map and returns its corresponding agency
  *
  *  @param map          The LIID map to search
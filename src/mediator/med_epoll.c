@@ -246,4 +246,33 @@ int remove_mediator_fdevent(med_epoll_ev_t *remev) {
 	return ret;
 }
 
+/** Moves a mediator epoll event for an active file descriptor to a
+ *  different epoll fd.
+ *
+ *  @param mev              The epoll event to move.
+ *  @param epoll_fd         The epoll fd that the event should be moved to.
+ *  @param events           The epoll events to apply to the fd, as a bitmask.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int move_mediator_fdevent(med_epoll_ev_t *mev, int epoll_fd, uint32_t events) {
+    struct epoll_event ev;
+
+    if (mev == NULL || mev->fd == -1) {
+        return -1;
+    }
+
+    if (epoll_ctl(mev->epoll_fd, EPOLL_CTL_DEL, mev->fd, &ev) < 0) {
+        return -1;
+    }
+
+    ev.data.ptr = (void *)mev;
+    ev.events = events;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mev->fd, &ev) < 0) {
+        return -1;
+    }
+    mev->epoll_fd = epoll_fd;
+    return 0;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -191,6 +191,18 @@ int modify_mediator_fdevent(med_epoll_ev_t *modev, uint32_t events);
  */
 int remove_mediator_fdevent(med_epoll_ev_t *remev);
 
+/** Moves a mediator epoll event for an active file descriptor to a
+ *  different epoll fd, e.g. to hand a collector socket over to one of
+ *  the collector receive threads.
+ *
+ *  @param mev              The epoll event to move.
+ *  @param epoll_fd         The epoll fd that the event should be moved to.
+ *  @param events           The epoll events to apply to the fd, as a bitmask.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int move_mediator_fdevent(med_epoll_ev_t *mev, int epoll_fd, uint32_t events);
+
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
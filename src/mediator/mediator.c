@@ -114,6 +114,9 @@ static void clear_med_config(mediator_state_t *state) {
     if (state->pcapdirectory) {
         free(state->pcapdirectory);
     }
+    if (state->spilldir) {
+        free(state->spilldir);
+    }
     if (state->operatorid) {
         free(state->operatorid);
     }
@@ -137,6 +140,9 @@ static void destroy_med_state(mediator_state_t *state) {
     PWord_t jval;
     Word_t bytes;
 
+    /* Stop the collector receive threads and drop their collectors */
+    destroy_med_collector_state(&(state->collectors));
+
     /* Remove all known LIIDs */
     purge_liid_map(&(state->liidmap));
 
@@ -146,10 +152,9 @@ static void destroy_med_state(mediator_state_t *state) {
     /* Tear down the connection to the provisioner */
     free_provisioner(&(state->provisioner));
 
-    destroy_med_collector_state(&(state->collectors));
-
     /* Delete all of the agencies and shut down any active handovers */
     drop_all_agencies(&(state->handover_state));
+    destroy_liid_map_locks(&(state->liidmap));
 
     libtrace_list_deinit(state->handover_state.agencies);
 
@@ -246,6 +251,9 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
 
     state->operatorid = NULL;
     state->pcapdirectory = NULL;
+    state->spilldir = NULL;
+    state->spillthresh = 1024;
+    state->collthreads = 1;
     state->pcapthread = -1;
     state->pcaprotatefreq = 30;
     state->listenerev = NULL;
@@ -259,6 +267,8 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
     state->handover_state.agency_mutex = calloc(1, sizeof(pthread_mutex_t));
     state->handover_state.connectthread = -1;
     state->handover_state.next_handover_id = 1;
+    state->handover_state.spilldir = NULL;
+    state->handover_state.spillthresh = 0;
 
     pthread_mutex_init(state->handover_state.agency_mutex, NULL);
 
@@ -321,10 +331,13 @@ static void prepare_mediator_state(mediator_state_t *state) {
 
     state->handover_state.agencies = libtrace_list_init(sizeof(mediator_agency_t));
     state->handover_state.epoll_fd = state->epoll_fd;
+    state->handover_state.spilldir = state->spilldir;
+    state->handover_state.spillthresh = state->spillthresh * 1024 * 1024;
     state->provisioner.epoll_fd = state->epoll_fd;
     state->collectors.epoll_fd = state->epoll_fd;
     state->collectors.collectors =
             libtrace_list_init(sizeof(active_collector_t *));
+    init_liid_map_locks(&(state->liidmap));
     
     /* Use an fd to catch signals during our main epoll loop, so that we
      * can provide our own signal handling without causing epoll_wait to
@@ -407,13 +420,18 @@ static int trigger_keepalive(mediator_state_t *state, med_epoll_ev_t *mev) {
     wandder_etsipshdr_data_t hdrdata;
     char elemstring[16];
     char liidstring[24];
+    uint64_t buffered;
 
     if (ho->outev == NULL) {
         return 0;
     }
 
-    if (ho->ho_state->pending_ka == NULL &&
-            get_buffered_amount(&(ho->ho_state->buf)) == 0) {
+    /* The collector receive threads may be appending to the buffer */
+    pthread_mutex_lock(&(ho->ho_state->buf_mutex));
+    buffered = get_buffered_amount(&(ho->ho_state->buf));
+    pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
+
+    if (ho->ho_state->pending_ka == NULL && buffered == 0) {
         /* Only create a new KA message if we have sent the last one we
          * had queued up.
          * Also only create one if we don't already have data to send. We
@@ -573,7 +591,9 @@ static int receive_lea_withdrawal(mediator_state_t *state, uint8_t *msgbody,
                 lea.agencyid);
     }
 
+    pthread_rwlock_wrlock(&(state->liidmap.maplock));
     withdraw_agency(&(state->handover_state), lea.agencyid);
+    pthread_rwlock_unlock(&(state->liidmap.maplock));
     return 0;
 }
 
@@ -588,6 +608,7 @@ static int receive_lea_announce(mediator_state_t *state, uint8_t *msgbody,
         uint16_t msglen) {
 
     liagency_t lea;
+    int ret;
 
     /* Call into netcomms.c to decode the message */
     if (decode_lea_announcement(msgbody, msglen, &lea) == -1) {
@@ -605,7 +626,11 @@ static int receive_lea_announce(mediator_state_t *state, uint8_t *msgbody,
                 lea.hi2_ipstr, lea.hi2_portstr, lea.hi3_ipstr, lea.hi3_portstr);
     }
 
-    return enable_agency(&(state->handover_state), &lea);
+    /* The receive threads may be using this agency's handovers */
+    pthread_rwlock_wrlock(&(state->liidmap.maplock));
+    ret = enable_agency(&(state->handover_state), &lea);
+    pthread_rwlock_unlock(&(state->liidmap.maplock));
+    return ret;
 }
 
 /* Given a received ETSI record, determine which agency it should be
@@ -620,6 +645,9 @@ static int receive_lea_announce(mediator_state_t *state, uint8_t *msgbody,
  * @param liidlen[out]  The number of bytes to strip from the front of the
  *                      message to reach the start of the actual ETSI record
  *
+ * The caller must hold the LIID map lock for reading until it is finished
+ * with the returned mapping.
+ *
  * @return A pointer to the LIID->agency mapping that this record corresponds
  *         to, or NULL if the LIID is not known by this mediator.
  */
@@ -656,6 +684,12 @@ static liid_map_entry_t *match_etsi_to_agency(mediator_state_t *state,
 static int enqueue_etsi(mediator_state_t *state, handover_t *ho,
         uint8_t *etsimsg, uint16_t msglen) {
 
+    int ret = 0;
+
+    /* Multiple receive threads can be writing to the same handover, and
+     * the main thread may be transmitting from it at the same time.
+     */
+    pthread_mutex_lock(&(ho->ho_state->buf_mutex));
     if (append_etsipdu_to_buffer(&(ho->ho_state->buf), etsimsg,
             (uint32_t)msglen, 0) == 0) {
 
@@ -664,15 +698,14 @@ static int enqueue_etsi(mediator_state_t *state, handover_t *ho,
                 "OpenLI Mediator: was unable to enqueue ETSI PDU for handover %s:%s HI%d",
                 ho->ipstr, ho->portstr, ho->handover_type);
         }
-        return -1;
+        ret = -1;
+    } else if (enable_handover_writing(ho) < 0) {
+        /* Got something to send, so make sure we are enable EPOLLOUT */
+        ret = -1;
     }
+    pthread_mutex_unlock(&(ho->ho_state->buf_mutex));
 
-    /* Got something to send, so make sure we are enable EPOLLOUT */
-    if (enable_handover_writing(ho) < 0) {
-        return -1;
-    }
-
-    return 0;
+    return ret;
 }
 
 /** Parse and action an instruction from a provisioner to remove an
@@ -758,7 +791,9 @@ static inline int remove_mediator_liid_mapping(mediator_state_t *state,
 
     liid_map_entry_t *m = (liid_map_entry_t *)(mev->state);
 
+    pthread_rwlock_wrlock(&(state->liidmap.maplock));
     remove_liid_agency_mapping(&(state->liidmap), m->liid);
+    pthread_rwlock_unlock(&(state->liidmap.maplock));
 
     /* Make sure that the timer event is removed from epoll */
     halt_mediator_timer(mev);
@@ -825,7 +860,11 @@ static int receive_liid_mapping(mediator_state_t *state, uint8_t *msgbody,
     }
     free(agencyid);
 
-    if (add_liid_agency_mapping(&(state->liidmap), liid, agency) < 0) {
+    pthread_rwlock_wrlock(&(state->liidmap.maplock));
+    err = add_liid_agency_mapping(&(state->liidmap), liid, agency);
+    pthread_rwlock_unlock(&(state->liidmap.maplock));
+
+    if (err < 0) {
         return -1;
     }
 
@@ -921,6 +960,10 @@ static int receive_provisioner(mediator_state_t *state, med_epoll_ev_t *mev) {
 /** Receives and actions a message from a collector, which can include
  *  an encoded ETSI CC or IRI.
  *
+ *  This is called by the collector receive threads (or the main thread
+ *  for collectors using RabbitMQ), so the LIID map must be read-locked
+ *  while each record is being matched and queued.
+ *
  *  @param state            The global state for this mediator.
  *  @param mev              The epoll event for the collector socket.
  *
@@ -936,6 +979,7 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
     openli_proto_msgtype_t msgtype;
     mediator_pcap_msg_t pcapmsg;
     uint16_t liidlen;
+    int ret = 0;
 
     do {
         if (mev->fdtype == MED_EPOLL_COL_RMQ) {
@@ -968,9 +1012,11 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                 /* This is a raw IP packet capture, rather than a properly
                  * encoded ETSI CC. */
                 /* msgbody should be an LIID + an IP packet */
+                pthread_rwlock_rdlock(&(state->liidmap.maplock));
                 thisint = match_etsi_to_agency(state, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
+                    pthread_rwlock_unlock(&(state->liidmap.maplock));
                     break;
                 }
                 if (cs->disabled_log == 1) {
@@ -985,13 +1031,15 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                     pcapmsg.msglen = msglen;
                     libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
                 }
-
+                pthread_rwlock_unlock(&(state->liidmap.maplock));
                 break;
             case OPENLI_PROTO_ETSI_CC:
                 /* msgbody should contain an LIID + a full ETSI CC record */
+                pthread_rwlock_rdlock(&(state->liidmap.maplock));
                 thisint = match_etsi_to_agency(state, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
+                    pthread_rwlock_unlock(&(state->liidmap.maplock));
                     break;
                 }
                 if (cs->disabled_log == 1) {
@@ -1006,28 +1054,35 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                             msglen - liidlen);
                     pcapmsg.msglen = msglen - liidlen;
                     libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
-                } else if (enqueue_etsi(state, thisint->agency->hi3,
-                        msgbody + liidlen, msglen - liidlen) == -1) {
+                } else {
+                    ret = enqueue_etsi(state, thisint->agency->hi3,
+                            msgbody + liidlen, msglen - liidlen);
+                }
+                pthread_rwlock_unlock(&(state->liidmap.maplock));
+                if (ret == -1) {
                     return -1;
                 }
                 break;
             case OPENLI_PROTO_ETSI_IRI:
                 /* msgbody should contain an LIID + a full ETSI IRI record */
+                pthread_rwlock_rdlock(&(state->liidmap.maplock));
                 thisint = match_etsi_to_agency(state, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
+                    pthread_rwlock_unlock(&(state->liidmap.maplock));
                     break;
                 }
                 if (cs->disabled_log == 1) {
                     reenable_collector_logging(&(state->collectors), cs);
                 }
-                if (thisint->agency == NULL) {
-                    /* Destined for a pcap file rather than an agency */
-                    /* IRIs don't make sense for a pcap, so just ignore it */
-                    break;
+                /* Destined for a pcap file rather than an agency */
+                /* IRIs don't make sense for a pcap, so just ignore it */
+                if (thisint->agency != NULL) {
+                    ret = enqueue_etsi(state, thisint->agency->hi2,
+                            msgbody + liidlen, msglen - liidlen);
                 }
-                if (enqueue_etsi(state, thisint->agency->hi2, msgbody + liidlen,
-                            msglen - liidlen) == -1) {
+                pthread_rwlock_unlock(&(state->liidmap.maplock));
+                if (ret == -1) {
                     return -1;
                 }
                 break;
@@ -1044,6 +1099,18 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
     return 0;
 }
 
+/** Callback used by the collector receive threads to process records
+ *  from a collector socket.
+ *
+ *  @param data             The global state for this mediator.
+ *  @param mev              The epoll event for the collector socket.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int receive_collector_cb(void *data, med_epoll_ev_t *mev) {
+    return receive_collector((mediator_state_t *)data, mev);
+}
+
 /** React to an event on a file descriptor reported by our epoll loop.
  *
  *  @param state            The global state for the mediator
@@ -1252,6 +1319,7 @@ static inline void drop_provisioner(mediator_state_t *currstate) {
      * from the old provisioner (just to be safe). */
 
     /* Purge the LIID->agency mappings */
+    pthread_rwlock_wrlock(&(currstate->liidmap.maplock));
     purge_liid_map(&(currstate->liidmap));
 
     disconnect_provisioner(&(currstate->provisioner), 1);
@@ -1259,6 +1327,7 @@ static inline void drop_provisioner(mediator_state_t *currstate) {
     /* Dump all known agencies -- we'll get new ones when we get a usable
      * provisioner again */
     drop_all_agencies(&(currstate->handover_state));
+    pthread_rwlock_unlock(&(currstate->liidmap.maplock));
 
 }
 
@@ -1659,6 +1728,14 @@ int main(int argc, char *argv[]) {
     pthread_create(&(medstate.pcapthread), NULL, start_pcap_thread,
             &(medstate.pcapqueue));
 
+    /* Start the threads that receive records from connected collectors */
+    if (start_collector_workers(&(medstate.collectors), medstate.collthreads,
+            receive_collector_cb, &medstate) < 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: could not start collector receive threads.");
+        return 1;
+    }
+
     /* Start the thread that listens for connections from collectors */
     if (start_collector_listener(&medstate) == -1) {
         logger(LOG_INFO,
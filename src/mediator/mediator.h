@@ -69,6 +69,18 @@ typedef struct med_state {
     /** Directory in which any pcap files should be written */
     char *pcapdirectory;
 
+    /** Directory to spill buffered handover records into once a handover
+     *  has buffered more than spillthresh MB in memory (NULL to disable) */
+    char *spilldir;
+
+    /** Amount of memory (in MB) that a handover may use for buffering
+     *  before spilling to disk */
+    uint64_t spillthresh;
+
+    /** The number of threads to use for receiving records from
+     *  collectors */
+    uint32_t collthreads;
+
     /** State for managing all connected handovers */
     handover_state_t handover_state;
 
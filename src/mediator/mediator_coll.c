@@ -30,6 +30,7 @@
 #include "logger.h"
 #include <unistd.h>
 #include <assert.h>
+#include <sys/epoll.h>
 
 /** Initialises the state for the collectors managed by a mediator.
  *
@@ -53,6 +54,11 @@ void init_med_collector_state(mediator_collector_t *medcol, uint8_t *usetls,
     medcol->epoll_fd = -1;
     medcol->rmqconf = rmqconf;
     medcol->parent_mediatorid = mediatorid;
+    medcol->workers = NULL;
+    medcol->workercount = 0;
+    medcol->recv_cb = NULL;
+    medcol->recv_data = NULL;
+    pthread_mutex_init(&(medcol->disabled_mutex), NULL);
 }
 
 /** Destroys the state for the collectors managed by mediator, including
@@ -65,6 +71,9 @@ void destroy_med_collector_state(mediator_collector_t *medcol) {
 
     unsigned char index[1024];
     disabled_collector_t *discol, *dtmp;
+    int i;
+
+    halt_collector_workers(medcol);
 
     /* Purge the disabled collector list */
     index[0] = '\0';
@@ -77,6 +86,199 @@ void destroy_med_collector_state(mediator_collector_t *medcol) {
     /* Dump all connected collectors */
     drop_all_collectors(medcol);
 
+    for (i = 0; i < medcol->workercount; i++) {
+        close(medcol->workers[i].epoll_fd);
+        pthread_mutex_destroy(&(medcol->workers[i].mutex));
+    }
+    free(medcol->workers);
+    medcol->workers = NULL;
+    medcol->workercount = 0;
+
+    pthread_mutex_destroy(&(medcol->disabled_mutex));
+}
+
+/** Main loop for a thread that receives records from the collectors that
+ *  have been assigned to it.
+ *
+ *  @param arg      The state for this collector receive thread
+ */
+static void *collector_worker_thread(void *arg) {
+    coll_worker_t *w = (coll_worker_t *)arg;
+    mediator_collector_t *medcol = w->parent;
+    struct epoll_event evs[64];
+    med_epoll_ev_t *mev;
+    uint32_t gen;
+    int i, nfds, ret;
+
+    while (!w->halt) {
+        pthread_mutex_lock(&(w->mutex));
+        gen = w->generation;
+        pthread_mutex_unlock(&(w->mutex));
+
+        /* Short timeout so that we notice the halt flag reasonably quickly */
+        nfds = epoll_wait(w->epoll_fd, evs, 64, 250);
+        if (nfds < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while waiting for epoll events in collector thread %d: %s.",
+                    w->workerid, strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&(w->mutex));
+        if (gen != w->generation) {
+            /* Some of our collectors were dropped while we were waiting,
+             * so our events may refer to freed state. Anything that is
+             * still readable will be reported again next time around.
+             */
+            pthread_mutex_unlock(&(w->mutex));
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            mev = (med_epoll_ev_t *)(evs[i].data.ptr);
+            ret = 0;
+            if (evs[i].events & EPOLLRDHUP) {
+                ret = -1;
+            } else if (evs[i].events & EPOLLIN) {
+                ret = medcol->recv_cb(medcol->recv_data, mev);
+            }
+            if (ret == -1) {
+                drop_collector(medcol, mev, 1);
+            }
+        }
+        pthread_mutex_unlock(&(w->mutex));
+    }
+
+    pthread_exit(NULL);
+}
+
+/** Starts the threads that will receive records from connected collectors.
+ *
+ *  @param medcol       The global state for collectors seen by this mediator
+ *  @param count        The number of receive threads to start
+ *  @param recv_cb      The function to call when a collector socket has
+ *                      records available to be read
+ *  @param recv_data    The data to pass into recv_cb
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int start_collector_workers(mediator_collector_t *medcol, int count,
+        collector_recv_cb_t recv_cb, void *recv_data) {
+
+    int i;
+    coll_worker_t *w;
+
+    medcol->recv_cb = recv_cb;
+    medcol->recv_data = recv_data;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    medcol->workers = (coll_worker_t *)calloc(count, sizeof(coll_worker_t));
+
+    for (i = 0; i < count; i++) {
+        w = &(medcol->workers[i]);
+        w->workerid = i;
+        w->parent = medcol;
+        w->generation = 0;
+        w->collectorcount = 0;
+        w->halt = 0;
+        pthread_mutex_init(&(w->mutex), NULL);
+
+        w->epoll_fd = epoll_create1(0);
+        if (w->epoll_fd < 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to create epoll fd for collector thread %d: %s",
+                    i, strerror(errno));
+            pthread_mutex_destroy(&(w->mutex));
+            break;
+        }
+
+        if (pthread_create(&(w->threadid), NULL, collector_worker_thread,
+                w) != 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to start collector thread %d",
+                    i);
+            close(w->epoll_fd);
+            pthread_mutex_destroy(&(w->mutex));
+            break;
+        }
+        medcol->workercount ++;
+    }
+
+    if (medcol->workercount == 0) {
+        free(medcol->workers);
+        medcol->workers = NULL;
+        return -1;
+    }
+
+    logger(LOG_INFO,
+            "OpenLI Mediator: started %d collector receive threads.",
+            medcol->workercount);
+    return 0;
+}
+
+/** Halts and joins all of the collector receive threads.
+ *
+ *  @param medcol       The global state for collectors seen by this mediator
+ */
+void halt_collector_workers(mediator_collector_t *medcol) {
+    int i;
+
+    for (i = 0; i < medcol->workercount; i++) {
+        medcol->workers[i].halt = 1;
+    }
+
+    for (i = 0; i < medcol->workercount; i++) {
+        pthread_join(medcol->workers[i].threadid, NULL);
+    }
+}
+
+/** Hands a collector whose connection is ready to receive records over to
+ *  the least busy collector receive thread.
+ *
+ *  Collectors that are using RabbitMQ remain with the main thread, since
+ *  their RMQ connections are serviced from there.
+ *
+ *  @param medcol       The global state for collectors seen by this mediator
+ *  @param col          The collector to be handed over
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int assign_collector_to_worker(mediator_collector_t *medcol,
+        active_collector_t *col) {
+
+    coll_worker_t *w;
+    int i;
+
+    if (medcol->workercount == 0 || medcol->rmqconf->enabled) {
+        return 0;
+    }
+
+    w = &(medcol->workers[0]);
+    for (i = 1; i < medcol->workercount; i++) {
+        if (medcol->workers[i].collectorcount < w->collectorcount) {
+            w = &(medcol->workers[i]);
+        }
+    }
+
+    pthread_mutex_lock(&(w->mutex));
+    if (move_mediator_fdevent(col->colev, w->epoll_fd,
+            EPOLLIN | EPOLLRDHUP) < 0) {
+        pthread_mutex_unlock(&(w->mutex));
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to move collector fd to collector thread %d: %s.",
+                w->workerid, strerror(errno));
+        return -1;
+    }
+    col->worker = w;
+    w->collectorcount ++;
+    pthread_mutex_unlock(&(w->mutex));
+    return 0;
 }
 
 /** Accepts a connection from a collector and prepares to receive encoded
@@ -121,6 +323,7 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
 
     col = (active_collector_t *)calloc(1, sizeof(active_collector_t));
     col->ssl = NULL;
+    col->worker = NULL;
 
     if (*(medcol->usingtls)) {
         /* We're using TLS so create an OpenSSL socket */
@@ -195,8 +398,10 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
     }
 
     /* Check if this is a reconnection case */
+    pthread_mutex_lock(&(medcol->disabled_mutex));
     HASH_FIND(hh, medcol->disabledcols, mstate->ipaddr,
             strlen(mstate->ipaddr), discol);
+    pthread_mutex_unlock(&(medcol->disabled_mutex));
 
     if (discol) {
         mstate->disabled_log = 1;
@@ -210,6 +415,12 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
     /* Add this collector to the set of active collectors */
     libtrace_list_push_back(medcol->collectors, &col);
 
+    if (fdtype == MED_EPOLL_COLLECTOR &&
+            assign_collector_to_worker(medcol, col) < 0) {
+        drop_collector(medcol, col->colev, 0);
+        return -1;
+    }
+
     return newfd;
 
 acceptfail:
@@ -282,6 +493,9 @@ int continue_collector_handshake(mediator_collector_t *medcol,
         }
     }
     mev->fdtype = MED_EPOLL_COLLECTOR;
+    if (assign_collector_to_worker(medcol, cs->owner) < 0) {
+        return -1;
+    }
     return 1;
 }
 
@@ -312,6 +526,7 @@ void drop_collector(mediator_collector_t *medcol,
         disabled_collector_t *discol;
 
         /* Add this collector to the disabled collectors list. */
+        pthread_mutex_lock(&(medcol->disabled_mutex));
         HASH_FIND(hh, medcol->disabledcols, mstate->ipaddr,
                 strlen(mstate->ipaddr), discol);
         if (discol == NULL) {
@@ -323,6 +538,7 @@ void drop_collector(mediator_collector_t *medcol,
             HASH_ADD_KEYPTR(hh, medcol->disabledcols, discol->ipaddr,
                     strlen(discol->ipaddr), discol);
         }
+        pthread_mutex_unlock(&(medcol->disabled_mutex));
     }
 
     if (mstate && mstate->incoming) {
@@ -353,6 +569,10 @@ void drop_collector(mediator_collector_t *medcol,
         }
         mstate->owner->rmqev = NULL;
         mstate->owner->colev = NULL;
+        if (mstate->owner->worker) {
+            mstate->owner->worker->collectorcount --;
+            mstate->owner->worker = NULL;
+        }
     }
 
     free(mstate);
@@ -367,6 +587,14 @@ void drop_all_collectors(mediator_collector_t *medcol) {
     /* TODO send disconnect messages to all collectors? */
     libtrace_list_node_t *n;
     active_collector_t *col;
+    int i;
+
+    /* Stop the receive threads from touching any collectors while we
+     * are dropping them */
+    for (i = 0; i < medcol->workercount; i++) {
+        pthread_mutex_lock(&(medcol->workers[i].mutex));
+        medcol->workers[i].generation ++;
+    }
 
     n = medcol->collectors->head;
     while (n) {
@@ -380,6 +608,10 @@ void drop_all_collectors(mediator_collector_t *medcol) {
     }
 
     libtrace_list_deinit(medcol->collectors);
+
+    for (i = 0; i < medcol->workercount; i++) {
+        pthread_mutex_unlock(&(medcol->workers[i].mutex));
+    }
 }
 
 /** Re-enables log messages for a collector that has re-connected.
@@ -394,6 +626,7 @@ void reenable_collector_logging(mediator_collector_t *medcol,
     disabled_collector_t *discol = NULL;
 
     cs->disabled_log = 0;
+    pthread_mutex_lock(&(medcol->disabled_mutex));
     HASH_FIND(hh, medcol->disabledcols, cs->ipaddr, strlen(cs->ipaddr), discol);
     if (discol) {
         HASH_DELETE(hh, medcol->disabledcols, discol);
@@ -402,6 +635,7 @@ void reenable_collector_logging(mediator_collector_t *medcol,
         logger(LOG_INFO, "collector %s has successfully re-connected",
                 cs->ipaddr);
     }
+    pthread_mutex_unlock(&(medcol->disabled_mutex));
 }
 
 void service_RMQ_connections(mediator_collector_t *medcol) {
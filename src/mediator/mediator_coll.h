@@ -27,6 +27,7 @@
 #ifndef OPENLI_MEDIATOR_COLL_H_
 #define OPENLI_MEDIATOR_COLL_H_
 
+#include <pthread.h>
 #include <uthash.h>
 #include <libtrace/linked_list.h>
 #include <amqp.h>
@@ -35,6 +36,48 @@
 #include "openli_tls.h"
 
 typedef struct active_collector active_collector_t;
+typedef struct mediator_collector_glob_state mediator_collector_t;
+
+/** Callback used by the collector receive threads to process any records
+ *  that are available on a collector socket. Returns -1 if the collector
+ *  should be dropped.
+ */
+typedef int (*collector_recv_cb_t)(void *data, med_epoll_ev_t *mev);
+
+/** State for a thread that receives ETSI records from a subset of the
+ *  connected collectors.
+ */
+typedef struct coll_worker {
+    /** The index of this worker, for logging */
+    int workerid;
+
+    /** The epoll fd for the collector sockets assigned to this worker */
+    int epoll_fd;
+
+    /** The pthread ID for this worker */
+    pthread_t threadid;
+
+    /** Held by the worker while it is acting on collector events, and
+     *  by the main thread whenever it needs to drop collectors that have
+     *  been assigned to this worker.
+     */
+    pthread_mutex_t mutex;
+
+    /** Incremented whenever the main thread removes collectors from this
+     *  worker, so that the worker can discard any events that it received
+     *  for those collectors before it was able to grab the mutex.
+     */
+    uint32_t generation;
+
+    /** The number of collectors currently assigned to this worker */
+    int collectorcount;
+
+    /** Set by the main thread when this worker should exit */
+    volatile int halt;
+
+    /** The collector state that this worker belongs to */
+    mediator_collector_t *parent;
+} coll_worker_t;
 
 /** Describes a collector which has been temporarily disabled, e.g. due to
  *  a connection breaking down.
@@ -86,12 +129,16 @@ struct active_collector {
 
     /** The SSL socket for this collector connection, if required */
     SSL *ssl;
+
+    /** The receive thread that this collector is assigned to, or NULL if
+     *  the collector is handled by the main thread */
+    coll_worker_t *worker;
 };
 
 /** Structure for storing global state for all collectors managed by a
  *  mediator instance.
  */
-typedef struct mediator_collector_glob_state {
+struct mediator_collector_glob_state {
     /* The error code for the most recent SSL error when accepting a collector
      * connection.
      */
@@ -119,7 +166,23 @@ typedef struct mediator_collector_glob_state {
 
     /** The ID of the mediator instance */
     uint32_t parent_mediatorid;
-} mediator_collector_t;
+
+    /** Protects the disabled collector map, which is also accessed by the
+     *  collector receive threads */
+    pthread_mutex_t disabled_mutex;
+
+    /** The threads that receive records from connected collectors */
+    coll_worker_t *workers;
+
+    /** The number of collector receive threads */
+    int workercount;
+
+    /** The function to call when a collector has records to be read */
+    collector_recv_cb_t recv_cb;
+
+    /** The data to pass into recv_cb */
+    void *recv_data;
+};
 
 /** Initialises the state for the collectors managed by a mediator.
  *
@@ -194,6 +257,25 @@ void drop_all_collectors(mediator_collector_t *medcol);
 void reenable_collector_logging(mediator_collector_t *medcol,
         single_coll_state_t *cs);
 
+/** Starts the threads that will receive records from connected collectors.
+ *
+ *  @param medcol       The global state for collectors seen by this mediator
+ *  @param count        The number of receive threads to start
+ *  @param recv_cb      The function to call when a collector socket has
+ *                      records available to be read
+ *  @param recv_data    The data to pass into recv_cb
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int start_collector_workers(mediator_collector_t *medcol, int count,
+        collector_recv_cb_t recv_cb, void *recv_data);
+
+/** Halts and joins all of the collector receive threads.
+ *
+ *  @param medcol       The global state for collectors seen by this mediator
+ */
+void halt_collector_workers(mediator_collector_t *medcol);
+
 int receive_rmq_invite(mediator_collector_t *medcol,
         single_coll_state_t *mstate);
 
@@ -1500,6 +1500,7 @@ int decode_coreserver_announcement(uint8_t *msgbody, uint16_t len,
     cs->ipstr = NULL;
     cs->portstr = NULL;
     cs->info = NULL;
+    cs->resolved = 0;
     cs->awaitingconfirm = 0;
     cs->serverkey = NULL;
 
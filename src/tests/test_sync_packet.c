@@ -0,0 +1,244 @@
+/*
+ *
+ * Copyright (c) 2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Copies packets read from a real libtrace input into the sync packet pool
+ * (as the processing threads do), keeps them outstanding while the input
+ * is still running and then releases them again. The released slots must
+ * come back detached from the input trace so that no format callback is
+ * ever run on a buffer that libtrace does not own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libtrace.h>
+
+#include "sync_packet.h"
+
+#define TEST_PACKETS 64
+
+static int fail(const char *msg) {
+    fprintf(stderr, "test_sync_packet: %s\n", msg);
+    return 1;
+}
+
+static int write_test_trace(const char *uri) {
+    libtrace_out_t *out;
+    libtrace_packet_t *pkt;
+    uint8_t frame[4000];
+    int i, len;
+
+    out = trace_create_output(uri);
+    if (trace_is_err_output(out)) {
+        trace_perror_output(out, "creating test trace");
+        trace_destroy_output(out);
+        return -1;
+    }
+    if (trace_start_output(out) < 0) {
+        trace_perror_output(out, "starting test trace");
+        trace_destroy_output(out);
+        return -1;
+    }
+
+    pkt = trace_create_packet();
+    for (i = 0; i < TEST_PACKETS; i++) {
+        /* every eighth packet is too big for a pool slot */
+        len = (i % 8 == 7) ? 3000 : 60 + (i * 23);
+
+        memset(frame, 0, sizeof(frame));
+        memset(frame, 0xaa, 12);
+        frame[12] = 0x08;
+        frame[13] = 0x00;
+        memset(frame + 14, i, len - 14);
+        trace_construct_packet(pkt, TRACE_TYPE_ETH, frame, len);
+        if (trace_write_packet(out, pkt) < 0) {
+            trace_perror_output(out, "writing test trace");
+            break;
+        }
+    }
+    trace_destroy_packet(pkt);
+    trace_destroy_output(out);
+    return (i == TEST_PACKETS) ? 0 : -1;
+}
+
+static int find_slot(void *slot, void **set, int setsize) {
+    int i;
+
+    for (i = 0; i < setsize; i++) {
+        if (set[i] != NULL && set[i] == slot) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+
+    char path[] = "/tmp/openli-syncpkt-XXXXXX";
+    char uri[64];
+    libtrace_t *trace;
+    libtrace_packet_t *pkt;
+    libtrace_packet_t *copies[TEST_PACKETS];
+    libtrace_packet_t *slots[TEST_PACKETS];
+    void *taken[TEST_PACKETS];
+    openli_pool_t *pool;
+    int fd, i, count = 0, pooled = 0, ret = 1;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return fail("unable to create temporary trace file");
+    }
+    close(fd);
+    snprintf(uri, sizeof(uri), "pcapfile:%s", path);
+
+    if (write_test_trace(uri) < 0) {
+        unlink(path);
+        return fail("unable to write test trace");
+    }
+
+    pool = create_object_pool(sizeof(openli_sync_packet_t),
+            SYNC_PACKET_POOL_MAX_FREE, NULL);
+    trace = trace_create(uri);
+    if (trace_is_err(trace) || trace_start(trace) < 0) {
+        trace_perror(trace, "reading test trace");
+        goto endtest;
+    }
+
+    pkt = trace_create_packet();
+    while (count < TEST_PACKETS && trace_read_packet(trace, pkt) > 0) {
+        libtrace_packet_t *copy;
+        uint8_t *origl3, *copyl3;
+        uint16_t origethertype, copyethertype;
+        uint32_t origrem, copyrem;
+
+        copy = copy_packet_for_sync(pool, pkt);
+        if (!copy) {
+            fail("copy_packet_for_sync() failed");
+            break;
+        }
+        copies[count] = copy;
+        slots[count] = NULL;
+        count ++;
+
+        if (trace_get_capture_length(pkt) + trace_get_framing_length(pkt)
+                <= SYNC_PACKET_SLOT_SIZE) {
+            if (copy->buf_control != TRACE_CTRL_EXTERNAL) {
+                fail("small packet was not copied into a pool slot");
+                break;
+            }
+            slots[count - 1] = copy;
+            pooled ++;
+        } else if (copy->buf_control != TRACE_CTRL_PACKET) {
+            fail("oversized packet was copied into a pool slot");
+            break;
+        }
+
+        /* the copy must be usable through the live input's format */
+        origl3 = trace_get_layer3(pkt, &origethertype, &origrem);
+        copyl3 = trace_get_layer3(copy, &copyethertype, &copyrem);
+        if (!origl3 || !copyl3 || origethertype != copyethertype ||
+                origrem != copyrem || memcmp(origl3, copyl3, origrem) != 0) {
+            fail("copied packet does not match the original");
+            break;
+        }
+    }
+    trace_destroy_packet(pkt);
+
+    if (count != TEST_PACKETS) {
+        goto releasecopies;
+    }
+
+    /* release everything while the input is still live */
+    for (i = 0; i < count; i++) {
+        int wasexternal = (copies[i]->buf_control == TRACE_CTRL_EXTERNAL);
+
+        release_sync_packet(copies[i]);
+        if (wasexternal && (copies[i]->trace != NULL ||
+                    copies[i]->cached.capture_length != 0)) {
+            fail("released pool slot is still attached to the input");
+            count = 0;
+            goto endtest;
+        }
+    }
+    count = 0;
+
+    memset(taken, 0, sizeof(taken));
+
+    /* take every pooled slot back out at once -- each one should be a
+     * different recycled slot, not a new allocation */
+    for (i = 0; i < pooled; i++) {
+        taken[i] = get_pooled_object(pool);
+        if (taken[i] == NULL || find_slot(taken[i], (void **)slots, TEST_PACKETS) < 0) {
+            fail("released slots did not return to the pool");
+            goto releasetaken;
+        }
+        if (find_slot(taken[i], taken, i) >= 0) {
+            fail("the pool handed out the same slot twice");
+            taken[i] = NULL;
+            goto releasetaken;
+        }
+    }
+
+    /* after another round trip, we should still only see the same slots */
+    for (i = 0; i < pooled; i++) {
+        release_pooled_object(taken[i]);
+        taken[i] = NULL;
+    }
+    for (i = 0; i < pooled; i++) {
+        taken[i] = get_pooled_object(pool);
+        if (taken[i] == NULL || find_slot(taken[i], (void **)slots, TEST_PACKETS) < 0) {
+            fail("pool allocated a new slot instead of reusing one");
+            goto releasetaken;
+        }
+        if (find_slot(taken[i], taken, i) >= 0) {
+            fail("the pool handed out the same slot twice");
+            taken[i] = NULL;
+            goto releasetaken;
+        }
+    }
+    ret = 0;
+
+releasetaken:
+    for (i = 0; i < pooled; i++) {
+        if (taken[i]) {
+            release_pooled_object(taken[i]);
+        }
+    }
+
+releasecopies:
+    for (i = 0; i < count; i++) {
+        release_sync_packet(copies[i]);
+    }
+
+endtest:
+    trace_destroy(trace);
+    destroy_object_pool(pool);
+    unlink(path);
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :